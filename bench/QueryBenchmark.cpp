@@ -0,0 +1,425 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+/**
+ * Multi-threaded TokenIndex query benchmark.
+ *
+ * Reader threads run random lookups (Span::narrow, or TokenIndex::NarrowBatch over groups of queries with --batch)
+ * and samples (Span::operator[]), optionally while a single writer thread keeps adding held-out sentences via
+ * TokenIndex::AddSentence().
+ * Reports throughput and latency percentiles per operation.
+ *
+ * Usage: query_benchmark [--corpus FILE] [--option value ...], see Usage() below.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Vocab.h"
+#include "Corpus.h"
+#include "TokenIndex.h"
+#include "Types.h"
+#include "util/usage.h"
+#include "util/vidscan.hpp"
+
+using namespace sto;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+/** benchmark options, with their defaults */
+struct Options {
+  std::string corpus;          /** text file, one tokenized sentence per line. empty: synthetic Zipf corpus */
+  size_t lines = 0;            /** max. number of lines read from corpus (0: all) */
+  size_t sentences = 100000;   /** synthetic corpus: number of sentences */
+  size_t words = 20000;        /** synthetic corpus: vocabulary size */
+  size_t held_out = 10000;     /** sentences not indexed up front, added by the writer during queries */
+  size_t threads = 4;          /** reader threads */
+  size_t queries = 100000;     /** queries per reader thread */
+  size_t min_len = 1;          /** query length distribution: uniform in [min_len, max_len] ... */
+  size_t max_len = 5;
+  std::string len_dist = "uniform"; /** ... or "geometric" with mean (min_len + max_len) / 2 */
+  size_t samples = 100;        /** Span::operator[] samples per query */
+  size_t batch = 0;            /** narrow this many queries at once with TokenIndex::NarrowBatch() (0: each one by narrow()) */
+  size_t leaf_size = 10000;    /** TokenIndex maxLeafSize */
+  size_t build_threads = 0;    /** TokenIndex::Build() threads (0: one per hardware thread) */
+  bool writer = true;          /** run a concurrent writer */
+  unsigned int seed = 42;
+};
+
+void Usage(const char *argv0) {
+  Options o;
+  std::cerr << "Usage: " << argv0 << " [options]\n"
+            << "  --corpus FILE       text corpus, one tokenized sentence per line (default: synthetic Zipf corpus)\n"
+            << "  --lines N           read at most N lines of the corpus (default: all)\n"
+            << "  --sentences N       synthetic corpus size (default: " << o.sentences << ")\n"
+            << "  --words N           synthetic corpus vocabulary size (default: " << o.words << ")\n"
+            << "  --held-out N        sentences added by the writer during queries (default: " << o.held_out << ")\n"
+            << "  --threads N         reader threads (default: " << o.threads << ")\n"
+            << "  --queries N         queries per reader thread (default: " << o.queries << ")\n"
+            << "  --min-len N         minimum query length (default: " << o.min_len << ")\n"
+            << "  --max-len N         maximum query length (default: " << o.max_len << ")\n"
+            << "  --len-dist D        query length distribution: uniform or geometric (default: " << o.len_dist << ")\n"
+            << "  --samples N         Span::operator[] samples per query (default: " << o.samples << ")\n"
+            << "  --batch N           narrow N queries at once with NarrowBatch(), timed per call (default: 0, narrow() each)\n"
+            << "  --leaf-size N       TokenIndex maxLeafSize (default: " << o.leaf_size << ")\n"
+            << "  --build-threads N   threads for building the index (default: one per hardware thread)\n"
+            << "  --writer 0|1        run a concurrent AddSentence() writer (default: " << o.writer << ")\n"
+            << "  --seed N            random seed (default: " << o.seed << ")\n";
+}
+
+Options ParseOptions(int argc, char **argv) {
+  Options o;
+  std::map<std::string, size_t *> sizes = {
+      {"--lines", &o.lines}, {"--sentences", &o.sentences}, {"--words", &o.words}, {"--held-out", &o.held_out},
+      {"--threads", &o.threads}, {"--queries", &o.queries}, {"--min-len", &o.min_len}, {"--max-len", &o.max_len},
+      {"--samples", &o.samples}, {"--leaf-size", &o.leaf_size}, {"--build-threads", &o.build_threads}, {"--batch", &o.batch}
+  };
+
+  for(int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if(arg == "-h" || arg == "--help") {
+      Usage(argv[0]);
+      exit(0);
+    }
+    if(i + 1 >= argc)
+      throw std::runtime_error(std::string("missing value for option ") + arg);
+    std::string value = argv[++i];
+
+    if(sizes.find(arg) != sizes.end())
+      *sizes[arg] = std::stoul(value);
+    else if(arg == "--corpus")
+      o.corpus = value;
+    else if(arg == "--len-dist")
+      o.len_dist = value;
+    else if(arg == "--writer")
+      o.writer = std::stoul(value) != 0;
+    else if(arg == "--seed")
+      o.seed = static_cast<unsigned int>(std::stoul(value));
+    else
+      throw std::runtime_error(std::string("unknown option ") + arg);
+  }
+
+  if(o.min_len == 0 || o.min_len > o.max_len)
+    throw std::runtime_error("query lengths must satisfy 0 < min-len <= max-len");
+  if(o.len_dist != "uniform" && o.len_dist != "geometric")
+    throw std::runtime_error(std::string("unknown query length distribution ") + o.len_dist);
+  if(o.threads == 0)
+    throw std::runtime_error("need at least one reader thread");
+  return o;
+}
+
+/** Read sentences, one in each line of the file, tokenized at ' ', into Corpus and Vocab. */
+void ReadTextFile(Corpus<SrcToken> &corpus, Vocab<SrcToken> &vocab, const std::string &filename, size_t nlines) {
+  std::ifstream ifs(filename.c_str());
+  if(!ifs.good())
+    throw std::runtime_error(std::string("failed to open corpus ") + filename);
+
+  vocab["</s>"]; // ensure </s> exists in vocab
+
+  std::string line;
+  for(size_t iline = 0; (nlines == 0 || iline < nlines) && std::getline(ifs, line); iline++) {
+    std::vector<SrcToken> sent;
+    size_t start_word = 0;
+    for(size_t i = 0; i <= line.size(); i++) {
+      if(i == line.size() || line[i] == ' ') {
+        if(i > start_word)
+          sent.push_back(vocab[line.substr(start_word, i - start_word)]);
+        start_word = i + 1;
+      }
+    }
+    if(sent.empty() || sent.size() > static_cast<size_t>(static_cast<Corpus<SrcToken>::Offset>(-1)))
+      continue; // skip empty sentences, and those too long for Offset
+    corpus.AddSentence(sent);
+  }
+}
+
+/** Generate a synthetic corpus of Zipf distributed words. */
+void GenerateZipfCorpus(Corpus<SrcToken> &corpus, Vocab<SrcToken> &vocab, size_t nsents, size_t nwords, unsigned int seed) {
+  std::mt19937 gen(seed);
+  std::vector<double> weights;
+  std::vector<SrcToken> words;
+  vocab["</s>"];
+  for(size_t i = 0; i < nwords; i++) {
+    weights.push_back(1.0 / static_cast<double>(i + 1));
+    words.push_back(vocab[std::string("w") + std::to_string(i)]);
+  }
+  std::discrete_distribution<size_t> word_dist(weights.begin(), weights.end());
+  std::uniform_int_distribution<size_t> len_dist(5, 30);
+
+  for(size_t i = 0; i < nsents; i++) {
+    std::vector<SrcToken> sent;
+    size_t len = len_dist(gen);
+    for(size_t j = 0; j < len; j++)
+      sent.push_back(words[word_dist(gen)]);
+    corpus.AddSentence(sent);
+  }
+}
+
+/** Sample random queries of existing phrases, starting at random index positions. */
+std::vector<std::vector<SrcToken>> CreateQueries(TokenIndex<SrcToken> &index, const Options &o, size_t num, unsigned int seed) {
+  std::mt19937 gen(seed);
+  TokenIndex<SrcToken>::Span span = index.span();
+  std::uniform_int_distribution<size_t> pos_dist(0, span.size() - 1);
+  std::uniform_int_distribution<size_t> uniform_len(o.min_len, o.max_len);
+  std::geometric_distribution<size_t> geometric_len(1.0 / (1.0 + static_cast<double>(o.min_len + o.max_len) / 2.0 - o.min_len));
+
+  std::vector<std::vector<SrcToken>> queries;
+  while(queries.size() < num) {
+    Position<SrcToken> pos = span[pos_dist(gen)];
+    Sentence<SrcToken> sent = index.corpus()->sentence(pos.sid);
+    size_t len = (o.len_dist == "uniform") ? uniform_len(gen) : std::min(o.max_len, o.min_len + geometric_len(gen));
+    len = std::min(len, sent.size() - static_cast<size_t>(pos.offset)); // never query </s>
+    if(len == 0)
+      continue;
+
+    std::vector<SrcToken> query;
+    for(size_t j = 0; j < len; j++)
+      query.push_back(sent[pos.offset + j]);
+    queries.push_back(query);
+  }
+  return queries;
+}
+
+/** Latencies of one operation type, in nanoseconds. */
+struct Latencies {
+  std::vector<uint64_t> ns;
+
+  /** allocate up front, so that vector growth is not timed */
+  void Reserve(size_t n) { ns.reserve(n); }
+
+  void Add(Clock::time_point begin, Clock::time_point end) {
+    ns.push_back(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count()));
+  }
+
+  void Merge(const Latencies &other) {
+    ns.insert(ns.end(), other.ns.begin(), other.ns.end());
+  }
+
+  /** print ops/sec over 'elapsed' seconds, and latency percentiles */
+  void Report(const std::string &name, double elapsed) {
+    std::sort(ns.begin(), ns.end());
+    auto percentile = [this](double p) -> double {
+      if(ns.empty())
+        return 0.0;
+      size_t i = std::min(ns.size() - 1, static_cast<size_t>(p * static_cast<double>(ns.size())));
+      return static_cast<double>(ns[i]) / 1000.0;
+    };
+    auto mean = [this]() -> double {
+      uint64_t sum = 0;
+      for(uint64_t n : ns)
+        sum += n;
+      return ns.empty() ? 0.0 : static_cast<double>(sum) / static_cast<double>(ns.size()) / 1000.0;
+    };
+    std::cout << std::left << std::setw(12) << name << std::right << std::fixed << std::setprecision(1)
+              << " ops=" << std::setw(10) << ns.size()
+              << " ops/s=" << std::setw(12) << (elapsed > 0.0 ? static_cast<double>(ns.size()) / elapsed : 0.0)
+              << "  latency [us] mean=" << std::setw(8) << mean()
+              << " p50=" << std::setw(8) << percentile(0.5)
+              << " p99=" << std::setw(8) << percentile(0.99)
+              << " p999=" << std::setw(8) << percentile(0.999)
+              << " max=" << std::setw(8) << percentile(1.0) << std::endl;
+  }
+};
+
+double Seconds(Clock::time_point begin, Clock::time_point end) {
+  return std::chrono::duration<double>(end - begin).count();
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  Options o;
+  try {
+    o = ParseOptions(argc, argv);
+  } catch(std::exception &e) {
+    std::cerr << "error: " << e.what() << std::endl;
+    Usage(argv[0]);
+    return 1;
+  }
+
+  Vocab<SrcToken> vocab;
+  Corpus<SrcToken> corpus(&vocab);
+  Clock::time_point begin = Clock::now();
+  if(o.corpus.empty()) {
+    GenerateZipfCorpus(corpus, vocab, o.sentences, o.words, o.seed);
+  } else {
+    try {
+      ReadTextFile(corpus, vocab, o.corpus, o.lines);
+    } catch(std::exception &e) {
+      std::cerr << "error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+  if(o.writer && o.held_out >= corpus.size()) {
+    std::cerr << "error: --held-out must be smaller than the corpus (" << corpus.size() << " sentences)" << std::endl;
+    return 1;
+  }
+  size_t nindexed = corpus.size() - (o.writer ? o.held_out : 0);
+  std::cerr << "corpus: " << corpus.size() << " sentences, read in "
+            << Seconds(begin, Clock::now()) << " s" << std::endl;
+
+  // index all but the held-out sentences
+  TokenIndex<SrcToken> index(corpus, o.leaf_size);
+  begin = Clock::now();
+  std::vector<Sentence<SrcToken>> sents;
+  for(size_t i = 0; i < nindexed; i++)
+    sents.push_back(corpus.sentence(i));
+  if(nindexed == corpus.size())
+    index.Build(o.build_threads);
+  else
+    index.AddSentences(sents);
+  std::cerr << "index: " << index.span().size() << " positions, built in " << Seconds(begin, Clock::now()) << " s" << std::endl;
+  std::cerr << "leaf scans: up to " << kScanRange << " positions, " << scan_bounds_kernel() << " kernel" << std::endl;
+  util::PrintUsage(std::cerr);
+
+  std::vector<std::vector<std::vector<SrcToken>>> queries;
+  for(size_t t = 0; t < o.threads; t++)
+    queries.push_back(CreateQueries(index, o, o.queries, o.seed + 1 + static_cast<unsigned int>(t)));
+
+  // run readers, and the writer until readers are done (or the held-out sentences are used up)
+  std::vector<Latencies> narrow_latencies(o.threads), sample_latencies(o.threads);
+  std::vector<size_t> failed(o.threads, 0);
+  Latencies write_latencies;
+  write_latencies.Reserve(corpus.size() - nindexed);
+  Clock::time_point writer_begin, writer_end;
+  std::atomic<bool> readers_done(false);
+
+  auto reader = [&](size_t t) {
+    // thread-local results, only stored into the shared vectors when done (no false sharing while timing)
+    Latencies narrow, sample;
+    size_t nnarrow = 0;
+    for(auto &query : queries[t])
+      nnarrow += query.size();
+    narrow.Reserve(nnarrow);
+    sample.Reserve(queries[t].size() * o.samples);
+    size_t nfailed = 0;
+
+    std::mt19937 gen(o.seed + static_cast<unsigned int>(t));
+    size_t dummy = 0;
+    auto sample_span = [&](const TokenIndex<SrcToken>::Span &span) {
+      if(span.size() == 0)
+        return;
+      std::uniform_int_distribution<size_t> sample_dist(0, span.size() - 1);
+      size_t nsamples = std::min(o.samples, span.size());
+      for(size_t i = 0; i < nsamples; i++) {
+        size_t rel = sample_dist(gen);
+        Clock::time_point before = Clock::now();
+        dummy += span[rel].offset;
+        sample.Add(before, Clock::now());
+      }
+    };
+
+    for(size_t q = 0; o.batch == 0 && q < queries[t].size(); q++) {
+      TokenIndex<SrcToken>::Span span = index.span();
+      for(auto token : queries[t][q]) {
+        Clock::time_point before = Clock::now();
+        size_t size = span.narrow(token);
+        narrow.Add(before, Clock::now());
+        nfailed += (size == 0);
+      }
+      sample_span(span);
+    }
+
+    // the j-th tokens of up to 'batch' queries in one NarrowBatch() call
+    for(size_t q = 0; o.batch > 0 && q < queries[t].size(); q += o.batch) {
+      size_t n = std::min(o.batch, queries[t].size() - q);
+      std::vector<TokenIndex<SrcToken>::Span> spans(n, index.span());
+      std::vector<TokenIndex<SrcToken>::Span> active;
+      std::vector<SrcToken> tokens;
+      std::vector<size_t> which;
+      for(size_t j = 0; j < o.max_len; j++) {
+        active.clear();
+        tokens.clear();
+        which.clear();
+        for(size_t i = 0; i < n; i++) {
+          if(j < queries[t][q + i].size()) {
+            active.push_back(spans[i]);
+            tokens.push_back(queries[t][q + i][j]);
+            which.push_back(i);
+          }
+        }
+        if(active.empty())
+          break;
+        Clock::time_point before = Clock::now();
+        std::vector<size_t> sizes = index.NarrowBatch(active, tokens);
+        narrow.Add(before, Clock::now());
+        for(size_t k = 0; k < which.size(); k++) {
+          nfailed += (sizes[k] == 0);
+          spans[which[k]] = std::move(active[k]);
+        }
+      }
+      for(auto &span : spans)
+        sample_span(span);
+    }
+    volatile size_t sink = dummy; (void) sink;
+    narrow_latencies[t] = std::move(narrow);
+    sample_latencies[t] = std::move(sample);
+    failed[t] = nfailed;
+  };
+  auto writer = [&]() {
+    writer_begin = Clock::now();
+    for(size_t i = nindexed; i < corpus.size() && !readers_done.load(); i++) {
+      Clock::time_point before = Clock::now();
+      index.AddSentence(corpus.sentence(i));
+      write_latencies.Add(before, Clock::now());
+    }
+    writer_end = Clock::now();
+  };
+
+  begin = Clock::now();
+  std::thread writer_thread;
+  if(o.writer)
+    writer_thread = std::thread(writer);
+  std::vector<std::thread> threads;
+  for(size_t t = 0; t < o.threads; t++)
+    threads.push_back(std::thread(reader, t));
+  for(auto &thread : threads)
+    thread.join();
+  Clock::time_point end = Clock::now();
+  readers_done = true;
+  if(o.writer)
+    writer_thread.join();
+  double elapsed = Seconds(begin, end);
+
+  Latencies narrow, sample;
+  narrow.Reserve(o.threads * o.queries * o.max_len);
+  sample.Reserve(o.threads * o.queries * o.samples);
+  size_t nfailed = 0;
+  for(size_t t = 0; t < o.threads; t++) {
+    narrow.Merge(narrow_latencies[t]);
+    sample.Merge(sample_latencies[t]);
+    nfailed += failed[t];
+  }
+
+  std::cout << "threads=" << o.threads << " queries=" << (o.threads * o.queries) << " elapsed=" << std::setprecision(3) << elapsed << " s"
+            << " queries/s=" << std::setprecision(1) << std::fixed << static_cast<double>(o.threads * o.queries) / elapsed << std::endl;
+  narrow.Report(o.batch ? "NarrowBatch" : "narrow", elapsed);
+  sample.Report("operator[]", elapsed);
+  if(o.writer)
+    write_latencies.Report("AddSentence", Seconds(writer_begin, writer_end)); // the writer may run out of sentences early
+  if(sto::Stats::kEnabled)
+    index.Stats().Print(std::cout);
+  util::PrintUsage(std::cerr);
+
+  if(nfailed > 0) {
+    std::cerr << "error: " << nfailed << " narrow() calls for existing phrases failed" << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -7,90 +7,70 @@
 #include <cassert>
 #include <algorithm>
 #include <sstream>
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#include <unistd.h>
 
 #include "Corpus.h"
 #include "Types.h"
+#include "util/fsync.hpp"
 
 namespace sto {
 
-/* Create empty corpus */
 template<class Token>
-Corpus<Token>::Corpus(const Corpus<Token>::Vocabulary *vocab) : vocab_(vocab), sentIndexEntries_(nullptr), sentIndexEntrySize_(1)
+Corpus<Token>::Track::Track() : trackTokens(nullptr), sentIndexEntries(nullptr), trackHeader(), sentIndexHeader(), packedNumTokens(0), dyn_numTokens(0)
 {
-  dyn_sentIndex_.push_back(0);
-  sentIndexHeader_.idxSize = 0; // no static entries
+  sentIndexHeader.idxSize = 0; // no static entries
 }
 
+/* Create empty corpus */
+template<class Token>
+Corpus<Token>::Corpus(const Corpus<Token>::Vocabulary *vocab) : vocab_(vocab), compress_(false), track_(new Track())
+{}
+
 /* Load corpus from mtt-build .mtt format or from split corpus/sentidx. */
 template<class Token>
-Corpus<Token>::Corpus(const std::string &filename, const Corpus<Token>::Vocabulary *vocab) : vocab_(vocab) {
-  track_.reset(new MappedFile(filename));
-  CorpusTrackHeader &header = *reinterpret_cast<CorpusTrackHeader*>(track_->ptr);
-  trackHeader_ = header;
+Corpus<Token>::Corpus(const std::string &filename, const Corpus<Token>::Vocabulary *vocab, const MapOptions &options) : vocab_(vocab), map_options_(options), compress_(false), track_(nullptr) {
+  track_.store(Load(filename).release());
+}
+
+template<class Token>
+Corpus<Token>::~Corpus() {
+  delete track_.load();
+}
+
+template<class Token>
+std::unique_ptr<typename Corpus<Token>::Track> Corpus<Token>::Load(const std::string &filename) const {
+  std::unique_ptr<Track> track(new Track());
+  track->filename = filename;
+  track->trackFile.reset(new MappedFile(filename, /* offset = */ 0, map_options_));
+  CorpusTrackHeader &header = *reinterpret_cast<CorpusTrackHeader*>(track->trackFile->ptr);
+  track->trackHeader = header;
 
   // read and interpret file header(s), find sentence index
   if(header.versionMagic == tpt::INDEX_V2_MAGIC) {
     // legacy v2 corpus, with concatenated track and sentence index
-    sentIndex_.reset(new MappedFile(filename, header.legacy_startIdx)); // this maps some memory twice, because we leave the index as mapped in track_, but it's shared mem anyway.
-    sentIndexHeader_.versionMagic = header.versionMagic;
-    sentIndexHeader_.idxSize = header.legacy_idxSize;
+    track->sentIndexFile.reset(new MappedFile(filename, header.legacy_startIdx, map_options_)); // this maps some memory twice, because we leave the index as mapped in trackFile, but it's shared mem anyway.
+    track->sentIndexHeader.versionMagic = header.versionMagic;
+    track->sentIndexHeader.idxSize = header.legacy_idxSize;
   } else if(header.versionMagic == tpt::INDEX_V3_MAGIC) {
     // there is a separate sentence index file
     std::string prefix = filename.substr(0, filename.find(".trk"));
-    sentIndex_.reset(new MappedFile(prefix + ".six", header.legacy_startIdx));
-    SentIndexHeader &idxHeader = *reinterpret_cast<SentIndexHeader*>(sentIndex_->ptr);
-    sentIndexHeader_ = idxHeader;
-    sentIndex_->ptr += sizeof(SentIndexHeader);
+    track->sentIndexFile.reset(new MappedFile(prefix + ".six", header.legacy_startIdx, map_options_));
+    SentIndexHeader &idxHeader = *reinterpret_cast<SentIndexHeader*>(track->sentIndexFile->ptr);
+    track->sentIndexHeader = idxHeader;
+    track->sentIndexFile->ptr += sizeof(SentIndexHeader);
   } else {
     throw std::runtime_error(std::string("unknown version magic in ") + filename);
   }
-  trackTokens_ = reinterpret_cast<Vid*>(track_->ptr + sizeof(CorpusTrackHeader));
-  sentIndexEntries_ = reinterpret_cast<SentIndexEntry*>(sentIndex_->ptr);
+  track->trackTokens = reinterpret_cast<Vid*>(track->trackFile->ptr + sizeof(CorpusTrackHeader));
+  track->sentIndexEntries = reinterpret_cast<SentIndexEntry*>(track->sentIndexFile->ptr);
   // maybe it would be nicer if the headers read themselves, without mmap usage.
-
-  dyn_sentIndex_.push_back(0);
-
-  // hack for byte counts in word alignment: divide each entry in sentIndexEntries_ by sentIndexEntrySize_
-  switch(Token::kIndexType) {
-    case CorpusIndexAccounting::IDX_CNT_ENTRIES: // corpus track
-      sentIndexEntrySize_ = 1;
-      break;
-    case CorpusIndexAccounting::IDX_CNT_BYTES: // word alignment
-      sentIndexEntrySize_ = sizeof(Token);
-      break;
-    default:
-      throw std::runtime_error("Corpus: unknown idx_type");
-  }
-}
-
-template<class Token>
-const typename Corpus<Token>::Vid* Corpus<Token>::begin(Sid sid) const {
-  // static track
-  if(sid < sentIndexHeader_.idxSize) {
-    // we never provide the trailing sentinel here (note that idxSize excludes it)
-    return trackTokens_ + sentIndexEntries_[sid] / sentIndexEntrySize_;
-  }
-
-  // dynamic track
-  sid -= sentIndexHeader_.idxSize;
-  assert(sid < dyn_sentIndex_.size() - 1);
-  // we never provide the trailing sentinel here (note that dyn_sentIndex_.size() includes it)
-  return dyn_track_.data() + dyn_sentIndex_[sid];
-}
-
-template<class Token>
-const typename Corpus<Token>::Vid* Corpus<Token>::end(Sid sid) const {
-  // static track
-  if(sid < sentIndexHeader_.idxSize) {
-    // provide the trailing sentinel here (note that idxSize excludes it)
-    return trackTokens_ + sentIndexEntries_[sid + 1] / sentIndexEntrySize_;
-  }
-
-  // dynamic track
-  sid -= sentIndexHeader_.idxSize;
-  assert(sid < dyn_sentIndex_.size() - 1);
-  // provide the trailing sentinel here (note that dyn_sentIndex_.size() includes it)
-  return dyn_track_.data() + dyn_sentIndex_[sid + 1];
+  return track;
 }
 
 template<class Token>
@@ -100,12 +80,27 @@ Sentence<Token> Corpus<Token>::sentence(Sid sid) const {
 
 template<class Token>
 void Corpus<Token>::AddSentence(const std::vector<Token> &sent) {
+  if(sent.size() > kMaxDynSentence)
+    throw std::runtime_error("Corpus: sentence too long");
+
+  std::vector<Vid> vids;
+  vids.reserve(sent.size());
   for(auto token : sent) {
     if(vocab_)
       vocab_->at(token); // access the Token to ensure it is contained in vocabulary (throws exception otherwise)
-    dyn_track_.push_back(token.vid);
+    vids.push_back(token.vid);
   }
-  dyn_sentIndex_.push_back(static_cast<SentIndexEntry>(dyn_track_.size()));
+
+  // free Tracks replaced by earlier Flush() calls, once their readers are gone
+  if(retired_.size() > 0)
+    retired_.Reclaim();
+
+  // thread safety: tokens are written before the sentence, which is published last
+  Track &track = *track_.load(std::memory_order_relaxed); // only the writer replaces it
+  size_t begin = track.dyn_track.append_contiguous(vids.data(), vids.size());
+  track.dyn_numTokens.fetch_add(vids.size(), std::memory_order_relaxed);
+  const Vid *first = &track.dyn_track[begin];
+  track.dyn_sentIndex.push_back(DynSentence{first, first + vids.size()});
 }
 
 template<class Token>
@@ -116,7 +111,8 @@ const typename Corpus<Token>::Vocabulary& Corpus<Token>::vocab() const {
 
 template<class Token>
 typename Corpus<Token>::Sid Corpus<Token>::size() const {
-  return sentIndexHeader_.idxSize + static_cast<Sid>(dyn_sentIndex_.size() - 1);
+  const Track *track = track_.load(std::memory_order_acquire);
+  return track->sentIndexHeader.idxSize + static_cast<Sid>(track->dyn_sentIndex.size());
 }
 
 template<class Token>
@@ -125,32 +121,314 @@ size_t Corpus<Token>::numTokens() const {
   // (implicit </s> per sentence not stored in track => each sentence takes up exactly its token count in the track)
 
   // static + dynamic
-  return sentIndexEntries_[size()] / sentIndexEntrySize_ + dyn_sentIndex_.back();
+  const Track *track = track_.load(std::memory_order_acquire);
+  return StaticTokens(*track) + track->dyn_numTokens.load(std::memory_order_relaxed);
+}
+
+template<class Token>
+size_t Corpus<Token>::StaticTokens(const Track &track) {
+  if(!track.packedIndex.empty())
+    return track.packedNumTokens;
+  return track.sentIndexEntries ? track.sentIndexEntries[track.sentIndexHeader.idxSize] / kIndexEntrySize : 0;
+}
+
+namespace {
+
+/** fwrite() all of 'data' or throw */
+void write_all(FILE *file, const void *data, size_t size, size_t count, const std::string &filename) {
+  if(count > 0 && fwrite(data, size, count, file) != count) {
+    fclose(file);
+    throw std::runtime_error(std::string("failed to write ") + filename);
+  }
+}
+
+/** open the temporary file for 'filename', which becomes visible atomically with commit_file() */
+FILE *open_tmp_file(const std::string &filename) {
+  std::string tmp_name = filename + ".tmp";
+  FILE *file = fopen(tmp_name.c_str(), "wb");
+  if(!file)
+    throw std::runtime_error(std::string("failed to open file for write at ") + tmp_name);
+  return file;
+}
+
+/** sync and close the temporary file and move it to 'filename' durably. Existing mappings of the old file stay valid. */
+void commit_file(FILE *file, const std::string &filename) {
+  std::string tmp_name = filename + ".tmp";
+  try {
+    sync_file(file, tmp_name);
+  } catch(...) {
+    fclose(file);
+    throw;
+  }
+  if(fclose(file) != 0 || rename(tmp_name.c_str(), filename.c_str()) != 0)
+    throw std::runtime_error(std::string("failed to write ") + filename);
+  sync_dir(filename);
+}
+
+/**
+ * Corpus::Compress(): code the vids of sentences [0, nsents) by frequency rank into 'packed' (the most frequent
+ * vids get the shortest codes), with the width of each sentence's largest rank, and locate them in 'index'.
+ * @return the number of tokens
+ */
+template<class Sid, class TokensOf, class Vid>
+size_t pack_ranks(Sid nsents, TokensOf tokens_of, std::vector<uint8_t> &packed, std::vector<uint64_t> &index, std::vector<Vid> &ranks, std::true_type integral_vids) {
+  (void) integral_vids;
+  std::vector<size_t> counts;
+  size_t ntokens = 0;
+  for(Sid sid = 0; sid < nsents; sid++) {
+    auto t = tokens_of(sid);
+    for(size_t i = 0; i < t.size(); i++) {
+      Vid v = t[i];
+      if(v >= counts.size())
+        counts.resize(static_cast<size_t>(v) + 1, 0);
+      counts[v]++;
+    }
+    ntokens += t.size();
+  }
+  for(size_t vid = 0; vid < counts.size(); vid++)
+    if(counts[vid] > 0)
+      ranks.push_back(static_cast<Vid>(vid));
+  std::stable_sort(ranks.begin(), ranks.end(), [&counts](Vid a, Vid b) { return counts[a] > counts[b]; });
+  std::vector<uint32_t> rank_of(counts.size());
+  for(size_t r = 0; r < ranks.size(); r++)
+    rank_of[ranks[r]] = static_cast<uint32_t>(r);
+
+  // each sentence with its own width, so that a sentence of only frequent words takes a byte per token
+  index.reserve(static_cast<size_t>(nsents) + 1);
+  for(Sid sid = 0; sid < nsents; sid++) {
+    auto t = tokens_of(sid);
+    uint32_t max_rank = 0;
+    for(size_t i = 0; i < t.size(); i++)
+      max_rank = std::max(max_rank, rank_of[t[i]]);
+    unsigned shift = (max_rank < (1u << 8)) ? 0 : (max_rank < (1u << 16)) ? 1 : 2;
+
+    size_t offset = packed.size();
+    index.push_back(static_cast<uint64_t>(offset) << 2 | shift);
+    packed.resize(offset + (t.size() << shift));
+    uint8_t *p = packed.data() + offset;
+    for(size_t i = 0; i < t.size(); i++, p += (1u << shift)) {
+      uint32_t r = rank_of[t[i]];
+      if(shift == 0) {
+        *p = static_cast<uint8_t>(r);
+      } else if(shift == 1) {
+        uint16_t r16 = static_cast<uint16_t>(r);
+        memcpy(p, &r16, sizeof(r16));
+      } else {
+        memcpy(p, &r, sizeof(r));
+      }
+    }
+  }
+  index.push_back(static_cast<uint64_t>(packed.size()) << 2); // trailing sentinel
+  packed.shrink_to_fit();
+  return ntokens;
 }
 
+/** vids which are not integral (AlignmentLink) cannot be ranked */
+template<class Sid, class TokensOf, class Vid>
+size_t pack_ranks(Sid nsents, TokensOf tokens_of, std::vector<uint8_t> &packed, std::vector<uint64_t> &index, std::vector<Vid> &ranks, std::false_type integral_vids) {
+  (void) nsents; (void) tokens_of; (void) packed; (void) index; (void) ranks; (void) integral_vids;
+  throw std::runtime_error("Corpus: cannot compress a track of this Token type");
+}
+
+} // namespace
+
+template<class Token>
+void Corpus<Token>::Write(const std::string &prefix) const {
+  Sid nsents = size(); // snapshot: sentences added concurrently are not written
+  size_t entrySize = kIndexEntrySize;
+
+  size_t ntokens = 0;
+  for(Sid sid = 0; sid < nsents; sid++)
+    ntokens += tokens(sid).size();
+  if(ntokens * entrySize > std::numeric_limits<SentIndexEntry>::max())
+    throw std::runtime_error("Corpus: too many tokens for v3 format");
+
+  // corpus track
+  std::string trackName = prefix + ".trk";
+  CorpusTrackHeader trackHeader{};
+  trackHeader.versionMagic = tpt::INDEX_V3_MAGIC;
+  trackHeader.legacy_startIdx = 0; // offset of SentIndexHeader in .six
+  trackHeader.legacy_idxSize = nsents;
+  trackHeader.totalWords = static_cast<uint32_t>(ntokens);
+
+  FILE *track = open_tmp_file(trackName);
+  write_all(track, &trackHeader, sizeof(trackHeader), 1, trackName);
+  for(Sid sid = 0; sid < nsents; sid++)
+    WriteTokens(track, sid, trackName);
+  // the track first: for a growing corpus, a crash before the index is committed leaves the old index,
+  // which still describes a prefix of the new track
+  commit_file(track, trackName);
+
+  WriteSentIndex(prefix, nsents);
+}
+
+template<class Token>
+void Corpus<Token>::WriteTokens(FILE *file, Sid sid, const std::string &filename) const {
+  Tokens t = tokens(sid);
+  if(t.data()) {
+    write_all(file, t.data(), sizeof(Vid), t.size(), filename);
+    return;
+  }
+  std::vector<Vid> vids;
+  vids.reserve(t.size());
+  for(size_t i = 0; i < t.size(); i++)
+    vids.push_back(t[i]);
+  write_all(file, vids.data(), sizeof(Vid), vids.size(), filename);
+}
+
+template<class Token>
+void Corpus<Token>::WriteSentIndex(const std::string &prefix, Sid nsents) const {
+  size_t entrySize = kIndexEntrySize;
+
+  // sentence index, with trailing sentinel
+  std::string indexName = prefix + ".six";
+  SentIndexHeader indexHeader{};
+  indexHeader.versionMagic = tpt::INDEX_V3_MAGIC;
+  indexHeader.idxSize = nsents;
+
+  std::vector<SentIndexEntry> entries;
+  entries.reserve(nsents + 1);
+  SentIndexEntry pos = 0;
+  for(Sid sid = 0; sid < nsents; sid++) {
+    entries.push_back(pos);
+    pos += static_cast<SentIndexEntry>(tokens(sid).size() * entrySize);
+  }
+  entries.push_back(pos);
+
+  FILE *index = open_tmp_file(indexName);
+  write_all(index, &indexHeader, sizeof(indexHeader), 1, indexName);
+  write_all(index, entries.data(), sizeof(SentIndexEntry), entries.size(), indexName);
+  commit_file(index, indexName);
+}
+
+template<class Token>
+void Corpus<Token>::Append(const Track &track, const std::string &prefix) const {
+  Sid nstatic = track.sentIndexHeader.idxSize;
+  Sid nsents = nstatic + static_cast<Sid>(track.dyn_sentIndex.size());
+  size_t nstaticTokens = StaticTokens(track);
+  size_t ntokens = nstaticTokens + track.dyn_numTokens.load(std::memory_order_relaxed);
+  if(ntokens * kIndexEntrySize > std::numeric_limits<SentIndexEntry>::max())
+    throw std::runtime_error("Corpus: too many tokens for v3 format");
+
+  std::string trackName = prefix + ".trk";
+  FILE *file = fopen(trackName.c_str(), "r+b");
+  if(!file)
+    throw std::runtime_error(std::string("failed to open file for write at ") + trackName);
+
+  // drop anything behind the sentinel (left by a crash before the index was committed), then append.
+  // Readers of the old mapping never look past the sentinel.
+  long tail = static_cast<long>(sizeof(CorpusTrackHeader) + nstaticTokens * sizeof(Vid));
+  if(ftruncate(fileno(file), tail) != 0 || fseek(file, tail, SEEK_SET) != 0) {
+    fclose(file);
+    throw std::runtime_error(std::string("failed to write ") + trackName);
+  }
+  for(Sid sid = nstatic; sid < nsents; sid++)
+    WriteTokens(file, sid, trackName);
+
+  // header fields are informative only, the sentence index is authoritative
+  CorpusTrackHeader trackHeader = track.trackHeader;
+  trackHeader.legacy_idxSize = nsents;
+  trackHeader.totalWords = static_cast<uint32_t>(ntokens);
+  if(fseek(file, 0, SEEK_SET) != 0) {
+    fclose(file);
+    throw std::runtime_error(std::string("failed to write ") + trackName);
+  }
+  write_all(file, &trackHeader, sizeof(trackHeader), 1, trackName);
+
+  // the track first, as in Write()
+  try {
+    sync_file(file, trackName);
+  } catch(...) {
+    fclose(file);
+    throw;
+  }
+  if(fclose(file) != 0)
+    throw std::runtime_error(std::string("failed to write ") + trackName);
+
+  WriteSentIndex(prefix, nsents);
+}
+
+template<class Token>
+void Corpus<Token>::Flush(const std::string &prefix) {
+  Track *old = track_.load(std::memory_order_relaxed); // only the writer replaces it
+
+  if(old->filename == prefix + ".trk" && old->trackHeader.versionMagic == tpt::INDEX_V3_MAGIC)
+    Append(*old, prefix);
+  else
+    Write(prefix);
+
+  // the static part of the new Track covers all sentences
+  std::unique_ptr<Track> track = compress_ ? CompressTrack(prefix + ".trk") : Load(prefix + ".trk");
+  assert(track->sentIndexHeader.idxSize == size());
+  track_.store(track.release(), std::memory_order_release);
+
+  // readers may still be inside the old mapping or dynamic part
+  retired_.Retire(old);
+  retired_.Reclaim();
+}
+
+template<class Token>
+void Corpus<Token>::Compress() {
+  Track *old = track_.load(std::memory_order_relaxed); // only the writer replaces it
+
+  // the compressed static part still describes the mapped track if it covers exactly its sentences, so Flush() can append to it
+  std::string filename = (old->dyn_sentIndex.size() == 0) ? old->filename : std::string();
+  std::unique_ptr<Track> track = CompressTrack(filename);
+  if(!filename.empty())
+    track->trackHeader = old->trackHeader;
+  track_.store(track.release(), std::memory_order_release);
+  compress_ = true;
+
+  // readers may still be inside the old mapping or dynamic part
+  retired_.Retire(old);
+  retired_.Reclaim();
+}
+
+template<class Token>
+bool Corpus<Token>::compressed() const {
+  return !track_.load(std::memory_order_acquire)->packedIndex.empty();
+}
+
+template<class Token>
+std::unique_ptr<typename Corpus<Token>::Track> Corpus<Token>::CompressTrack(const std::string &filename) const {
+  std::unique_ptr<Track> track(new Track());
+  Sid nsents = size();
+  track->packedNumTokens = pack_ranks(nsents, [this](Sid sid) { return tokens(sid); }, track->packed, track->packedIndex, track->ranks, std::is_integral<Vid>());
+  track->filename = filename;
+  track->trackHeader.versionMagic = tpt::INDEX_V3_MAGIC; // see Flush(): the .trk written by Write() or Append()
+  track->sentIndexHeader.idxSize = nsents;
+  return track;
+}
+
+template<class Token>
+constexpr size_t Corpus<Token>::kMaxDynSentence;
+template<class Token>
+constexpr size_t Corpus<Token>::kIndexEntrySize;
+
 // explicit template instantiation
 template class Corpus<SrcToken>;
 template class Corpus<TrgToken>;
+template class Corpus<SmallSrcToken>;
 template class Corpus<AlignmentLink>;
 
 // --------------------------------------------------------
 
 template<class Token>
-Sentence<Token>::Sentence() : corpus_(nullptr), sid_(0), begin_(nullptr), size_(0)
+Sentence<Token>::Sentence() : corpus_(nullptr), sid_(0), size_(0)
 {}
 
 template<class Token>
 Sentence<Token>::Sentence(const Corpus<Token> &corpus, Sid sid) : corpus_(&corpus), sid_(sid) {
-  begin_ = corpus.begin(sid);
-  size_ = corpus.end(sid) - begin_;
+  tokens_ = corpus.tokens(sid); // begin() and end() could see different Tracks across Flush()
+  size_ = tokens_.size();
 }
 
 template<class Token>
-Sentence<Token>::Sentence(const Sentence<Token> &o) : corpus_(o.corpus_), sid_(o.sid_), begin_(o.begin_), size_(o.size_)
+Sentence<Token>::Sentence(const Sentence<Token> &o) : corpus_(o.corpus_), sid_(o.sid_), tokens_(o.tokens_), size_(o.size_)
 {}
 
 template<class Token>
-Sentence<Token>::Sentence(const Sentence<Token> &&o) : corpus_(o.corpus_), sid_(o.sid_), begin_(o.begin_), size_(o.size_)
+Sentence<Token>::Sentence(const Sentence<Token> &&o) : corpus_(o.corpus_), sid_(o.sid_), tokens_(o.tokens_), size_(o.size_)
 {}
 
 template<class Token>
@@ -159,22 +437,23 @@ Token Sentence<Token>::operator[](size_t i) const {
   if(i == size_)
     return Token{Corpus<Token>::Vocabulary::kEOS}; // implicit </s>
   else
-    return Token{begin_[i]};
+    return Token{tokens_[i]};
 }
 
 template<class Token>
 std::string Sentence<Token>::surface() const {
   std::stringstream ss;
   if(size() > 0)
-    ss << corpus_->vocab()[Token{begin_[0]}];
+    ss << corpus_->vocab().c_str(Token{tokens_[0]});
   for(size_t i = 1; i < size(); i++)
-    ss << " " << corpus_->vocab()[Token{begin_[i]}];
+    ss << " " << corpus_->vocab().c_str(Token{tokens_[i]});
   return ss.str();
 }
 
 // explicit template instantiation
 template class Sentence<SrcToken>;
 template class Sentence<TrgToken>;
+template class Sentence<SmallSrcToken>;
 template class Sentence<AlignmentLink>;
 
 // --------------------------------------------------------
@@ -185,9 +464,14 @@ bool Position<Token>::compare(const Position<Token> &other, const Corpus<Token>
   Sentence<Token> sentThis(corpus, sid);
   Sentence<Token> sentOther(corpus, other.sid);
 
-  // this uses Token::operator<(), which sorts by vid (not by surface form)
-  return std::lexicographical_compare(sentOther.begin_ + other.offset, sentOther.begin_ + sentOther.size_,
-                                      sentThis.begin_ + offset, sentThis.begin_ + sentThis.size_);
+  // like Token::operator<(), this sorts by vid (not by surface form)
+  size_t i = other.offset, j = offset;
+  for(; i < sentOther.size_ && j < sentThis.size_; ++i, ++j) {
+    Vid a = sentOther.tokens_[i], b = sentThis.tokens_[j];
+    if(a != b)
+      return a < b;
+  }
+  return i >= sentOther.size_ && j < sentThis.size_; // shorter suffix sorts first
 }
 
 template<class Token>
@@ -219,5 +503,6 @@ Position<Token> Position<Token>::add(Offset offset, const Corpus<Token> &corpus)
 // explicit template instantiation
 template class Position<SrcToken>;
 template class Position<TrgToken>;
+template class Position<SmallSrcToken>;
 
 } // namespace sto
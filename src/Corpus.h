@@ -7,47 +7,115 @@
 #ifndef STO_CORPUS_H
 #define STO_CORPUS_H
 
+#include <cassert>
+#include <cstdint>
+#include <cstring>
 #include <vector>
 #include <string>
 #include <memory>
 #include <atomic>
+#include <type_traits>
 
 #include "Vocab.h"
 #include "MappedFile.h"
 #include "Types.h"
 #include "CorpusTypes.h"
+#include "util/appendvector.hpp"
+#include "util/epoch.hpp"
 
 namespace sto {
 
 template<class Token> class Sentence;
 
 /**
- * Memory-mapped corpus.
+ * Memory-mapped corpus, with a dynamic part for appending sentences.
  *
- * Read-only for now.
+ * Thread safety: there may be a single thread calling AddSentence() and Flush() at any time, concurrently with multiple
+ * threads reading. Appended sentences never move in memory, and become visible to readers atomically via size().
+ * Flush() moves all sentences to a new mapping: token pointers (begin(), end(), tokens()) and Sentence objects
+ * obtained before stay valid only while the reader holds an Epoch::Guard, which TokenIndex lookups take internally.
+ *
+ * Optionally, the track is compressed in memory, see Compress(). Tokens and Sentence decode it on access.
  */
 template<class Token>
 class Corpus {
 public:
-  typedef sid_t Sid; /** sentence ID type */
-  typedef offset_t Offset; /** type of token offset within sentence */
+  typedef typename Token::Sid Sid; /** sentence ID type */
+  typedef typename Token::Offset Offset; /** type of token offset within sentence */
   typedef typename Token::Vid Vid; /** vocabulary ID type */
   typedef typename Token::Vocabulary Vocabulary; /** Vocab<Token> */
 
   /** Create empty corpus */
   Corpus(const Vocabulary *vocab = nullptr);
 
-  /** Load corpus from mtt-build .mtt format or from split corpus/sentidx. */
-  Corpus(const std::string &filename, const Vocabulary *vocab = nullptr);
+  /**
+   * Load corpus from mtt-build .mtt format or from split corpus/sentidx.
+   * @param options  page cache policy of the mapped track and sentence index, e.g. MapOptions::kRandom for serving
+   */
+  Corpus(const std::string &filename, const Vocabulary *vocab = nullptr, const MapOptions &options = MapOptions());
+
+  ~Corpus();
 
-  /**Begin of sentence (points into sequence of vocabulary IDs in the corpus track) */
+  /** Begin of sentence (points into sequence of vocabulary IDs in the corpus track). nullptr if compressed, see tokens(). */
   const Vid *begin(Sid sid) const;
   // should be friended to Sentence
 
-  /**End of sentence (points past the last vocabulary ID of the sentence in the corpus track) */
+  /** End of sentence (points past the last vocabulary ID of the sentence in the corpus track). nullptr if compressed. */
   const Vid *end(Sid sid) const;
   // should be friended to Sentence
 
+  /**
+   * The vids of a sentence in the corpus track: a contiguous range, or ranks of a compressed track (see Compress()),
+   * which are decoded on access. Cheap to copy, and valid as long as token pointers would be.
+   */
+  class Tokens {
+  public:
+    Tokens(): vids_(nullptr), packed_(nullptr), ranks_(nullptr), size_(0), shift_(0) {}
+    /** uncompressed: the vids [begin, end) */
+    Tokens(const Vid *begin, const Vid *end): vids_(begin), packed_(nullptr), ranks_(nullptr), size_(static_cast<size_t>(end - begin)), shift_(0) {}
+    /** compressed: 'size' ranks of (1 << shift) bytes each at 'packed', which index the vids in 'ranks' */
+    Tokens(const uint8_t *packed, size_t size, unsigned shift, const Vid *ranks): vids_(nullptr), packed_(packed), ranks_(ranks), size_(size), shift_(shift) {}
+
+    /** number of tokens, excluding the implicit </s> */
+    size_t size() const { return size_; }
+
+    /** vid of token i < size(). Decodes this single token only, e.g. for a probe of find_bounds(). */
+    Vid operator[](size_t i) const { return vids_ ? vids_[i] : ranks_[rank(i)]; }
+
+    /** the contiguous vids, or nullptr if compressed */
+    const Vid *data() const { return vids_; }
+
+    /** hint that operator[](i) will be read soon */
+    void prefetch(size_t i) const { __builtin_prefetch(vids_ ? static_cast<const void *>(vids_ + i) : static_cast<const void *>(packed_ + (i << shift_))); }
+
+  private:
+    size_t rank(size_t i) const {
+      const uint8_t *p = packed_ + (i << shift_);
+      if(shift_ == 0)
+        return *p;
+      if(shift_ == 1) {
+        uint16_t r;
+        memcpy(&r, p, sizeof(r));
+        return r;
+      }
+      uint32_t r;
+      memcpy(&r, p, sizeof(r));
+      return r;
+    }
+
+    const Vid *vids_;      /** uncompressed vids, or nullptr */
+    const uint8_t *packed_; /** compressed ranks */
+    const Vid *ranks_;     /** vid of each rank */
+    size_t size_;
+    unsigned shift_;       /** log2 of the bytes per rank */
+  };
+
+  /**
+   * The tokens of sentence 'sid' with a single sentence index lookup, for suffix comparisons.
+   * Readers concurrent with Flush() must use this instead of separate begin() and end() calls, which may see different mappings.
+   */
+  Tokens tokens(Sid sid) const;
+
   /** retrieve Sentence, a lightweight reference to a sentence's location. Last token is the EOS symbol </s>. */
   Sentence<Token> sentence(Sid sid) const;
 
@@ -62,21 +130,135 @@ public:
   /** total number of tokens in the entire corpus */
   size_t numTokens() const;
 
+  /**
+   * Write the entire corpus (static and dynamic part) in v3 format, as 'prefix.trk' and 'prefix.six'.
+   * Load it again with Corpus(prefix + ".trk"). Existing files are replaced atomically.
+   *
+   * Thread safety: may be called by the writer, concurrently with readers.
+   */
+  void Write(const std::string &prefix) const;
+
+  /**
+   * Write the entire corpus like Write(), and remap it as the static part, releasing the dynamic part's memory.
+   * Sentence IDs stay the same, so Positions (and TokenIndex leaves) remain valid, see also TokenIndex::Flush().
+   *
+   * If 'prefix' is the v3 corpus which is currently mapped, only the dynamic part is appended to 'prefix.trk'
+   * (the sentence index is still rewritten). A crash in between leaves the old index, which describes a prefix
+   * of the track. Otherwise, the entire corpus is written.
+   *
+   * Thread safety: the old mapping and dynamic part are retired (see RetireList), and only freed once all readers
+   * have left the Epoch::Guard they held during Flush().
+   */
+  void Flush(const std::string &prefix);
+
+  /**
+   * Replace the corpus track by a compressed copy in memory, releasing the mapping and dynamic part it replaces.
+   * Vids are coded by frequency rank, in 1, 2 or 4 bytes per token (fixed within each sentence, by its rarest word),
+   * so a single token is still decoded in O(1). Sentence IDs stay the same. Sentences added later are appended
+   * uncompressed, and Flush() compresses the new static part again (its files are written uncompressed).
+   * Only for Token types with integral vids (not AlignmentLink).
+   *
+   * Thread safety: like Flush().
+   */
+  void Compress();
+
+  /** true if the static part is compressed, see Compress() */
+  bool compressed() const;
+
 private:
+  /** location of a dynamic sentence in dyn_track, resolved to pointers (appended tokens never move) */
+  struct DynSentence {
+    const Vid *begin;
+    const Vid *end;
+  };
+
+  /** max. number of tokens in a dynamic sentence, which must be stored contiguously */
+  static constexpr size_t kMaxDynSentence = 65536;
+
+  /** divide each entry in sentIndexEntries by this (hack for byte counts in word alignment, see CorpusIndexAccounting in Types.h) */
+  static constexpr size_t kIndexEntrySize = (Token::kIndexType == CorpusIndexAccounting::IDX_CNT_BYTES) ? sizeof(Token) : 1;
+
+  /** static part and dynamic part of the corpus, replaced as a whole by Flush() */
+  struct Track {
+    std::string filename;                      /** mapped .trk or .mtt file, empty if there is no static part */
+    std::unique_ptr<MappedFile> trackFile;     /** mapping starts from beginning of file, includes header */
+    std::unique_ptr<MappedFile> sentIndexFile; /** mapping starts from index start, *excludes* header */
+    Vid *trackTokens;                          /** static corpus track */
+    SentIndexEntry *sentIndexEntries;          /** indexes sentence start positions in trackTokens, includes trailing sentinel */
+    CorpusTrackHeader trackHeader;
+    SentIndexHeader sentIndexHeader;
+
+    std::vector<uint8_t> packed;        /** compressed static track, used instead of trackTokens, see Compress() */
+    std::vector<uint64_t> packedIndex;  /** per static sentence: byte offset into packed << 2 | log2 of its bytes per rank. Includes trailing sentinel. Empty if not compressed. */
+    std::vector<Vid> ranks;             /** vids of the compressed track by descending frequency, indexed by rank */
+    size_t packedNumTokens;             /** number of tokens in packed */
+
+    AppendVector<Vid, kMaxDynSentence> dyn_track; /** dynamic corpus track, located after the last static sentence ID. */
+    AppendVector<DynSentence> dyn_sentIndex; /** locates each dynamic sentence in dyn_track. size() publishes new sentences. */
+    std::atomic<size_t> dyn_numTokens; /** number of tokens in dyn_track, excluding padding */
+
+    /** empty static part */
+    Track();
+  };
+
   const Vocabulary *vocab_;
-  std::unique_ptr<MappedFile> track_;     /** mapping starts from beginning of file, includes header */
-  std::unique_ptr<MappedFile> sentIndex_; /** mapping starts from index start, *excludes* header */
-  Vid *trackTokens_;                      /** static corpus track */
-  SentIndexEntry *sentIndexEntries_;      /** indexes sentence start positions in trackTokens_, includes trailing sentinel */
-  size_t sentIndexEntrySize_;             /** divide each entry in sentIndexEntries_ by this (hack for byte counts in word alignment, see CorpusIndexAccounting in Types.h) */
+  MapOptions map_options_;        /** for the static part, also when remapped by Flush() */
+  bool compress_;                 /** writer only: Compress() was called, so Flush() compresses too */
+  std::atomic<Track *> track_;    /** current Track, owned. Replaced by Flush() */
+  RetireList<Track> retired_;     /** writer only: Tracks replaced by Flush(), waiting for readers to finish */
+
+  /** Map the static part from a .mtt file or from a .trk/.six pair. */
+  std::unique_ptr<Track> Load(const std::string &filename) const;
+
+  /** write the sentence index of the first 'nsents' sentences to 'prefix.six', see Write() */
+  void WriteSentIndex(const std::string &prefix, Sid nsents) const;
+
+  /** Flush(): append the dynamic part of 'track' to its own .trk file, and rewrite the .six. */
+  void Append(const Track &track, const std::string &prefix) const;
 
-  CorpusTrackHeader trackHeader_;
-  SentIndexHeader sentIndexHeader_;
+  /** number of tokens in the static part of 'track' */
+  static size_t StaticTokens(const Track &track);
 
-  std::vector<Vid> dyn_track_; /** dynamic corpus track, located after the last static sentence ID. */
-  std::vector<SentIndexEntry> dyn_sentIndex_; /** indexes sentence start positions in dyn_track_, includes trailing sentinel */
+  /** write the tokens of sentence 'sid' to 'file', decoding them if compressed */
+  void WriteTokens(FILE *file, Sid sid, const std::string &filename) const;
+
+  /** Compress(): a compressed copy of all current sentences, as a static part which describes the track 'filename' (if any) */
+  std::unique_ptr<Track> CompressTrack(const std::string &filename) const;
 };
 
+template<class Token>
+inline typename Corpus<Token>::Tokens Corpus<Token>::tokens(Sid sid) const {
+  const Track *track = track_.load(std::memory_order_acquire);
+
+  // static track
+  if(sid < track->sentIndexHeader.idxSize) {
+    if(!track->packedIndex.empty()) {
+      uint64_t entry = track->packedIndex[sid], next = track->packedIndex[sid + 1];
+      unsigned shift = static_cast<unsigned>(entry & 3);
+      return Tokens(track->packed.data() + (entry >> 2), ((next >> 2) - (entry >> 2)) >> shift, shift, track->ranks.data());
+    }
+    // we provide the trailing sentinel as end of the last sentence (note that idxSize excludes it)
+    return Tokens(track->trackTokens + track->sentIndexEntries[sid] / kIndexEntrySize, track->trackTokens + track->sentIndexEntries[sid + 1] / kIndexEntrySize);
+  }
+
+  // dynamic track
+  sid -= track->sentIndexHeader.idxSize;
+  assert(sid < track->dyn_sentIndex.size());
+  const DynSentence &dyn = track->dyn_sentIndex[sid];
+  return Tokens(dyn.begin, dyn.end);
+}
+
+template<class Token>
+inline const typename Corpus<Token>::Vid* Corpus<Token>::begin(Sid sid) const {
+  return tokens(sid).data();
+}
+
+template<class Token>
+inline const typename Corpus<Token>::Vid* Corpus<Token>::end(Sid sid) const {
+  Tokens t = tokens(sid);
+  return t.data() ? t.data() + t.size() : nullptr;
+}
+
 template<class Token> class Position;
 
 template<class Token>
@@ -114,12 +296,10 @@ private:
 
   const Corpus<Token> *corpus_;
   Sid sid_;     /** sentence ID */
-  const Vid *begin_;  /** corpus track begin of sentence */
+  typename Corpus<Token>::Tokens tokens_;  /** in the corpus track */
   size_t size_; /** number of tokens */
 };
 
-template<class Token> struct AtomicPosition;
-
 /**
  * Position of a Token within a Corpus.
  */
@@ -143,8 +323,6 @@ public:
   Position &operator=(Position &&other) = default;
   Position &operator=(const Position &other) = default;
 
-  Position(AtomicPosition<Token> &atomic_pos) : Position(atomic_pos.load()) {}
-
   /** like operator<(this, other) */
   bool compare(const Position<Token> &other, const Corpus<Token> &corpus) const;
 
@@ -161,37 +339,6 @@ public:
 };
 
 
-/**
- * Atomic Position<Token> wrapper to provide safe concurrent access to individual entries of a vector of these.
- */
-template<class Token>
-struct AtomicPosition {
-  static constexpr std::memory_order order = std::memory_order_relaxed;
-  
-  AtomicPosition(const Position<Token> &p) {
-    pos.store(p, order);
-  }
-  AtomicPosition(const AtomicPosition<Token> &&p) {
-    pos.store(p.pos.load(), order);
-  }
-  AtomicPosition(const AtomicPosition<Token> &p): pos() {
-    pos.store(p.pos.load(), order);
-  }
-  AtomicPosition<Token> &operator=(const AtomicPosition<Token> &p) {
-    pos.store(p.pos.load(), order);
-    return *this;
-  }
-  AtomicPosition<Token> &operator=(AtomicPosition<Token> &&p) {
-    pos.store(p.pos.load(), order);
-    return *this;
-  }
-
-  Position<Token> load() { return pos.load(order); }
-
-  std::atomic<Position<Token>> pos;
-};
-
-
 } // namespace sto
 
 #endif //STO_CORPUS_H
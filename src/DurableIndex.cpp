@@ -0,0 +1,211 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+
+#include <boost/filesystem.hpp>
+
+#include "DurableIndex.h"
+#include "util/fsync.hpp"
+
+namespace sto {
+
+template<class Token>
+constexpr size_t DurableIndex<Token>::kReplayBatch;
+
+template<class Token>
+DurableIndex<Token>::DurableIndex(const std::string &path, Vocabulary *vocab, size_t maxLeafSize, size_t groupCommit) :
+    path_(path), vocab_(vocab), logged_vid_(0), max_leaf_size_(maxLeafSize), group_commit_(groupCommit), checkpoint_(0), checkpoint_size_(0), replayed_(0)
+{
+  boost::filesystem::create_directories(path_);
+  std::ifstream current(current_path());
+  if(current && !(current >> checkpoint_ >> checkpoint_size_))
+    throw std::runtime_error(std::string("invalid checkpoint in ") + current_path());
+  Recover();
+}
+
+template<class Token>
+void DurableIndex<Token>::Recover() {
+  std::vector<Word> words;
+  std::vector<std::vector<Token>> sents;
+  if(checkpoint_ == 0) {
+    corpus_.reset(new Corpus<Token>(vocab_));
+    index_.reset(new TokenIndex<Token>(*corpus_, max_leaf_size_));
+  } else {
+    std::string prefix = checkpoint_prefix(checkpoint_);
+    std::vector<std::vector<Token>> none; // word records only
+    if(SentenceLog<Token>::Read(prefix + ".voc", none, &words) == 0)
+      throw std::runtime_error(std::string("invalid vocabulary in ") + prefix + ".voc");
+    corpus_.reset(new Corpus<Token>(corpus_prefix() + ".trk", vocab_));
+    index_.reset(new TokenIndex<Token>(prefix + ".sfa", *corpus_, max_leaf_size_));
+  }
+
+  // the vocabulary first, since the corpus checks the vids of added sentences
+  SentenceLog<Token>::Read(log_path(checkpoint_), sents, &words);
+  RestoreWords(words);
+
+  // sentences of a crashed Checkpoint() are at the head of the log, and already in the corpus (but not in the index)
+  Sid nsents = corpus_->size();
+  if(nsents < checkpoint_size_ || nsents - checkpoint_size_ > sents.size())
+    throw std::runtime_error(std::string("corpus does not match the checkpoint in ") + path_);
+  size_t skip = nsents - checkpoint_size_;
+
+  // replay the log tail in batches, each sorted and merged into the leaves at once
+  std::vector<Sentence<Token>> batch;
+  auto add_batch = [&]() {
+    if(!batch.empty())
+      index_->AddSentences(batch);
+    batch.clear();
+  };
+  for(size_t i = 0; i < sents.size(); i++) {
+    if(i >= skip)
+      corpus_->AddSentence(sents[i]);
+    batch.push_back(corpus_->sentence(static_cast<Sid>(checkpoint_size_ + i)));
+    if(batch.size() >= kReplayBatch)
+      add_batch();
+  }
+  add_batch();
+  replayed_ = sents.size();
+
+  // opening truncates a torn record at the end of the log
+  log_.reset(new SentenceLog<Token>(log_path(checkpoint_), group_commit_));
+}
+
+template<class Token>
+void DurableIndex<Token>::RestoreWords(const std::vector<Word> &words) {
+  logged_vid_ = Vocabulary::kEOS + 1;
+  if(!vocab_)
+    return;
+  for(const Word &word : words) {
+    bool match;
+    if(word.first < vocab_->end().vid) {
+      try {
+        match = word.second == vocab_->c_str(Token{word.first});
+      } catch(const std::out_of_range &) {
+        match = false; // gap in a loaded vocabulary
+      }
+    } else {
+      match = (*vocab_)[word.second].vid == word.first; // vids are assigned in order
+    }
+    if(!match)
+      throw std::runtime_error(std::string("vocabulary does not match the log in ") + path_ + ": " + word.second);
+    logged_vid_ = std::max(logged_vid_, static_cast<Vid>(word.first + 1));
+  }
+}
+
+template<class Token>
+void DurableIndex<Token>::LogWords() {
+  if(!vocab_)
+    return;
+  Vid end = vocab_->end().vid;
+  for(Vid vid = logged_vid_; vid < end; vid++) {
+    try {
+      log_->AppendWord(vid, vocab_->c_str(Token{vid}));
+    } catch(const std::out_of_range &) {
+      // gap in a loaded vocabulary
+    }
+  }
+  logged_vid_ = end;
+}
+
+template<class Token>
+void DurableIndex<Token>::AddSentence(const std::vector<Token> &sent) {
+  // write-ahead: once indexed, readers may observe the sentence, so it must be logged first
+  LogWords();
+  log_->Append(sent);
+  corpus_->AddSentence(sent);
+  index_->AddSentence(corpus_->sentence(corpus_->size() - 1));
+}
+
+template<class Token>
+void DurableIndex<Token>::Sync() {
+  log_->Sync();
+}
+
+template<class Token>
+void DurableIndex<Token>::Checkpoint() {
+  size_t next = checkpoint_ + 1;
+  std::string prefix = checkpoint_prefix(next);
+  Sid nsents = corpus_->size();
+
+  // the whole vocabulary, replacing any leftover of a crashed Checkpoint()
+  boost::filesystem::remove(prefix + ".voc");
+  Vid end = vocab_ ? vocab_->end().vid : 0;
+  {
+    SentenceLog<Token> voc(prefix + ".voc", /* groupSize = */ 0);
+    for(Vid vid = Vocabulary::kEOS + 1; vid < end; vid++) {
+      try {
+        voc.AppendWord(vid, vocab_->c_str(Token{vid}));
+      } catch(const std::out_of_range &) {
+        // gap in a loaded vocabulary
+      }
+    }
+    voc.Sync();
+  }
+
+  // the track first, see Corpus::Write(). After the first Checkpoint(), Flush() appends the new sentences
+  // to the track. Both also release the memory of the dynamic parts, and sync their files.
+  corpus_->Flush(corpus_prefix());
+  index_->Flush(prefix + ".sfa");
+
+  // a leftover log of a crashed Checkpoint() has no records, but remove it anyway
+  boost::filesystem::remove(log_path(next));
+
+  // commit: switch CURRENT atomically
+  std::string tmp_name = current_path() + ".tmp";
+  {
+    std::ofstream current(tmp_name);
+    current << next << " " << nsents << std::endl;
+    if(!current)
+      throw std::runtime_error(std::string("failed to write ") + tmp_name);
+  }
+  sync_path(tmp_name);
+  if(rename(tmp_name.c_str(), current_path().c_str()) != 0)
+    throw std::runtime_error(std::string("failed to write ") + current_path());
+  sync_dir(current_path());
+
+  // an empty log for the new checkpoint (the constructor syncs it). Until here, appends went to the old log.
+  log_.reset(new SentenceLog<Token>(log_path(next), group_commit_));
+  logged_vid_ = std::max(end, static_cast<Vid>(Vocabulary::kEOS + 1));
+
+  // the old checkpoint is not needed for recovery anymore (its mapping stays valid until unmapped)
+  boost::system::error_code ec;
+  if(checkpoint_ > 0)
+    for(std::string ext : {".voc", ".sfa"})
+      boost::filesystem::remove(checkpoint_prefix(checkpoint_) + ext, ec);
+  boost::filesystem::remove(log_path(checkpoint_), ec);
+  checkpoint_ = next;
+  checkpoint_size_ = nsents;
+}
+
+template<class Token>
+std::string DurableIndex<Token>::current_path() const {
+  return (boost::filesystem::path(path_) / "CURRENT").string();
+}
+
+template<class Token>
+std::string DurableIndex<Token>::corpus_prefix() const {
+  return (boost::filesystem::path(path_) / "corpus").string();
+}
+
+template<class Token>
+std::string DurableIndex<Token>::checkpoint_prefix(size_t n) const {
+  return (boost::filesystem::path(path_) / ("ckpt-" + std::to_string(n))).string();
+}
+
+template<class Token>
+std::string DurableIndex<Token>::log_path(size_t n) const {
+  return (boost::filesystem::path(path_) / ("log-" + std::to_string(n))).string();
+}
+
+// explicit template instantiation
+template class DurableIndex<SrcToken>;
+template class DurableIndex<TrgToken>;
+
+} // namespace sto
@@ -0,0 +1,124 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#ifndef STO_DURABLEINDEX_H
+#define STO_DURABLEINDEX_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Corpus.h"
+#include "TokenIndex.h"
+#include "SentenceLog.h"
+#include "Types.h"
+
+namespace sto {
+
+/**
+ * A dynamic Corpus, its vocabulary and TokenIndex in a directory, which survive a crash: every added sentence
+ * (and any new vocabulary entries it uses) is logged to a SentenceLog before it is indexed, and Checkpoint()
+ * persists the corpus track (v3 format), the vocabulary and the index (as a single .sfa suffix array).
+ *
+ * Opening the directory loads the last checkpoint and replays only the log written after it, with the batched
+ * insert path TokenIndex::AddSentences(). So recovery time is bounded by the checkpoint interval, rather than by
+ * the length of the update history.
+ *
+ * Directory layout, for checkpoint number n:
+ *
+ *   CURRENT         n and the number of sentences of checkpoint n, replaced atomically by Checkpoint()
+ *   corpus.trk/six  corpus, at least the sentences of checkpoint n. Checkpoint() appends to the track.
+ *   ckpt-n.voc      vocabulary of checkpoint n (n > 0), as SentenceLog word records
+ *   ckpt-n.sfa      index of checkpoint n (n > 0)
+ *   log-n           sentences (and new vocabulary entries) added after checkpoint n
+ *
+ * The corpus may hold more sentences than checkpoint n, after a crash during Checkpoint(): those are at the head
+ * of log-n, and only indexed when replaying it. Each Checkpoint() still writes the entire index, since new suffixes
+ * are spread over the whole suffix array (TreeNodeDisk would be the alternative for huge indexes).
+ *
+ * Thread safety: like TokenIndex, a single writer (which also inserts into the vocabulary), concurrently with
+ * readers of corpus() and index(). Checkpoint() replaces the corpus mapping and index leaves: readers must hold an
+ * Epoch::Guard while using Sentences or token pointers across calls, see Corpus::Flush(). Index lookups take one.
+ */
+template<class Token>
+class DurableIndex {
+public:
+  typedef typename Corpus<Token>::Vocabulary Vocabulary;
+
+  /**
+   * Open the index in directory 'path', which is created if it does not exist yet.
+   * @param vocab        the persisted vocabulary entries are restored into 'vocab', which must either be empty,
+   *                     or agree with them on each vid it already holds (e.g. the caller's own copy)
+   * @param groupCommit  fsync() the log every groupCommit added records, see SentenceLog
+   */
+  DurableIndex(const std::string &path, Vocabulary *vocab, size_t maxLeafSize = 10000, size_t groupCommit = 64);
+
+  /**
+   * Log any vocabulary entries added since the last call, then log the sentence (without </s>), add it to
+   * the corpus and index it. Durable after the next group commit or Sync().
+   */
+  void AddSentence(const std::vector<Token> &sent);
+
+  /** Make all sentences added so far durable. */
+  void Sync();
+
+  /**
+   * Persist the corpus and index as a new checkpoint, and start a new log. Afterwards, the older checkpoint and
+   * its log are removed. A crash during Checkpoint() recovers from the older checkpoint.
+   */
+  void Checkpoint();
+
+  Corpus<Token> &corpus() { return *corpus_; }
+  Vocabulary &vocab() { return *vocab_; }
+  TokenIndex<Token> &index() { return *index_; }
+
+  /** number of the current checkpoint, 0 for none */
+  size_t checkpoint() const { return checkpoint_; }
+
+  /** number of sentences replayed from the log when opening */
+  size_t replayed() const { return replayed_; }
+
+  /** number of sentences in the log, i.e. added after the current checkpoint */
+  size_t log_size() const { return log_->size(); }
+
+private:
+  /** sentences per AddSentences() batch, when replaying the log */
+  static constexpr size_t kReplayBatch = 10000;
+
+  typedef typename Corpus<Token>::Vid Vid;
+  typedef typename Corpus<Token>::Sid Sid;
+  typedef typename SentenceLog<Token>::Word Word;
+
+  std::string path_;
+  Vocabulary *vocab_;
+  Vid logged_vid_; /** vocabulary entries below this vid are in the current checkpoint or log */
+  size_t max_leaf_size_;
+  size_t group_commit_;
+  size_t checkpoint_;
+  Sid checkpoint_size_; /** number of sentences of checkpoint_, which its index holds */
+  size_t replayed_;
+  std::unique_ptr<Corpus<Token>> corpus_;
+  std::unique_ptr<TokenIndex<Token>> index_;
+  std::unique_ptr<SentenceLog<Token>> log_;
+
+  std::string current_path() const;
+  std::string corpus_prefix() const;
+  std::string checkpoint_prefix(size_t n) const;
+  std::string log_path(size_t n) const;
+
+  /** load checkpoint_, and replay its log */
+  void Recover();
+
+  /** insert persisted vocabulary entries into vocab_, checking vids */
+  void RestoreWords(const std::vector<Word> &words);
+
+  /** log the vocabulary entries added since the last call */
+  void LogWords();
+};
+
+} // namespace sto
+
+#endif //STO_DURABLEINDEX_H
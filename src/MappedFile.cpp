@@ -17,7 +17,7 @@
 
 namespace sto {
 
-MappedFile::MappedFile(const std::string& filename, size_t offset) {
+MappedFile::MappedFile(const std::string& filename, size_t offset, const MapOptions &options) : page_len_(0), stop_warmup_(false) {
   int fd;
   struct stat sb;
 
@@ -31,17 +31,63 @@ MappedFile::MappedFile(const std::string& filename, size_t offset) {
   }
   map_len_ = static_cast<size_t>(sb.st_size) - offset;
 
-  if((page_ptr_ = mmap(0, map_len_, PROT_READ, MAP_SHARED, fd, offset - offset % page_size)) == MAP_FAILED) {
+  if(map_len_ == 0) {
+    // mmap() refuses empty mappings
+    close(fd);
+    page_ptr_ = nullptr;
+    ptr = nullptr;
+    return;
+  }
+  int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+  if(options.populate)
+    flags |= MAP_POPULATE;
+#endif
+  // map from the page boundary, so the whole file range is covered
+  page_len_ = map_len_ + offset % page_size;
+  if((page_ptr_ = mmap(0, page_len_, PROT_READ, flags, fd, offset - offset % page_size)) == MAP_FAILED) {
     close(fd);
     throw std::runtime_error(std::string("mmap(): MAP_FAILED on ") + filename);
   }
-  fd_ = fd;
+  // the mapping stays valid without the descriptor, so we do not hold on to one per (possibly many) mapped files
+  close(fd);
   ptr = reinterpret_cast<char *>(page_ptr_) + offset % page_size;
+
+  // hints only: failures (e.g. unsupported by the kernel or file system) are ignored
+  switch(options.advice) {
+  case MapOptions::kNormal: break;
+  case MapOptions::kRandom: madvise(page_ptr_, page_len_, MADV_RANDOM); break;
+  case MapOptions::kSequential: madvise(page_ptr_, page_len_, MADV_SEQUENTIAL); break;
+  case MapOptions::kWillNeed: madvise(page_ptr_, page_len_, MADV_WILLNEED); break;
+  }
+#ifdef MADV_HUGEPAGE
+  if(options.hugepages)
+    madvise(page_ptr_, page_len_, MADV_HUGEPAGE);
+#endif
+
+  if(options.warmup && !options.populate)
+    warmup_ = std::thread(&MappedFile::Warmup, this, page_size);
 }
 
 MappedFile::~MappedFile() {
-  munmap(page_ptr_, map_len_);
-  close(fd_);
+  stop_warmup_.store(true);
+  WaitWarmup();
+  if(page_ptr_ != nullptr)
+    munmap(page_ptr_, page_len_);
+}
+
+void MappedFile::WaitWarmup() {
+  if(warmup_.joinable())
+    warmup_.join();
+}
+
+void MappedFile::Warmup(size_t page_size) {
+  // read a byte of every page, which faults it in (unlike MADV_WILLNEED, this is guaranteed to populate the mapping)
+  const volatile char *p = reinterpret_cast<const volatile char *>(page_ptr_);
+  char sum = 0;
+  for(size_t i = 0; i < page_len_ && !stop_warmup_.load(std::memory_order_relaxed); i += page_size)
+    sum ^= p[i];
+  (void) sum;
 }
 
 } // namespace sto
@@ -7,27 +7,66 @@
 #ifndef STO_MAPPEDFILE_H
 #define STO_MAPPEDFILE_H
 
+#include <atomic>
 #include <string>
+#include <thread>
 
 namespace sto {
 
+/**
+ * Page cache policy for a MappedFile. The defaults are a plain mapping, which is faulted in on demand.
+ */
+struct MapOptions {
+  /** expected access pattern, passed to madvise(), which controls kernel readahead */
+  enum Advice {
+    kNormal, /** default readahead */
+    kRandom, /** MADV_RANDOM: no readahead, e.g. for binary search probes into a large suffix array or corpus track */
+    kSequential, /** MADV_SEQUENTIAL: aggressive readahead */
+    kWillNeed /** MADV_WILLNEED: start asynchronous readahead of the whole file now */
+  };
+
+  Advice advice;
+  bool populate; /** MAP_POPULATE: prefault the whole file in the constructor (blocks until it is read) */
+  bool hugepages; /** MADV_HUGEPAGE: transparent huge pages, where the kernel supports them for file mappings */
+  bool warmup; /** touch every page from a background thread, so the file is cached without blocking the constructor */
+
+  MapOptions(Advice advice = kNormal, bool populate = false, bool hugepages = false, bool warmup = false) :
+      advice(advice), populate(populate), hugepages(hugepages), warmup(warmup) {}
+};
+
 /**
  * Memory-mapped file.
  */
 class MappedFile {
 public:
-  MappedFile(const std::string& filename, size_t offset = 0);
+  /**
+   * Map a file read-only, starting at byte 'offset'.
+   * Hints in 'options' which the kernel does not support are ignored (madvise() failures are not errors).
+   */
+  MappedFile(const std::string& filename, size_t offset = 0, const MapOptions &options = MapOptions());
+  /** stops an unfinished warm-up first */
   ~MappedFile();
 
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
   /** length of the mapping in bytes, may be smaller than the file size if using an offset */
   size_t size() const { return map_len_; }
 
+  /** block until the background warm-up (if any) has touched every page */
+  void WaitWarmup();
+
   char *ptr; /** pointer to mapped area of file data, honors offset */
 
 private:
-  int fd_;
   size_t map_len_; /** length of the mapping, may be smaller than the file size if using an offset */
   void *page_ptr_; /** file data pointer, points to beginning of mapped page */
+  size_t page_len_; /** length of the mapping from page_ptr_ */
+
+  std::atomic<bool> stop_warmup_;
+  std::thread warmup_; /** touches every page once, see MapOptions::warmup */
+
+  void Warmup(size_t page_size);
 };
 
 } // namespace sto
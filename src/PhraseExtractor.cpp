@@ -0,0 +1,120 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "PhraseExtractor.h"
+#include "util/epoch.hpp"
+
+namespace sto {
+
+size_t PhraseExtractor::PhraseHash::operator()(const TargetPhrase &phrase) const {
+  // FNV-1a over the vids
+  size_t hash = 14695981039346656037ULL;
+  for(Vid vid : phrase) {
+    hash ^= static_cast<size_t>(vid);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+PhraseExtractor::PhraseExtractor(const Corpus<TrgToken> &target, const Corpus<AlignmentLink> &alignment, size_t maxPhraseLength, bool extendUnaligned) :
+    target_(target), alignment_(alignment), kMaxPhraseLength(maxPhraseLength), kExtendUnaligned(extendUnaligned),
+    links_begin_(nullptr), links_end_(nullptr)
+{}
+
+size_t PhraseExtractor::Extract(const std::vector<Position<SrcToken>> &positions, size_t length, PhraseCounts &counts) {
+  // visit sentences in order, so each alignment is loaded only once, and the tracks are read sequentially
+  order_.resize(positions.size());
+  for(size_t i = 0; i < order_.size(); i++)
+    order_[i] = i;
+  std::sort(order_.begin(), order_.end(), [&positions](size_t a, size_t b) {
+    return positions[a].sid < positions[b].sid;
+  });
+
+  Epoch::Guard guard; // keeps the loaded target_tokens_ and links valid across Corpus::Flush()
+  size_t nextracted = 0;
+  bool loaded = false;
+  Sid sid = 0;
+  for(size_t i : order_) {
+    const Position<SrcToken> &pos = positions[i];
+    if(!loaded || pos.sid != sid) {
+      sid = pos.sid;
+      LoadAlignment(sid);
+      loaded = true;
+    }
+    size_t srcBegin = static_cast<size_t>(pos.offset);
+    if(ExtractRange(srcBegin, srcBegin + length, counts))
+      nextracted++;
+  }
+  return nextracted;
+}
+
+void PhraseExtractor::LoadAlignment(Sid sid) {
+  if(sid >= target_.size() || sid >= alignment_.size())
+    throw std::runtime_error("PhraseExtractor: sentence ID beyond the target or alignment Corpus");
+
+  target_tokens_ = target_.tokens(sid);
+  size_t target_length = target_tokens_.size();
+  Corpus<AlignmentLink>::Tokens links = alignment_.tokens(sid); // alignments are never compressed, see Corpus::Compress()
+  links_begin_ = links.data();
+  links_end_ = links.data() + links.size();
+
+  minSrc_.assign(target_length, kUnaligned);
+  maxSrc_.assign(target_length, 0);
+  for(const aln_link_t *link = links_begin_; link != links_end_; ++link) {
+    size_t src = static_cast<size_t>(link->src), trg = static_cast<size_t>(link->trg);
+    if(trg >= target_length)
+      throw std::runtime_error("PhraseExtractor: alignment link beyond the target sentence");
+    minSrc_[trg] = (minSrc_[trg] == kUnaligned) ? src : std::min(minSrc_[trg], src);
+    maxSrc_[trg] = std::max(maxSrc_[trg], src);
+  }
+}
+
+bool PhraseExtractor::ExtractRange(size_t srcBegin, size_t srcEnd, PhraseCounts &counts) {
+  // target range [trgBegin, trgEnd] covering all links from the source range
+  size_t trgBegin = kUnaligned, trgEnd = 0;
+  for(const aln_link_t *link = links_begin_; link != links_end_; ++link) {
+    size_t src = static_cast<size_t>(link->src), trg = static_cast<size_t>(link->trg);
+    if(src >= srcBegin && src < srcEnd) {
+      trgBegin = std::min(trgBegin, trg);
+      trgEnd = std::max(trgEnd, trg);
+    }
+  }
+  if(trgBegin == kUnaligned)
+    return false; // unaligned source phrase
+  if(trgEnd - trgBegin + 1 > kMaxPhraseLength)
+    return false;
+
+  // consistency: no target token inside may be aligned to a source token outside of the source range
+  for(size_t t = trgBegin; t <= trgEnd; t++)
+    if(minSrc_[t] != kUnaligned && (minSrc_[t] < srcBegin || maxSrc_[t] >= srcEnd))
+      return false;
+
+  // the minimal phrase, and optionally its extensions by unaligned target tokens on either side
+  size_t target_length = minSrc_.size();
+  size_t first = trgBegin, last = trgEnd;
+  if(kExtendUnaligned) {
+    while(first > 0 && minSrc_[first - 1] == kUnaligned && trgEnd - (first - 1) + 1 <= kMaxPhraseLength)
+      first--;
+    while(last + 1 < target_length && minSrc_[last + 1] == kUnaligned && (last + 1) - trgBegin + 1 <= kMaxPhraseLength)
+      last++;
+  }
+  for(size_t b = first; b <= trgBegin; b++) {
+    for(size_t e = trgEnd; e <= last && e - b + 1 <= kMaxPhraseLength; e++) {
+      phrase_.clear();
+      for(size_t i = b; i <= e; i++)
+        phrase_.push_back(target_tokens_[i]);
+      counts[phrase_]++;
+    }
+  }
+  return true;
+}
+
+constexpr size_t PhraseExtractor::kUnaligned;
+
+} // namespace sto
@@ -0,0 +1,98 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#ifndef STO_PHRASEEXTRACTOR_H
+#define STO_PHRASEEXTRACTOR_H
+
+#include <unordered_map>
+#include <vector>
+
+#include "Corpus.h"
+#include "Types.h"
+
+namespace sto {
+
+/**
+ * Extracts the target phrases aligned to occurrences of a source phrase in a word-aligned parallel corpus,
+ * such as the sampled Positions of a source TokenIndex Span, and aggregates their counts.
+ *
+ * The target Corpus and the word alignment Corpus must be parallel to the indexed source Corpus
+ * (same sentence IDs). Extracted target phrases are consistent with the word alignment: no target token
+ * inside is aligned to a source token outside of the source phrase. Optionally, they are extended by
+ * unaligned target tokens at their boundaries, like in Moses phrase extraction.
+ *
+ * Occurrences are processed in sentence ID order, and the alignment of each sentence is read once for all
+ * occurrences in it. Buffers are kept across calls, so a PhraseExtractor should be reused, but is
+ * not thread safe (use one per thread).
+ */
+class PhraseExtractor {
+public:
+  typedef TrgToken::Vid Vid;
+  typedef std::vector<Vid> TargetPhrase; /** vocabulary IDs of a target phrase */
+
+  struct PhraseHash {
+    size_t operator()(const TargetPhrase &phrase) const;
+  };
+  /** counts of extracted target phrases */
+  typedef std::unordered_map<TargetPhrase, size_t, PhraseHash> PhraseCounts;
+
+  /**
+   * @param target           target side Corpus, parallel to the source Corpus
+   * @param alignment        word alignment Corpus, with source offsets in AlignmentLink::src
+   * @param maxPhraseLength  maximum length of extracted target phrases
+   * @param extendUnaligned  also extract target phrases extended by unaligned target tokens at the boundaries
+   */
+  PhraseExtractor(const Corpus<TrgToken> &target, const Corpus<AlignmentLink> &alignment, size_t maxPhraseLength = 7, bool extendUnaligned = true);
+
+  /**
+   * Extract the target phrases for occurrences of a source phrase of 'length' tokens, starting at each of
+   * 'positions', and add their counts to 'counts'.
+   *
+   * @return number of positions for which at least one consistent target phrase was extracted
+   */
+  size_t Extract(const std::vector<Position<SrcToken>> &positions, size_t length, PhraseCounts &counts);
+
+  /**
+   * Sample up to k occurrences of the lookup sequence of 'span', see Span::sample(), and extract their
+   * target phrases like Extract(positions, span.depth(), counts).
+   */
+  template<class Span, class RNG>
+  size_t Extract(const Span &span, size_t k, RNG &rng, PhraseCounts &counts, bool stratified = false) {
+    span.sample(k, rng, positions_, stratified);
+    return Extract(positions_, span.depth(), counts);
+  }
+
+private:
+  typedef Corpus<SrcToken>::Sid Sid;
+  static constexpr size_t kUnaligned = static_cast<size_t>(-1);
+
+  const Corpus<TrgToken> &target_;
+  const Corpus<AlignmentLink> &alignment_;
+  const size_t kMaxPhraseLength;
+  const bool kExtendUnaligned;
+
+  // buffers reused across calls
+  std::vector<Position<SrcToken>> positions_; /** sampled source positions */
+  std::vector<size_t> order_; /** indices into the positions being extracted, in sentence ID order */
+  std::vector<size_t> minSrc_; /** per target token: lowest aligned source offset, or kUnaligned */
+  std::vector<size_t> maxSrc_; /** per target token: highest aligned source offset */
+  TargetPhrase phrase_; /** current target phrase */
+
+  // current sentence
+  Corpus<TrgToken>::Tokens target_tokens_; /** target sentence tokens */
+  const aln_link_t *links_begin_; /** word alignment links */
+  const aln_link_t *links_end_;
+
+  /** Load the target sentence and word alignment of sentence 'sid', filling minSrc_ and maxSrc_. */
+  void LoadAlignment(Sid sid);
+
+  /** Extract the target phrases for source range [srcBegin, srcEnd) of the current sentence into 'counts'. */
+  bool ExtractRange(size_t srcBegin, size_t srcEnd, PhraseCounts &counts);
+};
+
+} // namespace sto
+
+#endif //STO_PHRASEEXTRACTOR_H
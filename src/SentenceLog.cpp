@@ -0,0 +1,183 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "SentenceLog.h"
+#include "util/fsync.hpp"
+
+namespace sto {
+
+template<class Token>
+constexpr uint32_t SentenceLog<Token>::kMagic;
+template<class Token>
+constexpr uint32_t SentenceLog<Token>::kVersion;
+
+template<class Token>
+SentenceLog<Token>::SentenceLog(const std::string &filename, size_t groupSize) : filename_(filename), fd_(-1), group_size_(groupSize), unsynced_(0), size_(0) {
+  std::vector<std::vector<Token>> sents;
+  size_t length = Read(filename, sents);
+  size_ = sents.size();
+
+  fd_ = open(filename.c_str(), O_WRONLY | O_CREAT, 0644);
+  if(fd_ < 0)
+    throw std::runtime_error(std::string("failed to open log for write at ") + filename + ": " + strerror(errno));
+
+  if(length == 0) {
+    // new (or unreadable) log: start over with an empty one
+    Header header{kMagic, kVersion};
+    if(ftruncate(fd_, 0) != 0)
+      throw std::runtime_error(std::string("failed to truncate ") + filename);
+    WriteAll(&header, sizeof(header));
+    Sync();
+    sync_dir(filename); // the new directory entry
+    return;
+  }
+  // drop a torn record at the end, and append after the last complete one
+  if(ftruncate(fd_, static_cast<off_t>(length)) != 0 || lseek(fd_, static_cast<off_t>(length), SEEK_SET) < 0)
+    throw std::runtime_error(std::string("failed to truncate ") + filename);
+}
+
+template<class Token>
+SentenceLog<Token>::~SentenceLog() {
+  if(fd_ < 0)
+    return;
+  fsync(fd_);
+  close(fd_);
+}
+
+template<class Token>
+void SentenceLog<Token>::Append(const std::vector<Token> &sent) {
+  std::vector<Vid> vids;
+  vids.reserve(sent.size());
+  for(const Token &t : sent)
+    vids.push_back(t.vid);
+  AppendRecord(kSentence, static_cast<uint32_t>(vids.size()), reinterpret_cast<const char *>(vids.data()), vids.size() * sizeof(Vid));
+  size_++;
+}
+
+template<class Token>
+void SentenceLog<Token>::AppendWord(Vid vid, const std::string &surface) {
+  std::vector<char> payload(sizeof(Vid) + surface.size());
+  memcpy(payload.data(), &vid, sizeof(Vid));
+  memcpy(payload.data() + sizeof(Vid), surface.data(), surface.size());
+  AppendRecord(kWord, static_cast<uint32_t>(surface.size()), payload.data(), payload.size());
+}
+
+template<class Token>
+void SentenceLog<Token>::AppendRecord(uint32_t kind, uint32_t length, const char *payload, size_t size) {
+  // a single write() per record, so that a crash tears at most the last record
+  RecordHeader header{kind, length, Checksum(kind, length, payload, size)};
+  std::vector<char> record(sizeof(header) + size);
+  memcpy(record.data(), &header, sizeof(header));
+  if(size > 0)
+    memcpy(record.data() + sizeof(header), payload, size);
+  WriteAll(record.data(), record.size());
+
+  if(group_size_ > 0 && ++unsynced_ >= group_size_)
+    Sync();
+}
+
+template<class Token>
+void SentenceLog<Token>::Sync() {
+  if(fsync(fd_) != 0)
+    throw std::runtime_error(std::string("failed to sync ") + filename_);
+  unsynced_ = 0;
+}
+
+template<class Token>
+size_t SentenceLog<Token>::PayloadSize(const RecordHeader &header) {
+  return header.kind == kWord ? sizeof(Vid) + header.length : static_cast<size_t>(header.length) * sizeof(Vid);
+}
+
+template<class Token>
+size_t SentenceLog<Token>::Read(const std::string &filename, std::vector<std::vector<Token>> &sents, std::vector<Word> *words) {
+  FILE *file = fopen(filename.c_str(), "rb");
+  if(!file)
+    return 0;
+
+  // the file size bounds the payload of each record: the length of a torn or corrupt record must not be trusted
+  size_t file_size = 0;
+  if(fseek(file, 0, SEEK_END) == 0) {
+    long end = ftell(file);
+    file_size = end > 0 ? static_cast<size_t>(end) : 0;
+  }
+  Header header;
+  if(fseek(file, 0, SEEK_SET) != 0 || fread(&header, sizeof(header), 1, file) != 1 || header.magic != kMagic || header.version != kVersion) {
+    fclose(file);
+    return 0;
+  }
+  size_t length = sizeof(header);
+
+  RecordHeader record;
+  std::vector<char> payload;
+  while(fread(&record, sizeof(record), 1, file) == 1) {
+    if(record.kind != kSentence && record.kind != kWord)
+      break;
+    size_t size = PayloadSize(record);
+    if(size > file_size - length - sizeof(record))
+      break; // torn record
+    payload.resize(size);
+    if(size > 0 && fread(payload.data(), 1, size, file) != size)
+      break;
+    if(Checksum(record.kind, record.length, payload.data(), size) != record.checksum)
+      break;
+
+    if(record.kind == kSentence) {
+      const Vid *vids = reinterpret_cast<const Vid *>(payload.data());
+      sents.push_back(std::vector<Token>(vids, vids + record.length));
+    } else if(words) {
+      Vid vid;
+      memcpy(&vid, payload.data(), sizeof(Vid));
+      words->push_back(Word(vid, std::string(payload.data() + sizeof(Vid), record.length)));
+    }
+    length += sizeof(record) + size;
+  }
+  fclose(file);
+  return length;
+}
+
+template<class Token>
+uint32_t SentenceLog<Token>::Checksum(uint32_t kind, uint32_t length, const char *payload, size_t size) {
+  // FNV-1a over kind, length and payload
+  uint32_t h = 2166136261u;
+  auto add = [&h](uint8_t byte) {
+    h ^= byte;
+    h *= 16777619u;
+  };
+  for(uint32_t value : {kind, length})
+    for(size_t i = 0; i < sizeof(value); i++)
+      add(static_cast<uint8_t>(value >> (8 * i)));
+  for(size_t i = 0; i < size; i++)
+    add(static_cast<uint8_t>(payload[i]));
+  return h;
+}
+
+template<class Token>
+void SentenceLog<Token>::WriteAll(const void *data, size_t size) {
+  const char *p = static_cast<const char *>(data);
+  while(size > 0) {
+    ssize_t n = write(fd_, p, size);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      throw std::runtime_error(std::string("failed to write ") + filename_);
+    p += n;
+    size -= static_cast<size_t>(n);
+  }
+}
+
+// explicit template instantiation
+template class SentenceLog<SrcToken>;
+template class SentenceLog<TrgToken>;
+
+} // namespace sto
@@ -0,0 +1,103 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#ifndef STO_SENTENCELOG_H
+#define STO_SENTENCELOG_H
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Corpus.h"
+#include "Types.h"
+
+namespace sto {
+
+/**
+ * Append-only binary write-ahead log of added sentences, for crash recovery of dynamic updates (see DurableIndex).
+ *
+ * Each record holds either the vids of one sentence, or a vocabulary entry (a new vid and its surface form, so that
+ * a log can be replayed into a fresh vocabulary), with a checksum. Records are written to the file by Append()
+ * right away, so they survive a crash of the process, and are fsync()ed in groups (group commit), so that they
+ * survive a crash of the machine after Sync(). A torn record at the end of the log, from a crash during Append(),
+ * is detected by its length or checksum, and dropped.
+ *
+ * Not thread safe: a single writer appends.
+ */
+template<class Token>
+class SentenceLog {
+public:
+  typedef typename Corpus<Token>::Vid Vid;
+
+  /**
+   * Open the log at 'filename' for appending after its last complete record, or create an empty one.
+   * @param groupSize  fsync() after this many appended records (0: only on Sync())
+   */
+  SentenceLog(const std::string &filename, size_t groupSize = 64);
+
+  /** syncs the log */
+  ~SentenceLog();
+
+  SentenceLog(const SentenceLog &) = delete;
+  SentenceLog &operator=(const SentenceLog &) = delete;
+
+  /** Append a sentence record (without </s>). Durable after the next Sync(), automatically every groupSize records. */
+  void Append(const std::vector<Token> &sent);
+
+  /** Append a vocabulary entry record. Durable like Append(), which counts it towards the group. */
+  void AppendWord(Vid vid, const std::string &surface);
+
+  /** fsync() all records appended so far */
+  void Sync();
+
+  /** number of sentence records in the log */
+  size_t size() const { return size_; }
+
+  /** vocabulary entry: vid and surface form */
+  typedef std::pair<Vid, std::string> Word;
+
+  /**
+   * Read all complete records of the log at 'filename' into 'sents' and (optionally) 'words', each in order of appending.
+   * @return length in bytes of the complete records (including the file header), 0 if there is no valid log
+   */
+  static size_t Read(const std::string &filename, std::vector<std::vector<Token>> &sents, std::vector<Word> *words = nullptr);
+
+private:
+  static constexpr uint32_t kMagic = 0x4c4f5453; /** "STOL" */
+  static constexpr uint32_t kVersion = 2;
+
+  enum Kind : uint32_t { kSentence = 0, kWord = 1 };
+
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+  };
+  struct RecordHeader {
+    uint32_t kind; /** see Kind */
+    uint32_t length; /** kSentence: number of vids. kWord: length of the surface form, which follows its vid */
+    uint32_t checksum; /** of kind, length and payload, see Checksum() */
+  };
+
+  std::string filename_;
+  int fd_;
+  size_t group_size_;
+  size_t unsynced_; /** records appended since the last fsync() */
+  size_t size_;
+
+  /** size in bytes of the payload which follows a record header */
+  static size_t PayloadSize(const RecordHeader &header);
+
+  static uint32_t Checksum(uint32_t kind, uint32_t length, const char *payload, size_t size);
+  void WriteAll(const void *data, size_t size);
+
+  /** write a single record, and sync if the group is complete */
+  void AppendRecord(uint32_t kind, uint32_t length, const char *payload, size_t size);
+};
+
+} // namespace sto
+
+#endif //STO_SENTENCELOG_H
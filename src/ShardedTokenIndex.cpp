@@ -0,0 +1,263 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+#include "ShardedTokenIndex.h"
+
+namespace sto {
+
+template<class Token>
+class TokenIndexShard<Token>::SequenceView : public TokenIndexShard<Token>::SpanView {
+public:
+  SequenceView(const TokenIndexShard<Token> &shard, std::vector<Token> sequence) :
+      shard_(shard), sequence_(std::move(sequence)), size_(shard.Count(sequence_)) {}
+
+  virtual size_t size() const { return size_; }
+
+  virtual std::shared_ptr<const SpanView> narrow(Token t) const {
+    std::vector<Token> sequence = sequence_;
+    sequence.push_back(t);
+    return std::make_shared<SequenceView>(shard_, std::move(sequence));
+  }
+
+  virtual void at_sorted(const std::vector<size_t> &ranks, std::vector<Position<Token>> &out) const {
+    shard_.Positions(sequence_, ranks, out);
+  }
+
+private:
+  const TokenIndexShard<Token> &shard_;
+  std::vector<Token> sequence_;
+  size_t size_;
+};
+
+template<class Token>
+std::shared_ptr<const typename TokenIndexShard<Token>::SpanView> TokenIndexShard<Token>::span() const {
+  return std::make_shared<SequenceView>(*this, std::vector<Token>());
+}
+
+// --------------------------------------------------------
+
+template<class Token>
+class LocalShard<Token>::LocalView : public TokenIndexShard<Token>::SpanView {
+public:
+  typedef typename TokenIndexShard<Token>::SpanView SpanView;
+
+  LocalView(const typename TokenIndex<Token>::Span &span, bool found) : span_(span), found_(found) {}
+
+  virtual size_t size() const { return found_ ? span_.size() : 0; }
+
+  virtual std::shared_ptr<const SpanView> narrow(Token t) const {
+    typename TokenIndex<Token>::Span span = span_;
+    bool found = found_ && span.narrow(t) > 0; // TokenIndex::Span stays unchanged if not found
+    return std::make_shared<LocalView>(span, found);
+  }
+
+  virtual void at_sorted(const std::vector<size_t> &ranks, std::vector<Position<Token>> &out) const {
+    out.clear();
+    if(!ranks.empty())
+      span_.at_sorted(ranks, out);
+  }
+
+private:
+  typename TokenIndex<Token>::Span span_;
+  bool found_;
+};
+
+template<class Token>
+LocalShard<Token>::LocalShard(const typename Corpus<Token>::Vocabulary *vocab, size_t maxLeafSize) :
+    corpus_(vocab), index_(corpus_, maxLeafSize), busy_(false), stop_(false), writer_(&LocalShard<Token>::Run, this)
+{}
+
+template<class Token>
+LocalShard<Token>::~LocalShard() {
+  Flush();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  queued_.notify_all();
+  writer_.join();
+}
+
+template<class Token>
+void LocalShard<Token>::AddSentence(const std::vector<Token> &sent) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(sent);
+  }
+  queued_.notify_all();
+}
+
+template<class Token>
+void LocalShard<Token>::Flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  finished_.wait(lock, [this]() { return queue_.empty() && !busy_; });
+}
+
+template<class Token>
+void LocalShard<Token>::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while(true) {
+    queued_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+    if(queue_.empty())
+      return; // stop_, after indexing everything queued
+    std::vector<Token> sent = std::move(queue_.front());
+    queue_.pop_front();
+    busy_ = true;
+    lock.unlock();
+
+    // this thread is the single writer of corpus_ and index_
+    corpus_.AddSentence(sent);
+    index_.AddSentence(corpus_.sentence(corpus_.size() - 1));
+
+    lock.lock();
+    busy_ = false;
+    finished_.notify_all();
+  }
+}
+
+template<class Token>
+size_t LocalShard<Token>::Count(const std::vector<Token> &sequence) const {
+  typename TokenIndex<Token>::Span span = index_.span();
+  for(const Token &t : sequence)
+    if(span.narrow(t) == 0)
+      return 0;
+  return span.size();
+}
+
+template<class Token>
+void LocalShard<Token>::Positions(const std::vector<Token> &sequence, const std::vector<size_t> &ranks, std::vector<Position<Token>> &out) const {
+  out.clear();
+  if(ranks.empty())
+    return;
+  typename TokenIndex<Token>::Span span = index_.span();
+  for(const Token &t : sequence)
+    span.narrow(t);
+  span.at_sorted(ranks, out);
+}
+
+template<class Token>
+std::shared_ptr<const typename TokenIndexShard<Token>::SpanView> LocalShard<Token>::span() const {
+  return std::make_shared<LocalView>(index_.span(), /* found = */ true);
+}
+
+template<class Token>
+ShardedTokenIndex<Token>::ShardedTokenIndex(const typename Corpus<Token>::Vocabulary *vocab, size_t nshards, size_t maxLeafSize) : nsents_(0) {
+  assert(nshards > 0);
+  for(size_t i = 0; i < nshards; i++)
+    shards_.push_back(std::unique_ptr<TokenIndexShard<Token>>(new LocalShard<Token>(vocab, maxLeafSize)));
+}
+
+template<class Token>
+ShardedTokenIndex<Token>::ShardedTokenIndex(std::vector<std::unique_ptr<TokenIndexShard<Token>>> shards, Sid numSentences) :
+    shards_(std::move(shards)), nsents_(numSentences)
+{
+  assert(!shards_.empty());
+}
+
+template<class Token>
+void ShardedTokenIndex<Token>::AddSentence(const std::vector<Token> &sent) {
+  if(nsents_ == std::numeric_limits<Sid>::max())
+    throw std::runtime_error("ShardedTokenIndex: too many sentences");
+  shards_[nsents_ % shards_.size()]->AddSentence(sent);
+  nsents_++;
+}
+
+template<class Token>
+void ShardedTokenIndex<Token>::Flush() {
+  for(auto &shard : shards_)
+    shard->Flush();
+}
+
+template<class Token>
+Position<Token> ShardedTokenIndex<Token>::global(size_t shard, Position<Token> local) const {
+  assert(static_cast<size_t>(local.sid) <= (static_cast<size_t>(std::numeric_limits<Sid>::max()) - shard) / shards_.size());
+  Sid sid = static_cast<Sid>(static_cast<size_t>(local.sid) * shards_.size() + shard);
+  return Position<Token>(sid, local.offset);
+}
+
+template<class Token>
+ShardedTokenIndex<Token>::Span::Span(const ShardedTokenIndex<Token> &index) : index_(&index) {
+  // scatter: local shards answer from their own index. Remote shards could be queried concurrently here.
+  std::vector<View> views;
+  for(auto &shard : index.shards_)
+    views.push_back(shard->span());
+  SetViews(std::move(views));
+}
+
+template<class Token>
+void ShardedTokenIndex<Token>::Span::SetViews(std::vector<View> views) {
+  views_ = std::move(views);
+  offsets_.assign(1, 0);
+  for(const View &view : views_)
+    offsets_.push_back(offsets_.back() + view->size());
+}
+
+template<class Token>
+size_t ShardedTokenIndex<Token>::Span::narrow(Token t) {
+  // shards with an empty span stay empty, without a query
+  std::vector<View> views;
+  size_t total = 0;
+  for(const View &view : views_) {
+    views.push_back(view->size() > 0 ? view->narrow(t) : view);
+    total += views.back()->size();
+  }
+  if(total == 0)
+    return 0; // not found anywhere: keep the Span unchanged
+  sequence_.push_back(t);
+  SetViews(std::move(views));
+  return total;
+}
+
+template<class Token>
+size_t ShardedTokenIndex<Token>::Span::shard_of(size_t rel) const {
+  // last shard whose span starts at or before rel (skipping shards with empty spans)
+  return static_cast<size_t>(std::upper_bound(offsets_.begin(), offsets_.end(), rel) - offsets_.begin()) - 1;
+}
+
+template<class Token>
+Position<Token> ShardedTokenIndex<Token>::Span::operator[](size_t rel) const {
+  assert(rel < size());
+  size_t shard = shard_of(rel);
+  std::vector<Position<Token>> out;
+  views_[shard]->at_sorted(std::vector<size_t>{rel - offsets_[shard]}, out);
+  return index_->global(shard, out[0]);
+}
+
+template<class Token>
+void ShardedTokenIndex<Token>::Span::at_sorted(const std::vector<size_t> &sorted, std::vector<Position<Token>> &out) const {
+  out.clear();
+  out.reserve(sorted.size());
+  std::vector<size_t> ranks;
+  std::vector<Position<Token>> local;
+
+  // gather: ascending ranks visit the shards in order, with one query for each run of ranks within a shard
+  size_t i = 0;
+  while(i < sorted.size()) {
+    size_t shard = shard_of(sorted[i]);
+    ranks.clear();
+    for(; i < sorted.size() && sorted[i] < offsets_[shard + 1]; i++)
+      ranks.push_back(sorted[i] - offsets_[shard]);
+    views_[shard]->at_sorted(ranks, local);
+    for(const Position<Token> &pos : local)
+      out.push_back(index_->global(shard, pos));
+  }
+}
+
+// explicit template instantiation
+template class TokenIndexShard<SrcToken>;
+template class TokenIndexShard<TrgToken>;
+template class LocalShard<SrcToken>;
+template class LocalShard<TrgToken>;
+template class ShardedTokenIndex<SrcToken>;
+template class ShardedTokenIndex<TrgToken>;
+
+} // namespace sto
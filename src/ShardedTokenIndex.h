@@ -0,0 +1,199 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#ifndef STO_SHARDEDTOKENINDEX_H
+#define STO_SHARDEDTOKENINDEX_H
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Corpus.h"
+#include "TokenIndex.h"
+#include "Types.h"
+
+namespace sto {
+
+/**
+ * One partition of a ShardedTokenIndex: a Corpus of its own, and a TokenIndex over it.
+ *
+ * The interface only passes plain values (token sequences, ranks and Positions), so a shard may live
+ * behind an RPC boundary in another process or on another node. Positions and ranks are local to the shard.
+ */
+template<class Token>
+class TokenIndexShard {
+public:
+  virtual ~TokenIndexShard() {}
+
+  /** Append a sentence to the shard's Corpus and index it. May return before the sentence is indexed, see Flush(). */
+  virtual void AddSentence(const std::vector<Token> &sent) = 0;
+
+  /** Block until all sentences added so far are indexed. */
+  virtual void Flush() = 0;
+
+  /** @return number of occurrences of the lookup 'sequence' (size of its span) */
+  virtual size_t Count(const std::vector<Token> &sequence) const = 0;
+
+  /** Retrieve the local Positions at ascending 'ranks' within the span of 'sequence' into 'out'. */
+  virtual void Positions(const std::vector<Token> &sequence, const std::vector<size_t> &ranks, std::vector<Position<Token>> &out) const = 0;
+
+  /** Immutable view of the shard's span of a lookup sequence, e.g. a TokenIndex::Span snapshot, or a remote session. */
+  class SpanView {
+  public:
+    virtual ~SpanView() {}
+
+    /** number of local positions spanned */
+    virtual size_t size() const = 0;
+
+    /** @return this span narrowed by 't', which may be empty */
+    virtual std::shared_ptr<const SpanView> narrow(Token t) const = 0;
+
+    /** Retrieve the local Positions at ascending 'ranks' into 'out'. */
+    virtual void at_sorted(const std::vector<size_t> &ranks, std::vector<Position<Token>> &out) const = 0;
+  };
+
+  /**
+   * View of the span of the empty lookup sequence, to be narrowed. The default view keeps only the sequence,
+   * and re-runs its lookup with Count() and Positions() for each call.
+   */
+  virtual std::shared_ptr<const SpanView> span() const;
+
+private:
+  class SequenceView;
+};
+
+/**
+ * In-process TokenIndexShard, with its own writer thread: AddSentence() only queues the sentence,
+ * so that the shards of a ShardedTokenIndex index in parallel. Reads are concurrent with the writer,
+ * like for TokenIndex.
+ */
+template<class Token>
+class LocalShard : public TokenIndexShard<Token> {
+public:
+  /** @param vocab  Vocabulary of the tokens, may be shared across shards */
+  LocalShard(const typename Corpus<Token>::Vocabulary *vocab, size_t maxLeafSize = 10000);
+
+  /** indexes all queued sentences before returning */
+  virtual ~LocalShard();
+
+  virtual void AddSentence(const std::vector<Token> &sent);
+  virtual void Flush();
+  virtual size_t Count(const std::vector<Token> &sequence) const;
+  virtual void Positions(const std::vector<Token> &sequence, const std::vector<size_t> &ranks, std::vector<Position<Token>> &out) const;
+
+  /** view holding a TokenIndex::Span, which narrows incrementally and keeps the leaf arrays it has descended into */
+  virtual std::shared_ptr<const typename TokenIndexShard<Token>::SpanView> span() const;
+
+  const Corpus<Token> &corpus() const { return corpus_; }
+
+private:
+  class LocalView;
+
+  Corpus<Token> corpus_;
+  TokenIndex<Token> index_;
+
+  std::mutex mutex_;
+  std::condition_variable queued_;
+  std::condition_variable finished_;
+  std::deque<std::vector<Token>> queue_; /** sentences waiting to be indexed */
+  bool busy_; /** writer is indexing a sentence taken from queue_ */
+  bool stop_;
+  std::thread writer_; /** last: started after all other members are initialized */
+
+  void Run();
+};
+
+/**
+ * Indexes a corpus partitioned into independent shards, e.g. for parallel writers or for corpora larger
+ * than the RAM of a single node (with shards behind an RPC boundary, see TokenIndexShard).
+ *
+ * Sentences are distributed round-robin by their global sentence ID: sid goes to shard sid % N, as local
+ * sentence sid / N. Lookups scatter to all shards and gather their counts into a merged Span.
+ * Global sentence IDs must fit into Sid: N shards together hold at most as many sentences as a single Corpus.
+ */
+template<class Token>
+class ShardedTokenIndex {
+public:
+  typedef typename Corpus<Token>::Sid Sid;
+
+  /** Create 'nshards' LocalShards. */
+  ShardedTokenIndex(const typename Corpus<Token>::Vocabulary *vocab, size_t nshards, size_t maxLeafSize = 10000);
+
+  /** Take ownership of existing shards, which must each hold the sentences sid % shards.size() == i (e.g. empty shards). */
+  explicit ShardedTokenIndex(std::vector<std::unique_ptr<TokenIndexShard<Token>>> shards, Sid numSentences = 0);
+
+  /**
+   * Merged view of the spans of a lookup sequence in all shards. The positions of shard 0 come first,
+   * then those of shard 1 etc., each in their shard's suffix order.
+   * Holds one TokenIndexShard::SpanView per shard, which is narrowed along with the Span, and answers random access.
+   */
+  class Span {
+  public:
+    friend class ShardedTokenIndex<Token>;
+
+    /**
+     * Narrow the span by adding a token to the end of the lookup sequence. Queries every shard.
+     * Returns new span size. If the token was not found at all, returns zero without modifying the Span.
+     */
+    size_t narrow(Token t);
+
+    /** Random access to a (global) position at a rank within the span. A single access to the view of the shard owning it. */
+    Position<Token> operator[](size_t rel) const;
+
+    /** Random access to many positions at ascending ranks 'sorted', with a single access per shard involved. */
+    void at_sorted(const std::vector<size_t> &sorted, std::vector<Position<Token>> &out) const;
+
+    /** Number of token positions spanned in all shards. */
+    size_t size() const { return offsets_.back(); }
+
+    /** Length of the lookup sequence. */
+    size_t depth() const { return sequence_.size(); }
+
+  private:
+    typedef std::shared_ptr<const typename TokenIndexShard<Token>::SpanView> View;
+
+    const ShardedTokenIndex<Token> *index_;
+    std::vector<Token> sequence_;
+    std::vector<View> views_; /** span of each shard */
+    std::vector<size_t> offsets_; /** prefix counts: the span of shard i is at [offsets_[i], offsets_[i+1]) */
+
+    explicit Span(const ShardedTokenIndex<Token> &index);
+
+    /** set views_ and offsets_ */
+    void SetViews(std::vector<View> views);
+
+    /** @return shard holding global rank 'rel' */
+    size_t shard_of(size_t rel) const;
+  };
+
+  /** Span over the entire index, i.e. the empty lookup sequence. */
+  Span span() const { return Span(*this); }
+
+  /** Add a sentence with the next global sentence ID to its shard. May return before it is indexed, see Flush(). */
+  void AddSentence(const std::vector<Token> &sent);
+
+  /** Block until all sentences added so far are indexed in all shards. */
+  void Flush();
+
+  size_t num_shards() const { return shards_.size(); }
+  Sid num_sentences() const { return nsents_; }
+
+  /** shard-local Position of shard 'shard' -> global Position */
+  Position<Token> global(size_t shard, Position<Token> local) const;
+
+  TokenIndexShard<Token> &shard(size_t i) { return *shards_[i]; }
+
+private:
+  std::vector<std::unique_ptr<TokenIndexShard<Token>>> shards_;
+  Sid nsents_; /** global sentence count */
+};
+
+} // namespace sto
+
+#endif //STO_SHARDEDTOKENINDEX_H
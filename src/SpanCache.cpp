@@ -0,0 +1,167 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#include <algorithm>
+#include <random>
+
+#include "SpanCache.h"
+
+namespace sto {
+
+template<class Token, class TreeNodeT>
+constexpr size_t SpanCache<Token, TreeNodeT>::kShards;
+
+template<class Token, class TreeNodeT>
+SpanCache<Token, TreeNodeT>::SpanCache(const Index &index, size_t capacity, size_t sampleSize) :
+    index_(&index), shard_capacity_(std::max<size_t>(1, capacity / kShards)), sample_size_(sampleSize),
+    shards_(new Shard[kShards]), hits_(0), misses_(0)
+{}
+
+template<class Token, class TreeNodeT>
+size_t SpanCache<Token, TreeNodeT>::Hash::operator()(const std::vector<Token> &sequence) const {
+  // FNV-1a over the vids
+  size_t h = 14695981039346656037ULL;
+  for(const Token &t : sequence) {
+    h ^= static_cast<size_t>(t.vid);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+template<class Token, class TreeNodeT>
+typename SpanCache<Token, TreeNodeT>::Span SpanCache<Token, TreeNodeT>::span(const std::vector<Token> &sequence) {
+  Shard &shard = shard_of(sequence);
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(sequence);
+    if(it != shard.entries.end() && it->second->fresh()) {
+      shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+      hits_.fetch_add(1, std::memory_order_relaxed);
+      return it->second->span;
+    }
+  }
+  misses_.fetch_add(1, std::memory_order_relaxed);
+  Span span = Resolve(sequence);
+  Store(shard, sequence, span, span.size(), nullptr);
+  return span;
+}
+
+template<class Token, class TreeNodeT>
+std::shared_ptr<const typename SpanCache<Token, TreeNodeT>::Sample> SpanCache<Token, TreeNodeT>::sample(const std::vector<Token> &sequence) {
+  Shard &shard = shard_of(sequence);
+  std::unique_ptr<Span> cached;
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(sequence);
+    if(it != shard.entries.end() && it->second->fresh()) {
+      shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+      if(it->second->sample) {
+        hits_.fetch_add(1, std::memory_order_relaxed);
+        return it->second->sample;
+      }
+      cached.reset(new Span(it->second->span)); // fresh Span, but no sample drawn yet
+    }
+  }
+  if(cached)
+    hits_.fetch_add(1, std::memory_order_relaxed);
+  else
+    misses_.fetch_add(1, std::memory_order_relaxed);
+
+  // read the size before drawing: if the tree grows meanwhile, the entry is stale rather than missing the change
+  Span span = cached ? *cached : Resolve(sequence);
+  size_t size = span.size();
+  // draw outside of the lock: random access into a large span may take a while
+  std::mt19937 rng(static_cast<std::mt19937::result_type>(Hash()(sequence)));
+  std::shared_ptr<Sample> sample = std::make_shared<Sample>();
+  span.sample(sample_size_, rng, *sample);
+  Store(shard, sequence, span, size, sample);
+  return sample;
+}
+
+template<class Token, class TreeNodeT>
+void SpanCache<Token, TreeNodeT>::clear() {
+  for(size_t i = 0; i < kShards; i++) {
+    std::lock_guard<std::mutex> lock(shards_[i].mutex);
+    shards_[i].entries.clear();
+    shards_[i].lru.clear();
+  }
+}
+
+template<class Token, class TreeNodeT>
+size_t SpanCache<Token, TreeNodeT>::size() const {
+  size_t n = 0;
+  for(size_t i = 0; i < kShards; i++) {
+    std::lock_guard<std::mutex> lock(shards_[i].mutex);
+    n += shards_[i].entries.size();
+  }
+  return n;
+}
+
+template<class Token, class TreeNodeT>
+typename SpanCache<Token, TreeNodeT>::Span SpanCache<Token, TreeNodeT>::Resolve(const std::vector<Token> &sequence) const {
+  Span span = index_->span();
+  for(const Token &t : sequence)
+    if(span.narrow(t) == 0)
+      break; // not found (or an empty leaf): no longer sequence can be found either
+  return span;
+}
+
+template<class Token, class TreeNodeT>
+void SpanCache<Token, TreeNodeT>::prune() {
+  for(size_t i = 0; i < kShards; i++) {
+    std::lock_guard<std::mutex> lock(shards_[i].mutex);
+    Prune(shards_[i]);
+  }
+}
+
+template<class Token, class TreeNodeT>
+void SpanCache<Token, TreeNodeT>::Store(Shard &shard, const std::vector<Token> &sequence, const Span &span, size_t size, const std::shared_ptr<const Sample> &sample) {
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  // amortized O(1) per miss: stale entries which are never looked up again do not hold on to their leaf arrays
+  if(++shard.misses >= shard_capacity_)
+    Prune(shard);
+
+  auto it = shard.entries.find(sequence);
+  if(it != shard.entries.end()) {
+    Entry &entry = *it->second;
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    if(!sample && entry.fresh())
+      return; // a concurrent lookup stored it meanwhile, maybe with a sample
+    entry.span = span;
+    entry.size = size;
+    entry.sample = sample; // a stale sample goes with its stale Span
+    return;
+  }
+
+  shard.lru.emplace_front(sequence, span, size);
+  shard.lru.front().sample = sample;
+  shard.entries.emplace(sequence, shard.lru.begin());
+  while(shard.entries.size() > shard_capacity_) {
+    shard.entries.erase(shard.lru.back().sequence);
+    shard.lru.pop_back();
+  }
+}
+
+template<class Token, class TreeNodeT>
+void SpanCache<Token, TreeNodeT>::Prune(Shard &shard) {
+  for(auto it = shard.lru.begin(); it != shard.lru.end();) {
+    if(it->fresh()) {
+      ++it;
+    } else {
+      shard.entries.erase(it->sequence);
+      it = shard.lru.erase(it);
+    }
+  }
+  shard.misses = 0;
+}
+
+// explicit template instantiation
+template class SpanCache<SrcToken>;
+template class SpanCache<TrgToken>;
+template class SpanCache<SrcToken, TreeNodeMemory<SrcToken, FlatMap>>;
+template class SpanCache<TrgToken, TreeNodeMemory<TrgToken, FlatMap>>;
+
+} // namespace sto
@@ -0,0 +1,127 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#ifndef STO_SPANCACHE_H
+#define STO_SPANCACHE_H
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "TokenIndex.h"
+#include "Types.h"
+
+namespace sto {
+
+/**
+ * Cache of resolved Spans for frequent lookup sequences, e.g. the high-frequency n-grams of Zipfian decoder traffic,
+ * so that repeated lookups skip the narrow() descents, and optionally the random access of drawing a sample.
+ *
+ * An entry is stale once the index changed within its own Span: Positions were added to the subtree it ends in,
+ * or the leaf array it holds was replaced (see Span::current()). Writes to other subtrees and leaves leave it fresh.
+ * A stale entry is resolved again on its next lookup. The cache holds at most 'capacity' entries, evicting
+ * the least recently used ones.
+ *
+ * A stale entry still holds the leaf array it was resolved in, so after writes a shard drops all its stale
+ * entries once every capacity/16 misses, and prune() releases them at once (e.g. after a batch of writes).
+ *
+ * Thread safety: lookups may be called concurrently by many threads, and concurrently with the index writer.
+ * Entries are partitioned into shards by hash, each with its own lock and LRU list.
+ */
+template<class Token, class TreeNodeT = TreeNodeMemory<Token>>
+class SpanCache {
+public:
+  typedef TokenIndex<Token, TreeNodeT> Index;
+  typedef typename Index::Span Span;
+  typedef std::vector<Position<Token>> Sample;
+
+  /**
+   * @param capacity    maximum number of cached lookup sequences
+   * @param sampleSize  size of the sample pre-drawn for each entry by sample(), see Span::sample()
+   */
+  SpanCache(const Index &index, size_t capacity = 4096, size_t sampleSize = 100);
+
+  /**
+   * Span of the lookup 'sequence', narrowed token by token: like narrow() of each token on index.span(). If a token
+   * is not found, the Span stops before it, so depth() < sequence.size(). O(1) expected for a cached sequence.
+   */
+  Span span(const std::vector<Token> &sequence);
+
+  /**
+   * Uniform random sample of min(sampleSize, size()) positions of span(sequence) in suffix order, drawn once
+   * per fresh entry (deterministically seeded by the sequence).
+   */
+  std::shared_ptr<const Sample> sample(const std::vector<Token> &sequence);
+
+  /** remove all entries */
+  void clear();
+
+  /** remove all stale entries, releasing the leaf arrays they hold */
+  void prune();
+
+  /** number of cached sequences */
+  size_t size() const;
+
+  /** lookups answered from the cache, and lookups which resolved (or refreshed) their entry */
+  size_t hits() const { return hits_.load(std::memory_order_relaxed); }
+  size_t misses() const { return misses_.load(std::memory_order_relaxed); }
+
+private:
+  static constexpr size_t kShards = 16;
+
+  struct Entry {
+    std::vector<Token> sequence;
+    Span span;
+    size_t size; /** span.size() when resolved: a Span in the tree reads the tree's current size */
+    std::shared_ptr<const Sample> sample; /** drawn lazily by sample() */
+
+    Entry(const std::vector<Token> &seq, const Span &s, size_t n) : sequence(seq), span(s), size(n) {}
+
+    /** false once the index changed within span */
+    bool fresh() const { return span.size() == size && span.current(); }
+  };
+
+  struct Hash {
+    size_t operator()(const std::vector<Token> &sequence) const;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::list<Entry> lru; /** most recently used first */
+    std::unordered_map<std::vector<Token>, typename std::list<Entry>::iterator, Hash> entries;
+    size_t misses; /** Store() calls since the last Prune() */
+
+    Shard() : misses(0) {}
+  };
+
+  const Index *index_;
+  size_t shard_capacity_;
+  size_t sample_size_;
+  std::unique_ptr<Shard[]> shards_;
+  std::atomic<size_t> hits_;
+  std::atomic<size_t> misses_;
+
+  Shard &shard_of(const std::vector<Token> &sequence) const { return shards_[Hash()(sequence) % kShards]; }
+
+  /** narrow() from the root. Outside of any lock, so concurrent lookups of other sequences do not wait. */
+  Span Resolve(const std::vector<Token> &sequence) const;
+
+  /**
+   * Insert or refresh the entry of 'sequence' resolved as 'span' of 'size', unless a concurrent lookup stored a fresh
+   * one meanwhile (keeping its sample, if we have none). Evicts the LRU entries, and prunes every shard_capacity_ misses.
+   */
+  void Store(Shard &shard, const std::vector<Token> &sequence, const Span &span, size_t size, const std::shared_ptr<const Sample> &sample);
+
+  /** remove the stale entries of 'shard', with its lock held */
+  static void Prune(Shard &shard);
+};
+
+} // namespace sto
+
+#endif //STO_SPANCACHE_H
@@ -4,18 +4,28 @@
  * Licensed under GNU LGPL Version 2.1, see COPYING *
  ****************************************************/
 
+#include <cassert>
+
 #include "SuffixArrayDisk.h"
 
 namespace sto {
 
 template<class Token>
-SuffixArrayDisk<Token>::SuffixArrayDisk(const std::string &filename) : mapping_(new MappedFile(filename)) {
+SuffixArrayDisk<Token>::SuffixArrayDisk(const std::string &filename, const MapOptions &options) : mapping_(new MappedFile(filename, /* offset = */ 0, options)) {
   array_ = reinterpret_cast<SuffixArrayPosition<Token> *>(mapping_->ptr);
   length_ = mapping_->size() / sizeof(SuffixArrayPosition<Token>);
 }
 
+template<class Token>
+SuffixArrayDisk<Token>::SuffixArrayDisk(std::shared_ptr<MappedFile> mapping, SuffixArrayPosition<Token> *array, size_t length) :
+    array_(array), length_(length), mapping_(mapping)
+{
+  assert(reinterpret_cast<char *>(array + length) <= mapping_->ptr + mapping_->size());
+}
+
 // explicit template instantiation
 template class SuffixArrayDisk<SrcToken>;
 template class SuffixArrayDisk<TrgToken>;
+template class SuffixArrayDisk<SmallSrcToken>;
 
 } // namespace sto
\ No newline at end of file
@@ -28,14 +28,21 @@ struct __attribute__((packed)) SuffixArrayPosition {
   SuffixArrayPosition() {}
 
   SuffixArrayPosition(const Position<Token> &other) : sid(other.sid), offset(other.offset) {}
-  operator Position<Token>() { return Position<Token>(sid, offset); }
+  operator Position<Token>() const { return Position<Token>(sid, offset); }
 };
 
 
 template<class Token>
 class SuffixArrayDisk {
 public:
-  SuffixArrayDisk(const std::string &filename);
+  /** Memory map a suffix array file, which consists entirely of SuffixArrayPositions. */
+  SuffixArrayDisk(const std::string &filename, const MapOptions &options = MapOptions());
+
+  /**
+   * Read-only view of 'length' SuffixArrayPositions starting at 'array', which must point into 'mapping'.
+   * Keeps the mapping alive for as long as the view exists.
+   */
+  SuffixArrayDisk(std::shared_ptr<MappedFile> mapping, SuffixArrayPosition<Token> *array, size_t length);
 
   class Iterator {
   public:
@@ -48,6 +55,7 @@ public:
     Iterator(SuffixArrayPosition<Token> *pos = nullptr) : pos_(pos) {}
 
     Iterator &operator++() { ++pos_; return *this; }
+    Iterator &operator--() { --pos_; return *this; }
     Position<Token> operator*() { return *pos_; }
     bool operator!=(const Iterator &other) { return pos_ != other.pos_; }
 
@@ -66,10 +74,18 @@ public:
 
   Position<Token> operator[](size_t pos) const { return array_[pos]; }
 
+  /** mapped entries, like std::vector::data() */
+  const SuffixArrayPosition<Token> *data() const { return array_; }
+
+  /** Read-only view of the entries [begin, end), sharing this mapping. */
+  std::shared_ptr<SuffixArrayDisk<Token>> slice(size_t begin, size_t end) const {
+    return std::make_shared<SuffixArrayDisk<Token>>(mapping_, array_ + begin, end - begin);
+  }
+
 private:
   SuffixArrayPosition<Token> *array_; /** pointer to mmapped suffix array on disk */
   size_t length_; /** length of array in number of entries (SuffixArrayPositions) */
-  std::unique_ptr<MappedFile> mapping_;
+  std::shared_ptr<MappedFile> mapping_; /** may be shared between several views into the same file */
 };
 
 } // namespace sto
@@ -8,13 +8,98 @@
 #define STO_SUFFIXARRAYMEMORY_H
 
 #include "Corpus.h"
+#include "Range.h"
+#include "SuffixArrayDisk.h"
 
+#include <memory>
 #include <vector>
 
 namespace sto {
 
+/**
+ * In-memory suffix array leaf, packed like the on-disk format: 5 bytes per Position (instead of 8 for an aligned
+ * Position<Token>), without any spare capacity. Single inserts do not copy the array: they go into the leaf's insert
+ * buffer (TreeNode::DeltaArray), which is merged into a new array every sqrt(n) inserts, see TreeNodeMemory::AddPosition().
+ *
+ * Thread safety: a published array is never modified. Writers build a new array and replace the TreeNode's
+ * shared_ptr, so readers observe either the old or the new array.
+ */
 template<class Token>
-using SuffixArrayMemory = std::vector<AtomicPosition<Token>>;
+using SuffixArrayMemory = std::vector<SuffixArrayPosition<Token>>;
+
+/**
+ * Lexicographic suffix comparison of two Positions, like Position::compare() but reading vids directly
+ * from the Corpus. Compares from 'skip' tokens into the suffixes. A shorter suffix sorts first.
+ */
+template<class Token>
+bool suffix_less(const Corpus<Token> &corpus, const Position<Token> &a, const Position<Token> &b, size_t skip) {
+  typedef typename Corpus<Token>::Vid Vid;
+  typename Corpus<Token>::Tokens ta = corpus.tokens(a.sid), tb = corpus.tokens(b.sid);
+  size_t ai = a.offset + skip, aend = ta.size();
+  size_t bi = b.offset + skip, bend = tb.size();
+  for(; ai < aend && bi < bend; ++ai, ++bi) {
+    Vid av = ta[ai], bv = tb[bi];
+    if(av != bv)
+      return av < bv;
+  }
+  return ai >= aend && bi < bend; // shorter suffix sorts first
+}
+
+/**
+ * Get the vid at 'depth' into the suffix at 'pos', with the implicit </s> at the end of the sentence.
+ * @return false if the suffix is shorter than 'depth' (it sorts before any vid at 'depth')
+ */
+template<class Token>
+inline bool suffix_vid(const Corpus<Token> &corpus, const Position<Token> &pos, size_t depth, typename Corpus<Token>::Vid &vid) {
+  typedef typename Corpus<Token>::Vid Vid;
+  // decodes this single token only, also in a compressed corpus track
+  typename Corpus<Token>::Tokens tokens = corpus.tokens(pos.sid);
+  size_t i = pos.offset + depth;
+  if(i > tokens.size())
+    return false;
+  vid = (i == tokens.size()) ? static_cast<Vid>(Corpus<Token>::Vocabulary::kEOS) : tokens[i];
+  return true;
+}
+
+/**
+ * 3-way comparison of the vid at 'depth' into the suffix at 'pos' against t, by vid (not surface form) like
+ * Token::operator<(). A suffix shorter than 'depth' sorts first. The probe of the binary searches over leaves.
+ */
+template<class Token>
+inline int compare_vid(const Corpus<Token> &corpus, const Position<Token> &pos, size_t depth, Token t) {
+  typename Corpus<Token>::Vid vid;
+  if(!suffix_vid(corpus, pos, depth, vid))
+    return -1;
+  return (vid < t.vid) ? -1 : (t.vid < vid) ? 1 : 0;
+}
+
+/**
+ * Linear merge of the sorted Positions add[range] into the sorted array 'cur' of any suffix array type.
+ * Equal suffixes from 'cur' come first, like the upper_bound insert in AddPosition().
+ */
+template<class Token, class Array>
+std::shared_ptr<SuffixArrayMemory<Token>> merge_array(const Corpus<Token> &corpus, const Array &cur, const std::vector<Position<Token>> &add, Range range) {
+  std::shared_ptr<SuffixArrayMemory<Token>> merged = std::make_shared<SuffixArrayMemory<Token>>();
+  merged->reserve(cur.size() + range.size());
+
+  size_t icur = 0, iadd = range.begin;
+  while(icur < cur.size() && iadd < range.end) {
+    Position<Token> pos = cur[icur];
+    if(suffix_less(corpus, add[iadd], pos, /* skip = */ 0)) {
+      merged->push_back(add[iadd++]);
+    } else {
+      merged->push_back(pos);
+      icur++;
+    }
+  }
+  // fill from the side that still has remaining positions
+  for(; icur < cur.size(); icur++)
+    merged->push_back(Position<Token>(cur[icur]));
+  for(; iadd < range.end; iadd++)
+    merged->push_back(add[iadd]);
+
+  return merged;
+}
 
 } // namespace sto
 
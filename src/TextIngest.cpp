@@ -0,0 +1,268 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include "TextIngest.h"
+#include "MappedFile.h"
+
+namespace sto {
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds_since(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+} // namespace
+
+template<class Token>
+constexpr size_t TextIngest<Token>::kCacheShards;
+
+template<class Token>
+void TextIngest<Token>::Stats::Print(std::ostream &os) const {
+  os << "bytes " << bytes << std::endl;
+  os << "lines " << lines << std::endl;
+  os << "tokens " << tokens << std::endl;
+  os << "new_words " << new_words << std::endl;
+  os << "seconds " << seconds << std::endl;
+  os << "tokenize_seconds " << tokenize_seconds << std::endl;
+  os << "tokenize_stall_seconds " << tokenize_stall_seconds << std::endl;
+  os << "corpus_seconds " << corpus_seconds << std::endl;
+  os << "index_seconds " << index_seconds << std::endl;
+  os << "writer_stall_seconds " << writer_stall_seconds << std::endl;
+  if(seconds > 0)
+    os << "mb_per_second " << static_cast<double>(bytes) / 1e6 / seconds << std::endl;
+}
+
+template<class Token>
+TextIngest<Token>::TextIngest(Vocab<Token> &vocab, Corpus<Token> &corpus, TokenIndex<Token> *index, const Options &options) :
+    vocab_(vocab), corpus_(corpus), index_(index), options_(options), cache_(new CacheShard[kCacheShards]), seeded_(0)
+{
+  if(options_.nthreads == 0)
+    options_.nthreads = std::max<size_t>(1, std::thread::hardware_concurrency());
+  options_.chunk_size = std::max<size_t>(1, options_.chunk_size);
+  options_.queue_size = std::max<size_t>(1, options_.queue_size);
+  options_.index_batch = std::max<size_t>(1, options_.index_batch);
+}
+
+template<class Token>
+typename TextIngest<Token>::Stats TextIngest<Token>::Read(const std::string &filename) {
+  MapOptions options;
+  options.advice = MapOptions::kSequential;
+  MappedFile file(filename, /* offset = */ 0, options);
+  return Read(file.ptr, file.size());
+}
+
+template<class Token>
+typename TextIngest<Token>::Stats TextIngest<Token>::Read(const char *data, size_t size) {
+  Clock::time_point start = Clock::now();
+  Stats stats;
+
+  // chunk boundaries: after the first line end past each multiple of chunk_size
+  std::vector<const char *> bounds = {data};
+  const char *end = data + size;
+  while(bounds.back() != end) {
+    const char *next = bounds.back() + std::min(options_.chunk_size, static_cast<size_t>(end - bounds.back()));
+    if(next != end) {
+      const char *nl = static_cast<const char *>(memchr(next, '\n', static_cast<size_t>(end - next)));
+      next = nl ? nl + 1 : end;
+    }
+    bounds.push_back(next);
+  }
+  size_t nchunks = bounds.size() - 1;
+
+  std::mutex mutex;
+  std::condition_variable tokenized; /** a chunk is done */
+  std::condition_variable written; /** the writer took a chunk, freeing space in the queue */
+  std::map<size_t, Chunk> done; /** tokenized chunks, waiting for the writer */
+  size_t nwritten = 0; /** chunks taken by the writer */
+  bool stop = false; /** the writer failed: workers must not wait for it */
+  std::atomic<size_t> next(0);
+  std::atomic<int64_t> tokenize_nanos(0), stall_nanos(0);
+
+  auto worker = [&]() {
+    size_t i;
+    while((i = next.fetch_add(1)) < nchunks) {
+      {
+        // backpressure: stay within queue_size chunks of the writer
+        Clock::time_point wait = Clock::now();
+        std::unique_lock<std::mutex> lock(mutex);
+        written.wait(lock, [&]() { return stop || i < nwritten + options_.queue_size; });
+        stall_nanos.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - wait).count());
+        if(stop)
+          return;
+      }
+      Clock::time_point begin = Clock::now();
+      Chunk chunk;
+      Tokenize(bounds[i], bounds[i + 1], chunk);
+      tokenize_nanos.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - begin).count());
+
+      std::lock_guard<std::mutex> lock(mutex);
+      done.insert(std::make_pair(i, std::move(chunk)));
+      tokenized.notify_one();
+    }
+  };
+  SeedCache();
+
+  std::vector<std::thread> threads;
+  auto join = [&]() {
+    for(auto &thread : threads)
+      thread.join();
+    threads.clear();
+  };
+  for(size_t t = 0; t < options_.nthreads; t++)
+    threads.push_back(std::thread(worker));
+
+  // writer: chunks in file order
+  std::vector<Sentence<Token>> batch;
+  try {
+    for(size_t i = 0; i < nchunks; i++) {
+      Chunk chunk;
+      {
+        Clock::time_point wait = Clock::now();
+        std::unique_lock<std::mutex> lock(mutex);
+        tokenized.wait(lock, [&]() { return done.count(i) > 0; });
+        stats.writer_stall_seconds += seconds_since(wait);
+        chunk = std::move(done[i]);
+        done.erase(i);
+        nwritten++;
+        written.notify_all();
+      }
+      Write(chunk, batch, stats);
+    }
+    join();
+    if(index_ && !batch.empty()) {
+      Clock::time_point begin = Clock::now();
+      index_->AddSentences(batch);
+      stats.index_seconds += seconds_since(begin);
+    }
+  } catch(...) {
+    // e.g. out of memory in Write(): joinable threads must not be destroyed (std::terminate)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+      written.notify_all();
+    }
+    join();
+    throw;
+  }
+
+  stats.tokenize_seconds = static_cast<double>(tokenize_nanos.load()) / 1e9;
+  stats.tokenize_stall_seconds = static_cast<double>(stall_nanos.load()) / 1e9;
+  stats.seconds = seconds_since(start);
+  return stats;
+}
+
+template<class Token>
+void TextIngest<Token>::SeedCache() {
+  // vids are never reassigned, so entries of earlier calls stay valid: only add the words inserted since
+  Vid end = vocab_.end().vid;
+  for(Vid vid = std::max(seeded_, vocab_.begin().vid); vid < end; vid++) {
+    const char *surface;
+    try {
+      surface = vocab_.c_str(Token{vid});
+    } catch(std::out_of_range &) {
+      continue; // unused vid, e.g. in a loaded .tdx file
+    }
+    CacheShard &shard = shard_of(surface);
+    shard.vids.insert(std::make_pair(std::string(surface), vid));
+  }
+  seeded_ = std::max(seeded_, end);
+}
+
+template<class Token>
+void TextIngest<Token>::Tokenize(const char *begin, const char *end, Chunk &chunk) const {
+  chunk.bytes = static_cast<size_t>(end - begin);
+  std::string surface;
+  const char *p = begin;
+  while(p != end) {
+    const char *eol = static_cast<const char *>(memchr(p, '\n', static_cast<size_t>(end - p)));
+    if(!eol)
+      eol = end;
+    size_t length = 0;
+    const char *w = p;
+    while(w != eol) {
+      // skip separators, including '\r' of CRLF line ends
+      while(w != eol && (*w == ' ' || *w == '\t' || *w == '\r'))
+        ++w;
+      const char *wend = w;
+      while(wend != eol && *wend != ' ' && *wend != '\t' && *wend != '\r')
+        ++wend;
+      if(wend == w)
+        break;
+
+      surface.assign(w, wend);
+      CacheShard &shard = shard_of(surface);
+      Vid vid = 0;
+      bool found;
+      {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.vids.find(surface);
+        found = it != shard.vids.end();
+        if(found)
+          vid = it->second;
+      }
+      if(!found)
+        chunk.misses.push_back(std::make_pair(chunk.vids.size(), surface));
+      chunk.vids.push_back(vid);
+      length++;
+      w = wend;
+    }
+    chunk.lengths.push_back(length);
+    p = (eol == end) ? end : eol + 1;
+  }
+}
+
+template<class Token>
+void TextIngest<Token>::Write(Chunk &chunk, std::vector<Sentence<Token>> &batch, Stats &stats) {
+  Clock::time_point begin = Clock::now();
+
+  // new words are inserted here, in file order, so vids are assigned like by a serial read
+  for(auto &miss : chunk.misses) {
+    Vid size = vocab_.end().vid;
+    Vid vid = vocab_[miss.second].vid;
+    if(vocab_.end().vid != size)
+      stats.new_words++;
+    CacheShard &shard = shard_of(miss.second);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.vids.insert(std::make_pair(miss.second, vid));
+    chunk.vids[miss.first] = vid;
+  }
+
+  size_t pos = 0;
+  std::vector<Token> sent;
+  for(size_t length : chunk.lengths) {
+    sent.assign(chunk.vids.begin() + pos, chunk.vids.begin() + pos + length);
+    pos += length;
+    corpus_.AddSentence(sent);
+    if(index_)
+      batch.push_back(corpus_.sentence(corpus_.size() - 1));
+  }
+  stats.bytes += chunk.bytes;
+  stats.lines += chunk.lengths.size();
+  stats.tokens += chunk.vids.size();
+  stats.corpus_seconds += seconds_since(begin);
+
+  if(index_ && batch.size() >= options_.index_batch) {
+    Clock::time_point index_begin = Clock::now();
+    index_->AddSentences(batch);
+    batch.clear();
+    stats.index_seconds += seconds_since(index_begin);
+  }
+}
+
+// explicit template instantiation
+template class TextIngest<SrcToken>;
+template class TextIngest<TrgToken>;
+
+} // namespace sto
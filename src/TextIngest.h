@@ -0,0 +1,125 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#ifndef STO_TEXTINGEST_H
+#define STO_TEXTINGEST_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Corpus.h"
+#include "TokenIndex.h"
+#include "Types.h"
+#include "Vocab.h"
+
+namespace sto {
+
+/**
+ * Parallel pipeline for loading tokenized plain text (one sentence per line, tokens separated by spaces or tabs)
+ * into a Vocab, a Corpus and optionally a TokenIndex:
+ *
+ *   chunks of the mapped file -> tokenize and look up vids (N threads) -> ordered writer: vocab insert, corpus, index
+ *
+ * Worker threads tokenize chunks of lines and look up known words in a sharded concurrent cache of the vocabulary.
+ * The writer (the calling thread) takes the chunks in file order, inserts the new words into the Vocab, appends
+ * the sentences to the Corpus, and indexes them in batches with TokenIndex::AddSentences(). Since only the writer
+ * inserts, in order, the resulting vids and sentence IDs are the same as for a serial read of the file.
+ * The cache is seeded with the Vocab's existing words at the start of Read(), so tokenizers resolve all known words,
+ * and only words new to the Vocab are left to the writer. Their inserts are serialized on the writer by design:
+ * Vocab is not thread-safe, and inserting in file order keeps the vids deterministic.
+ * At most 'queue_size' chunks are in flight, which bounds memory: workers wait for the writer (backpressure).
+ */
+template<class Token>
+class TextIngest {
+public:
+  typedef typename Corpus<Token>::Vid Vid;
+
+  struct Options {
+    size_t nthreads; /** tokenizer threads (0: one per hardware thread) */
+    size_t chunk_size; /** approximate bytes per chunk, split at line ends */
+    size_t queue_size; /** max. chunks tokenized ahead of the writer */
+    size_t index_batch; /** sentences per TokenIndex::AddSentences() batch */
+
+    Options(size_t nthreads = 0, size_t chunk_size = 1 << 20, size_t queue_size = 16, size_t index_batch = 100000) :
+        nthreads(nthreads), chunk_size(chunk_size), queue_size(queue_size), index_batch(index_batch) {}
+  };
+
+  /** throughput of each stage. Times of the tokenizer stage are summed over its threads. */
+  struct Stats {
+    size_t bytes;
+    size_t lines;
+    size_t tokens;
+    size_t new_words; /** inserted into the Vocab */
+    double seconds; /** wall clock time of the whole pipeline */
+    double tokenize_seconds; /** tokenizing and vid lookups */
+    double tokenize_stall_seconds; /** tokenizers waiting for the writer (backpressure) */
+    double corpus_seconds; /** writer: vocab inserts and Corpus::AddSentence() */
+    double index_seconds; /** writer: TokenIndex::AddSentences() */
+    double writer_stall_seconds; /** writer waiting for the next chunk in order */
+
+    Stats() : bytes(0), lines(0), tokens(0), new_words(0), seconds(0), tokenize_seconds(0), tokenize_stall_seconds(0),
+              corpus_seconds(0), index_seconds(0), writer_stall_seconds(0) {}
+
+    /** print one stage or counter per line: "name value" */
+    void Print(std::ostream &os) const;
+  };
+
+  /** @param index  if set, added sentences are indexed as well */
+  TextIngest(Vocab<Token> &vocab, Corpus<Token> &corpus, TokenIndex<Token> *index = nullptr, const Options &options = Options());
+
+  /** Load the text file 'filename' (memory mapped, read sequentially). */
+  Stats Read(const std::string &filename);
+
+  /** Load text from memory, e.g. received over the network. */
+  Stats Read(const char *data, size_t size);
+
+private:
+  static constexpr size_t kCacheShards = 64;
+
+  /** sharded concurrent map of known words, filled by the writer and read by the tokenizers */
+  struct CacheShard {
+    std::mutex mutex;
+    std::unordered_map<std::string, Vid> vids;
+  };
+
+  /** output of tokenizing one chunk */
+  struct Chunk {
+    std::vector<Vid> vids; /** all tokens of the chunk */
+    std::vector<size_t> lengths; /** tokens per line */
+    std::vector<std::pair<size_t, std::string>> misses; /** (index into vids, surface) of words unknown to the cache */
+    size_t bytes;
+  };
+
+  Vocab<Token> &vocab_;
+  Corpus<Token> &corpus_;
+  TokenIndex<Token> *index_;
+  Options options_;
+  std::unique_ptr<CacheShard[]> cache_;
+  Vid seeded_; /** the cache holds all Vocab words with vids below this */
+
+  CacheShard &shard_of(const std::string &surface) const { return cache_[std::hash<std::string>()(surface) % kCacheShards]; }
+
+  /** writer: add the Vocab words inserted since the last call to the cache */
+  void SeedCache();
+
+  void Tokenize(const char *begin, const char *end, Chunk &chunk) const;
+
+  /** writer: resolve the misses of 'chunk', then add its sentences to the corpus, and to 'batch' for indexing */
+  void Write(Chunk &chunk, std::vector<Sentence<Token>> &batch, Stats &stats);
+};
+
+} // namespace sto
+
+#endif //STO_TEXTINGEST_H
@@ -5,48 +5,342 @@
  ****************************************************/
 
 #include "TokenIndex.h"
+#include "util/fsync.hpp"
+#include "util/vidscan.hpp"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstring>
+#include <cstdio>
+#include <stdexcept>
+#include <thread>
 
 namespace sto {
 
 // --------------------------------------------------------
 
-template<class Token>
-TokenIndex<Token>::TokenIndex(const std::string &filename, Corpus<Token> &corpus, size_t maxLeafSize) : corpus_(&corpus), root_(new TreeNodeT(filename, maxLeafSize))
-{}
+template<class Token, class TreeNodeT>
+TokenIndex<Token, TreeNodeT>::TokenIndex(const std::string &filename, Corpus<Token> &corpus, size_t maxLeafSize, const MapOptions &options) : corpus_(&corpus), root_(new TreeNodeT(filename, maxLeafSize, options))
+{
+  root_->BulkSplit(corpus, /* depth = */ 0);
+}
 
-template<class Token>
-TokenIndex<Token>::TokenIndex(Corpus<Token> &corpus, size_t maxLeafSize) : corpus_(&corpus), root_(new TreeNodeT("", maxLeafSize))
+template<class Token, class TreeNodeT>
+TokenIndex<Token, TreeNodeT>::TokenIndex(Corpus<Token> &corpus, size_t maxLeafSize) : corpus_(&corpus), root_(new TreeNodeT("", maxLeafSize))
 {}
 
-template<class Token>
-TokenIndex<Token>::~TokenIndex() {
+template<class Token, class TreeNodeT>
+TokenIndex<Token, TreeNodeT>::~TokenIndex() {
   delete root_;
 }
 
-template<class Token>
-typename TokenIndex<Token>::Span TokenIndex<Token>::span() const {
+template<class Token, class TreeNodeT>
+typename TokenIndex<Token, TreeNodeT>::Span TokenIndex<Token, TreeNodeT>::span() const {
   return Span(*this);
 }
 
-template<class Token>
-void TokenIndex<Token>::AddSentence(const Sentence<Token> &sent) {
+template<class Token, class TreeNodeT>
+std::vector<std::vector<typename TokenIndex<Token, TreeNodeT>::Span>> TokenIndex<Token, TreeNodeT>::LookupSentence(const std::vector<Token> &sent, size_t maxLen, size_t nthreads) const {
+  if(maxLen == 0)
+    maxLen = sent.size();
+  if(nthreads == 0)
+    nthreads = std::max<size_t>(1, std::thread::hardware_concurrency());
+  nthreads = std::min(nthreads, sent.size());
+
+  std::vector<std::vector<Span>> spans(sent.size());
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    size_t i;
+    while((i = next.fetch_add(1)) < sent.size()) {
+      // each narrow() extends the previous sub-phrase by one token
+      Span span = this->span();
+      size_t end = std::min(sent.size(), i + maxLen);
+      for(size_t j = i; j < end && span.narrow(sent[j]) > 0; j++)
+        spans[i].push_back(span);
+    }
+  };
+
+  if(nthreads <= 1) {
+    // extend the sub-phrases of all start positions in lockstep, interleaving their lookups
+    std::vector<Span> active;
+    std::vector<size_t> starts;
+    for(size_t i = 0; i < sent.size(); i++) {
+      active.push_back(this->span());
+      starts.push_back(i);
+    }
+    for(size_t k = 0; !active.empty() && k < maxLen; k++) {
+      std::vector<Token> tokens;
+      size_t n = 0;
+      for(size_t j = 0; j < active.size(); j++) {
+        if(starts[j] + k >= sent.size())
+          continue;
+        if(n != j)
+          active[n] = std::move(active[j]);
+        starts[n++] = starts[j];
+        tokens.push_back(sent[starts[j] + k]);
+      }
+      active.resize(n, this->span());
+      starts.resize(n);
+
+      std::vector<size_t> sizes = NarrowBatch(active, tokens);
+      n = 0;
+      for(size_t j = 0; j < active.size(); j++) {
+        if(sizes[j] == 0)
+          continue;
+        spans[starts[j]].push_back(active[j]);
+        if(n != j)
+          active[n] = std::move(active[j]);
+        starts[n++] = starts[j];
+      }
+      active.resize(n, this->span());
+      starts.resize(n);
+    }
+    return spans;
+  }
+  std::vector<std::thread> threads;
+  for(size_t i = 0; i < nthreads; i++)
+    threads.push_back(std::thread(worker));
+  for(auto &thread : threads)
+    thread.join();
+  return spans;
+}
+
+template<class Token, class TreeNodeT>
+std::vector<size_t> TokenIndex<Token, TreeNodeT>::NarrowBatch(std::vector<Span> &spans, const std::vector<Token> &tokens, size_t width) const {
+  assert(spans.size() == tokens.size());
+  Epoch::Guard guard; // the corpus track may be replaced concurrently, see Corpus::Flush()
+  std::vector<size_t> sizes(spans.size());
+  std::vector<bool> searched(spans.size(), false); /** narrowed by an interleaved search in its leaf */
+
+  // ranges of up to kScanRange Positions are left to find_bounds(), which scans them
+
+  // state of one interleaved search for 'token' at 'depth' within the leaf of span 'index'
+  struct Search {
+    enum Phase { kEqual, kLower, kUpper } phase; /** shared search until the first hit, then the separate bounds */
+    enum Stage { kIssue, kLoad, kCompare } stage; /** pipeline of the current probe */
+    size_t index;
+    Token token;
+    size_t depth;
+    size_t lo, hi; /** kEqual: remaining range. kLower: range of the lower bound, kUpper: of the upper bound */
+    size_t lower; /** lower bound, once found */
+    size_t upper_lo, upper_hi; /** range of the upper bound, while in kLower */
+    size_t probe;
+    Position<Token> pos;
+  };
+
+  Corpus<Token> &corpus = *corpus_;
+
+  // advance 's' by one step. returns true once its bounds are final
+  auto step = [&](Search &s) -> bool {
+    const typename TreeNodeT::LeafArray &leaf = spans[s.index].leaf_;
+    switch(s.stage) {
+      case Search::kLoad:
+        s.pos = leaf[s.probe];
+        corpus.tokens(s.pos.sid).prefetch(s.pos.offset + s.depth);
+        s.stage = Search::kCompare;
+        return false;
+      case Search::kCompare: {
+        int c = compare_vid(corpus, s.pos, s.depth, s.token);
+        if(s.phase == Search::kEqual) {
+          if(c < 0) {
+            s.lo = s.probe + 1;
+          } else if(c > 0) {
+            s.hi = s.probe;
+          } else {
+            // found t: lower bound within [lo, probe], upper bound within [probe + 1, hi]
+            s.upper_lo = s.probe + 1;
+            s.upper_hi = s.hi;
+            s.hi = s.probe;
+            s.phase = Search::kLower;
+          }
+        } else if(s.phase == Search::kLower) {
+          if(c < 0)
+            s.lo = s.probe + 1;
+          else
+            s.hi = s.probe;
+        } else {
+          if(c > 0)
+            s.hi = s.probe;
+          else
+            s.lo = s.probe + 1;
+        }
+        break;
+      }
+      case Search::kIssue:
+        break;
+    }
+
+    // finish small ranges with find_bounds(), or issue the next probe
+    if(s.hi - s.lo <= kScanRange) {
+      Range bounds = leaf.find_bounds(corpus, Range{s.lo, s.hi}, s.token, s.depth);
+      if(s.phase == Search::kEqual) {
+        sizes[s.index] = bounds.size();
+        spans[s.index].array_path_.push_back(bounds);
+        return true;
+      }
+      if(s.phase == Search::kLower) {
+        s.lower = bounds.begin;
+        s.lo = s.upper_lo;
+        s.hi = s.upper_hi;
+        s.phase = Search::kUpper;
+        if(s.hi - s.lo > kScanRange) {
+          s.probe = s.lo + (s.hi - s.lo) / 2;
+          leaf.prefetch(s.probe);
+          s.stage = Search::kLoad;
+          return false;
+        }
+        bounds = leaf.find_bounds(corpus, Range{s.lo, s.hi}, s.token, s.depth);
+      }
+      sizes[s.index] = bounds.end - s.lower;
+      spans[s.index].array_path_.push_back(Range{s.lower, bounds.end});
+      return true;
+    }
+    s.probe = s.lo + (s.hi - s.lo) / 2;
+    leaf.prefetch(s.probe);
+    s.stage = Search::kLoad;
+    return false;
+  };
+
+  std::vector<Search> active;
+  size_t next = 0;
+  while(next < spans.size() || !active.empty()) {
+    // refill the group with the next spans. tree steps do not read leaves, so they are done right away
+    while(active.size() < std::max<size_t>(width, 1) && next < spans.size()) {
+      size_t i = next++;
+      if(!spans[i].in_array()) {
+        sizes[i] = spans[i].narrow(tokens[i]);
+        continue;
+      }
+      STO_STATS_ADD(kNarrowArray, 1);
+      searched[i] = true;
+      Range bounds = spans[i].array_path_.back();
+      Range first;
+      if(spans[i].array_path_.size() == 1)
+        spans[i].tree_path_.back()->EnsureRuns(*corpus_, spans[i].sequence_.size(), spans[i].leaf_);
+      if(bounds.begin == 0 && bounds.end == spans[i].leaf_.size() && spans[i].leaf_.find_first(tokens[i], spans[i].sequence_.size(), first)) {
+        // entering the leaf: its RunIndex has the bounds, no search needed
+        sizes[i] = first.size();
+        spans[i].array_path_.push_back(first);
+        continue;
+      }
+      Search s;
+      s.phase = Search::kEqual;
+      s.stage = Search::kIssue;
+      s.index = i;
+      s.token = tokens[i];
+      s.depth = spans[i].sequence_.size();
+      s.lo = bounds.begin;
+      s.hi = bounds.end;
+      s.lower = s.upper_lo = s.upper_hi = s.probe = 0;
+      active.push_back(s);
+    }
+
+    // one step of each search in the group, removing the finished ones
+    size_t n = 0;
+    for(size_t j = 0; j < active.size(); j++) {
+      if(step(active[j]))
+        continue;
+      active[n++] = active[j];
+    }
+    active.resize(n);
+  }
+
+  // like narrow(): if not found, leave the Span unmodified
+  for(size_t i = 0; i < spans.size(); i++) {
+    if(!searched[i])
+      continue;
+    // the searches appended their bounds above
+    if(sizes[i] == 0)
+      spans[i].array_path_.pop_back();
+    else
+      spans[i].sequence_.push_back(tokens[i]);
+  }
+  return sizes;
+}
+
+template<class Token, class TreeNodeT>
+void TokenIndex<Token, TreeNodeT>::AddSentence(const Sentence<Token> &sent) {
   // start a subsequence at each sentence position
   // each subsequence only goes as deep as necessary to hit a SA
   for(Offset i = 0; i < sent.size(); i++)
     AddSubsequence_(sent, i);
 }
 
-template<class Token>
-void TokenIndex<Token>::DebugPrint(std::ostream &os) {
+template<class Token, class TreeNodeT>
+void TokenIndex<Token, TreeNodeT>::AddSentences(const std::vector<Sentence<Token>> &sents) {
+  std::vector<Position<Token>> positions;
+  for(const Sentence<Token> &sent : sents)
+    for(Offset i = 0; i < sent.size(); i++)
+      positions.push_back(Position<Token>{sent.sid(), i});
+  root_->AddPositions(*corpus_, positions);
+}
+
+template<class Token, class TreeNodeT>
+void TokenIndex<Token, TreeNodeT>::Build(size_t nthreads) {
+  root_->BuildIndex(*corpus_, nthreads);
+}
+
+template<class Token, class TreeNodeT>
+void TokenIndex<Token, TreeNodeT>::Write(const std::string &filename) const {
+  typedef tpt::TsaHeader TokenIndexHeader;
+  typedef typename Corpus<Token>::Vid Vid;
+
+  if(sizeof(SuffixArrayPosition<Token>) != sizeof(tpt::TsaPosition))
+    throw std::runtime_error(std::string("Position widths of this Token type are not layout compatible with mtt-build, cannot write ") + filename);
+
+  // snapshot of all Positions, in suffix order
+  Span span = this->span();
+  size_t size = span.size();
+  std::vector<SuffixArrayPosition<Token>> positions;
+  positions.reserve(size);
+  for(size_t i = 0; i < size; i++)
+    positions.push_back(span[i]);
+
+  // index: byte offset of the first Position for each vid of the first token, relative to the start of positions
+  Vid maxVid = 0;
+  for(const auto &pos : positions)
+    maxVid = std::max(maxVid, Position<Token>(pos).vid(*corpus_));
+  std::vector<tpt::filepos_type> index(static_cast<size_t>(maxVid) + 2, 0);
+  for(const auto &pos : positions)
+    index[static_cast<size_t>(Position<Token>(pos).vid(*corpus_)) + 1] += sizeof(SuffixArrayPosition<Token>);
+  for(size_t i = 1; i < index.size(); i++)
+    index[i] += index[i - 1];
+
+  TokenIndexHeader header;
+  header.versionMagic = tpt::INDEX_V2_MAGIC;
+  header.idxStart = sizeof(TokenIndexHeader) + positions.size() * sizeof(SuffixArrayPosition<Token>);
+  header.idxSize = static_cast<tpt::id_type>(index.size());
+
+  // write to a temp file first, then move it to filename. Existing mappings of the old file stay valid.
+  std::string tmp_name = filename + ".tmp";
+  FILE *file = fopen(tmp_name.c_str(), "wb");
+  if(!file)
+    throw std::runtime_error(std::string("failed to open file for write at ") + tmp_name);
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  ok = ok && (positions.empty() || fwrite(positions.data(), sizeof(SuffixArrayPosition<Token>), positions.size(), file) == positions.size());
+  ok = ok && fwrite(index.data(), sizeof(tpt::filepos_type), index.size(), file) == index.size();
+  ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+  if(fclose(file) != 0 || !ok || rename(tmp_name.c_str(), filename.c_str()) != 0)
+    throw std::runtime_error(std::string("failed to write ") + filename);
+  sync_dir(filename);
+}
+
+template<class Token, class TreeNodeT>
+void TokenIndex<Token, TreeNodeT>::Flush(const std::string &filename, const MapOptions &options) {
+  // the Positions must not change between Write() and remapping them. Background splits may still be installed
+  // in between (by RemapLeaves() itself), since they keep the order of Positions.
+  Write(filename);
+  root_->RemapLeaves(*corpus_, filename, options);
+}
+
+template<class Token, class TreeNodeT>
+void TokenIndex<Token, TreeNodeT>::DebugPrint(std::ostream &os) {
   root_->DebugPrint(os, *corpus_);
 }
 
-template<class Token>
-void TokenIndex<Token>::AddSubsequence_(const Sentence<Token> &sent, Offset start) {
+template<class Token, class TreeNodeT>
+void TokenIndex<Token, TreeNodeT>::AddSubsequence_(const Sentence<Token> &sent, Offset start) {
   /*
    * A hybrid suffix trie / suffix array implementation.
    *
@@ -127,5 +421,10 @@ void TokenIndex<Token>::AddSubsequence_(const Sentence<Token> &sent, Offset star
 // explicit template instantiation
 template class TokenIndex<SrcToken>;
 template class TokenIndex<TrgToken>;
+template class TokenIndex<SmallSrcToken>;
+template class TokenIndex<SrcToken, TreeNodeMemory<SrcToken, FlatMap>>;
+template class TokenIndex<TrgToken, TreeNodeMemory<TrgToken, FlatMap>>;
+template class TokenIndex<SrcToken, TreeNodeDisk<SrcToken>>;
+template class TokenIndex<TrgToken, TreeNodeDisk<TrgToken>>;
 
 } // namespace sto
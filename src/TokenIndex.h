@@ -7,48 +7,56 @@
 #ifndef STO_TOKENINDEX_H
 #define STO_TOKENINDEX_H
 
+#include <algorithm>
 #include <iostream>
+#include <random>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "Range.h"
 #include "SuffixArrayMemory.h"
 #include "TreeNodeMemory.h"
-//#include "SuffixArrayDisk.h"
-//#include "TreeNodeDisk.h"
+#include "SuffixArrayDisk.h"
+#include "TreeNodeDisk.h"
 #include "Corpus.h"
 #include "util/rbtree.hpp"
+#include "util/stats.hpp"
 
 namespace sto {
 
-template<class Token, class SuffixArray> class TreeNode;
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT> class TreeNode;
 
 /**
  * Indexes a Corpus. The index is implemented as a hybrid suffix tree/array.
  *
  * Vocab note: vid of explicit sentence end delimiting symbol </s> must be at the very beginning of all vocab symbols
  * (sort order matters, shorter sequences must come first)!
+ *
+ * TreeNodeT is the TreeNode implementation, e.g. TreeNodeMemory<Token, FlatMap> for flat child maps
+ * which are faster to search in read-mostly indexes, or TreeNodeDisk<Token> for an index persisted
+ * in a directory, which can be reopened instantly and may be much larger than RAM.
  */
-template<class Token>
+template<class Token, class TreeNodeT = TreeNodeMemory<Token>>
 class TokenIndex {
 public:
   typedef typename Corpus<Token>::Offset Offset;
 
-  typedef SuffixArrayMemory<Token> SuffixArray;
-  typedef TreeNodeMemory<Token> TreeNodeT;
-
-  //typedef SuffixArrayDisk<Token> SuffixArray;
-  //typedef TreeNodeDisk<Token> TreeNodeT;
+  typedef typename TreeNodeT::SuffixArrayT SuffixArray;
 
 
   /**
    * Load TokenIndex from mtt-build *.sfa file for the associated corpus.
    *
-   * Currently, this creates one big suffix array (not memory mapped) regardless of maxLeafSize, but subsequent calls to
-   * AddSentence() will honor maxLeafSize and split where necessary (so the first additions will be expensive).
+   * The suffix array is memory mapped read-only, so the page cache can be shared across processes.
+   * It is split into a tree honoring maxLeafSize in a single pass. The leaves remain views into the mapping,
+   * until AddSentence() copies a leaf into memory the first time it is written to.
+   * 'options' sets the page cache policy of the mapping, e.g. MapOptions::kRandom for binary search probes.
    */
-  TokenIndex(const std::string &filename, Corpus<Token> &corpus, size_t maxLeafSize = 10000);
+  TokenIndex(const std::string &filename, Corpus<Token> &corpus, size_t maxLeafSize = 10000, const MapOptions &options = MapOptions());
+  // TreeNodeDisk: 'filename' is the index directory instead. It is opened if it exists, otherwise an empty index is created there.
 
-  /** Construct an empty TokenIndex, i.e. this does not index the Corpus by itself. */
+  /** Construct an empty TokenIndex, i.e. this does not index the Corpus by itself. Not for TreeNodeDisk, which needs a directory. */
   TokenIndex(Corpus<Token> &corpus, size_t maxLeafSize = 10000);
   ~TokenIndex();
 
@@ -62,15 +70,14 @@ public:
    */
   class Span {
   public:
-    friend class TokenIndex<Token>;
-    typedef typename TokenIndex<Token>::TreeNodeT TreeNodeT;
+    friend class TokenIndex<Token, TreeNodeT>;
 
     // note: use TokenIndex::span() for constructing an IndexSpan
 
-    Span(Span &other) = default;
+    Span(const Span &other) = default;
     Span(Span &&other) = default;
 
-    Span& operator=(Span &other) = default;
+    Span& operator=(const Span &other) = default;
     Span& operator=(Span &&other) = default;
 
     /**
@@ -88,14 +95,32 @@ public:
      * O(log(n/k)) with with k = TreeNode<Token>::kMaxArraySize.
      *
      * When reading a SuffixArray leaf that is being written to,
-     * returned Position values will always be valid, but
-     * may be to the left of 'rel'.
+     * the Span keeps reading the leaf's array as of narrow(),
+     * so returned Position values are consistent with size().
      */
     Position<Token> operator[](size_t rel) const;
 
     // for testing!
     Position<Token> at_unchecked(size_t rel) const;
 
+    /**
+     * Random access to many positions at once, at ascending ranks 'sorted' within the span.
+     * Walks the tree and leaf once in order, instead of a full descent per position like operator[].
+     */
+    void at_sorted(const std::vector<size_t> &sorted, std::vector<Position<Token>> &out) const;
+
+    /**
+     * Draw a uniform random sample of min(k, size()) distinct positions into 'out', in suffix order.
+     *
+     * Ranks are drawn first and sorted, then retrieved with at_sorted(). If 'stratified', the span is divided into
+     * k equal strata, with one position drawn from each, which spreads the sample evenly over the span.
+     * Samples are reproducible with a deterministically seeded 'rng'.
+     *
+     * O(k log k) for drawing the ranks, plus at_sorted().
+     */
+    template<class RNG>
+    void sample(size_t k, RNG &rng, std::vector<Position<Token>> &out, bool stratified = false) const;
+
     /**
      * Number of token positions spanned in the index.
      *
@@ -103,6 +128,15 @@ public:
      */
     size_t size() const;
 
+    /**
+     * Frequency of each one-token extension of the lookup sequence, in ascending vid order, i.e. the size()
+     * narrow(token) would give for each token that occurs next. Includes the implicit </s> at sentence ends.
+     *
+     * Reads the children's partial sums in the tree. In a suffix array leaf, scans the span's range once
+     * by galloping over runs of equal tokens, instead of binary searches for each possible token.
+     */
+    std::vector<std::pair<Token, size_t>> children_counts() const;
+
     /** Length of lookup sequence, or the number of times narrow() has been called. */
     size_t depth() const;
 
@@ -118,6 +152,13 @@ public:
     /** true if span reaches into a suffix array leaf. */
     bool in_array() const;
 
+    /**
+     * In a suffix array leaf: true if the leaf's current array is still the one this Span holds, i.e. the leaf
+     * was not written to, split or remapped since narrow(). In the tree: always true, since size() and random
+     * access read the tree itself. One leaf_array() load, instead of narrowing from the root again.
+     */
+    bool current() const;
+
     /** partial lookup sequence so far, as appended by narrow() */
     const std::vector<Token>& sequence() const { return sequence_; }
 
@@ -125,16 +166,17 @@ public:
 
   protected:
     /** use TokenIndex::span() for constructing an IndexSpan */
-    Span(const TokenIndex<Token> &index);
+    Span(const TokenIndex<Token, TreeNodeT> &index);
 
   private:
     static constexpr size_t STO_NOT_FOUND = static_cast<size_t>(-1);
 
-    const TokenIndex<Token> *index_;
+    const TokenIndex<Token, TreeNodeT> *index_;
 
     std::vector<Token> sequence_; /** partial lookup sequence so far, as appended by narrow() */
     std::vector<TreeNodeT *> tree_path_; /** first part of path from root through the tree */
     std::vector<Range> array_path_; /** second part of path from leaf through the suffix array. These Ranges always index relative to the specific suffix array. */
+    typename TreeNodeT::LeafArray leaf_; /** the leaf's suffix array as of entering it, which array_path_ indexes into. empty while in the tree. */
 
     /** narrow() in suffix array.
      * returns > 0 on success, STO_NOT_FOUND on failure: for consistency with narrow_tree_() */
@@ -152,6 +194,32 @@ public:
   /** Returns the whole span of the entire index (empty lookup sequence). */
   Span span() const;
 
+  /**
+   * Look up all sub-phrases of 'sent' of up to 'maxLen' tokens (0: unlimited).
+   *
+   * Returns spans[i][k] for the sub-phrase of k+1 tokens starting at sent[i]. Spans are extended incrementally
+   * from each start position, sharing the narrow() work of common prefixes, and stop at the first sub-phrase
+   * which is not found, so spans[i] contains only non-empty spans.
+   *
+   * Start positions are distributed over 'nthreads' threads (0: one per hardware thread).
+   */
+  std::vector<std::vector<Span>> LookupSentence(const std::vector<Token> &sent, size_t maxLen = 0, size_t nthreads = 1) const;
+
+  /**
+   * Narrow many independent spans at once, with the same results as spans[i].narrow(tokens[i]) for each i.
+   *
+   * Binary searches in suffix array leaves are interleaved over up to 'width' spans (AMAC style): each step of
+   * a span prefetches the suffix array entry or corpus token which its next step reads, then moves on to the
+   * next span. So the cache misses of independent lookups overlap, instead of forming one dependent chain each.
+   * Spans in the tree are narrowed directly.
+   *
+   * This only pays off for searches over large, cold leaf ranges. When most lookups end in the tree, in RunIndex
+   * hits or in short scans, it is about as fast as narrow() for each span. Compare with query_benchmark --batch.
+   *
+   * @return new span sizes, like narrow()
+   */
+  std::vector<size_t> NarrowBatch(std::vector<Span> &spans, const std::vector<Token> &tokens, size_t width = 16) const;
+
   Corpus<Token> *corpus() const { return corpus_; }
 
   /**
@@ -170,8 +238,68 @@ public:
    */
   void AddSentence(const Sentence<Token> &sent);
 
+  /**
+   * Insert a batch of existing Corpus Sentences into this index, with the same resulting Positions
+   * as calling AddSentence() for each of them in order.
+   *
+   * The new Positions are sorted once and merged into each affected suffix array leaf in a single
+   * linear pass, which is much cheaper than individual inserts for large batches.
+   *
+   * Thread safety: like AddSentence(), each leaf is replaced atomically.
+   */
+  void AddSentences(const std::vector<Sentence<Token>> &sents);
+
+  /**
+   * Index the entire Corpus at once, which must not have been indexed yet (empty TokenIndex).
+   *
+   * Suffixes are partitioned by their first token. The partitions are sorted and built into subtrees
+   * of the root in parallel, using 'nthreads' threads (0: one per hardware thread).
+   * Much faster than calling AddSentence() for each Sentence, with the same resulting Positions.
+   */
+  void Build(size_t nthreads = 0);
+
+  /**
+   * Write the entire index as a single suffix array in mtt-build *.sfa format, which can be loaded again
+   * with TokenIndex(filename, corpus), e.g. after Corpus::Flush() of the indexed Corpus.
+   * The existing file is replaced atomically. Throws for Token types whose Position widths differ from mtt-build's
+   * (e.g. SmallSrcToken).
+   *
+   * Thread safety: may be called by the writer, concurrently with readers.
+   */
+  void Write(const std::string &filename) const;
+
+  /**
+   * Write() the index, and remap all leaves as read-only views into the written file, releasing the memory
+   * of their arrays (see TreeNodeMemory::RemapLeaves()). Call after Corpus::Flush() of the indexed Corpus,
+   * so that both are persistent. Waits for background splits first, see FinishSplits().
+   *
+   * Thread safety: may be called by the writer, concurrently with readers.
+   */
+  void Flush(const std::string &filename, const MapOptions &options = MapOptions());
+
   void DebugPrint(std::ostream &os);
 
+  /**
+   * Split oversized leaves in AddSentence() on a background thread, so the writer is not stalled
+   * by copying a large leaf. Until the finished split is installed by a later AddSentence() call,
+   * the leaf keeps taking inserts. Resulting Positions are the same as with synchronous splits.
+   * Disabling waits for pending splits. Not supported by TreeNodeDisk (ignored).
+   */
+  void SetAsyncSplits(bool async) { root_->SetAsyncSplits(async); }
+
+  /**
+   * Wait for all background splits and install them, e.g. before comparing or persisting the tree.
+   * TreeNodeDisk: write the insert buffers of all leaves, so that all Positions are persistent.
+   */
+  void FinishSplits() { root_->FinishSplits(); }
+
+  /**
+   * Snapshot of the hot path counters, for exporting to metrics or tuning maxLeafSize.
+   * The counters are process-wide (summed over all TokenIndex instances and threads), and only compiled in
+   * with -DSTO_STATS. Otherwise, all counters are zero.
+   */
+  sto::Stats::Snapshot Stats() const { return sto::Stats::Collect(); }
+
 private:
   friend class Span;
 
@@ -182,6 +310,36 @@ private:
   void AddSubsequence_(const Sentence<Token> &sent, Offset start);
 };
 
+template<class Token, class TreeNodeT>
+template<class RNG>
+void TokenIndex<Token, TreeNodeT>::Span::sample(size_t k, RNG &rng, std::vector<Position<Token>> &out, bool stratified) const {
+  size_t n = size();
+  std::vector<size_t> ranks;
+  if(k >= n) {
+    // the entire span
+    for(size_t i = 0; i < n; i++)
+      ranks.push_back(i);
+  } else if(stratified) {
+    // one rank from each stratum [i*n/k, (i+1)*n/k), which are non-empty for k < n
+    for(size_t i = 0; i < k; i++) {
+      std::uniform_int_distribution<size_t> dist(i * n / k, (i + 1) * n / k - 1);
+      ranks.push_back(dist(rng));
+    }
+  } else {
+    // Floyd's algorithm: k distinct ranks with exactly k draws
+    std::unordered_set<size_t> drawn;
+    for(size_t j = n - k; j < n; j++) {
+      std::uniform_int_distribution<size_t> dist(0, j);
+      size_t r = dist(rng);
+      if(!drawn.insert(r).second)
+        drawn.insert(j);
+    }
+    ranks.assign(drawn.begin(), drawn.end());
+    std::sort(ranks.begin(), ranks.end());
+  }
+  at_sorted(ranks, out);
+}
+
 } // namespace sto
 
 #endif //STO_TOKENINDEX_H
@@ -11,22 +11,26 @@
 
 #include "TokenIndex.h"
 #include "TreeNode.h"
+#include "util/epoch.hpp"
+#include "util/stats.hpp"
 
 namespace sto {
 
-template<class Token>
-TokenIndex<Token>::Span::Span(const TokenIndex<Token> &index) : index_(&index) {
+template<class Token, class TreeNodeT>
+TokenIndex<Token, TreeNodeT>::Span::Span(const TokenIndex<Token, TreeNodeT> &index) : index_(&index) {
   // starting sentinel
   tree_path_.push_back(index_->root_);
 
   // this sentinel should be handled in narrow(),
   // but for a leaf-only tree (rooted in a suffix array) we cannot do better:
-  if (index_->root_->is_leaf())
-    array_path_.push_back(Range{0, index_->root_->size()});
+  leaf_ = index_->root_->leaf_array();
+  if (leaf_)
+    array_path_.push_back(Range{0, leaf_.size()});
 }
 
-template<class Token>
-size_t TokenIndex<Token>::Span::narrow(Token t) {
+template<class Token, class TreeNodeT>
+size_t TokenIndex<Token, TreeNodeT>::Span::narrow(Token t) {
+  Epoch::Guard guard; // the corpus track may be replaced concurrently, see Corpus::Flush()
   size_t new_span;
 
   if (in_array())
@@ -43,18 +47,21 @@ size_t TokenIndex<Token>::Span::narrow(Token t) {
   // if we just descended into the suffix array, add sentinel: spanning full array range
   // array_path_: entries always index relative to the specific suffix array
   if (in_array() && array_path_.size() == 0)
-    array_path_.push_back(Range{0, tree_path_.back()->size()});
+    array_path_.push_back(Range{0, leaf_.size()});
 
   return new_span;
 }
 
-template<class Token>
-Range TokenIndex<Token>::Span::find_bounds_array_(Token t) {
-  return tree_path_.back()->find_bounds_array_(*index_->corpus_, array_path_.back(), t, sequence_.size());
+template<class Token, class TreeNodeT>
+Range TokenIndex<Token, TreeNodeT>::Span::find_bounds_array_(Token t) {
+  if(array_path_.size() == 1)
+    tree_path_.back()->EnsureRuns(*index_->corpus_, sequence_.size(), leaf_); // entering the leaf
+  return leaf_.find_bounds(*index_->corpus_, array_path_.back(), t, sequence_.size());
 }
 
-template<class Token>
-size_t TokenIndex<Token>::Span::narrow_array_(Token t) {
+template<class Token, class TreeNodeT>
+size_t TokenIndex<Token, TreeNodeT>::Span::narrow_array_(Token t) {
+  STO_STATS_ADD(kNarrowArray, 1);
   Range new_range = find_bounds_array_(t);
 
   if (new_range.size() == 0)
@@ -64,8 +71,9 @@ size_t TokenIndex<Token>::Span::narrow_array_(Token t) {
   return new_range.size();
 }
 
-template<class Token>
-size_t TokenIndex<Token>::Span::narrow_tree_(Token t) {
+template<class Token, class TreeNodeT>
+size_t TokenIndex<Token, TreeNodeT>::Span::narrow_tree_(Token t) {
+  STO_STATS_ADD(kNarrowTree, 1);
   TreeNodeT *node;
   if (!tree_path_.back()->find_child_(t.vid, &node))
     return STO_NOT_FOUND; // do not modify the IndexSpan and signal failure
@@ -73,26 +81,46 @@ size_t TokenIndex<Token>::Span::narrow_tree_(Token t) {
   // note: we also end up here if stepping into an empty, existing SuffixArray leaf
   assert(node != nullptr);
   tree_path_.push_back(node);
-  return tree_path_.back()->size();
+
+  // thread safety: hold on to the leaf's current array. Later inserts and splits by a writer do not affect it,
+  // so our array_path_ Ranges stay consistent.
+  leaf_ = node->leaf_array();
+  return leaf_ ? leaf_.size() : node->size();
 }
 
-template<class Token>
-Position<Token> TokenIndex<Token>::Span::operator[](size_t rel) const {
+template<class Token, class TreeNodeT>
+Position<Token> TokenIndex<Token, TreeNodeT>::Span::operator[](size_t rel) const {
   assert(rel < size());
+  STO_STATS_ADD(kAt, 1);
 
   // traverses the tree down using binary search on the cumulative counts at each internal TreeNode
   // until we hit a SuffixArray leaf and can do random access there.
   // upper_bound()-1 of rel inside the list of our children
-  return tree_path_.back()->At(array_path_.size() ? array_path_.back().begin : 0, rel);
+  return at_unchecked(rel);
 }
 
-template<class Token>
-Position<Token> TokenIndex<Token>::Span::at_unchecked(size_t rel) const {
-  return tree_path_.back()->At(array_path_.size() ? array_path_.back().begin : 0, rel);
+template<class Token, class TreeNodeT>
+Position<Token> TokenIndex<Token, TreeNodeT>::Span::at_unchecked(size_t rel) const {
+  if (in_array())
+    return leaf_[array_path_.back().begin + rel];
+  return tree_path_.back()->At(0, rel);
 }
 
-template<class Token>
-size_t TokenIndex<Token>::Span::size() const {
+template<class Token, class TreeNodeT>
+void TokenIndex<Token, TreeNodeT>::Span::at_sorted(const std::vector<size_t> &sorted, std::vector<Position<Token>> &out) const {
+  out.resize(sorted.size());
+  if (in_array()) {
+    size_t begin = array_path_.back().begin;
+    for (size_t i = 0; i < sorted.size(); i++)
+      out[i] = leaf_[begin + sorted[i]];
+    return;
+  }
+  if (!sorted.empty())
+    tree_path_.back()->AtSorted(sorted.data(), sorted.size(), /* base = */ 0, out.data());
+}
+
+template<class Token, class TreeNodeT>
+size_t TokenIndex<Token, TreeNodeT>::Span::size() const {
   if (in_array()) {
     assert(array_path_.size() > 0);
     return array_path_.back().size();
@@ -102,33 +130,62 @@ size_t TokenIndex<Token>::Span::size() const {
   }
 }
 
-template<class Token>
-typename TokenIndex<Token>::Span::TreeNodeT *TokenIndex<Token>::Span::node() {
+template<class Token, class TreeNodeT>
+std::vector<std::pair<Token, size_t>> TokenIndex<Token, TreeNodeT>::Span::children_counts() const {
+  Epoch::Guard guard; // see narrow()
+  std::vector<std::pair<typename Corpus<Token>::Vid, size_t>> counts;
+  if (in_array())
+    leaf_.extension_counts(*index_->corpus_, array_path_.back(), sequence_.size(), counts);
+  else
+    tree_path_.back()->child_counts(counts);
+
+  std::vector<std::pair<Token, size_t>> tokens;
+  tokens.reserve(counts.size());
+  for (auto &c : counts)
+    tokens.push_back(std::make_pair(Token{c.first}, c.second));
+  return tokens;
+}
+
+template<class Token, class TreeNodeT>
+TreeNodeT *TokenIndex<Token, TreeNodeT>::Span::node() {
   return tree_path_.back();
 }
 
-template<class Token>
-size_t TokenIndex<Token>::Span::depth() const {
+template<class Token, class TreeNodeT>
+size_t TokenIndex<Token, TreeNodeT>::Span::depth() const {
   return sequence_.size();
 }
 
-template<class Token>
-size_t TokenIndex<Token>::Span::tree_depth() const {
+template<class Token, class TreeNodeT>
+size_t TokenIndex<Token, TreeNodeT>::Span::tree_depth() const {
   return tree_path_.size() - 1; // exclude sentinel entry for root (for root, tree_depth() == 0)
 }
 
-template<class Token>
-bool TokenIndex<Token>::Span::in_array() const {
-  return tree_path_.back()->is_leaf();
+template<class Token, class TreeNodeT>
+bool TokenIndex<Token, TreeNodeT>::Span::in_array() const {
+  return static_cast<bool>(leaf_);
+}
+
+template<class Token, class TreeNodeT>
+bool TokenIndex<Token, TreeNodeT>::Span::current() const {
+  if (!in_array())
+    return true;
+  typename TreeNodeT::LeafArray leaf = tree_path_.back()->leaf_array();
+  return leaf.delta == leaf_.delta && leaf.static_array == leaf_.static_array && leaf.array == leaf_.array;
 }
 
-template<class Token>
-Corpus<Token> *TokenIndex<Token>::Span::corpus() const {
+template<class Token, class TreeNodeT>
+Corpus<Token> *TokenIndex<Token, TreeNodeT>::Span::corpus() const {
   return index_->corpus();
 }
 
 // explicit template instantiation
 template class TokenIndex<SrcToken>::Span;
 template class TokenIndex<TrgToken>::Span;
+template class TokenIndex<SmallSrcToken>::Span;
+template class TokenIndex<SrcToken, TreeNodeMemory<SrcToken, FlatMap>>::Span;
+template class TokenIndex<TrgToken, TreeNodeMemory<TrgToken, FlatMap>>::Span;
+template class TokenIndex<SrcToken, TreeNodeDisk<SrcToken>>::Span;
+template class TokenIndex<TrgToken, TreeNodeDisk<TrgToken>>::Span;
 
 } // namespace sto
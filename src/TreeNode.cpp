@@ -10,124 +10,490 @@
 
 #include "TreeNode.h"
 #include "TokenIndex.h"
+#include "util/stats.hpp"
+#include "util/vidscan.hpp"
 
 namespace sto {
 
-template<class Token, class SuffixArray>
-TreeNode<Token, SuffixArray>::TreeNode(size_t maxArraySize) : is_leaf_(true), array_(nullptr), kMaxArraySize(maxArraySize)
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+TreeNode<Token, SuffixArray, ChildMapT>::TreeNode(size_t maxArraySize) : is_leaf_(true), children_loaded_(true), array_(nullptr), runs_deferred_(false), kMaxArraySize(maxArraySize)
 {}
 
-template<class Token, class SuffixArray>
-TreeNode<Token, SuffixArray>::~TreeNode() {
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+TreeNode<Token, SuffixArray, ChildMapT>::~TreeNode() {
   // ~RBTree() should do the work. But pointers are opaque to it (ValueType), so it does not, currently.
-  children_.Walk([](Vid vid, TreeNode<Token, SuffixArray> *e) {
+  children_.Walk([](Vid vid, TreeNode<Token, SuffixArray, ChildMapT> *e) {
     delete e;
   });
 }
 
-template<class Token, class SuffixArray>
-void TreeNode<Token, SuffixArray>::AddSize(Vid vid, size_t add_size) {
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+void TreeNode<Token, SuffixArray, ChildMapT>::AddSize(Vid vid, size_t add_size) {
+  EnsureChildren();
   children_.AddSize(vid, add_size);
 }
 
-template<class Token, class SuffixArray>
-Range TreeNode<Token, SuffixArray>::find_bounds_array_(Corpus<Token> &corpus, Range prev_bounds, Token t, size_t depth) {
+/**
+ * binary search for the bounds of Token t at 'depth' within prev_bounds of any suffix array type.
+ *
+ * Both bounds are found in a single pass, like std::equal_range(): probes are shared until the first hit of t,
+ * then the remaining lower and upper halves are searched separately. Each probe reads a single vid directly
+ * from the corpus track.
+ *
+ * If enabled (kScanRange > 0), once the remaining range is small, its vids are gathered into a contiguous buffer
+ * instead, and the run of t is located with a branch-free (vectorized) scan, which avoids the mispredicted branches
+ * of the last binary search steps.
+ */
+template<class Token, class Array>
+Range find_bounds(Array &array, Corpus<Token> &corpus, Range prev_bounds, Token t, size_t depth) {
+  typedef typename Corpus<Token>::Vid Vid;
+
   // for each token position, we need to check if it's long enough to extend as far as we do
   // (note: lexicographic sort order means shorter stuff is always at the beginning - so if Pos is too short, then Pos < Tok.)
   // then, we only need to compare at the depth of new_sequence_size, since all tokens before should be equal
-  size_t old_sequence_size = depth;
 
-  auto array = array_;
-  Range bounds;
+  // 3-way comparison of the vid at 'depth' of array[i] against t
+  STO_STATS_ONLY(size_t probes = 0);
+  auto compare = [&array, &corpus, &t, depth STO_STATS_ONLY(, &probes)](size_t i) -> int {
+    STO_STATS_ONLY(probes++);
+    return compare_vid(corpus, Position<Token>(array[i]), depth, t);
+  };
 
-  // binary search for the range containing Token t
-  bounds.begin = std::lower_bound(
-      array->begin() + prev_bounds.begin, array->begin() + prev_bounds.end,
-      //new_sequence,
-      t,
-      [&corpus, old_sequence_size](const Position<Token> &pos, const Token &t) {
-        Sentence<Token> sent = corpus.sentence(pos.sid);
-        // lexicographic sort order means shorter sequences always come first in array
-        // sent.size() + 1: add implicit </s>
-        if (sent.size() + 1 - pos.offset < old_sequence_size + 1)
-          return true;
-        // we only need to compare at the depth of new_sequence_size, since all tokens before are equal
-
-        // note: Token::operator<(Token&) compares by vid (not surface form)
-        return sent[pos.offset + old_sequence_size] < t;
+  // bounds of t within the small range [lo, hi), by scanning all of its vids
+  auto scan = [&array, &corpus, &t, depth STO_STATS_ONLY(, &probes)](size_t lo, size_t hi) -> Range {
+    Vid vids[kScanRange > 0 ? kScanRange : 1];
+    size_t n = 0, nshort = 0;
+    for(size_t i = lo; i < hi; i++) {
+      if(suffix_vid(corpus, Position<Token>(array[i]), depth, vids[n]))
+        n++;
+      else
+        nshort++; // shorter sequences sort first, i.e. before t
+    }
+    STO_STATS_ONLY(probes += hi - lo);
+    size_t nless, nequal;
+    scan_bounds(vids, n, t.vid, nless, nequal);
+    size_t l = lo + nshort + nless;
+    return Range{l, l + nequal};
+  };
+
+  size_t lo = prev_bounds.begin, hi = prev_bounds.end;
+  while(lo < hi) {
+    if(hi - lo <= kScanRange) {
+      Range bounds = scan(lo, hi);
+      STO_STATS_RECORD(kFindBoundsProbes, probes);
+      return bounds;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    int c = compare(mid);
+    if(c < 0) {
+      lo = mid + 1;
+    } else if(c > 0) {
+      hi = mid;
+    } else {
+      // found t: lower bound within [lo, mid], upper bound within [mid + 1, hi]
+      size_t l = lo, h = mid;
+      while(l < h) {
+        size_t m = l + (h - l) / 2;
+        if(compare(m) < 0)
+          l = m + 1;
+        else
+          h = m;
       }
-  ) - array->begin();
-
-  bounds.end = std::upper_bound(
-      array->begin() + prev_bounds.begin, array->begin() + prev_bounds.end,
-      //new_sequence,
-      t,
-      [&corpus, old_sequence_size](const Token &t, const Position<Token> &pos) {
-        Sentence<Token> sent = corpus.sentence(pos.sid);
-        // lexicographic sort order means shorter sequences always come first in array
-        // sent.size() + 1: add implicit </s>
-        if (sent.size() + 1 - pos.offset < old_sequence_size + 1)
-          return false;
-        // we only need to compare at the depth of new_sequence_size, since all tokens before are equal
-
-        // note: Token::operator<(Token&) compares by vid (not surface form)
-        return t < sent[pos.offset + old_sequence_size];
+      size_t ul = mid + 1, uh = hi;
+      while(ul < uh) {
+        size_t m = ul + (uh - ul) / 2;
+        if(compare(m) > 0)
+          uh = m;
+        else
+          ul = m + 1;
       }
-  ) - array->begin();
+      STO_STATS_RECORD(kFindBoundsProbes, probes);
+      return Range{l, ul};
+    }
+  }
+  STO_STATS_RECORD(kFindBoundsProbes, probes);
+  return Range{lo, lo}; // not found: empty range at the insertion point
+}
+
+/**
+ * Count the Positions of each distinct vid at 'depth' within 'bounds' of any suffix array type.
+ * Positions which end before 'depth' are not counted.
+ *
+ * Runs of equal vids are skipped by galloping: exponential steps from the start of the run, then a binary search
+ * for its end. This reads O(d log(n/d)) vids from the corpus track for d distinct vids, and at most about 2n.
+ */
+template<class Token, class Array>
+void extension_counts(Array &array, const Corpus<Token> &corpus, Range bounds, size_t depth, std::vector<std::pair<typename Corpus<Token>::Vid, size_t>> &counts) {
+  typedef typename Corpus<Token>::Vid Vid;
+
+  // vid at 'depth' of array[i], for a Position which extends at least up to the implicit </s> at 'depth'
+  auto vid_at = [&array, &corpus, depth](size_t i) {
+    Position<Token> pos = array[i];
+    typename Corpus<Token>::Tokens tokens = corpus.tokens(pos.sid);
+    size_t v = pos.offset + depth;
+    return (v == tokens.size()) ? static_cast<Vid>(Corpus<Token>::Vocabulary::kEOS) : tokens[v];
+  };
+  // true if array[i] ends before 'depth', i.e. its implicit </s> is already part of the span (e.g. 'c </s>')
+  auto shorter = [&array, &corpus, depth](size_t i) {
+    Position<Token> pos = array[i];
+    return pos.offset + depth > corpus.tokens(pos.sid).size();
+  };
+
+  // shorter Positions have no extension. They sort first, so a binary search skips them without reading past their end.
+  size_t lo = bounds.begin, hi = bounds.end;
+  while(lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if(shorter(mid))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  size_t begin = lo;
+  while(begin < bounds.end) {
+    Vid vid = vid_at(begin);
+
+    // gallop: find step with array[begin + step/2] in the run, and array[begin + step] beyond it (or the end)
+    size_t step = 1;
+    while(step < bounds.end - begin && vid_at(begin + step) == vid)
+      step *= 2;
+    // binary search for the end of the run in (begin + step/2, min(begin + step, bounds.end)]
+    size_t lo = begin + step / 2 + 1, hi = std::min(begin + step, bounds.end);
+    while(lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if(vid_at(mid) == vid)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+    counts.push_back(std::make_pair(vid, lo - begin));
+    begin = lo;
+  }
+}
+
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+Position<Token> TreeNode<Token, SuffixArray, ChildMapT>::DeltaArray::operator[](size_t i) const {
+  // j: number of buffered Positions before index i in the merged view
+  size_t j = static_cast<size_t>(std::lower_bound(ranks.begin(), ranks.end(), i) - ranks.begin());
+  if(j < ranks.size() && ranks[j] == i)
+    return Position<Token>(positions[j]);
+  return static_base ? (*static_base)[i - j] : Position<Token>((*base)[i - j]);
+}
+
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+size_t TreeNode<Token, SuffixArray, ChildMapT>::LeafArray::size() const {
+  return delta ? delta->size() : static_array ? static_array->size() : array->size();
+}
+
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+Position<Token> TreeNode<Token, SuffixArray, ChildMapT>::LeafArray::operator[](size_t i) const {
+  return delta ? (*delta)[i] : static_array ? (*static_array)[i] : Position<Token>((*array)[i]);
+}
+
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+bool TreeNode<Token, SuffixArray, ChildMapT>::LeafArray::has_runs(size_t depth) const {
+  if(!runs || runs->depth != depth || delta)
+    return false;
+  // same owner: runs describes exactly this array version
+  const std::weak_ptr<const void> &described = runs->array;
+  return static_array ? !described.owner_before(static_array) && !static_array.owner_before(described)
+                      : !described.owner_before(array) && !array.owner_before(described);
+}
+
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+bool TreeNode<Token, SuffixArray, ChildMapT>::LeafArray::find_first(Token t, size_t depth, Range &bounds) const {
+  if(!has_runs(depth))
+    return false;
+
+  size_t i = static_cast<size_t>(std::lower_bound(runs->vids.begin(), runs->vids.end(), t.vid) - runs->vids.begin());
+  if(i < runs->vids.size() && runs->vids[i] == t.vid)
+    bounds = Range{runs->starts[i], runs->starts[i + 1]};
+  else
+    bounds = Range{runs->starts[i], runs->starts[i]}; // not found: empty range at the insertion point
+  return true;
+}
+
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+void TreeNode<Token, SuffixArray, ChildMapT>::LeafArray::prefetch(size_t i) const {
+  if(delta)
+    return;
+  if(static_array)
+    __builtin_prefetch(static_array->data() + i);
+  else
+    __builtin_prefetch(array->data() + i);
+}
+
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+Range TreeNode<Token, SuffixArray, ChildMapT>::LeafArray::find_bounds(Corpus<Token> &corpus, Range prev_bounds, Token t, size_t depth) const {
+  Range bounds;
+  if(prev_bounds.begin == 0 && prev_bounds.end == size() && find_first(t, depth, bounds))
+    return bounds;
+  if(delta)
+    return sto::find_bounds(*delta, corpus, prev_bounds, t, depth);
+  if(static_array)
+    return sto::find_bounds(*static_array, corpus, prev_bounds, t, depth);
+  return sto::find_bounds(*array, corpus, prev_bounds, t, depth);
+}
+
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+void TreeNode<Token, SuffixArray, ChildMapT>::LeafArray::extension_counts(Corpus<Token> &corpus, Range bounds, size_t depth, std::vector<std::pair<Vid, size_t>> &counts) const {
+  if(delta)
+    sto::extension_counts(*delta, corpus, bounds, depth, counts);
+  else if(static_array)
+    sto::extension_counts(*static_array, corpus, bounds, depth, counts);
+  else
+    sto::extension_counts(*array, corpus, bounds, depth, counts);
+}
+
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+void TreeNode<Token, SuffixArray, ChildMapT>::child_counts(std::vector<std::pair<Vid, size_t>> &counts) {
+  // the children's sizes are the partial sums maintained in children_, no need to visit the leaves
+  EnsureChildren();
+  children_.Walk([&counts](Vid vid, TreeNode<Token, SuffixArray, ChildMapT> *child) {
+    counts.push_back(std::make_pair(vid, child->size()));
+  });
+}
+
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+typename TreeNode<Token, SuffixArray, ChildMapT>::LeafArray TreeNode<Token, SuffixArray, ChildMapT>::leaf_array() const {
+  // thread safety: obtain references first, check later -- avoids race with SplitNode().
+  LeafArray leaf = leaf_array_unchecked();
+  if(!is_leaf())
+    return LeafArray();
+  return leaf;
+}
+
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+typename TreeNode<Token, SuffixArray, ChildMapT>::LeafArray TreeNode<Token, SuffixArray, ChildMapT>::leaf_array_unchecked() const {
+  // check delta_ first: it carries its own base array, and a writer sets the merged array_ and releases
+  // static_array_ before releasing delta_. Then static_array_: a writer sets array_ before releasing static_array_.
+  LeafArray leaf;
+  leaf.delta = delta_;
+  if(!leaf.delta)
+    leaf.static_array = static_array_;
+  if(!leaf.delta && !leaf.static_array)
+    leaf.array = array_;
+  if(!leaf.delta && !leaf.static_array && !leaf.array)
+    leaf.static_array = static_array_; // remapped meanwhile: TreeNodeMemory::RemapLeaves() sets static_array_ before releasing array_
+  leaf.runs = runs();
+  return leaf;
+}
+
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+void TreeNode<Token, SuffixArray, ChildMapT>::BuildRuns(const Corpus<Token> &corpus, size_t depth) {
+  set_runs(MakeRuns(corpus, depth, leaf_array_unchecked()));
+}
+
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+void TreeNode<Token, SuffixArray, ChildMapT>::DeferRuns() {
+  std::atomic_store(&runs_, std::shared_ptr<const RunIndex>());
+  // release: after a reader sees the flag, it builds the RunIndex of an array at least as new as the dropped one's
+  runs_deferred_.store(true, std::memory_order_release);
+}
+
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+void TreeNode<Token, SuffixArray, ChildMapT>::EnsureRuns(const Corpus<Token> &corpus, size_t depth, LeafArray &leaf) {
+  if(leaf.delta || !runs_deferred_.load(std::memory_order_acquire))
+    return; // a delta is searched without a RunIndex anyway (and merging it rebuilds one)
+  bool deferred = true;
+  if(!runs_deferred_.compare_exchange_strong(deferred, false))
+    return; // built by a concurrent reader
+
+  // for the array which this reader holds: if a writer has replaced it meanwhile, this only misses a RunIndex
+  // for the new array (until its next rebuild), since find_first() ignores a RunIndex of another array
+  std::shared_ptr<const RunIndex> built = MakeRuns(corpus, depth, leaf);
+  std::shared_ptr<const RunIndex> expected = leaf.runs;
+  std::atomic_compare_exchange_strong(&runs_, &expected, built); // unless a writer has published a newer one
+  leaf.runs = built;
+}
+
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+std::shared_ptr<const typename TreeNode<Token, SuffixArray, ChildMapT>::RunIndex> TreeNode<Token, SuffixArray, ChildMapT>::MakeRuns(const Corpus<Token> &corpus, size_t depth, const LeafArray &leaf) {
+  if(leaf.delta || leaf.size() < kRunIndexMinSize)
+    return nullptr;
+
+  std::vector<std::pair<Vid, size_t>> counts;
+  if(leaf.static_array)
+    sto::extension_counts(*leaf.static_array, corpus, Range{0, leaf.size()}, depth, counts);
+  else
+    sto::extension_counts(*leaf.array, corpus, Range{0, leaf.size()}, depth, counts);
+  size_t ncounted = 0;
+  for(auto &c : counts)
+    ncounted += c.second;
+  if(counts.empty())
+    return nullptr; // e.g. a leaf of </s>, where all Positions end before 'depth'
+
+  std::shared_ptr<RunIndex> runs = std::make_shared<RunIndex>();
+  if(leaf.static_array)
+    runs->array = leaf.static_array;
+  else
+    runs->array = leaf.array;
+  runs->depth = depth;
+  runs->starts.push_back(leaf.size() - ncounted); // Positions ending before 'depth' sort first
+  for(auto &c : counts) {
+    runs->vids.push_back(c.first);
+    runs->starts.push_back(runs->starts.back() + c.second);
+  }
+  return runs;
+}
 
-  return bounds;
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+bool TreeNode<Token, SuffixArray, ChildMapT>::BufferPositions(const Corpus<Token> &corpus, const std::vector<Position<Token>> &positions, Range range) {
+  std::shared_ptr<SuffixArrayDisk<Token>> static_array = this->static_array_;
+  std::shared_ptr<SuffixArray> array = this->array_;
+  std::shared_ptr<DeltaArray> delta = this->delta_; // if set, its base is static_array or array
+
+  const SuffixArrayPosition<Token> *base = static_array ? static_array->data() : array->data();
+  size_t base_size = static_array ? static_array->size() : array->size();
+  size_t ndelta = delta ? delta->positions.size() : 0;
+  size_t nbuffered = ndelta + range.size();
+  if(nbuffered * nbuffered > base_size)
+    return false; // the buffer would be full, see TreeNodeMemory::AddPosition()
+
+  auto less = [&corpus](const Position<Token> &a, const Position<Token> &b) {
+    return suffix_less(corpus, a, b, /* skip = */ 0);
+  };
+
+  // linear merge with the current buffer. Equal suffixes keep the order of AddPosition() calls:
+  // base Positions first (upper_bound), then the buffered ones, then the new ones.
+  std::shared_ptr<DeltaArray> buffered = std::make_shared<DeltaArray>();
+  buffered->base = array;
+  buffered->static_base = static_array;
+  buffered->positions.reserve(nbuffered);
+  buffered->ranks.reserve(nbuffered);
+  size_t j = 0;
+  auto take_buffered = [&]() {
+    buffered->ranks.push_back(delta->ranks[j] - j + buffered->positions.size()); // same base Positions before it
+    buffered->positions.push_back(delta->positions[j]);
+    j++;
+  };
+  for(size_t i = range.begin; i < range.end; i++) {
+    const Position<Token> &pos = positions[i];
+    while(j < ndelta && !less(pos, delta->positions[j]))
+      take_buffered();
+    size_t nbase = static_cast<size_t>(std::upper_bound(base, base + base_size, pos, less) - base);
+    buffered->ranks.push_back(nbase + buffered->positions.size());
+    buffered->positions.push_back(pos);
+  }
+  while(j < ndelta)
+    take_buffered();
+
+  this->delta_ = buffered; // atomic replace
+  return true;
+}
+
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+std::shared_ptr<SuffixArrayMemory<Token>> TreeNode<Token, SuffixArray, ChildMapT>::MergedArray(const DeltaArray &delta) {
+  const SuffixArrayPosition<Token> *base = delta.static_base ? delta.static_base->data() : delta.base->data();
+  size_t base_size = delta.static_base ? delta.static_base->size() : delta.base->size();
+  if(delta.static_base) {
+    STO_STATS_ADD(kArrayCopies, 1);
+    STO_STATS_ADD(kArrayCopiedPositions, base_size);
+  }
+
+  std::shared_ptr<SuffixArrayMemory<Token>> merged = std::make_shared<SuffixArrayMemory<Token>>();
+  merged->reserve(delta.size());
+  size_t ibase = 0;
+  for(size_t j = 0; j < delta.positions.size(); j++) {
+    size_t nbase = delta.ranks[j] - j; // base Positions before positions[j]
+    merged->insert(merged->end(), base + ibase, base + nbase);
+    merged->push_back(delta.positions[j]);
+    ibase = nbase;
+  }
+  merged->insert(merged->end(), base + ibase, base + base_size);
+  return merged;
 }
 
-template<class Token, class SuffixArray>
-bool TreeNode<Token, SuffixArray>::find_child_(Vid vid, TreeNode<Token, SuffixArray> **child) {
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+Range TreeNode<Token, SuffixArray, ChildMapT>::find_bounds_array_(Corpus<Token> &corpus, Range prev_bounds, Token t, size_t depth) {
+  return leaf_array_unchecked().find_bounds(corpus, prev_bounds, t, depth);
+}
+
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+bool TreeNode<Token, SuffixArray, ChildMapT>::find_child_(Vid vid, TreeNode<Token, SuffixArray, ChildMapT> **child) {
+  EnsureChildren();
   return children_.Find(vid, child);
 }
 
-template<class Token, class SuffixArray>
-size_t TreeNode<Token, SuffixArray>::size() const {
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+size_t TreeNode<Token, SuffixArray, ChildMapT>::size() const {
   // thread safety: obtain reference first, check later, so we are sure to have a valid array -- avoids race with SplitNode()
-  std::shared_ptr<SuffixArray> array = array_;
+  LeafArray leaf = leaf_array_unchecked();
   if(is_leaf())
-    return array->size();
-  else
-    return children_.Size();
+    return leaf.size();
+  EnsureChildren();
+  return children_.Size();
 }
 
-template<class Token, class SuffixArray>
-Position<Token> TreeNode<Token, SuffixArray>::At(size_t sa_offset, size_t rel_offset) {
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+Position<Token> TreeNode<Token, SuffixArray, ChildMapT>::At(size_t sa_offset, size_t rel_offset) {
   // thread safety: obtain reference first, check later, so we are sure to have a valid array -- avoids race with SplitNode()
-  std::shared_ptr<SuffixArray> array = array_;
+  LeafArray leaf = leaf_array_unchecked();
+  STO_STATS_ADD(kAtTreeNodes, 1);
   if(is_leaf()) {
-    return (*array)[sa_offset + rel_offset];
+    return leaf[sa_offset + rel_offset];
   } else {
-    TreeNode<Token, SuffixArray> *child = children_.At(&rel_offset); // note: changes rel_offset
+    EnsureChildren();
+    TreeNode<Token, SuffixArray, ChildMapT> *child = children_.At(&rel_offset); // note: changes rel_offset
     assert(child != nullptr);
     return child->At(sa_offset, rel_offset);
   }
 }
 
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+void TreeNode<Token, SuffixArray, ChildMapT>::AtSorted(const size_t *ranks, size_t n, size_t base, Position<Token> *out) {
+  // thread safety: hold on to a consistent array, like At()
+  LeafArray leaf = leaf_array();
+  if(leaf) {
+    for(size_t i = 0; i < n; i++)
+      out[i] = leaf[ranks[i] - base];
+    return;
+  }
+
+  EnsureChildren();
+  size_t i = 0;
+  while(i < n) {
+    size_t rel_offset = ranks[i] - base;
+    TreeNode<Token, SuffixArray, ChildMapT> *child = children_.At(&rel_offset); // note: changes rel_offset
+    assert(child != nullptr);
+
+    // all following ranks within this child are resolved in the same descent
+    size_t child_base = ranks[i] - rel_offset;
+    size_t child_end = child_base + child->size();
+    size_t j = i + 1;
+    while(j < n && ranks[j] < child_end)
+      j++;
+    child->AtSorted(ranks + i, j - i, child_base, out + i);
+    i = j;
+  }
+}
+
 std::string nspaces(size_t n) {
   char buf[n+1];
   memset(buf, ' ', n); buf[n] = '\0';
   return std::string(buf);
 }
 
-template<class Token, class SuffixArray>
-void TreeNode<Token, SuffixArray>::DebugPrint(std::ostream &os, const Corpus<Token> &corpus, size_t depth) {
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT>
+void TreeNode<Token, SuffixArray, ChildMapT>::DebugPrint(std::ostream &os, const Corpus<Token> &corpus, size_t depth) {
   std::string spaces = nspaces(depth * 2);
   os << spaces << "TreeNode size=" << size() << " is_leaf=" << (is_leaf() ? "true" : "false") << std::endl;
 
   // for internal TreeNodes (is_leaf=false), these have children_ entries
-  children_.Walk([&corpus, &os, &spaces, depth](Vid vid, TreeNode<Token, SuffixArray> *e) {
+  if(!is_leaf())
+    EnsureChildren();
+  children_.Walk([&corpus, &os, &spaces, depth](Vid vid, TreeNode<Token, SuffixArray, ChildMapT> *e) {
     std::string surface = corpus.vocab()[Token{vid}];
     os << spaces << "* '" << surface << "' vid=" << static_cast<int>(vid) << std::endl;
     e->DebugPrint(os, corpus, depth + 1);
   });
 
   // for suffix arrays (is_leaf=true)
-  std::shared_ptr<SuffixArray> array = array_;
-  if(array != nullptr) {
-    for(Position<Token> p : *array) {
+  LeafArray leaf = leaf_array_unchecked();
+  if(leaf) {
+    for(size_t i = 0; i < leaf.size(); i++) {
+      Position<Token> p = leaf[i];
       os << spaces << "* [sid=" << static_cast<int>(p.sid) << " offset=" << static_cast<int>(p.offset) << "]" << std::endl;
     }
   }
@@ -136,6 +502,9 @@ void TreeNode<Token, SuffixArray>::DebugPrint(std::ostream &os, const Corpus<Tok
 // explicit template instantiation
 template class TreeNode<SrcToken, SuffixArrayMemory<SrcToken>>;
 template class TreeNode<TrgToken, SuffixArrayMemory<TrgToken>>;
+template class TreeNode<SmallSrcToken, SuffixArrayMemory<SmallSrcToken>>;
+template class TreeNode<SrcToken, SuffixArrayMemory<SrcToken>, FlatMap>;
+template class TreeNode<TrgToken, SuffixArrayMemory<TrgToken>, FlatMap>;
 
 template class TreeNode<SrcToken, SuffixArrayDisk<SrcToken>>;
 template class TreeNode<TrgToken, SuffixArrayDisk<TrgToken>>;
@@ -9,17 +9,22 @@
 
 #include <memory>
 #include <atomic>
+#include <utility>
+#include <vector>
 
 #include "Range.h"
 #include "Corpus.h"
 #include "util/rbtree.hpp"
+#include "util/flatmap.hpp"
 
 #include "SuffixArrayDisk.h"
+#include "SuffixArrayMemory.h"
 
 namespace sto {
 
 template<class Token> class IndexSpan;
-template<class Token> class TokenIndex;
+template<class Token, class TreeNodeT> class TokenIndex;
+template<class Token, template<typename, typename> class ChildMapT> class TreeNodeMemory;
 
 /**
  * A TreeNode belongs to a TokenIndex and represents a word and its possible
@@ -28,16 +33,82 @@ template<class Token> class TokenIndex;
  * Each leaf is implemented as a suffix array, which itself encodes part of
  * the tree (with potentially arbitrary depth). This helps to keep the RAM
  * size low.
+ *
+ * ChildMapT is the map type holding the children of internal TreeNodes along with their partial sums,
+ * either RBTree or the flat, read-optimized FlatMap.
  */
-template<class Token, class SuffixArray>
+template<class Token, class SuffixArray, template<typename, typename> class ChildMapT = RBTree>
 class TreeNode {
 public:
   typedef typename Corpus<Token>::Vid Vid;
   typedef typename Corpus<Token>::Offset Offset;
-  typedef RBTree<Vid, TreeNode<Token, SuffixArray> *> ChildMap;
+  typedef ChildMapT<Vid, TreeNode<Token, SuffixArray, ChildMapT> *> ChildMap;
   typedef SuffixArray SuffixArrayT;
 
-  ~TreeNode();
+  static_assert(sizeof(SuffixArrayPosition<Token>) == sizeof(typename Corpus<Token>::Sid) + sizeof(Offset),
+                "SuffixArrayPosition must be packed, for every Token type");
+
+  /**
+   * Sorted insert buffer of a leaf, on top of the leaf's immutable base array. Together they
+   * form a merged view, in which positions[j] is at index ranks[j]. Like published arrays, a published
+   * DeltaArray is never modified: an insert publishes a new one, and a full buffer is merged into a new base array.
+   * The base is either the in-memory array, or the read-only mapped array of a loaded leaf (which is not copied
+   * before the buffer is merged). In TreeNodeDisk, the base is the mapped leaf file, which is rewritten by a merge.
+   */
+  struct DeltaArray {
+    std::shared_ptr<SuffixArray> base; /** array which the ranks refer to, unless static_base is set */
+    std::shared_ptr<SuffixArrayDisk<Token>> static_base; /** if set, the mapped array which the ranks refer to */
+    std::vector<SuffixArrayPosition<Token>> positions; /** inserted Positions, sorted (packed, like SuffixArrayMemory) */
+    std::vector<size_t> ranks; /** strictly increasing: index of positions[j] in the merged view */
+
+    size_t size() const { return (static_base ? static_base->size() : base->size()) + positions.size(); }
+    /** O(log(positions.size())) without any corpus access */
+    Position<Token> operator[](size_t i) const;
+  };
+
+  /**
+   * First-token skip index of a leaf: the run of each distinct vid at the leaf's depth within one specific
+   * suffix array version. Lets the first narrow() into a large leaf find its bounds without any corpus access.
+   * Once the array is replaced (e.g. by an insert), the RunIndex does not match anymore and is ignored, until
+   * it is rebuilt for the new array. A leaf with a non-empty insert buffer (DeltaArray) does not use it.
+   */
+  struct RunIndex {
+    std::weak_ptr<const void> array; /** the array described: compared by owner, so a new array never matches */
+    size_t depth; /** distance of the leaf from the root, i.e. the lookup sequence length it is entered with */
+    std::vector<Vid> vids; /** ascending */
+    std::vector<size_t> starts; /** the run of vids[i] is [starts[i], starts[i+1]) */
+  };
+
+  /**
+   * Consistent view of the suffix array of a leaf. Writers replace published arrays instead of modifying them,
+   * so a LeafArray stays valid and unchanged while it is held, even across inserts into and splits of the leaf.
+   */
+  struct LeafArray {
+    std::shared_ptr<DeltaArray> delta; /** if set, it is used instead of static_array and array */
+    std::shared_ptr<SuffixArrayDisk<Token>> static_array; /** if set, it is used instead of array */
+    std::shared_ptr<SuffixArray> array;
+    std::shared_ptr<const RunIndex> runs; /** may describe an older array, see find_first() */
+
+    explicit operator bool() const { return delta || static_array || array; }
+    size_t size() const;
+    Position<Token> operator[](size_t i) const;
+    /** find the bounds of an existing Token or insertion point of a new one, like TreeNode::find_bounds_array_() */
+    Range find_bounds(Corpus<Token> &corpus, Range prev_bounds, Token t, size_t depth) const;
+    /** if 'runs' describes this array at 'depth', set 'bounds' of t within the full array by a table lookup */
+    bool find_first(Token t, size_t depth, Range &bounds) const;
+    /** true if 'runs' describes this array at 'depth' */
+    bool has_runs(size_t depth) const;
+    /** hint that operator[](i) will be read soon (not for a delta, whose index mapping needs the lookup itself) */
+    void prefetch(size_t i) const;
+    /** append (vid, count) of each distinct vid at 'depth' within 'bounds' to 'counts', in ascending vid order */
+    void extension_counts(Corpus<Token> &corpus, Range bounds, size_t depth, std::vector<std::pair<Vid, size_t>> &counts) const;
+  };
+
+  /** virtual: children are deleted through TreeNode pointers, and e.g. TreeNodeDisk has members of its own. */
+  virtual ~TreeNode();
+
+  /** @return the current suffix array of this leaf, or an empty LeafArray if this is not a leaf (anymore). */
+  LeafArray leaf_array() const;
 
   /** true if this is a leaf, i.e. a suffix array. */
   bool is_leaf() const { return is_leaf_.load(); }
@@ -51,6 +122,12 @@ public:
    */
   Position<Token> At(size_t abs_offset, size_t rel_offset);
 
+  /**
+   * Access to 'n' positions at ascending 'ranks' (relative to this TreeNode plus 'base') at once, into out[0..n).
+   * Visits each TreeNode on the way at most once, with a single child lookup per distinct child.
+   */
+  void AtSorted(const size_t *ranks, size_t n, size_t base, Position<Token> *out);
+
   void DebugPrint(std::ostream &os, const Corpus<Token> &corpus, size_t depth = 0);
 
   /**
@@ -79,12 +156,77 @@ public:
   Range find_bounds_array_(Corpus<Token> &corpus, Range prev_bounds, Token t, size_t depth);
 
   /** @return true if child with 'vid' as the key was found, and optionally sets 'child'. */
-  bool find_child_(Vid vid, TreeNode<Token, SuffixArray> **child = nullptr);
+  bool find_child_(Vid vid, TreeNode<Token, SuffixArray, ChildMapT> **child = nullptr);
+
+  /** append (vid, size) of each child of this internal TreeNode to 'counts', in ascending vid order */
+  void child_counts(std::vector<std::pair<Vid, size_t>> &counts);
+
+  /**
+   * Leaf only: before the first narrow() into 'leaf' (a view of this leaf, entered at 'depth'), build its RunIndex
+   * if it was deferred (see DeferRuns()), and set it in 'leaf'. Free unless deferred, and built only once.
+   */
+  void EnsureRuns(const Corpus<Token> &corpus, size_t depth, LeafArray &leaf);
 
 protected:
   std::atomic<bool> is_leaf_; /** whether this is a suffix array (leaf node) */
+  std::atomic<bool> children_loaded_; /** false while the children_ of an internal TreeNodeDisk are not loaded yet, see EnsureChildren() */
   ChildMap children_; /** TreeNode children, empty if is_leaf. Additionally carries along partial sums for child sizes. */
   std::shared_ptr<SuffixArray> array_; /** suffix array, only if is_leaf */
+  std::shared_ptr<SuffixArrayDisk<Token>> static_array_; /** read-only memory mapped suffix array, if set it is used instead of array_ (TreeNodeMemory: until its insert buffer is merged into array_) */
+  std::shared_ptr<DeltaArray> delta_; /** insert buffer over static_array_ or array_, if set it is used instead of both */
+
+  std::shared_ptr<const RunIndex> runs_; /** skip index of the current array, if built, see BuildRuns(). Only via runs() and set_runs(). */
+  std::atomic<bool> runs_deferred_; /** the current array has no RunIndex yet, see DeferRuns() */
+
+  /** leaves with fewer positions get no RunIndex: their first find_bounds() is only a few probes anyway */
+  static constexpr size_t kRunIndexMinSize = 256;
+
+  /**
+   * Make children_ of this internal TreeNode readable. TreeNodeDisk loads its subtree lazily: the children of
+   * an internal node are only loaded on first access, see LoadChildren(). No-op once loaded (and for TreeNodeMemory).
+   */
+  void EnsureChildren() const {
+    if(!children_loaded_.load(std::memory_order_acquire))
+      const_cast<TreeNode<Token, SuffixArray, ChildMapT> *>(this)->LoadChildren();
+  }
+
+  /** load children_ and set children_loaded_ (once, even if called concurrently). Only called by EnsureChildren(). */
+  virtual void LoadChildren() {}
+
+  /** @return the current view of this leaf, without checking is_leaf(). See leaf_array(). */
+  LeafArray leaf_array_unchecked() const;
+
+  /**
+   * build the RunIndex of the current array of this leaf at 'depth', if it is large enough (not for a delta).
+   * Called whenever a leaf gets a new base array: by splits, bulk builds and merges of the insert buffer.
+   */
+  void BuildRuns(const Corpus<Token> &corpus, size_t depth);
+
+  /**
+   * Drop the RunIndex, and let the first narrow() into the current array build it, see EnsureRuns(). For leaves
+   * which are only loaded (opening an index, remapping), so that this costs no corpus access until they are used.
+   */
+  void DeferRuns();
+
+  /** thread safety: readers also publish a RunIndex, see EnsureRuns(), so runs_ is accessed atomically */
+  std::shared_ptr<const RunIndex> runs() const { return std::atomic_load(&runs_); }
+  /** replace the RunIndex of the current array, e.g. nullptr to drop it without deferring */
+  void set_runs(std::shared_ptr<const RunIndex> runs) {
+    runs_deferred_.store(false);
+    std::atomic_store(&runs_, runs);
+  }
+
+  /** @return the RunIndex of 'leaf' at 'depth', or nullptr if it is too small, a delta, or all Positions end before 'depth' */
+  static std::shared_ptr<const RunIndex> MakeRuns(const Corpus<Token> &corpus, size_t depth, const LeafArray &leaf);
+
+  /**
+   * Leaf only: insert the sorted 'range' of 'positions' into the insert buffer delta_, in a single linear merge with it.
+   * @return false without any change, if the buffer would grow beyond sqrt(n) (see TreeNodeMemory::AddPosition())
+   */
+  bool BufferPositions(const Corpus<Token> &corpus, const std::vector<Position<Token>> &positions, Range range);
+
+  /** @return the merged view of 'delta' as a single array, in one linear pass */
+  static std::shared_ptr<SuffixArrayMemory<Token>> MergedArray(const DeltaArray &delta);
 
   /**
    * maximum size of suffix array leaf, larger sizes are split up into TreeNodes.
@@ -7,34 +7,169 @@
 #include "TreeNodeDisk.h"
 #include "SuffixArrayMemory.h"
 #include "TokenIndex.h"
+#include "util/fsync.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <exception>
 #include <sstream>
 #include <iomanip>
 #include <cstdio>
 #include <array>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
 
 #include <boost/filesystem.hpp>
 
 namespace sto {
 
+/** entry of a manifest file, see TreeNodeDisk::LoadChildren() */
+template<class Vid>
+struct __attribute__((packed)) ManifestEntry {
+  Vid vid;
+  uint64_t size; /** number of Positions in the child's subtree */
+};
+
 template<class Token>
-TreeNodeDisk<Token>::TreeNodeDisk(std::string path, size_t maxArraySize) :
-    TreeNode<Token, SuffixArrayDisk<Token>>(maxArraySize), path_(path)
+TreeNodeDisk<Token>::TreeNodeDisk(std::string path, size_t maxArraySize, const MapOptions &options) :
+    TreeNode<Token, SuffixArrayDisk<Token>>(maxArraySize), path_(path), map_options_(options), tree_(std::make_shared<Tree>())
 {
+  if(path.empty())
+    throw std::runtime_error("TreeNodeDisk requires a backing directory path");
+
+  // without the root's manifest, the index was not closed cleanly (or is new, or older): load it eagerly
+  tree_->root = this;
+  tree_->manifest = manifest_path();
+  tree_->lazy = boost::filesystem::exists(manifest_path().c_str());
+  tree_->dirty = !tree_->lazy;
+  Open();
+}
+
+template<class Token>
+TreeNodeDisk<Token>::TreeNodeDisk(const std::string &path, const TreeNodeDisk<Token> &parent) :
+    TreeNode<Token, SuffixArrayDisk<Token>>(parent.kMaxArraySize), path_(path), map_options_(parent.map_options_), tree_(parent.tree_)
+{
+  Open();
+}
+
+template<class Token>
+void TreeNodeDisk<Token>::Open() {
   using namespace boost::filesystem;
 
   /*
-   * if path exists: recursively load the subtree rooted at this path.
+   * if path exists: load the subtree rooted at this path.
    * if path does not exist: create an empty leaf node here.
    */
-  if(exists(path.c_str())) {
+  if(exists(path_.c_str())) {
     this->is_leaf_ = exists(array_path().c_str());
+    if(this->is_leaf()) {
+      this->array_.reset(new SuffixArrayDisk<Token>(array_path(), map_options_));
+      this->DeferRuns(); // opening an index does not read the corpus, see EnsureRuns()
+    } else {
+      this->children_loaded_ = false;
+      if(!tree_->lazy)
+        LoadChildren();
+    }
   } else {
-    create_directories(path.c_str());
-    ofstream(array_path().c_str()); // create empty suffix array
+    // e.g. for a new child: its directory and array must be persistent before the parent's split removes its own array
+    std::vector<std::string> created; // deepest first
+    for(boost::filesystem::path dir(path_); !dir.empty() && !exists(dir); dir = dir.parent_path())
+      created.push_back(dir.string());
+    create_directories(path_.c_str());
     this->is_leaf_ = true;
+    WriteArray(SuffixArrayMemory<Token>(), Range{0, 0}); // create empty suffix array
+    for(const std::string &dir : created)
+      sync_dir(dir); // the entry of a new directory in its parent
   }
-  this->array_.reset(new SuffixArrayDisk<Token>(array_path()));
+}
+
+template<class Token>
+TreeNodeDisk<Token>::~TreeNodeDisk() {
+  // destructors must not throw: buffered Positions (or manifests) are lost, like after a crash
+  try {
+    if(tree_->root == this)
+      FinishSplits();
+    else
+      WriteBuffer();
+  } catch(const std::exception &) {
+  }
+  if(tree_->root == this)
+    tree_->root = nullptr; // the children are deleted after us
+}
+
+template<class Token>
+void TreeNodeDisk<Token>::LoadChildren() {
+  using namespace boost::filesystem;
+  constexpr size_t kVidDigits = sizeof(Vid)*2;
+
+  std::lock_guard<std::mutex> lock(load_mutex_);
+  if(this->children_loaded_.load(std::memory_order_acquire))
+    return; // loaded by a concurrent caller
+
+  std::vector<Vid> vids;
+  std::vector<TreeNode<Token, SuffixArray> *> children;
+  std::vector<size_t> sizes;
+  try {
+    if(tree_->lazy) {
+      // manifest: the vids and sizes of all children, in ascending vid order
+      std::ifstream manifest(manifest_path().c_str(), std::ios::binary);
+      ManifestEntry<Vid> entry;
+      while(manifest.read(reinterpret_cast<char *>(&entry), sizeof(entry))) {
+        if(!vids.empty() && entry.vid <= vids.back())
+          throw std::runtime_error(std::string("failed to load unsorted manifest ") + manifest_path());
+        TreeNodeDisk<Token> *child = new TreeNodeDisk<Token>(child_path(entry.vid), *this);
+        children.push_back(child);
+        vids.push_back(entry.vid);
+        sizes.push_back(entry.size);
+        // leaves are mapped right away (and internal children are checked when loading their own manifest)
+        if(child->is_leaf() && child->size() != entry.size)
+          throw std::runtime_error(std::string("failed to load manifest which does not match its leaves ") + manifest_path());
+      }
+      if(!manifest.eof() || manifest.gcount() != 0 || vids.empty())
+        throw std::runtime_error(std::string("failed to read manifest ") + manifest_path());
+    } else {
+      // e.g. "000007a/0007a120" (dir1/dir2), see child_sub_path()
+      for(directory_iterator dir1(path_), end; dir1 != end; ++dir1) {
+        if(!is_directory(dir1->status()))
+          continue;
+        for(directory_iterator dir2(dir1->path()); dir2 != end; ++dir2) {
+          std::string name = dir2->path().filename().string();
+          if(!is_directory(dir2->status()) || name.size() != kVidDigits || name.find_first_not_of("0123456789abcdef") != std::string::npos)
+            continue;
+          TreeNodeDisk<Token> *child = new TreeNodeDisk<Token>(dir2->path().string(), *this);
+          children.push_back(child);
+          vids.push_back(static_cast<Vid>(std::stoul(name, nullptr, 16)));
+          sizes.push_back(child->size());
+        }
+      }
+      // directory order is unspecified
+      std::vector<size_t> order(vids.size());
+      for(size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+      std::sort(order.begin(), order.end(), [&vids](size_t a, size_t b) { return vids[a] < vids[b]; });
+      std::vector<Vid> sorted_vids;
+      std::vector<TreeNode<Token, SuffixArray> *> sorted_children;
+      std::vector<size_t> sorted_sizes;
+      for(size_t i : order) {
+        sorted_vids.push_back(vids[i]);
+        sorted_children.push_back(children[i]);
+        sorted_sizes.push_back(sizes[i]);
+      }
+      vids.swap(sorted_vids);
+      children.swap(sorted_children);
+      sizes.swap(sorted_sizes);
+    }
+  } catch(...) {
+    for(TreeNode<Token, SuffixArray> *child : children)
+      delete child;
+    throw;
+  }
+
+  this->children_.BuildSorted(vids, children, sizes);
+
+  // release: ensure prior writes to children_ get flushed before the atomic operation
+  this->children_loaded_.store(true, std::memory_order_release);
 }
 
 template<class Token>
@@ -43,55 +178,341 @@ bool TreeNodeDisk<Token>::find_child_(Vid vid, TreeNodeDisk<Token> **child) {
 }
 
 template<class Token>
-void TreeNodeDisk<Token>::Merge(typename TokenIndex<Token>::Span &curSpan, typename TokenIndex<Token>::Span &addSpan) {
-  size_t addSize = addSpan.size();
-  size_t curSize = this->array_->size();
-  size_t newSize = curSize + addSize;
-  size_t icur = 0, iadd = 0;
+TreeNodeDisk<Token> *TreeNodeDisk<Token>::NewChild(Vid vid) {
+  // below a leaf, sub-directories can only be left over from an interrupted split
+  boost::filesystem::remove_all(child_path(vid).c_str());
+  return new TreeNodeDisk<Token>(child_path(vid), *this);
+}
+
+template<class Token>
+void TreeNodeDisk<Token>::AddLeaf(Vid vid) {
+  this->EnsureChildren();
+  this->children_[vid] = NewChild(vid);
+}
 
-  assert(this->array_->size() == curSpan.size()); // curSpan should be a full span
-  // TODO: assert: (span over the same vid) -> each Position (at depth) should have the same vid.
+template<class Token>
+void TreeNodeDisk<Token>::AddPosition(const Sentence<Token> &sent, Offset start, size_t depth) {
+  assert(this->is_leaf()); // Exclusively for adding to a SA (leaf node).
+
+  std::vector<Position<Token>> positions{Position<Token>{sent.sid(), start}};
+  // disallow splits of </s>, see TreeNodeMemory::AddPosition()
+  bool allow_split = sent.size() + 1 > start + depth; // +1 for implicit </s>
+  MergePositions(sent.corpus(), positions, Range{0, 1}, depth, allow_split);
+}
 
-  SuffixArrayPosition<Token> *newArray = new SuffixArrayPosition<Token>[newSize];
-  SuffixArrayPosition<Token> *pnew = newArray;
-  Corpus<Token> &corpus = *curSpan.corpus();
+template<class Token>
+void TreeNodeDisk<Token>::AddPositions(const Corpus<Token> &corpus, std::vector<Position<Token>> &positions) {
+  // sort once. stable: equal suffixes stay in insertion order, like repeated AddPosition() calls would order them.
+  std::stable_sort(positions.begin(), positions.end(), [&corpus](const Position<Token> &a, const Position<Token> &b) {
+    return suffix_less(corpus, a, b, /* skip = */ 0);
+  });
+  MergePositions(corpus, positions, Range{0, positions.size()}, /* depth = */ 0, /* allow_split = */ true);
+}
+
+template<class Token>
+void TreeNodeDisk<Token>::Merge(typename TokenIndex<Token, TreeNodeMemory<Token, RBTree>>::Span &addSpan) {
+  // spans are sorted like our leaves, so the Positions can be merged right away
+  std::vector<Position<Token>> positions;
+  positions.reserve(addSpan.size());
+  for(size_t i = 0; i < addSpan.size(); i++)
+    positions.push_back(addSpan[i]);
+
+  const std::vector<Token> &sequence = addSpan.sequence();
+  bool allow_split = sequence.empty() || sequence.back().vid != Corpus<Token>::Vocabulary::kEOS;
+  MergePositions(*addSpan.corpus(), positions, Range{0, positions.size()}, addSpan.depth(), allow_split);
+}
 
-  Position<Token> cur = (curSize > 0) ? curSpan[icur++] : Position<Token>();
-  Position<Token> add = addSpan[iadd++];
-  while(icur < curSize && iadd < addSize) {
-    // assuming that curSpan is much larger, this loop will be most active
-    while(cur.compare(add, corpus) && icur < curSize) {
-      *pnew++ = cur;
-      cur = curSpan[icur++];
+template<class Token>
+void TreeNodeDisk<Token>::MergePositions(const Corpus<Token> &corpus, const std::vector<Position<Token>> &positions, Range range, size_t depth, bool allow_split) {
+  if(range.size() == 0)
+    return;
+
+  if(this->is_leaf()) {
+    // a few Positions into a large leaf go into its insert buffer, instead of rewriting the leaf file
+    bool fits = !allow_split || this->size() + range.size() <= this->kMaxArraySize;
+    if(fits && this->BufferPositions(corpus, positions, range))
+      return;
+
+    std::shared_ptr<DeltaArray> delta = this->delta_;
+    std::shared_ptr<SuffixArrayMemory<Token>> merged = delta ? merge_array(corpus, *delta, positions, range)
+                                                             : merge_array(corpus, *this->array_, positions, range);
+    BuildSubtree(corpus, *merged, Range{0, merged->size()}, depth, allow_split);
+    return;
+  }
+
+  // internal TreeNode: the sorted range consists of runs of equal vids at 'depth', one for each child.
+  // Positions reaching an internal TreeNode are long enough (the </s> leaf is never split).
+  auto vid_at = [&corpus, &positions, depth](size_t i) {
+    return corpus.sentence(positions[i].sid)[positions[i].offset + depth].vid;
+  };
+  size_t begin = range.begin;
+  while(begin < range.end) {
+    Vid vid = vid_at(begin);
+    size_t end = begin + 1;
+    while(end < range.end && vid_at(end) == vid)
+      end++;
+
+    TreeNodeDisk<Token> *child = nullptr;
+    if(!find_child_(vid, &child)) {
+      AddLeaf(vid);
+      find_child_(vid, &child);
     }
-    *pnew++ = add;
-    add = addSpan[iadd++];
+    child->MergePositions(corpus, positions, Range{begin, end}, depth + 1, /* allow_split = */ vid != Corpus<Token>::Vocabulary::kEOS);
+
+    // add sizes after the child, so that readers will see a valid state (children being at least as big as they should be)
+    this->AddSize(vid, end - begin);
+
+    begin = end;
   }
-  // fill from the side that still has remaining positions
-  while(icur < curSize) {
-    *pnew++ = cur;
-    cur = curSpan[icur++];
+}
+
+template<class Token>
+void TreeNodeDisk<Token>::BuildSubtree(const Corpus<Token> &corpus, const SuffixArrayMemory<Token> &array, Range range, size_t depth, bool allow_split) {
+  assert(this->is_leaf());
+
+  if(range.size() <= this->kMaxArraySize || !allow_split) {
+    WriteArray(array, range);
+    if(allow_split)
+      this->BuildRuns(corpus, depth); // not for </s>: its Positions end before 'depth'
+    else
+      this->set_runs(nullptr);
+    return;
   }
-  while(iadd < addSize) {
-    *pnew++ = add;
-    add = addSpan[iadd++];
+
+  // vid at 'depth' of array[i]. Positions in a leaf extend at least up to the implicit </s> at its depth.
+  auto vid_at = [&corpus, &array, depth](size_t i) {
+    Position<Token> pos = array[i];
+    typename Corpus<Token>::Tokens tokens = corpus.tokens(pos.sid);
+    size_t v = pos.offset + depth;
+    return (v == tokens.size()) ? static_cast<Vid>(Corpus<Token>::Vocabulary::kEOS) : tokens[v];
+  };
+
+  // thread safety: we build the children while is_leaf_ == true, so children_ is not accessed while being modified
+  size_t begin = range.begin;
+  while(begin < range.end) {
+    Vid vid = vid_at(begin);
+    size_t end = begin + 1;
+    while(end < range.end && vid_at(end) == vid)
+      end++;
+
+    TreeNodeDisk<Token> *child = NewChild(vid);
+    child->BuildSubtree(corpus, array, Range{begin, end}, depth + 1, /* allow_split = */ vid != Corpus<Token>::Vocabulary::kEOS);
+    this->children_.FindOrInsert(vid, /* add_size = */ end - begin) = child;
+
+    begin = end;
   }
 
-  // TODO: check if split is necessary, and perform split.
+  // release: ensure prior writes to children_ get flushed before the atomic operation
+  this->is_leaf_.store(false, std::memory_order_release);
+
+  // commit the split on disk: without 'array', this directory is an internal TreeNode
+  boost::filesystem::remove(array_path().c_str());
+  sync_dir(array_path());
+  this->array_.reset();
+  this->delta_.reset();
+  this->set_runs(nullptr);
+}
+
+template<class Token>
+void TreeNodeDisk<Token>::WriteFile(const std::string &filename, const void *data, size_t size) {
+  // write to a temp file first
+  std::string filename_tmp = filename + ".tmp";
+  FILE *tmp = fopen(filename_tmp.c_str(), "wb");
+  if(!tmp)
+    throw std::runtime_error(std::string("failed to open tmp file for write at ") + filename_tmp);
+  bool ok = size == 0 || fwrite(data, 1, size, tmp) == size;
+  ok = ok && fflush(tmp) == 0 && fsync(fileno(tmp)) == 0;
+  if(fclose(tmp) != 0 || !ok)
+    throw std::runtime_error(std::string("failed to write ") + filename_tmp);
+
+  // move temp file over 'filename' durably. Existing mappings of the old file stay valid.
+  boost::filesystem::rename(filename_tmp.c_str(), filename.c_str());
+  sync_dir(filename);
+}
+
+template<class Token>
+void TreeNodeDisk<Token>::MarkDirty() {
+  if(tree_->dirty)
+    return;
+  boost::filesystem::remove(tree_->manifest.c_str());
+  sync_dir(tree_->manifest);
+  tree_->dirty = true;
+}
 
-  // write newArray to a temp file first
-  std::string array_tmp = array_path() + ".tmp";
-  FILE *tmp = fopen(array_tmp.c_str(), "wb");
-  if(!tmp) {
-    delete[] newArray;
-    throw std::runtime_error(std::string("failed to open array.tmp file for write at ") + array_tmp);
+template<class Token>
+void TreeNodeDisk<Token>::WriteArray(const SuffixArrayMemory<Token> &array, Range range) {
+  MarkDirty();
+  WriteFile(array_path(), array.data() + range.begin, range.size() * sizeof(SuffixArrayPosition<Token>));
+
+  // thread safety: atomic replace. Readers holding the old array keep its mapping alive.
+  // Readers check delta_ first, so the new array must be valid before the insert buffer (if any) is released.
+  this->array_ = std::make_shared<SuffixArrayDisk<Token>>(array_path(), map_options_);
+  this->delta_.reset();
+}
+
+template<class Token>
+void TreeNodeDisk<Token>::WriteBuffer() {
+  std::shared_ptr<DeltaArray> delta = this->delta_;
+  if(!this->is_leaf() || !delta)
+    return;
+  std::shared_ptr<SuffixArrayMemory<Token>> merged = this->MergedArray(*delta);
+  WriteArray(*merged, Range{0, merged->size()});
+  this->DeferRuns(); // no Corpus here: built by the first narrow() into the new array
+}
+
+template<class Token>
+void TreeNodeDisk<Token>::FinishSplits() {
+  WriteBuffers();
+  if(tree_->dirty && tree_->root == this && !this->is_leaf()) {
+    WriteManifests(); // the root's last: it marks all of them valid
+    tree_->dirty = false;
+  }
+}
+
+template<class Token>
+void TreeNodeDisk<Token>::WriteBuffers() {
+  if(this->is_leaf()) {
+    WriteBuffer();
+    return;
   }
-  fwrite(newArray, sizeof(SuffixArrayPosition<Token>), newSize, tmp);
-  fclose(tmp);
-  delete[] newArray;
+  if(!this->children_loaded_.load(std::memory_order_acquire))
+    return; // nothing was inserted below
+  this->children_.Walk([](Vid vid, TreeNode<Token, SuffixArray> *child) {
+    (void) vid;
+    static_cast<TreeNodeDisk<Token> *>(child)->WriteBuffers();
+  });
+}
+
+template<class Token>
+void TreeNodeDisk<Token>::WriteManifests() {
+  // subtrees which were not loaded are unchanged, so their manifests are still valid
+  if(this->is_leaf() || !this->children_loaded_.load(std::memory_order_acquire))
+    return;
+
+  std::vector<ManifestEntry<Vid>> manifest;
+  this->children_.Walk([this, &manifest](Vid vid, TreeNode<Token, SuffixArray> *child) {
+    static_cast<TreeNodeDisk<Token> *>(child)->WriteManifests();
+    manifest.push_back(ManifestEntry<Vid>{vid, this->children_.ChildSize(vid)});
+  });
+  WriteFile(manifest_path(), manifest.data(), manifest.size() * sizeof(ManifestEntry<Vid>));
+}
+
+template<class Token>
+void TreeNodeDisk<Token>::BuildIndex(const Corpus<Token> &corpus, size_t nthreads) {
+  typedef typename Corpus<Token>::Sid Sid;
+  typedef std::vector<Position<Token>> Bucket;
+
+  assert(this->is_leaf() && this->size() == 0); // this method works only on an empty root
+  if(nthreads == 0)
+    nthreads = std::max<size_t>(1, std::thread::hardware_concurrency());
+
+  // partition all suffixes by their first vid, see TreeNodeMemory::BuildIndex()
+  std::vector<size_t> counts;
+  for(Sid sid = 0; sid < corpus.size(); sid++) {
+    typename Corpus<Token>::Tokens tokens = corpus.tokens(sid);
+    for(size_t i = 0; i < tokens.size(); i++) {
+      Vid v = tokens[i];
+      if(v >= counts.size())
+        counts.resize(v + 1, 0);
+      counts[v]++;
+    }
+  }
+  std::vector<std::shared_ptr<Bucket>> buckets(counts.size());
+  std::vector<Vid> vids;
+  size_t total = 0;
+  for(Vid vid = 0; vid < counts.size(); vid++) {
+    if(counts[vid] == 0)
+      continue;
+    buckets[vid] = std::make_shared<Bucket>();
+    buckets[vid]->reserve(counts[vid]);
+    vids.push_back(vid);
+    total += counts[vid];
+  }
+  for(Sid sid = 0; sid < corpus.size(); sid++) {
+    typename Corpus<Token>::Tokens tokens = corpus.tokens(sid);
+    for(size_t i = 0; i < tokens.size(); i++)
+      buckets[tokens[i]]->push_back(Position<Token>{sid, static_cast<Offset>(i)});
+  }
+
+  // within a bucket, the first token is equal. Equal suffixes are ordered by sid, like AddSentence() would insert them.
+  auto less = [&corpus](const Position<Token> &a, const Position<Token> &b) {
+    if(suffix_less(corpus, a, b, /* skip = */ 1))
+      return true;
+    if(suffix_less(corpus, b, a, /* skip = */ 1))
+      return false;
+    return a.sid < b.sid;
+  };
+
+  std::vector<TreeNode<Token, SuffixArray> *> children(vids.size(), nullptr);
+  std::vector<size_t> sizes(vids.size());
+
+  // largest buckets first, for load balancing
+  std::vector<size_t> order(vids.size());
+  for(size_t i = 0; i < order.size(); i++)
+    order[i] = i;
+  std::sort(order.begin(), order.end(), [&vids, &counts](size_t a, size_t b) { return counts[vids[a]] > counts[vids[b]]; });
+
+  // each worker writes the subtrees of its buckets into their own child directories
+  std::atomic<size_t> next(0);
+  std::vector<std::exception_ptr> errors(nthreads);
+  bool build_children = total > this->kMaxArraySize;
+  auto worker = [&](size_t ithread) {
+    try {
+      size_t i;
+      while((i = next.fetch_add(1)) < order.size()) {
+        size_t ichild = order[i];
+        std::shared_ptr<Bucket> &bucket = buckets[vids[ichild]];
+        std::sort(bucket->begin(), bucket->end(), less);
+        sizes[ichild] = bucket->size();
+        if(build_children) {
+          SuffixArrayMemory<Token> array(bucket->begin(), bucket->end());
+          bucket.reset(); // free memory early
+          TreeNodeDisk<Token> *child = NewChild(vids[ichild]);
+          children[ichild] = child;
+          child->BuildSubtree(corpus, array, Range{0, array.size()}, /* depth = */ 1, /* allow_split = */ vids[ichild] != Corpus<Token>::Vocabulary::kEOS);
+        }
+      }
+    } catch(...) {
+      errors[ithread] = std::current_exception();
+      next = order.size(); // stop the other workers
+    }
+  };
+  std::vector<std::thread> threads;
+  for(size_t i = 0; i < nthreads; i++)
+    threads.push_back(std::thread(worker, i));
+  for(auto &thread : threads)
+    thread.join();
+
+  for(const std::exception_ptr &error : errors) {
+    if(!error)
+      continue;
+    // this root stays an empty leaf. Child directories left behind are replaced by the next split, see NewChild().
+    for(TreeNode<Token, SuffixArray> *child : children)
+      delete child;
+    std::rethrow_exception(error);
+  }
+
+  if(!build_children) {
+    // small index: a single leaf, concatenating the sorted buckets in vid order
+    SuffixArrayMemory<Token> array;
+    array.reserve(total);
+    for(Vid vid : vids)
+      array.insert(array.end(), buckets[vid]->begin(), buckets[vid]->end());
+    WriteArray(array, Range{0, array.size()});
+    this->BuildRuns(corpus, /* depth = */ 0);
+    return;
+  }
+
+  this->children_.BuildSorted(vids, children, sizes);
+
+  // release: ensure prior writes to children_ get flushed before the atomic operation
+  this->is_leaf_.store(false, std::memory_order_release);
 
-  // move temp file to array
-  boost::filesystem::rename(array_tmp.c_str(), array_path().c_str());
+  // commit on disk: without 'array', the root directory is an internal TreeNode
+  boost::filesystem::remove(array_path().c_str());
+  sync_dir(array_path());
+  this->array_.reset();
+  this->set_runs(nullptr);
 }
 
 template<class Token>
@@ -7,10 +7,16 @@
 #ifndef STO_DISKTREENODE_H
 #define STO_DISKTREENODE_H
 
+#include <memory>
+#include <mutex>
+#include <vector>
+
 #include "TreeNode.h"
 #include "SuffixArrayDisk.h"
+#include "SuffixArrayMemory.h"
 
 class TokenIndexTests_TreeNodeDisk_Test;
+class TokenIndexTests_disk_lazy_open_Test;
 
 namespace sto {
 
@@ -18,10 +24,30 @@ namespace sto {
  * Like TreeNode, an internal representation used by TokenIndex,
  * represents a word and its possible suffix extensions.
  *
- * Geared towards a disk-based hybrid suffix tree/array.
+ * Geared towards a disk-based hybrid suffix tree/array, for use as TokenIndex<Token, TreeNodeDisk<Token>>.
+ *
+ * The tree part is stored as an open directory structure in the filesystem itself: each TreeNode is a directory,
+ * with its children in nested sub-directories (see child_sub_path()). Leaves (suffix array chunks) are
+ * the file 'array' in their directory, consisting entirely of SuffixArrayPositions, which is memory mapped.
+ * The presence of 'array' marks a leaf.
+ *
+ * All writes replace an entire 'array' file atomically: it is written to a temporary file first, which is fsync()ed
+ * and then renamed over the old one, and the directory is fsync()ed after each change of its entries. Readers keep
+ * the old mapping until they are done. A split writes all new child leaves before removing the parent's 'array',
+ * so a crash in between leaves the unsplit leaf intact.
  *
- * The tree part is currently stored as an open directory structure in the filesystem itself.
- * Leaves (suffix array chunks) can be memory mapped.
+ * Like in TreeNodeMemory, a few inserted Positions go into the leaf's insert buffer (DeltaArray, over the mapped
+ * leaf file), which is merged into a rewritten leaf file once it holds more than sqrt(n) Positions. Buffered
+ * Positions are only persistent after FinishSplits(), which is also called by the destructor.
+ *
+ * Subtrees are loaded lazily, so that opening even a huge index only maps the root: the children of an internal
+ * TreeNode are loaded on first access (see TreeNode::EnsureChildren()) from the manifest file 'children' in its
+ * directory, which lists the vid and size of each child. FinishSplits() writes the manifests of all loaded internal
+ * TreeNodes, the root's last. The first change of a leaf file after that removes the root's manifest again, so an
+ * index which was not closed cleanly (e.g. after a crash) has none: it is loaded eagerly from the directory structure
+ * instead, and its manifests are rewritten by the next FinishSplits().
+ *
+ * Assumes there is at most one writer at all times (one process, and only one writing thread).
  */
 template<class Token>
 class TreeNodeDisk : public TreeNode<Token, SuffixArrayDisk<Token>> {
@@ -29,37 +55,97 @@ public:
   typedef SuffixArrayDisk<Token> SuffixArray;
   typedef typename TreeNode<Token, SuffixArray>::Vid Vid;
   typedef typename TreeNode<Token, SuffixArray>::Offset Offset;
-  typedef typename TreeNode<Token, SuffixArray>::SuffixArrayT SuffixArrayT; // to do: mmap
+  typedef typename TreeNode<Token, SuffixArray>::SuffixArrayT SuffixArrayT;
+  typedef typename TreeNode<Token, SuffixArray>::DeltaArray DeltaArray;
 
   /**
-   * if path exists: recursively load the subtree rooted at this path.
+   * if path exists: recursively load the subtree rooted at this path. Leaf arrays are memory mapped,
+   * so their contents are only paged in when accessed.
    * if path does not exist: create an empty leaf node here.
    *
-   * @param path  path to the backing directory
+   * @param path  path to the backing directory (must not be empty)
    */
-  TreeNodeDisk(std::string path, size_t maxArraySize = 1000000);
+  TreeNodeDisk(std::string path, size_t maxArraySize = 1000000, const MapOptions &options = MapOptions());
 
-  /** Set the path to the directory backing this DiskTreeNode. */
-  //void SetPath(const std::string &path) { path_ = path; }
+  /** The root calls FinishSplits() (errors are ignored here: call FinishSplits() to see them). */
+  virtual ~TreeNodeDisk();
 
   /**
-   * For now, leaves only. Merge the entire IndexSpan into this leaf.
-   * Writes to a temporary file first, before moving it to replace the old suffix array.
+   * Merge all Positions of an in-memory index span into this subtree, e.g. to persist a batch of sentences
+   * indexed in memory. addSpan must span the lookup sequence which leads to this TreeNode, e.g. the full span
+   * of an index for the root. Leaves which grow beyond kMaxArraySize are split.
    *
-   * Assumes there is at most one writer at all times (one process, and only one writing thread).
+   * @param addSpan  a span of a TreeNode to be merged in (span over the same lookup sequence)
+   */
+  void Merge(typename TokenIndex<Token, TreeNodeMemory<Token, RBTree>>::Span &addSpan);
+
+  /**
+   * Insert the existing Corpus Position into this leaf node (SuffixArray), see TreeNodeMemory::AddPosition().
+   * The Position goes into the leaf's insert buffer, so only every sqrt(n)-th insert rewrites the leaf file.
    *
-   * @param curSpan  a span of this entire TreeNode
-   * @param addSpan  a span of a TreeNode to be merged in (span over the same vid)
+   * depth: distance of TreeNode from the root of this tree, used in splits
+   */
+  void AddPosition(const Sentence<Token> &sent, Offset start, size_t depth);
+
+  /**
+   * Insert a batch of existing Corpus Positions into the tree below this root node.
+   * 'positions' is sorted once, then each affected leaf is merged and rewritten once
+   * (or takes a few Positions into its insert buffer, like AddPosition()).
+   * Leaves which grow beyond kMaxArraySize are split.
+   */
+  void AddPositions(const Corpus<Token> &corpus, std::vector<Position<Token>> &positions);
+
+  /** Add an empty leaf node (SuffixArray) as a child. */
+  void AddLeaf(Vid vid);
+
+  /**
+   * No-op, so that opening an index does not visit its leaves: they were persisted within kMaxArraySize already.
+   * Leaves of a directory written with a larger maxArraySize are split by their next merge instead.
+   */
+  void BulkSplit(const Corpus<Token> &corpus, size_t depth) { (void) corpus; (void) depth; }
+
+  /**
+   * Index all Positions of 'corpus' in this empty root leaf, using 'nthreads' threads (0: one per hardware thread).
+   * Like TreeNodeMemory::BuildIndex(), suffixes are partitioned by their first vid, and each partition is sorted
+   * and written into its subtree independently.
+   */
+  void BuildIndex(const Corpus<Token> &corpus, size_t nthreads);
+
+  /** Splits on disk are always synchronous, so that AddPosition() returns with any split leaf files written. */
+  void SetAsyncSplits(bool async) { (void) async; }
+
+  /**
+   * Write the insert buffers of all leaves in this subtree into their leaf files, so that all Positions are
+   * persistent. The RunIndex of a rewritten leaf is built again by the first narrow() into it, see TreeNode::EnsureRuns().
+   * Root only: then write the manifests of changed subtrees, so that the next open is lazy.
    */
-  void Merge(typename TokenIndex<Token>::Span &curSpan, typename TokenIndex<Token>::Span &addSpan);
+  void FinishSplits();
 
-  void AddPosition(const Sentence<Token> &sent, Offset start, size_t depth) { assert(0); }
+  /** Leaves on disk are already persistent, so there is nothing to remap. */
+  void RemapLeaves(const Corpus<Token> &corpus, const std::string &filename, const MapOptions &options = MapOptions()) {
+    (void) corpus; (void) filename; (void) options;
+  }
 
   /** @return true if child with 'vid' as the key was found, and optionally sets 'child'. */
   bool find_child_(Vid vid, TreeNodeDisk<Token> **child = nullptr);
 
 private:
   friend class ::TokenIndexTests_TreeNodeDisk_Test;
+  friend class ::TokenIndexTests_disk_lazy_open_Test;
+
+  /** state shared by all TreeNodes of a tree */
+  struct Tree {
+    TreeNodeDisk<Token> *root; /** nullptr once the root is destroyed */
+    std::string manifest; /** path to the root's manifest */
+    bool lazy; /** load children from their manifests: the root's manifest existed when opening */
+    bool dirty; /** writer only: leaf files changed since the manifests were written, and the root's manifest is removed */
+  };
+
+  /** child TreeNode at 'path' of the same tree as 'parent', see Open() */
+  TreeNodeDisk(const std::string &path, const TreeNodeDisk<Token> &parent);
+
+  /** load the TreeNode at path_ (children lazily, if tree_->lazy), or create an empty leaf there */
+  void Open();
 
   /**
    * Creates the nested directory name for a given vid.
@@ -70,7 +156,55 @@ private:
   /** full path to /array file backing leaves */
   std::string array_path() { return path_ + "/array"; }
 
+  /** full path to the manifest of the children of an internal TreeNode */
+  std::string manifest_path() { return path_ + "/children"; }
+
+  /** full path to the directory of the child with 'vid' */
+  std::string child_path(Vid vid) { return path_ + "/" + child_sub_path(vid); }
+
+  /** Leaf only: merge the insert buffer (if any) into a rewritten leaf file. */
+  void WriteBuffer();
+
+  /**
+   * Load the children of this internal TreeNode: from its manifest if tree_->lazy, otherwise from its sub-directories
+   * (recursively). Thread safety: may be called concurrently by readers, see TreeNode::EnsureChildren().
+   */
+  virtual void LoadChildren();
+
+  /** write the insert buffers of all loaded leaves in this subtree, see FinishSplits() */
+  void WriteBuffers();
+
+  /** write the manifests of all loaded internal TreeNodes in this subtree, deepest first */
+  void WriteManifests();
+
+  /** before the first change of a leaf file: remove the root's manifest, so that a crash leaves an eagerly loaded index */
+  void MarkDirty();
+
+  /** write 'size' bytes at 'data' durably to 'filename', via a temporary file and rename() */
+  static void WriteFile(const std::string &filename, const void *data, size_t size);
+
+  /** Create a new, empty child leaf, replacing any stale directory left at its path. */
+  TreeNodeDisk<Token> *NewChild(Vid vid);
+
+  /**
+   * Merge the sorted 'range' of 'positions' into this subtree, and update partial sums (deepest first).
+   * depth: distance of TreeNode from the root of this tree
+   */
+  void MergePositions(const Corpus<Token> &corpus, const std::vector<Position<Token>> &positions, Range range, size_t depth, bool allow_split);
+
+  /** Write 'range' of the sorted 'array' into this leaf, and recursively split it if it exceeds kMaxArraySize. */
+  void BuildSubtree(const Corpus<Token> &corpus, const SuffixArrayMemory<Token> &array, Range range, size_t depth, bool allow_split);
+
+  /**
+   * Replace the array file of this leaf with 'range' of 'array', via a temporary file and rename(),
+   * and publish the new mapping to readers (replacing any insert buffer).
+   */
+  void WriteArray(const SuffixArrayMemory<Token> &array, Range range);
+
   std::string path_; /** path to the directory backing this DiskTreeNode */
+  MapOptions map_options_; /** page cache policy of the leaf files, inherited by the children */
+  std::shared_ptr<Tree> tree_; /** shared by all TreeNodes of this tree */
+  std::mutex load_mutex_; /** serializes concurrent LoadChildren() calls */
 };
 
 } // namespace sto
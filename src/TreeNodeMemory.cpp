@@ -7,53 +7,214 @@
 #include "TreeNodeMemory.h"
 #include "Corpus.h"
 #include "MappedFile.h"
+#include "util/stats.hpp"
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 namespace sto {
 
+/**
+ * Background split of an oversized leaf: its children are built by the SplitWorker from a snapshot of the leaf array,
+ * while the writer keeps inserting into the leaf, logging the new Positions in 'delta'.
+ */
+template<class Token, template<typename, typename> class ChildMapT>
+struct TreeNodeMemory<Token, ChildMapT>::SplitJob {
+  TreeNodeMemory<Token, ChildMapT> *node; /** leaf being split */
+  const Corpus<Token> *corpus;
+  size_t depth; /** depth of node */
+  std::shared_ptr<SuffixArray> snapshot; /** leaf array at the time the split was queued */
+  std::shared_ptr<DeltaArray> buffered; /** leaf insert buffer at that time, if any: merged into snapshot by the worker */
+
+  // built by the worker, not visible to readers until installed
+  std::vector<Vid> vids;
+  std::vector<TreeNode<Token, SuffixArray, ChildMapT> *> children;
+  std::vector<size_t> sizes;
+
+  std::vector<Position<Token>> delta; /** writer only: Positions inserted into the leaf after the snapshot */
+
+  ~SplitJob() {
+    // children of abandoned splits
+    for(auto child : children)
+      delete child;
+  }
+};
+
+/** Single background thread building the children of queued SplitJobs in order. */
+template<class Token, template<typename, typename> class ChildMapT>
+class TreeNodeMemory<Token, ChildMapT>::SplitWorker {
+public:
+  SplitWorker() : ndone_(0), stop_(false), busy_(false), thread_(&SplitWorker::Run, this) {}
+
+  /** queued jobs which have not been started are abandoned. */
+  ~SplitWorker() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    queued_.notify_all();
+    thread_.join();
+  }
+
+  void Submit(const std::shared_ptr<SplitJob> &job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(job);
+    }
+    queued_.notify_all();
+  }
+
+  /** @return all finished jobs. Cheap if there are none (a single atomic load, no lock). */
+  std::vector<std::shared_ptr<SplitJob>> TakeDone() {
+    std::vector<std::shared_ptr<SplitJob>> jobs;
+    if(ndone_.load(std::memory_order_acquire) == 0)
+      return jobs;
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs.swap(done_);
+    ndone_.store(0, std::memory_order_relaxed);
+    return jobs;
+  }
+
+  /** block until all submitted jobs are finished. */
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    finished_.wait(lock, [this]() { return queue_.empty() && !busy_; });
+  }
 
-template<class Token>
-TreeNodeMemory<Token>::TreeNodeMemory(std::string filename, size_t maxArraySize) : TreeNode<Token, SuffixArrayMemory<Token>>(maxArraySize) {
+private:
+  std::mutex mutex_;
+  std::condition_variable queued_;
+  std::condition_variable finished_;
+  std::deque<std::shared_ptr<SplitJob>> queue_;
+  std::vector<std::shared_ptr<SplitJob>> done_;
+  std::atomic<size_t> ndone_; /** done_.size(), for checking without the lock */
+  bool stop_;
+  bool busy_;
+  std::thread thread_; /** last: started after all other members are initialized */
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while(true) {
+      queued_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+      if(stop_)
+        return;
+      std::shared_ptr<SplitJob> job = queue_.front();
+      queue_.pop_front();
+      busy_ = true;
+      lock.unlock();
+
+      // the snapshot is immutable, and Corpus supports reading concurrently with the writer appending
+      if(job->buffered)
+        job->snapshot = TreeNodeMemory::MergedArray(*job->buffered);
+      job->node->BuildChildren(*job->corpus, job->snapshot, Range{0, job->snapshot->size()}, job->depth, job->vids, job->children, job->sizes);
+
+      lock.lock();
+      busy_ = false;
+      done_.push_back(job);
+      ndone_.store(done_.size(), std::memory_order_release);
+      finished_.notify_all();
+    }
+  }
+};
+
+template<class Token, template<typename, typename> class ChildMapT>
+TreeNodeMemory<Token, ChildMapT>::TreeNodeMemory(std::string filename, size_t maxArraySize, const MapOptions &options) : TreeNode<Token, SuffixArrayMemory<Token>, ChildMapT>(maxArraySize), worker_(nullptr) {
   this->array_.reset(new SuffixArray);
   if(filename != "")
-    LoadArray(filename);
+    LoadArray(filename, options);
 }
 
-template<class Token>
-void TreeNodeMemory<Token>::AddPosition(const Sentence<Token> &sent, Offset start, size_t depth) {
-  assert(this->is_leaf()); // Exclusively for adding to a SA (leaf node).
+template<class Token, template<typename, typename> class ChildMapT>
+TreeNodeMemory<Token, ChildMapT>::~TreeNodeMemory() {
+  // own_worker_ stops before ~TreeNode() deletes the children
+}
 
+template<class Token, template<typename, typename> class ChildMapT>
+TreeNodeMemory<Token, ChildMapT> *TreeNodeMemory<Token, ChildMapT>::NewNode() const {
+  TreeNodeMemory<Token, ChildMapT> *node = new TreeNodeMemory<Token, ChildMapT>("", this->kMaxArraySize);
+  node->worker_ = worker_;
+  return node;
+}
+
+template<class Token, template<typename, typename> class ChildMapT>
+void TreeNodeMemory<Token, ChildMapT>::AddPosition(const Sentence<Token> &sent, Offset start, size_t depth) {
   Position<Token> corpus_pos{sent.sid(), start};
   const Corpus<Token> &corpus = sent.corpus();
+
+  if(worker_) {
+    InstallSplits();
+    if(!this->is_leaf()) {
+      // our own split was just installed: insert into the new children, like AddPositions()
+      std::vector<Position<Token>> positions{corpus_pos};
+      MergePositions(corpus, positions, Range{0, 1}, depth, /* allow_split = */ true);
+      return;
+    }
+  }
+  assert(this->is_leaf()); // Exclusively for adding to a SA (leaf node).
+
+  // the base array is the read-only mapping of a loaded leaf, if any: it is only copied when the buffer is merged
+  std::shared_ptr<SuffixArrayDisk<Token>> static_array = this->static_array_;
   std::shared_ptr<SuffixArray> array = this->array_;
+  std::shared_ptr<DeltaArray> delta = this->delta_; // if set, its base is static_array or array
 
-  // find insert position in sorted suffix array
-  // thread safety: single writer guarantees that the insert_pos will still be valid later below
-  auto insert_pos = std::upper_bound(
-      array->begin(), array->end(),
-      corpus_pos,
-      [&corpus](const Position<Token> &new_pos, const Position<Token> &arr_pos) {
-        return arr_pos.compare(new_pos, corpus);
-      }
-  );
+  auto less = [&corpus](const Position<Token> &new_pos, const Position<Token> &arr_pos) {
+    return arr_pos.compare(new_pos, corpus);
+  };
 
-  if(array->capacity() >= array->size() + 1) {
-    // safe to insert, no reallocation: shifting elements backwards. readers may observe either old or shifted elements.
-    array->insert(insert_pos, corpus_pos);
-  } else {
-    // reallocation must happen. we do this manually (instead of using vector::insert()) to avoid locking.
+  // find insert position in the sorted base array, and in the sorted insert buffer
+  // thread safety: single writer guarantees that these will still be valid later below
+  const SuffixArrayPosition<Token> *base = static_array ? static_array->data() : array->data();
+  size_t base_size = static_array ? static_array->size() : array->size();
+  size_t rank = static_cast<size_t>(std::upper_bound(base, base + base_size, corpus_pos, less) - base);
+  size_t ndelta = delta ? delta->positions.size() : 0;
+  size_t j = delta ? static_cast<size_t>(std::upper_bound(delta->positions.begin(), delta->positions.end(), corpus_pos, less) - delta->positions.begin()) : 0;
+
+  // thread safety: published arrays are never modified. The new state is prepared in a copy of the (small) insert
+  // buffer, which replaces the current one atomically, so readers observe either the old or the new buffer.
+  std::shared_ptr<DeltaArray> inserted = std::make_shared<DeltaArray>();
+  inserted->base = array;
+  inserted->static_base = static_array;
+  inserted->positions.reserve(ndelta + 1);
+  inserted->ranks.reserve(ndelta + 1);
+  if(delta) {
+    inserted->positions.insert(inserted->positions.end(), delta->positions.begin(), delta->positions.begin() + j);
+    inserted->ranks.insert(inserted->ranks.end(), delta->ranks.begin(), delta->ranks.begin() + j);
+  }
+  inserted->positions.push_back(corpus_pos); // new item
+  inserted->ranks.push_back(rank + j); // preceded by 'rank' base and j buffered Positions
+  for(size_t i = j; i < ndelta; i++) {
+    inserted->positions.push_back(delta->positions[i]);
+    inserted->ranks.push_back(delta->ranks[i] + 1); // shifted by the new item
+  }
+  size_t ncopies = ndelta;
 
-    // in a new copy, prepare the new state of the vector
-    std::shared_ptr<SuffixArray> resized = std::make_shared<SuffixArray>();
-    resized->reserve(std::max<size_t>(1, array->capacity() * 2)); // reserve at least 1, because capacity starts at 0
-    resized->insert(resized->begin(), array->begin(), insert_pos); // copy first part
-    resized->push_back(corpus_pos); // new item
-    resized->insert(resized->end(), insert_pos, array->end()); // copy second part
+  // disallow splits of </s>, see below
+  bool allow_split = sent.size() + 1 > start + depth; // +1 for implicit </s>
 
-    this->array_ = resized; // atomic replace
+  if(inserted->positions.size() * inserted->positions.size() > base_size) {
+    // merge a full buffer in a single pass. Buffers of up to sqrt(n) Positions balance the O(d) buffer copies
+    // against the O(n) merges every d inserts, for amortized O(sqrt(n)) copies per insert instead of O(n).
+    array = this->MergedArray(*inserted);
+    ncopies += array->size();
+    // thread safety: readers check delta_ first, then static_array_, so array_ must be valid before they are released
+    this->array_ = array;
+    this->static_array_.reset();
+    this->delta_.reset();
+    if(allow_split)
+      this->BuildRuns(corpus, depth); // O(d log(n/d)) corpus reads, against the O(n) merge
+  } else {
+    this->delta_ = inserted; // atomic replace
+  }
+  STO_STATS_RECORD(kAddPositionCopies, ncopies); // once per insert, including any merge
+  size_t new_size = inserted->size();
 
-    array = this->array_;
+  if(pending_split_) {
+    pending_split_->delta.push_back(corpus_pos); // merged into the children when the split is installed
+    return;
   }
 
   /*
@@ -70,29 +231,206 @@ void TreeNodeMemory<Token>::AddPosition(const Sentence<Token> &sent, Offset star
    * into a single number. However, the leaves contain the Corpus Positions of the entire path to the suffix,
    * which we want to sample.
    */
-  bool allow_split = sent.size() + 1 > start + depth; // +1 for implicit </s>
+  if(new_size > this->kMaxArraySize && allow_split) {
+    if(worker_) {
+      // build the split in the background, from the current (immutable) array and insert buffer
+      pending_split_ = std::make_shared<SplitJob>();
+      pending_split_->node = this;
+      pending_split_->corpus = &corpus;
+      pending_split_->depth = depth;
+      pending_split_->snapshot = array;
+      pending_split_->buffered = this->delta_;
+      worker_->Submit(pending_split_);
+    } else {
+      MergeDelta();
+      SplitNode(corpus, static_cast<Offset>(depth)); // suffix array grown too large, split into TreeNode
+    }
+  }
+}
 
-  if(array->size() > this->kMaxArraySize && allow_split) {
-    SplitNode(corpus, static_cast<Offset>(depth)); // suffix array grown too large, split into TreeNode
+template<class Token, template<typename, typename> class ChildMapT>
+void TreeNodeMemory<Token, ChildMapT>::SetAsyncSplits(bool async) {
+  if(async && !own_worker_) {
+    own_worker_.reset(new SplitWorker);
+    SetWorker(own_worker_.get());
+  } else if(!async && own_worker_) {
+    FinishSplits();
+    SetWorker(nullptr);
+    own_worker_.reset();
   }
 }
 
-template<class Token>
-void TreeNodeMemory<Token>::AddLeaf(Vid vid) {
-  this->children_[vid] = new TreeNodeMemory<Token>("", this->kMaxArraySize);
+template<class Token, template<typename, typename> class ChildMapT>
+void TreeNodeMemory<Token, ChildMapT>::FinishSplits() {
+  if(!own_worker_)
+    return;
+  own_worker_->Wait();
+  InstallSplits();
 }
 
-template<class Token>
-bool TreeNodeMemory<Token>::find_child_(Vid vid, TreeNodeMemory<Token> **child) {
-  return TreeNode<Token, SuffixArray>::find_child_(vid, reinterpret_cast<TreeNode<Token, SuffixArray> **>(child));
+template<class Token, template<typename, typename> class ChildMapT>
+void TreeNodeMemory<Token, ChildMapT>::SetWorker(SplitWorker *worker) {
+  worker_ = worker;
+  if(!this->is_leaf()) {
+    this->children_.Walk([worker](Vid vid, TreeNode<Token, SuffixArray, ChildMapT> *child) {
+      static_cast<TreeNodeMemory<Token, ChildMapT> *>(child)->SetWorker(worker);
+    });
+  }
+}
+
+template<class Token, template<typename, typename> class ChildMapT>
+void TreeNodeMemory<Token, ChildMapT>::InstallSplits() {
+  for(const std::shared_ptr<SplitJob> &job : worker_->TakeDone()) {
+    // skip splits which were superseded, e.g. by MergePositions() replacing the leaf
+    if(job->node->pending_split_ == job)
+      job->node->InstallSplit(*job);
+  }
+}
+
+template<class Token, template<typename, typename> class ChildMapT>
+void TreeNodeMemory<Token, ChildMapT>::InstallSplit(SplitJob &job) {
+  assert(this->is_leaf() && pending_split_.get() == &job);
+  const Corpus<Token> &corpus = *job.corpus;
+  size_t depth = job.depth;
+
+  // merge the logged Positions into the (still private) children, one run of equal vids at a time.
+  // A child which gets only a few of them takes them into its insert buffer, without a copy of its array.
+  // stable: equal suffixes stay in insertion order, like the AddPosition() calls into the leaf ordered them.
+  std::vector<Position<Token>> &delta = job.delta;
+  std::stable_sort(delta.begin(), delta.end(), [&corpus](const Position<Token> &a, const Position<Token> &b) {
+    return suffix_less(corpus, a, b, /* skip = */ 0);
+  });
+  auto vid_at = [&corpus, &delta, depth](size_t i) {
+    return delta[i].add(depth, corpus).vid(corpus);
+  };
+  size_t begin = 0;
+  while(begin < delta.size()) {
+    Vid vid = vid_at(begin);
+    size_t end = begin + 1;
+    while(end < delta.size() && vid_at(end) == vid)
+      end++;
+
+    size_t i = std::lower_bound(job.vids.begin(), job.vids.end(), vid) - job.vids.begin();
+    if(i == job.vids.size() || job.vids[i] != vid) {
+      job.vids.insert(job.vids.begin() + i, vid);
+      job.children.insert(job.children.begin() + i, NewNode());
+      job.sizes.insert(job.sizes.begin() + i, 0);
+    }
+    TreeNodeMemory<Token, ChildMapT> *child = static_cast<TreeNodeMemory<Token, ChildMapT> *>(job.children[i]);
+    child->MergePositions(corpus, delta, Range{begin, end}, depth + 1, /* allow_split = */ vid != Corpus<Token>::Vocabulary::kEOS);
+    job.sizes[i] += end - begin;
+
+    begin = end;
+  }
+  STO_STATS_ADD(kSplits, 1);
+
+  this->children_.BuildSorted(job.vids, job.children, job.sizes);
+  job.children.clear(); // owned by children_ now
+  assert(this->children_.Size() == this->leaf_array_unchecked().size());
+
+  // release: ensure prior writes to children_ get flushed before the atomic operation
+  this->is_leaf_.store(false, std::memory_order_release);
+
+  // destroy this node's own suffix array (last reader will clean up)
+  this->array_.reset();
+  this->static_array_.reset();
+  this->delta_.reset();
+  this->set_runs(nullptr);
+  pending_split_.reset();
+}
+
+template<class Token, template<typename, typename> class ChildMapT>
+void TreeNodeMemory<Token, ChildMapT>::AddPositions(const Corpus<Token> &corpus, std::vector<Position<Token>> &positions) {
+  // sort once. stable: equal suffixes stay in insertion order, like repeated AddPosition() calls would order them.
+  std::stable_sort(positions.begin(), positions.end(), [&corpus](const Position<Token> &a, const Position<Token> &b) {
+    return suffix_less(corpus, a, b, /* skip = */ 0);
+  });
+  MergePositions(corpus, positions, Range{0, positions.size()}, /* depth = */ 0, /* allow_split = */ true);
+}
+
+template<class Token, template<typename, typename> class ChildMapT>
+void TreeNodeMemory<Token, ChildMapT>::MergePositions(const Corpus<Token> &corpus, const std::vector<Position<Token>> &positions, Range range, size_t depth, bool allow_split) {
+  if(range.size() == 0)
+    return;
+
+  if(this->is_leaf()) {
+    // a few Positions into a large leaf go into its insert buffer, instead of copying the whole array
+    bool fits = !allow_split || this->size() + range.size() <= this->kMaxArraySize;
+    if(!pending_split_ && fits && this->BufferPositions(corpus, positions, range))
+      return;
+
+    // build the merged array privately, then publish it with a single atomic replace
+    std::shared_ptr<SuffixArrayDisk<Token>> static_array = this->static_array_;
+    std::shared_ptr<DeltaArray> delta = this->delta_;
+    std::shared_ptr<SuffixArray> merged;
+    if(delta)
+      merged = merge_array(corpus, *delta, positions, range);
+    else if(static_array)
+      merged = merge_array(corpus, *static_array, positions, range);
+    else
+      merged = merge_array(corpus, *this->array_, positions, range);
+    STO_STATS_ADD(kMergedPositions, merged->size());
+
+    // thread safety: readers check delta_ and static_array_ first, so array_ must be valid before they are released
+    this->array_ = merged;
+    this->static_array_.reset();
+    this->delta_.reset();
+    pending_split_.reset(); // a background split of the previous array is obsolete
+
+    // disallow splits of </s>, see AddPosition()
+    if(merged->size() > this->kMaxArraySize && allow_split)
+      BuildSubtree(corpus, merged, Range{0, merged->size()}, depth, allow_split);
+    else if(allow_split)
+      this->BuildRuns(corpus, depth);
+    else
+      this->set_runs(nullptr);
+    return;
+  }
+
+  // internal TreeNode: the sorted range consists of runs of equal vids at 'depth', one for each child.
+  // Positions reaching an internal TreeNode are long enough (the </s> leaf is never split).
+  auto vid_at = [&corpus, &positions, depth](size_t i) {
+    return corpus.sentence(positions[i].sid)[positions[i].offset + depth].vid;
+  };
+  size_t begin = range.begin;
+  while(begin < range.end) {
+    Vid vid = vid_at(begin);
+    size_t end = begin + 1;
+    while(end < range.end && vid_at(end) == vid)
+      end++;
+
+    TreeNodeMemory<Token, ChildMapT> *child = nullptr;
+    if(!find_child_(vid, &child)) {
+      AddLeaf(vid);
+      find_child_(vid, &child);
+    }
+    child->MergePositions(corpus, positions, Range{begin, end}, depth + 1, /* allow_split = */ vid != Corpus<Token>::Vocabulary::kEOS);
+
+    // add sizes after the child, so that readers will see a valid state (children being at least as big as they should be)
+    this->AddSize(vid, end - begin);
+
+    begin = end;
+  }
+}
+
+template<class Token, template<typename, typename> class ChildMapT>
+void TreeNodeMemory<Token, ChildMapT>::AddLeaf(Vid vid) {
+  this->children_[vid] = NewNode();
+}
+
+template<class Token, template<typename, typename> class ChildMapT>
+bool TreeNodeMemory<Token, ChildMapT>::find_child_(Vid vid, TreeNodeMemory<Token, ChildMapT> **child) {
+  return TreeNode<Token, SuffixArray, ChildMapT>::find_child_(vid, reinterpret_cast<TreeNode<Token, SuffixArray, ChildMapT> **>(child));
 }
 
 /** Split this leaf node (suffix array) into a proper TreeNode with children. */
-template<class Token>
-void TreeNodeMemory<Token>::SplitNode(const Corpus<Token> &corpus, Offset depth) {
+template<class Token, template<typename, typename> class ChildMapT>
+void TreeNodeMemory<Token, ChildMapT>::SplitNode(const Corpus<Token> &corpus, Offset depth) {
   typedef typename SuffixArray::iterator iter;
 
   assert(this->is_leaf()); // this method works only on suffix arrays
+  STO_STATS_ADD(kSplits, 1);
+  STO_STATS_TIMER(kSplitNanos);
 
   auto comp = [&corpus, depth](const Position<Token> &a, const Position<Token> &b) {
     // the suffix array at this depth should only contain positions that continue long enough without the sentence ending
@@ -111,13 +449,15 @@ void TreeNodeMemory<Token>::SplitNode(const Corpus<Token> &corpus, Offset depth)
     vid_range = std::equal_range(array->begin(), array->end(), pos, comp);
 
     // copy each range into its own suffix array
-    TreeNodeMemory<Token> *new_child = new TreeNodeMemory<Token>("", this->kMaxArraySize);
+    TreeNodeMemory<Token, ChildMapT> *new_child = NewNode();
     std::shared_ptr<SuffixArray> new_array = new_child->array_;
     new_array->insert(new_array->begin(), vid_range.first, vid_range.second);
+    if(pos.add(depth, corpus).vid(corpus) != Corpus<Token>::Vocabulary::kEOS)
+      new_child->BuildRuns(corpus, depth + 1);
     //children_[pos.add(depth, corpus).vid(corpus)] = new_child;
     this->children_.FindOrInsert(pos.add(depth, corpus).vid(corpus), /* add_size = */ new_array->size()) = new_child;
 
-    TreeNodeMemory<Token> *n = nullptr;
+    TreeNodeMemory<Token, ChildMapT> *n = nullptr;
     assert(this->find_child_(pos.add(depth, corpus).vid(corpus), &n));
     assert(n != nullptr);
     assert(this->children_.ChildSize(pos.add(depth, corpus).vid(corpus)) == new_array->size());
@@ -134,38 +474,309 @@ void TreeNodeMemory<Token>::SplitNode(const Corpus<Token> &corpus, Offset depth)
 
   // destroy the suffix array (last reader will clean up)
   this->array_.reset();
+  this->set_runs(nullptr);
   // note: array_ null check could replace is_leaf_
 }
 
-template<class Token>
-void TreeNodeMemory<Token>::LoadArray(const std::string &filename) {
-  typedef tpt::id_type Sid_t;
-  typedef tpt::offset_type Offset_t;
+template<class Token, template<typename, typename> class ChildMapT>
+void TreeNodeMemory<Token, ChildMapT>::BulkSplit(const Corpus<Token> &corpus, size_t depth) {
+  assert(this->is_leaf()); // this method works only on suffix arrays
+
+  if(this->size() <= this->kMaxArraySize) {
+    this->DeferRuns(); // opening an index does not read the corpus, see EnsureRuns()
+    return; // nothing to split
+  }
+
+  MergeDelta();
+  std::shared_ptr<SuffixArrayDisk<Token>> static_array = this->static_array_;
+  if(static_array)
+    BuildSubtree(corpus, static_array, Range{0, static_array->size()}, depth, /* allow_split = */ true);
+  else
+    BuildSubtree(corpus, this->array_, Range{0, this->array_->size()}, depth, /* allow_split = */ true);
+}
+
+template<class Token, template<typename, typename> class ChildMapT>
+void TreeNodeMemory<Token, ChildMapT>::BuildIndex(const Corpus<Token> &corpus, size_t nthreads) {
+  typedef std::vector<Position<Token>> Bucket;
+
+  assert(this->is_leaf() && this->size() == 0); // this method works only on an empty root
+  if(nthreads == 0)
+    nthreads = std::max<size_t>(1, std::thread::hardware_concurrency());
+
+  // partition all suffixes by their first vid (counting first, so each bucket is allocated exactly once)
+  std::vector<size_t> counts;
+  for(Sid sid = 0; sid < corpus.size(); sid++) {
+    typename Corpus<Token>::Tokens tokens = corpus.tokens(sid);
+    for(size_t i = 0; i < tokens.size(); i++) {
+      Vid v = tokens[i];
+      if(v >= counts.size())
+        counts.resize(v + 1, 0);
+      counts[v]++;
+    }
+  }
+  std::vector<std::shared_ptr<Bucket>> buckets(counts.size());
+  std::vector<Vid> vids;
+  for(Vid vid = 0; vid < counts.size(); vid++) {
+    if(counts[vid] == 0)
+      continue;
+    buckets[vid] = std::make_shared<Bucket>();
+    buckets[vid]->reserve(counts[vid]);
+    vids.push_back(vid);
+  }
+  for(Sid sid = 0; sid < corpus.size(); sid++) {
+    typename Corpus<Token>::Tokens tokens = corpus.tokens(sid);
+    for(size_t i = 0; i < tokens.size(); i++)
+      buckets[tokens[i]]->push_back(Position<Token>{sid, static_cast<Offset>(i)});
+  }
+
+  // within a bucket, the first token is equal, so compare suffixes from the second token on.
+  // Equal suffixes are ordered by sid, like AddSentence() would insert them.
+  auto less = [&corpus](const Position<Token> &a, const Position<Token> &b) {
+    if(suffix_less(corpus, a, b, /* skip = */ 1))
+      return true;
+    if(suffix_less(corpus, b, a, /* skip = */ 1))
+      return false;
+    return a.sid < b.sid;
+  };
+
+  size_t total = 0;
+  for(Vid vid : vids)
+    total += counts[vid];
+
+  std::vector<TreeNode<Token, SuffixArray, ChildMapT> *> children(vids.size(), nullptr);
+  std::vector<size_t> sizes(vids.size());
+
+  // largest buckets first, for load balancing
+  std::vector<size_t> order(vids.size());
+  for(size_t i = 0; i < order.size(); i++)
+    order[i] = i;
+  std::sort(order.begin(), order.end(), [&vids, &counts](size_t a, size_t b) { return counts[vids[a]] > counts[vids[b]]; });
+
+  std::atomic<size_t> next(0);
+  bool build_children = total > this->kMaxArraySize;
+  auto worker = [&]() {
+    size_t i;
+    while((i = next.fetch_add(1)) < order.size()) {
+      size_t ichild = order[i];
+      std::shared_ptr<Bucket> &bucket = buckets[vids[ichild]];
+      std::sort(bucket->begin(), bucket->end(), less);
+      sizes[ichild] = bucket->size();
+      if(build_children) {
+        TreeNodeMemory<Token, ChildMapT> *new_child = NewNode();
+        new_child->BuildSubtree(corpus, bucket, Range{0, bucket->size()}, /* depth = */ 1, /* allow_split = */ vids[ichild] != Corpus<Token>::Vocabulary::kEOS);
+        children[ichild] = new_child;
+        bucket.reset(); // free memory early
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for(size_t i = 0; i < nthreads; i++)
+    threads.push_back(std::thread(worker));
+  for(auto &thread : threads)
+    thread.join();
+
+  if(!build_children) {
+    // small index: a single leaf, concatenating the sorted buckets in vid order
+    std::shared_ptr<SuffixArray> array = std::make_shared<SuffixArray>();
+    array->reserve(total);
+    for(Vid vid : vids)
+      array->insert(array->end(), buckets[vid]->begin(), buckets[vid]->end());
+    this->array_ = array;
+    this->BuildRuns(corpus, /* depth = */ 0);
+    return;
+  }
+
+  this->children_.BuildSorted(vids, children, sizes);
+
+  // release: ensure prior writes to children_ get flushed before the atomic operation
+  this->is_leaf_.store(false, std::memory_order_release);
+  this->array_.reset();
+  this->set_runs(nullptr);
+}
+
+template<class Token, template<typename, typename> class ChildMapT>
+template<class Array>
+void TreeNodeMemory<Token, ChildMapT>::BuildSubtree(const Corpus<Token> &corpus, const std::shared_ptr<Array> &array, Range range, size_t depth, bool allow_split) {
+  assert(this->is_leaf());
+
+  if(range.size() <= this->kMaxArraySize || !allow_split) {
+    SetLeafArray(array, range); // new leaf (BulkSplit() never calls us with a small range)
+    if(allow_split)
+      this->BuildRuns(corpus, depth); // not for </s>: its Positions end before 'depth'
+    else
+      this->set_runs(nullptr);
+    return;
+  }
+  STO_STATS_ADD(kSplits, 1);
+
+  std::vector<Vid> vids;
+  std::vector<TreeNode<Token, SuffixArray, ChildMapT> *> children;
+  std::vector<size_t> sizes;
+
+  // thread safety: we build the TreeNode while is_leaf_ == true, so children_ is not accessed while being modified
+  BuildChildren(corpus, array, range, depth, vids, children, sizes);
+  this->children_.BuildSorted(vids, children, sizes);
+  assert(this->children_.Size() == range.size());
+
+  // release: ensure prior writes to children_ get flushed before the atomic operation
+  this->is_leaf_.store(false, std::memory_order_release);
+
+  // destroy this node's own suffix array (last reader will clean up)
+  this->array_.reset();
+  this->static_array_.reset();
+  this->delta_.reset();
+  this->set_runs(nullptr);
+}
+
+template<class Token, template<typename, typename> class ChildMapT>
+template<class Array>
+void TreeNodeMemory<Token, ChildMapT>::BuildChildren(const Corpus<Token> &corpus, const std::shared_ptr<Array> &array, Range range, size_t depth,
+                                                     std::vector<Vid> &vids, std::vector<TreeNode<Token, SuffixArray, ChildMapT> *> &children, std::vector<size_t> &sizes) const {
+  // vid at 'depth' of the entry at index i. All positions at this depth are long enough (the </s> leaf is never split).
+  auto vid_at = [&corpus, &array, depth](size_t i) {
+    Position<Token> pos = (*array)[i];
+    return corpus.sentence(pos.sid)[pos.offset + depth].vid;
+  };
+
+  // walk the sorted range once, from run to run of equal vids. Galloping search finds the end of each run,
+  // which needs O(log(run length)) corpus accesses instead of looking at every position.
+  size_t begin = range.begin;
+  while(begin < range.end) {
+    Vid vid = vid_at(begin);
+    size_t step = 1, lo = begin, hi;
+    while(begin + step < range.end && vid_at(begin + step) == vid) {
+      lo = begin + step;
+      step *= 2;
+    }
+    hi = std::min(begin + step, range.end); // vid_at(lo) == vid, and hi is either range.end or vid_at(hi) != vid
+    while(lo + 1 < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if(vid_at(mid) == vid)
+        lo = mid;
+      else
+        hi = mid;
+    }
+
+    TreeNodeMemory<Token, ChildMapT> *new_child = NewNode();
+    new_child->BuildSubtree(corpus, array, Range{begin, hi}, depth + 1, /* allow_split = */ vid != Corpus<Token>::Vocabulary::kEOS);
+    vids.push_back(vid);
+    children.push_back(new_child);
+    sizes.push_back(hi - begin);
+
+    begin = hi;
+  }
+}
+
+template<class Token, template<typename, typename> class ChildMapT>
+void TreeNodeMemory<Token, ChildMapT>::SetLeafArray(const std::shared_ptr<SuffixArrayDisk<Token>> &array, Range range) {
+  this->static_array_ = array->slice(range.begin, range.end);
+}
+
+template<class Token, template<typename, typename> class ChildMapT>
+void TreeNodeMemory<Token, ChildMapT>::SetLeafArray(const std::shared_ptr<SuffixArray> &array, Range range) {
+  std::shared_ptr<SuffixArray> new_array = std::make_shared<SuffixArray>();
+  new_array->insert(new_array->begin(), array->begin() + range.begin, array->begin() + range.end);
+  this->array_ = new_array;
+}
+
+template<class Token, template<typename, typename> class ChildMapT>
+void TreeNodeMemory<Token, ChildMapT>::SetLeafArray(const std::shared_ptr<std::vector<Position<Token>>> &array, Range range) {
+  std::shared_ptr<SuffixArray> new_array = std::make_shared<SuffixArray>();
+  new_array->insert(new_array->begin(), array->begin() + range.begin, array->begin() + range.end);
+  this->array_ = new_array;
+}
+
+template<class Token, template<typename, typename> class ChildMapT>
+void TreeNodeMemory<Token, ChildMapT>::LoadArray(const std::string &filename, const MapOptions &options) {
+  this->static_array_ = MapArray(filename, options);
+}
+
+template<class Token, template<typename, typename> class ChildMapT>
+std::shared_ptr<SuffixArrayDisk<Token>> TreeNodeMemory<Token, ChildMapT>::MapArray(const std::string &filename, const MapOptions &options) {
   typedef tpt::TsaHeader TokenIndexHeader;
+  // checked at runtime: Token types with narrower Position widths are supported, just not as *.sfa files
+  if(sizeof(SuffixArrayPosition<Token>) != sizeof(tpt::TsaPosition))
+    throw std::runtime_error(std::string("Position widths of this Token type are not layout compatible with mtt-build, cannot map ") + filename);
 
-  MappedFile file(filename);
-  TokenIndexHeader &header = *reinterpret_cast<TokenIndexHeader *>(file.ptr);
+  std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(filename, /* offset = */ 0, options);
+  TokenIndexHeader &header = *reinterpret_cast<TokenIndexHeader *>(file->ptr);
 
   if(header.versionMagic != tpt::INDEX_V2_MAGIC) {
     throw std::runtime_error(std::string("unknown version magic in ") + filename);
   }
 
-  size_t num_positions = (header.idxStart - sizeof(TokenIndexHeader)) / (sizeof(Sid_t) + sizeof(Offset_t));
+  size_t num_positions = (header.idxStart - sizeof(TokenIndexHeader)) / sizeof(tpt::TsaPosition);
   // we could also sanity-check index size against the vocabulary size.
 
-  //std::cerr << "sizeof(TokenIndexHeader) = " << sizeof(TokenIndexHeader) << std::endl;
-  //std::cerr << "num_positions = " << num_positions << std::endl;
+  // no copy: the positions stay in the mapping (and in the page cache, which is shared across processes)
+  SuffixArrayPosition<Token> *positions = reinterpret_cast<SuffixArrayPosition<Token> *>(file->ptr + sizeof(TokenIndexHeader));
+  return std::make_shared<SuffixArrayDisk<Token>>(file, positions, num_positions);
+}
+
+template<class Token, template<typename, typename> class ChildMapT>
+void TreeNodeMemory<Token, ChildMapT>::RemapLeaves(const Corpus<Token> &corpus, const std::string &filename, const MapOptions &options) {
+  // a split installed later would replace the remapped leaf with children copied from its old array
+  FinishSplits();
+
+  std::shared_ptr<SuffixArrayDisk<Token>> array = MapArray(filename, options);
+  size_t offset = 0;
+  RemapLeaves(corpus, array, offset, /* depth = */ 0);
+  if(offset != array->size())
+    throw std::runtime_error(std::string("index does not match ") + filename);
+}
 
-  std::shared_ptr<SuffixArray> array = std::make_shared<SuffixArray>();
-  tpt::TsaPosition *p = reinterpret_cast<tpt::TsaPosition *>(file.ptr + sizeof(TokenIndexHeader));
-  for(size_t i = 0; i < num_positions; i++, p++) {
-    array->push_back(Position<Token>{p->sid, p->offset});
+template<class Token, template<typename, typename> class ChildMapT>
+void TreeNodeMemory<Token, ChildMapT>::RemapLeaves(const Corpus<Token> &corpus, const std::shared_ptr<SuffixArrayDisk<Token>> &array, size_t &offset, size_t depth) {
+  if(!this->is_leaf()) {
+    // children in ascending vid order, which is the order of Positions in the file
+    this->children_.Walk([&](Vid vid, TreeNode<Token, SuffixArray, ChildMapT> *child) {
+      static_cast<TreeNodeMemory<Token, ChildMapT> *>(child)->RemapLeaves(corpus, array, offset, depth + 1);
+    });
+    return;
   }
-  this->array_ = array;
+
+  if(pending_split_)
+    throw std::runtime_error("cannot remap a leaf with a background split in progress");
+  typename TreeNode<Token, SuffixArray, ChildMapT>::LeafArray leaf = this->leaf_array_unchecked();
+  size_t size = leaf.size();
+  if(offset + size > array->size())
+    throw std::runtime_error("index does not match its file");
+
+  // thread safety: readers fall back from array_ to static_array_, so static_array_ must be set before array_ is released
+  std::shared_ptr<SuffixArrayDisk<Token>> static_array = array->slice(offset, offset + size);
+  this->static_array_ = static_array;
+  this->delta_.reset();
+  this->array_.reset();
+  offset += size;
+
+  // a RunIndex only applies to the array it was built from. The remapped Positions are the same, so a RunIndex of
+  // the old array carries over without any corpus access. Otherwise, it is built on demand like after opening.
+  if(leaf.has_runs(depth)) {
+    typedef typename TreeNode<Token, SuffixArray, ChildMapT>::RunIndex RunIndex;
+    std::shared_ptr<RunIndex> runs = std::make_shared<RunIndex>(*leaf.runs);
+    runs->array = static_array;
+    this->set_runs(runs);
+  } else {
+    this->DeferRuns();
+  }
+}
+
+template<class Token, template<typename, typename> class ChildMapT>
+void TreeNodeMemory<Token, ChildMapT>::MergeDelta() {
+  std::shared_ptr<DeltaArray> delta = this->delta_;
+  if(!delta)
+    return;
+  // thread safety: readers check delta_ first, then static_array_, so array_ must be valid before they are released
+  this->array_ = this->MergedArray(*delta);
+  this->static_array_.reset();
+  this->delta_.reset();
 }
 
 // explicit template instantiation
 template class TreeNodeMemory<SrcToken>;
 template class TreeNodeMemory<TrgToken>;
+template class TreeNodeMemory<SmallSrcToken>;
+template class TreeNodeMemory<SrcToken, FlatMap>;
+template class TreeNodeMemory<TrgToken, FlatMap>;
 
 } // namespace sto
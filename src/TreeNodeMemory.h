@@ -7,6 +7,9 @@
 #ifndef STO_TREENODEMEMORY_H
 #define STO_TREENODEMEMORY_H
 
+#include <memory>
+#include <vector>
+
 #include "TreeNode.h"
 //#include "TokenIndex.h"
 #include "SuffixArrayMemory.h"
@@ -16,39 +19,123 @@ namespace sto {
 /**
  * See TreeNode: an internal representation used by TokenIndex,
  * represents a word and its possible suffix extensions.
+ *
+ * ChildMapT: map type for children of internal TreeNodes, see TreeNode.
  */
-template<class Token>
-class TreeNodeMemory : public TreeNode<Token, SuffixArrayMemory<Token>> {
+template<class Token, template<typename, typename> class ChildMapT = RBTree>
+class TreeNodeMemory : public TreeNode<Token, SuffixArrayMemory<Token>, ChildMapT> {
   typedef SuffixArrayMemory<Token> SuffixArray;
-  typedef typename TreeNode<Token, SuffixArray>::Vid Vid;
+  typedef typename TreeNode<Token, SuffixArray, ChildMapT>::Vid Vid;
   typedef typename Corpus<Token>::Offset Offset;
+  typedef typename Corpus<Token>::Sid Sid;
+  typedef typename TreeNode<Token, SuffixArray, ChildMapT>::DeltaArray DeltaArray;
 
 public:
   /**
    * Constructs an empty TreeNode, i.e. a leaf with a SuffixArray.
-   * @param filename  load mtt-build *.sfa file if specified
+   * @param filename  load mtt-build *.sfa file if specified (memory mapped, see LoadArray())
+   * @param options   page cache policy of the mapping
    */
-  TreeNodeMemory(std::string filename, size_t maxArraySize = 10000);
+  TreeNodeMemory(std::string filename, size_t maxArraySize = 10000, const MapOptions &options = MapOptions());
+
+  /** Any background splits still in progress are abandoned (their leaves stay intact). */
+  virtual ~TreeNodeMemory();
 
   /**
    * Insert the existing Corpus Position into this leaf node (SuffixArray).
    * This potentially splits the SuffixArray into individual TreeNodes,
-   * and inserts a Position entry into the suffix array. Hence, it is an
-   * O(k + log(n)) operation, with k = TreeNode<Token>::kMaxArraySize
+   * and inserts a Position entry into the suffix array.
+   *
+   * The Position goes into the leaf's small sorted insert buffer (DeltaArray), which readers see merged with
+   * the leaf array. The buffer is merged into a new leaf array once it holds more than sqrt(n) Positions,
+   * so an insert costs O(log(n)) comparisons and O(sqrt(k)) amortized copies, with k = TreeNode<Token>::kMaxArraySize.
+   * A leaf loaded from a mapped *.sfa file is not copied by its first insert: its buffer sits on top of the mapping.
    *
    * Exclusively for adding to a SA (leaf node).
    *
+   * With async splits (see SetAsyncSplits()), an oversized leaf is instead handed to the background
+   * worker, keeps taking inserts until the split is finished, and is replaced by its children
+   * in a later call on the writer thread.
+   *
    * depth: distance of TreeNode from the root of this tree, used in splits
    */
   void AddPosition(const Sentence<Token> &sent, Offset start, size_t depth);
 
+  /**
+   * Insert a batch of existing Corpus Positions into the tree below this root node.
+   * 'positions' is sorted once, then each leaf gets its share of new Positions in a single linear merge
+   * (instead of one upper_bound and insert per Position), and is published with a single array_ swap.
+   * A leaf which gets only a few Positions takes them into its insert buffer instead, see BufferPositions().
+   * Leaves which grow beyond kMaxArraySize are split, see BulkSplit().
+   */
+  void AddPositions(const Corpus<Token> &corpus, std::vector<Position<Token>> &positions);
+
   /** Add an empty leaf node (SuffixArray) as a child. */
   void AddLeaf(Vid vid);
 
+  /**
+   * Split this leaf node (SuffixArray) in a single pass into the full subtree in which every leaf honors
+   * kMaxArraySize (except for leaves of </s>, which cannot be split). Partial sums are filled bottom-up.
+   * Leaves built from a read-only static_array_ stay read-only views into the same mapping.
+   * A leaf within kMaxArraySize is left as is, without reading the corpus (its RunIndex is deferred, see DeferRuns()).
+   *
+   * depth: distance of TreeNode from the root of this tree
+   */
+  void BulkSplit(const Corpus<Token> &corpus, size_t depth);
+
+  /**
+   * Index all Positions of 'corpus' in this empty root leaf, using 'nthreads' threads.
+   * Suffixes are partitioned by their first vid, and each partition is sorted and built
+   * into a subtree independently, see BulkSplit().
+   */
+  void BuildIndex(const Corpus<Token> &corpus, size_t nthreads);
+
+  /**
+   * Root only: enable or disable splitting oversized leaves from AddPosition() on a background thread,
+   * so the writer is not stalled by copying a large leaf into its children.
+   *
+   * The split is built from a snapshot of the leaf array. Positions inserted into the leaf meanwhile
+   * are logged, and merged into the new children when the writer installs the finished split
+   * (at the start of a subsequent AddPosition() call, or in FinishSplits()). Installing publishes
+   * the children with the same is_leaf_ release store as a synchronous split, and results in the
+   * same Positions. Disabling first waits for all pending splits, see FinishSplits().
+   */
+  void SetAsyncSplits(bool async);
+
+  /** Root only: wait for all background splits, and install them. No-op without async splits. */
+  void FinishSplits();
+
+  /**
+   * Root only: replace the arrays of all leaves by read-only views into 'filename', which must have been written
+   * by TokenIndex::Write() from this tree (with no inserts since). Releases the memory of the leaf arrays and
+   * insert buffers. The Positions stay the same, and so do the RunIndexes (retargeted to the new arrays). Pending background
+   * splits are installed first (see FinishSplits()): they do not change the order of Positions, so the file still matches.
+   */
+  void RemapLeaves(const Corpus<Token> &corpus, const std::string &filename, const MapOptions &options = MapOptions());
+
   /** @return true if child with 'vid' as the key was found, and optionally sets 'child'. */
-  bool find_child_(Vid vid, TreeNodeMemory<Token> **child = nullptr);
+  bool find_child_(Vid vid, TreeNodeMemory<Token, ChildMapT> **child = nullptr);
 
 private:
+  struct SplitJob;
+  class SplitWorker;
+
+  SplitWorker *worker_; /** background split worker of this tree, or nullptr for synchronous splits */
+  std::unique_ptr<SplitWorker> own_worker_; /** root only: owns worker_, see SetAsyncSplits() */
+  std::shared_ptr<SplitJob> pending_split_; /** writer only: background split of this leaf in progress */
+
+  /** new empty leaf, sharing this node's split worker */
+  TreeNodeMemory<Token, ChildMapT> *NewNode() const;
+
+  /** set worker_ in this entire subtree */
+  void SetWorker(SplitWorker *worker);
+
+  /** writer only: replace the leaves of all finished background splits by their children. */
+  void InstallSplits();
+
+  /** writer only: merge the Positions logged since the snapshot into the children of 'job', and publish them. */
+  void InstallSplit(SplitJob &job);
+
   /**
    * Split this leaf node (SuffixArray) into a proper TreeNode with children.
    * depth: distance of TreeNode from the root of this tree
@@ -57,8 +144,42 @@ private:
 
   /**
    * Load this leaf node (SuffixArray) from mtt-build *.sfa file on disk.
+   * The file is memory mapped as a read-only static_array_, without copying its positions.
+   */
+  void LoadArray(const std::string &filename, const MapOptions &options);
+
+  /** memory map all Positions of the mtt-build *.sfa file 'filename' as a read-only array */
+  static std::shared_ptr<SuffixArrayDisk<Token>> MapArray(const std::string &filename, const MapOptions &options);
+
+  /** RemapLeaves() of this subtree, whose Positions start at 'offset' in 'array'. Advances 'offset' past them. */
+  void RemapLeaves(const Corpus<Token> &corpus, const std::shared_ptr<SuffixArrayDisk<Token>> &array, size_t &offset, size_t depth);
+
+  /** Merge the insert buffer delta_ (if any) with its base (array_ or the read-only static_array_) into a new array_. */
+  void MergeDelta();
+
+  /**
+   * Merge the sorted 'range' of 'positions' into this subtree, and update partial sums (deepest first).
+   * Leaves take a few Positions into their insert buffer (see BufferPositions()), otherwise they are merged into a new array.
+   * depth: distance of TreeNode from the root of this tree
    */
-  void LoadArray(const std::string &filename);
+  void MergePositions(const Corpus<Token> &corpus, const std::vector<Position<Token>> &positions, Range range, size_t depth, bool allow_split);
+
+  /** Recursively build the subtree for the sorted 'range' of 'array' into this leaf, see BulkSplit(). */
+  template<class Array>
+  void BuildSubtree(const Corpus<Token> &corpus, const std::shared_ptr<Array> &array, Range range, size_t depth, bool allow_split);
+
+  /**
+   * Build the children for the sorted 'range' of 'array', one subtree per vid at 'depth', without touching this node.
+   * Used by BuildSubtree(), and by the background worker on a snapshot of this leaf.
+   */
+  template<class Array>
+  void BuildChildren(const Corpus<Token> &corpus, const std::shared_ptr<Array> &array, Range range, size_t depth,
+                     std::vector<Vid> &vids, std::vector<TreeNode<Token, SuffixArray, ChildMapT> *> &children, std::vector<size_t> &sizes) const;
+
+  /** Make this leaf hold 'range' of 'array': as a view for read-only arrays, otherwise as a copy. */
+  void SetLeafArray(const std::shared_ptr<SuffixArrayDisk<Token>> &array, Range range);
+  void SetLeafArray(const std::shared_ptr<SuffixArray> &array, Range range);
+  void SetLeafArray(const std::shared_ptr<std::vector<Position<Token>>> &array, Range range);
 };
 
 } // namespace sto
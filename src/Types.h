@@ -17,8 +17,18 @@ template<class Token> class DummyVocab;
 /** Vocabulary ID type for internal use. The external interface is SrcToken/TrgToken. */
 typedef uint32_t vid_t;
 
-typedef uint32_t sid_t; /** sentence ID type */
-typedef uint8_t offset_t; /** type of token offset within sentence */
+typedef uint32_t sid_t; /** default sentence ID type */
+typedef uint8_t offset_t; /** default type of token offset within sentence */
+
+/*
+ * Token traits: besides its Vid and Vocabulary, each Token type fixes at compile time
+ *
+ *   Sid, Offset   widths of a corpus Position, and of the packed SuffixArrayPosition
+ *   kIndexType    accounting of the corpus sentence index (entries or bytes)
+ *
+ * so that Corpus and the suffix arrays are specialized per Token type. A Token with narrower Sid/Offset packs
+ * Positions tighter for small corpora (files written with one Token type cannot be read with another).
+ */
 
 /**
  * Accounting type in sentence index of corpus.
@@ -34,6 +44,8 @@ struct CorpusIndexAccounting {
 struct SrcToken {
   typedef Vocab<SrcToken> Vocabulary;
   typedef vid_t Vid; /** vocabulary ID type */
+  typedef sid_t Sid; /** sentence ID type */
+  typedef offset_t Offset; /** type of token offset within sentence */
   static constexpr Vid kInvalidVid = 0;
   static constexpr CorpusIndexAccounting::acc_t kIndexType = CorpusIndexAccounting::IDX_CNT_ENTRIES;
 
@@ -56,6 +68,8 @@ struct SrcToken {
 struct TrgToken {
   typedef Vocab<TrgToken> Vocabulary;
   typedef vid_t Vid; /** vocabulary ID type */
+  typedef sid_t Sid; /** sentence ID type */
+  typedef offset_t Offset; /** type of token offset within sentence */
   static constexpr Vid kInvalidVid = 0;
   static constexpr CorpusIndexAccounting::acc_t kIndexType = CorpusIndexAccounting::IDX_CNT_ENTRIES;
 
@@ -75,6 +89,35 @@ struct TrgToken {
   Vid &operator*() { return vid; }
 };
 
+/**
+ * Source token with narrower Position widths, for corpora of up to 65536 sentences: in-memory suffix array
+ * leaves pack a Position into 3 bytes (instead of 5). Such indexes are not layout compatible with mtt-build
+ * *.sfa files, so they cannot be written or loaded as *.sfa (see TokenIndex::Write()).
+ */
+struct SmallSrcToken {
+  typedef Vocab<SmallSrcToken> Vocabulary;
+  typedef vid_t Vid; /** vocabulary ID type */
+  typedef uint16_t Sid; /** sentence ID type */
+  typedef offset_t Offset; /** type of token offset within sentence */
+  static constexpr Vid kInvalidVid = 0;
+  static constexpr CorpusIndexAccounting::acc_t kIndexType = CorpusIndexAccounting::IDX_CNT_ENTRIES;
+
+  Vid vid; /** vocabulary ID */
+
+  /** construct invalid token */
+  constexpr SmallSrcToken(): vid(0) {}
+
+  SmallSrcToken(Vid v): vid(v) {}
+
+  bool operator==(const SmallSrcToken &other) const { return vid == other.vid; }
+  bool operator!=(const SmallSrcToken &other) const { return vid != other.vid; }
+  bool operator<(const SmallSrcToken &other) const { return vid < other.vid; }
+
+  // these two make us iterable
+  SmallSrcToken &operator++() { ++vid; return *this; }
+  Vid &operator*() { return vid; }
+};
+
 /** Link type for internal use. The external interface is AlignmentLink. */
 struct aln_link_t {
   offset_t src; /** token offset in source sentence */
@@ -94,6 +137,8 @@ struct aln_link_t {
 struct AlignmentLink {
   typedef DummyVocab<AlignmentLink> Vocabulary;
   typedef aln_link_t Vid; /** vocabulary ID type */
+  typedef sid_t Sid; /** sentence ID type */
+  typedef offset_t Offset; /** type of token offset within sentence */
   static constexpr offset_t kInvalidOffset = static_cast<offset_t>(-1);
   static constexpr CorpusIndexAccounting::acc_t kIndexType = CorpusIndexAccounting::IDX_CNT_BYTES;
 
@@ -4,18 +4,30 @@
  * Licensed under GNU LGPL Version 2.1, see COPYING *
  ****************************************************/
 
+#include <algorithm>
 #include <cstdint>
-#include <cstdio>
-#include <sys/stat.h>
+#include <cstring>
 #include <memory>
+#include <stdexcept>
 
 #include "Vocab.h"
+#include "MappedFile.h"
 #include "Types.h"
 
 namespace sto {
 
+struct UGVocabHeader {
+  uint32_t size; /** size of vocabulary (and index) */
+  uint32_t unk_vid; /** vocabulary ID of UNK word */
+};
+
+struct UGIndexEntry {
+  uint32_t offset; /** offset of surface string */
+  uint32_t vid; /** vocabulary ID */
+};
+
 template<class Token>
-Vocab<Token>::Vocab() : size_(1) {
+Vocab<Token>::Vocab() : size_(1), index_(nullptr), index_size_(0), strings_(nullptr) {
   // insert </s> sentinel to ensure it has the lowest possible vid
   // vid == kEOS must not be used by any word because we use it in TokenIndex as a sentinel.
   Token eos = operator[]("</s>");
@@ -24,7 +36,7 @@ Vocab<Token>::Vocab() : size_(1) {
 }
 
 template<class Token>
-Vocab<Token>::Vocab(const std::string &filename) : size_(0) /* set later */ {
+Vocab<Token>::Vocab(const std::string &filename) : size_(0) /* set later */, index_(nullptr), index_size_(0), strings_(nullptr) {
   load_ugsapt_tdx(filename);
 
   // TODO remove UNK from vocab. or build with mtt-build -unk '</s>'
@@ -37,19 +49,57 @@ Vocab<Token>::Vocab(const std::string &filename) : size_(0) /* set later */ {
 }
 
 template<class Token>
-const std::string& Vocab<Token>::operator[](const Token token) const {
-  return id2surface_.at(token.vid);
+const char *Vocab<Token>::find_surface(Vid vid) const {
+  // the overlay takes precedence, e.g. for </s>
+  auto result = id2surface_.find(vid);
+  if(result != id2surface_.end())
+    return result->second.c_str();
+  if(vid < offsets_.size() && offsets_[vid] != kNoOffset)
+    return strings_ + offsets_[vid];
+  return nullptr;
 }
 
 template<class Token>
-Token Vocab<Token>::operator[](const std::string &surface) {
+bool Vocab<Token>::find_vid(const std::string &surface, Vid *vid) const {
   auto result = surface2id_.find(surface);
   if(result != surface2id_.end()) {
+    *vid = result->second;
+    return true;
+  }
+
+  // binary search in the mapped index, which mtt-build sorts by strcmp()
+  const UGIndexEntry *entry = std::lower_bound(index_, index_ + index_size_, surface.c_str(), [this](const UGIndexEntry &e, const char *s) {
+    return strcmp(strings_ + e.offset, s) < 0;
+  });
+  if(entry != index_ + index_size_ && strcmp(strings_ + entry->offset, surface.c_str()) == 0) {
+    *vid = static_cast<Vid>(entry->vid);
+    return true;
+  }
+  return false;
+}
+
+template<class Token>
+std::string Vocab<Token>::operator[](const Token token) const {
+  return at(token);
+}
+
+template<class Token>
+const char *Vocab<Token>::c_str(const Token token) const {
+  const char *surface = find_surface(token.vid);
+  if(surface == nullptr)
+    throw std::out_of_range("vid not in vocabulary");
+  return surface;
+}
+
+template<class Token>
+Token Vocab<Token>::operator[](const std::string &surface) {
+  Vid id;
+  if(find_vid(surface, &id)) {
     // retrieve result
-    return Token{result->second};
+    return Token{id};
   } else {
     // insert
-    Vid id = size_++;
+    id = size_++;
     surface2id_[surface] = id;
     id2surface_[id] = surface;
     return Token{id};
@@ -58,17 +108,20 @@ Token Vocab<Token>::operator[](const std::string &surface) {
 
 template<class Token>
 std::string Vocab<Token>::at(const Token token) const {
-  return id2surface_.at(token.vid);
+  return c_str(token);
 }
 
 template<class Token>
 std::string Vocab<Token>::at_vid(Vid vid) const {
-  return id2surface_.at(vid);
+  return c_str(Token{vid});
 }
 
 template<class Token>
 Token Vocab<Token>::at(const std::string &surface) const {
-  return Token{surface2id_.at(surface)};
+  Vid id;
+  if(!find_vid(surface, &id))
+    throw std::out_of_range(std::string("surface form not in vocabulary: ") + surface);
+  return Token{id};
 }
 
 template<class Token>
@@ -81,54 +134,33 @@ Token Vocab<Token>::end() const {
   return Token{size_};
 }
 
-struct UGVocabHeader {
-  uint32_t size; /** size of vocabulary (and index) */
-  uint32_t unk_vid; /** vocabulary ID of UNK word */
-};
-
-struct UGIndexEntry {
-  uint32_t offset; /** offset of surface string */
-  uint32_t vid; /** vocabulary ID */
-};
-
-off_t fsize(const char *filename) {
-  struct stat st;
-
-  if (stat(filename, &st) == 0)
-    return st.st_size;
-
-  throw std::runtime_error(std::string("failed to stat file ") + filename);
-}
-
 template<class Token>
 void Vocab<Token>::load_ugsapt_tdx(const std::string &filename) {
   /* Load vocabulary from mtt-build .tdx format */
 
-  UGVocabHeader header;
-  FILE *fin = fopen(filename.c_str(), "rb");
-  if(fin == nullptr)
-    throw std::runtime_error(std::string("failed to open file ") + filename);
-
-  fread(&header, sizeof(header), 1, fin);
-
-  std::unique_ptr<UGIndexEntry[]> index(new UGIndexEntry[header.size]);
-  fread(index.get(), sizeof(UGIndexEntry), header.size, fin);
-
-  size_t strings_size =
-      fsize(filename.c_str())
-      - sizeof(UGVocabHeader)
-      - sizeof(UGIndexEntry) * header.size;
-
-  std::unique_ptr<char[]> strings(new char[strings_size]);
-  fread(strings.get(), sizeof(char), strings_size, fin);
-  fclose(fin);
-
-  for(size_t i = 0; i < header.size; i++) {
-    char *s = strings.get() + index[i].offset;
-    Vid id = index[i].vid;
-    std::string surface = s;
-    surface2id_[surface] = id;
-    id2surface_[id] = surface;
+  // no copy: surface forms stay in the mapping (and in the page cache, which is shared across processes)
+  file_ = std::make_shared<MappedFile>(filename);
+  if(file_->size() < sizeof(UGVocabHeader))
+    throw std::runtime_error(std::string("vocabulary file too short: ") + filename);
+  const UGVocabHeader &header = *reinterpret_cast<const UGVocabHeader *>(file_->ptr);
+  if(file_->size() < sizeof(UGVocabHeader) + sizeof(UGIndexEntry) * header.size)
+    throw std::runtime_error(std::string("vocabulary file too short: ") + filename);
+
+  index_ = reinterpret_cast<const UGIndexEntry *>(file_->ptr + sizeof(UGVocabHeader));
+  index_size_ = header.size;
+  strings_ = file_->ptr + sizeof(UGVocabHeader) + sizeof(UGIndexEntry) * header.size;
+  size_t strings_size = file_->size() - sizeof(UGVocabHeader) - sizeof(UGIndexEntry) * header.size;
+
+  // vids are dense: a flat offset array instead of a hash map
+  offsets_.assign(header.size, kNoOffset);
+  for(size_t i = 0; i < index_size_; i++) {
+    // each string must be terminated within the mapping, for strcmp() here and in find_vid()
+    if(index_[i].vid >= header.size || index_[i].offset >= strings_size
+       || !memchr(strings_ + index_[i].offset, 0, strings_size - index_[i].offset))
+      throw std::runtime_error(std::string("corrupt vocabulary index in ") + filename);
+    if(i > 0 && strcmp(strings_ + index_[i - 1].offset, strings_ + index_[i].offset) >= 0)
+      throw std::runtime_error(std::string("vocabulary index is not sorted in ") + filename);
+    offsets_[index_[i].vid] = index_[i].offset;
   }
   size_ = header.size;
 }
@@ -139,9 +171,13 @@ constexpr typename DummyVocab<Token>::Vid DummyVocab<Token>::kEOS;
 template<class Token>
 constexpr typename Vocab<Token>::Vid Vocab<Token>::kEOS;
 
+template<class Token>
+constexpr uint32_t Vocab<Token>::kNoOffset;
+
 // explicit template instantiation
 template class Vocab<SrcToken>;
 template class Vocab<TrgToken>;
+template class Vocab<SmallSrcToken>;
 
 template class DummyVocab<AlignmentLink>;
 
@@ -9,10 +9,16 @@
 
 #include <string>
 #include <cassert>
+#include <cstdint>
+#include <memory>
 #include <unordered_map>
+#include <vector>
 
 namespace sto {
 
+class MappedFile;
+struct UGIndexEntry;
+
 /**
  * Vocabulary mapping between surface forms and Tokens (holding vocabulary IDs).
  * Choose between SrcToken and TrgToken from Types.h
@@ -26,11 +32,20 @@ public:
   /** Create empty vocabulary */
   Vocab();
 
-  /** Load vocabulary from mtt-build .tdx format */
+  /**
+   * Load vocabulary from mtt-build .tdx format.
+   *
+   * The file is memory mapped read-only: surface forms are served from the mapped string pool,
+   * and looked up by binary search in the (sorted) mapped index. Words inserted later are held
+   * in a separate, mutable overlay.
+   */
   Vocab(const std::string &filename);
 
   /** Returns the surface form of `token`. */
-  const std::string& operator[](const Token token) const;
+  std::string operator[](const Token token) const;
+
+  /** Returns the surface form of `token` without copying, valid for the lifetime of this Vocab. */
+  const char *c_str(const Token token) const;
 
   /** Returns the Token for the given `surface` form. May insert `surface`. */
   Token operator[](const std::string &surface);
@@ -48,10 +63,24 @@ public:
   Token end() const;
 
 private:
-  std::unordered_map<Vid, std::string> id2surface_;
-  std::unordered_map<std::string, Vid> surface2id_;
+  std::unordered_map<Vid, std::string> id2surface_; /** overlay: words not in the mapped file, and overrides */
+  std::unordered_map<std::string, Vid> surface2id_; /** overlay: words not in the mapped file, and overrides */
   Vid size_;
 
+  std::shared_ptr<MappedFile> file_; /** mapped .tdx file, if loaded */
+  const UGIndexEntry *index_; /** mapped index entries, sorted by surface form */
+  size_t index_size_; /** number of index entries */
+  const char *strings_; /** mapped string pool */
+  std::vector<uint32_t> offsets_; /** string pool offset for each vid in the mapped file, or kNoOffset */
+
+  static constexpr uint32_t kNoOffset = static_cast<uint32_t>(-1);
+
+  /** surface form of `vid`, or nullptr if unknown */
+  const char *find_surface(Vid vid) const;
+
+  /** @return true if `surface` is known, and sets `vid` */
+  bool find_vid(const std::string &surface, Vid *vid) const;
+
   /** Load vocabulary from mtt-build .tdx format */
   void load_ugsapt_tdx(const std::string &filename);
 };
@@ -65,6 +94,7 @@ public:
 
   std::string operator[](const Token token) const { assert(false); return std::string(); }
   std::string at(const Token token) const { assert(false); return std::string(); }
+  const char *c_str(const Token token) const { assert(false); return ""; }
 };
 
 } // namespace sto
@@ -0,0 +1,47 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#ifndef STO_ALIGNED_H
+#define STO_ALIGNED_H
+
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+namespace sto {
+
+/**
+ * Construct a T in storage aligned to alignof(T), e.g. for cache line aligned (alignas(64)) per-thread Records.
+ * Under C++11, plain 'new T' only guarantees alignof(std::max_align_t), and ignores over-alignment.
+ *
+ * Free with delete_aligned(), or never (e.g. Records which are reused for the lifetime of the process).
+ */
+template<class T, class... Args>
+T *new_aligned(Args&&... args) {
+  void *p = nullptr;
+  size_t alignment = alignof(T) < sizeof(void *) ? sizeof(void *) : alignof(T); // posix_memalign() minimum
+  if(posix_memalign(&p, alignment, sizeof(T)) != 0)
+    throw std::bad_alloc();
+  try {
+    return new(p) T(std::forward<Args>(args)...);
+  } catch(...) {
+    free(p);
+    throw;
+  }
+}
+
+/** destroy and free a T allocated by new_aligned() */
+template<class T>
+void delete_aligned(T *obj) {
+  if(!obj)
+    return;
+  obj->~T();
+  free(obj);
+}
+
+} // namespace sto
+
+#endif //STO_ALIGNED_H
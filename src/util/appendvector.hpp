@@ -0,0 +1,136 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#ifndef STO_APPENDVECTOR_H
+#define STO_APPENDVECTOR_H
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+
+namespace sto {
+
+/**
+ * Append-only vector which never moves its elements, for concurrent reading while appending.
+ *
+ * Elements are stored in segments of doubling size: segment k holds kFirstSegment << k elements, so a fixed,
+ * small directory of segment pointers covers any size, and is never reallocated either. Random access
+ * and pointers to elements stay valid for the lifetime of the AppendVector.
+ *
+ * Thread safety guarantees:
+ *
+ * There may be a single thread appending at any time, concurrently with multiple threads reading.
+ * Appends write the new elements first, and then publish them by increasing size() atomically (release).
+ * Readers may access all elements below a size() they have observed, without locks.
+ *
+ * T must be trivially destructible, and need not be default constructible: padding elements are left unconstructed.
+ * kFirstSegment must be a power of two.
+ */
+template<typename T, size_t kFirstSegment = 1024>
+class AppendVector {
+public:
+  typedef std::size_t size_type;
+
+  AppendVector() : size_(0) {
+    for(auto &segment : segments_)
+      segment.store(nullptr, std::memory_order_relaxed);
+  }
+  /** the owner must ensure that there are no readers left. */
+  ~AppendVector() {
+    for(auto &segment : segments_)
+      ::operator delete(segment.load(std::memory_order_relaxed));
+  }
+  AppendVector(const AppendVector &) = delete;
+  AppendVector &operator=(const AppendVector &) = delete;
+
+  /** number of published elements */
+  size_type size() const { return size_.load(std::memory_order_acquire); }
+  bool empty() const { return size() == 0; }
+
+  const T &operator[](size_type i) const {
+    size_type k = segment_of(i);
+    return segments_[k].load(std::memory_order_acquire)[i - segment_begin(k)];
+  }
+
+  /** append and publish a single element. */
+  void push_back(const T &value) {
+    size_type i = size_.load(std::memory_order_relaxed);
+    new(&slot(i)) T(value);
+    size_.store(i + 1, std::memory_order_release);
+  }
+
+  /**
+   * Append and publish 'n' elements (n <= kFirstSegment), which are guaranteed to be contiguous in memory.
+   * If they do not fit into the rest of the current segment, the rest is skipped and left as padding.
+   *
+   * @return index of the first appended element
+   */
+  size_type append_contiguous(const T *values, size_type n) {
+    assert(n <= kFirstSegment);
+    size_type begin = size_.load(std::memory_order_relaxed);
+    size_type k = segment_of(begin);
+    if(n > 0 && segment_of(begin + n - 1) != k)
+      begin = segment_begin(++k); // skip to the next segment
+    T *dest = segment(k) + (begin - segment_begin(k)); // allocates even if n == 0, so &(*this)[begin] is valid
+    for(size_type j = 0; j < n; j++)
+      new(dest + j) T(values[j]);
+    size_.store(begin + n, std::memory_order_release);
+    return begin;
+  }
+
+  /** remove all elements and release their memory. There must not be any concurrent readers. */
+  void clear() {
+    size_.store(0, std::memory_order_relaxed);
+    for(auto &segment : segments_)
+      ::operator delete(segment.exchange(nullptr, std::memory_order_relaxed));
+  }
+
+private:
+  static constexpr size_type kMaxSegments = 64 - 10; /** enough for 64-bit indices with any kFirstSegment >= 1024 */
+  static_assert((kFirstSegment & (kFirstSegment - 1)) == 0, "kFirstSegment must be a power of two");
+  static_assert(kFirstSegment >= 1024, "kFirstSegment too small for kMaxSegments");
+  static_assert(std::is_trivially_destructible<T>::value, "elements are never destructed");
+
+  std::array<std::atomic<T *>, kMaxSegments> segments_;
+  std::atomic<size_type> size_;
+
+  /** index of the segment holding element i: floor(log2(i / kFirstSegment + 1)) */
+  static size_type segment_of(size_type i) {
+    return static_cast<size_type>(63 - __builtin_clzll(static_cast<unsigned long long>(i / kFirstSegment + 1)));
+  }
+  /** index of the first element in segment k */
+  static size_type segment_begin(size_type k) {
+    return kFirstSegment * ((size_type(1) << k) - 1);
+  }
+
+  /** writer only: segment k, allocated if necessary. */
+  T *segment(size_type k) {
+    T *seg = segments_[k].load(std::memory_order_relaxed);
+    if(seg == nullptr) {
+      seg = static_cast<T *>(::operator new(sizeof(T) * (kFirstSegment << k)));
+      // the segment becomes visible to readers with their acquire of a size() covering it (or of this pointer)
+      segments_[k].store(seg, std::memory_order_release);
+    }
+    return seg;
+  }
+
+  /** writer only: storage of element i, allocating its segment if necessary. */
+  T &slot(size_type i) {
+    size_type k = segment_of(i);
+    return segment(k)[i - segment_begin(k)];
+  }
+};
+
+template<typename T, size_t kFirstSegment>
+constexpr typename AppendVector<T, kFirstSegment>::size_type AppendVector<T, kFirstSegment>::kMaxSegments;
+
+} // namespace sto
+
+#endif //STO_APPENDVECTOR_H
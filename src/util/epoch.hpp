@@ -0,0 +1,196 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#ifndef STO_EPOCH_H
+#define STO_EPOCH_H
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "aligned.hpp"
+
+namespace sto {
+
+/**
+ * Epoch-based memory reclamation for single-writer, multi-reader data structures.
+ *
+ * Readers enclose their traversals with an Epoch::Guard, which announces the global epoch they started in.
+ * Within a guard, they may follow raw pointers without any reference counting. A writer which unlinks an
+ * object hands it to a RetireList instead of deleting it. The object is deleted only after every reader
+ * which could still see it has left its guard.
+ *
+ * Entering and leaving a guard writes only to the reader thread's own (cache line sized) record, so readers
+ * do not contend with each other. Guards may be nested.
+ */
+class Epoch {
+public:
+  typedef uint64_t Value;
+  static constexpr Value kQuiescent = 0; /** announced by a thread outside of any guard */
+
+  /** per-thread reader announcement. Records are never freed, but reused after their thread exits. */
+  struct alignas(64) Record {
+    std::atomic<Value> epoch;
+    std::atomic<bool> in_use;
+    size_t depth; /** guard nesting depth, only accessed by the owning thread */
+    Record *next;
+
+    Record() : epoch(kQuiescent), in_use(true), depth(0), next(nullptr) {}
+  };
+
+  /** RAII reader section: pointers read while the guard exists stay valid until it is destroyed. */
+  class Guard {
+  public:
+    Guard() : record_(Epoch::local()) {
+      if(record_->depth++ == 0) {
+        record_->epoch.store(Epoch::global().load(std::memory_order_relaxed), std::memory_order_relaxed);
+        // announce our epoch before reading any pointers (pairs with the fence in RetireList::Reclaim())
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+      }
+    }
+    ~Guard() {
+      if(--record_->depth == 0)
+        record_->epoch.store(kQuiescent, std::memory_order_release);
+    }
+    Guard(const Guard &) = delete;
+    Guard &operator=(const Guard &) = delete;
+
+  private:
+    Record *record_;
+  };
+
+  /** @return the oldest epoch announced by any reader, or kQuiescent if no reader is in a guard. */
+  static Value MinActive() {
+    Value min = std::numeric_limits<Value>::max();
+    for(Record *r = head().load(std::memory_order_acquire); r != nullptr; r = r->next) {
+      Value e = r->epoch.load(std::memory_order_acquire);
+      if(e != kQuiescent)
+        min = std::min(min, e);
+    }
+    if(min == std::numeric_limits<Value>::max())
+      return kQuiescent;
+    return min;
+  }
+
+  /** start a new epoch. @return the new epoch */
+  static Value Advance() {
+    return global().fetch_add(1, std::memory_order_seq_cst) + 1;
+  }
+
+  /** current global epoch */
+  static Value Current() {
+    return global().load(std::memory_order_acquire);
+  }
+
+private:
+  static std::atomic<Value> &global() {
+    static std::atomic<Value> epoch(1); // never kQuiescent
+    return epoch;
+  }
+
+  static std::atomic<Record *> &head() {
+    static std::atomic<Record *> list(nullptr);
+    return list;
+  }
+
+  /** releases the thread's Record for reuse when the thread exits. */
+  struct LocalRecord {
+    Record *record;
+    LocalRecord() : record(Acquire()) {}
+    ~LocalRecord() {
+      record->epoch.store(kQuiescent, std::memory_order_release);
+      record->in_use.store(false, std::memory_order_release);
+    }
+  };
+
+  static Record *local() {
+    static thread_local LocalRecord local;
+    return local.record;
+  }
+
+  /** reuse a free Record, or prepend a new one to the list (lock-free) */
+  static Record *Acquire() {
+    for(Record *r = head().load(std::memory_order_acquire); r != nullptr; r = r->next) {
+      bool expected = false;
+      if(!r->in_use.load(std::memory_order_relaxed) && r->in_use.compare_exchange_strong(expected, true)) {
+        r->depth = 0;
+        return r;
+      }
+    }
+    Record *r = new_aligned<Record>(); // plain new ignores alignas(64) before C++17
+    Record *old_head = head().load(std::memory_order_relaxed);
+    do {
+      r->next = old_head;
+    } while(!head().compare_exchange_weak(old_head, r, std::memory_order_release, std::memory_order_relaxed));
+    return r;
+  }
+};
+
+/**
+ * Objects unlinked by a single writer, waiting to be deleted until no reader can access them anymore.
+ * Not thread safe itself: only the writer may call Retire() and Reclaim().
+ *
+ * Deleter frees an object, e.g. NodePool::Deleter for objects from a pool.
+ */
+template<typename T, typename Deleter = std::default_delete<T>>
+class RetireList {
+public:
+  /** reclaim after this many retired objects */
+  static constexpr size_t kReclaimThreshold = 64;
+
+  explicit RetireList(Deleter deleter = Deleter()) : deleter_(deleter) {}
+  RetireList(const RetireList &) = delete;
+  RetireList &operator=(const RetireList &) = delete;
+
+  /** deletes all objects still pending: the owner must ensure that there are no readers left. */
+  ~RetireList() {
+    for(auto &r : retired_)
+      deleter_(r.second);
+  }
+
+  /** defer 'delete obj' until all current readers have left their guards. 'obj' must already be unreachable. */
+  void Retire(T *obj) {
+    retired_.push_back(std::make_pair(Epoch::Current(), obj));
+    if(retired_.size() >= kReclaimThreshold)
+      Reclaim();
+  }
+
+  /** delete all retired objects which readers cannot access anymore. */
+  void Reclaim() {
+    // readers entering from now on cannot see any of retired_
+    Epoch::Advance();
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    Epoch::Value min_active = Epoch::MinActive();
+
+    size_t kept = 0;
+    for(size_t i = 0; i < retired_.size(); i++) {
+      // retired in epoch e: safe if every active reader entered in a later epoch
+      if(min_active == Epoch::kQuiescent || retired_[i].first < min_active)
+        deleter_(retired_[i].second);
+      else
+        retired_[kept++] = retired_[i];
+    }
+    retired_.resize(kept);
+  }
+
+  size_t size() const { return retired_.size(); }
+
+private:
+  std::vector<std::pair<Epoch::Value, T *>> retired_;
+  Deleter deleter_;
+};
+
+template<typename T, typename Deleter>
+constexpr size_t RetireList<T, Deleter>::kReclaimThreshold;
+
+} // namespace sto
+
+#endif //STO_EPOCH_H
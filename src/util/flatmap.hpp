@@ -0,0 +1,247 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#ifndef STO_FLATMAP_H
+#define STO_FLATMAP_H
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "epoch.hpp"
+
+namespace sto {
+
+/**
+ * Flat sorted map of vids that maintains partial sums of the entry sizes, with the same interface as RBTree.
+ * Keys and values are held in contiguous sorted arrays, partial sums in a Fenwick tree (binary indexed tree).
+ *
+ * Find() is a binary search over the packed key array, At() a descent through the Fenwick tree and
+ * AddSize() updates O(log n) counters in place, without allocations or reference counting along the way.
+ * Inserting a new key copies all entries, so this is geared towards read-mostly nodes, with few distinct
+ * keys inserted after construction (e.g. via BuildSorted()).
+ *
+ * Thread safety guarantees:
+ *
+ * There may be a single thread writing to the FlatMap at any time.
+ * Writing may occur concurrently with multiple threads reading. Inserts build a new copy of the entries
+ * which replaces the current one atomically, and the old copy is retired until readers have finished
+ * (see RetireList). Sizes are updated in place, with a best-effort presentation of write results to readers,
+ * like in RBTree. Readers access the entries within an Epoch::Guard, without reference counting.
+ *
+ * Template types:
+ *
+ * KeyType must support these operators: ==, <
+ * ValueType must currently have a default constructor
+ */
+template<typename KeyType, typename ValueType>
+class FlatMap {
+public:
+  typedef std::size_t size_type;
+
+  FlatMap() : entries_(new Entries(0)) {}
+  /** the owner must ensure that there are no readers left. */
+  ~FlatMap() {
+    delete entries_.load();
+  }
+
+  inline bool Contains(const KeyType& key) const {
+    return Find(key);
+  }
+  inline size_type Count() const {
+    Epoch::Guard guard;
+    return Current()->keys.size();
+  }
+  inline bool Empty() const {
+    return Count() == 0;
+  }
+
+  ValueType& FindOrInsert(const KeyType& key, size_t add_size = 0) {
+    Entries *entries = Current();
+    size_t i = entries->LowerBound(key);
+    if(i == entries->keys.size() || !(entries->keys[i] == key)) {
+      Entries *inserted = Insert(entries, i, key);
+      entries_.store(inserted, std::memory_order_release); // atomic replace
+      retired_.Retire(entries);
+      entries = inserted;
+    }
+    if(add_size != 0)
+      entries->AddSize(i, add_size);
+    return entries->values[i];
+  }
+
+  /** finds the entry for key, or inserts a new empty entry. */
+  ValueType& operator[](const KeyType& key) {
+    return FindOrInsert(key, /* add_size = */ 0);
+  }
+
+  bool Find(const KeyType& key, ValueType *val = nullptr) const {
+    Epoch::Guard guard;
+    Entries *entries = Current();
+    size_t i = entries->LowerBound(key);
+    if(i < entries->keys.size() && entries->keys[i] == key) {
+      if(val != nullptr)
+        *val = entries->values[i];
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  /** size of the entry with 'key' */
+  size_t ChildSize(const KeyType& key) const {
+    Epoch::Guard guard;
+    Entries *entries = Current();
+    size_t i = entries->LowerBound(key);
+    assert(i < entries->keys.size() && entries->keys[i] == key);
+    return entries->sizes[i].load(kOrder);
+  }
+
+  size_t Size() const {
+    Epoch::Guard guard;
+    return Current()->total.load(kOrder);
+  }
+
+  /**
+   * Random access into this map at a specific size offset.
+   * Changes 'offset' to be relative into the entry returned.
+   * */
+  ValueType At(size_t *offset) const {
+    Epoch::Guard guard;
+    Entries *entries = Current();
+    assert(!entries->keys.empty());
+    size_t n = entries->keys.size();
+
+    // Fenwick tree descent: find the largest pos with prefix sum <= offset, then pos is the index of our entry
+    size_t pos = 0, rem = *offset, step = 1;
+    while((step << 1) <= n)
+      step <<= 1;
+    for(; step > 0; step >>= 1) {
+      if(pos + step <= n) {
+        size_t sum = entries->tree[pos + step].load(kOrder);
+        if(sum <= rem) {
+          pos += step;
+          rem -= sum;
+        }
+      }
+    }
+    // concurrent writes may leave us beyond the last entry, which is then the best match
+    if(pos >= n) {
+      pos = n - 1;
+      rem = entries->sizes[pos].load(kOrder) > 0 ? entries->sizes[pos].load(kOrder) - 1 : 0;
+    }
+    *offset = rem;
+    return entries->values[pos];
+  }
+
+  void AddSize(const KeyType& key, size_t add_size) {
+    Entries *entries = Current();
+    size_t i = entries->LowerBound(key);
+    assert(i < entries->keys.size() && entries->keys[i] == key);
+    entries->AddSize(i, add_size);
+  }
+
+  /**
+   * Bulk-load this empty map from entries sorted by ascending key, each with its own size.
+   * Builds the partial sums in O(n), and publishes them at once.
+   */
+  void BuildSorted(const std::vector<KeyType> &keys, const std::vector<ValueType> &values, const std::vector<size_t> &sizes) {
+    assert(Empty());
+    assert(keys.size() == values.size() && keys.size() == sizes.size());
+
+    Entries *entries = new Entries(keys.size());
+    entries->keys = keys;
+    entries->values = values;
+    for(size_t i = 0; i < sizes.size(); i++)
+      entries->sizes[i].store(sizes[i], kOrder);
+    entries->BuildTree();
+
+    // thread safety: the entries are built separately, and become visible to readers with this assignment
+    retired_.Retire(entries_.exchange(entries, std::memory_order_acq_rel));
+  }
+
+  /** Walk map in key order and apply func(key, value) to each entry. */
+  template<typename Func>
+  void Walk(Func func) {
+    Epoch::Guard guard;
+    Entries *entries = Current();
+    for(size_t i = 0; i < entries->keys.size(); i++)
+      func(entries->keys[i], entries->values[i]);
+  }
+
+private:
+  static constexpr std::memory_order kOrder = std::memory_order_relaxed;
+
+  /** One immutable (except for sizes) version of the map entries. */
+  struct Entries {
+    std::vector<KeyType> keys;
+    std::vector<ValueType> values;
+    std::vector<std::atomic<size_t>> sizes; /** size of each entry */
+    std::vector<std::atomic<size_t>> tree; /** Fenwick tree over sizes, 1-based: tree[i] sums sizes (i - lowbit(i), i] */
+    std::atomic<size_t> total;
+
+    Entries(size_t n) : keys(n), values(n), sizes(n), tree(n + 1), total(0) {}
+
+    size_t LowerBound(const KeyType& key) const {
+      return std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+    }
+
+    void AddSize(size_t i, size_t add_size) {
+      // update from the entry upwards, like RBTree: readers will see children being at least as big as their partial sums
+      sizes[i].fetch_add(add_size, kOrder);
+      for(size_t pos = i + 1; pos < tree.size(); pos += pos & (~pos + 1))
+        tree[pos].fetch_add(add_size, kOrder);
+      total.fetch_add(add_size, kOrder);
+    }
+
+    /** Fill the Fenwick tree from sizes in O(n). */
+    void BuildTree() {
+      size_t sum = 0;
+      for(size_t pos = 1; pos < tree.size(); pos++)
+        tree[pos].store(sizes[pos - 1].load(kOrder), kOrder);
+      for(size_t pos = 1; pos < tree.size(); pos++) {
+        size_t parent = pos + (pos & (~pos + 1));
+        if(parent < tree.size())
+          tree[parent].store(tree[parent].load(kOrder) + tree[pos].load(kOrder), kOrder);
+        sum += sizes[pos - 1].load(kOrder);
+      }
+      total.store(sum, kOrder);
+    }
+  };
+
+  std::atomic<Entries *> entries_;
+  RetireList<Entries> retired_; /** replaced versions of the entries, waiting for readers to finish */
+
+  inline Entries *Current() const { return entries_.load(std::memory_order_acquire); }
+
+  /** @return a copy of 'entries' with a new empty entry for key, inserted at index i */
+  static Entries *Insert(const Entries *entries, size_t i, const KeyType& key) {
+    size_t n = entries->keys.size();
+    Entries *inserted = new Entries(n + 1);
+    for(size_t j = 0, k = 0; j <= n; j++) {
+      if(j == i) {
+        inserted->keys[j] = key;
+        continue;
+      }
+      inserted->keys[j] = entries->keys[k];
+      inserted->values[j] = entries->values[k];
+      inserted->sizes[j].store(entries->sizes[k].load(kOrder), kOrder);
+      k++;
+    }
+    inserted->BuildTree();
+    return inserted;
+  }
+};
+
+template<typename KeyType, typename ValueType>
+constexpr std::memory_order FlatMap<KeyType, ValueType>::kOrder;
+
+} // namespace sto
+
+#endif //STO_FLATMAP_H
@@ -0,0 +1,49 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#ifndef STO_FSYNC_H
+#define STO_FSYNC_H
+
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace sto {
+
+/*
+ * Durable file replacement: write a temporary file, sync_file() it, rename() it over the target, then sync_dir()
+ * the directory, so that both the new contents and the new directory entry survive a crash of the machine.
+ */
+
+/** flush and fsync() an open file, so that its contents survive a crash of the machine */
+inline void sync_file(FILE *file, const std::string &filename) {
+  if(fflush(file) != 0 || fsync(fileno(file)) != 0)
+    throw std::runtime_error(std::string("failed to sync ") + filename);
+}
+
+/** fsync() a file or directory by path */
+inline void sync_path(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0 || fsync(fd) != 0) {
+    if(fd >= 0)
+      close(fd);
+    throw std::runtime_error(std::string("failed to sync ") + path);
+  }
+  close(fd);
+}
+
+/** fsync() the directory containing 'filename', e.g. after renaming a file into it */
+inline void sync_dir(const std::string &filename) {
+  size_t slash = filename.rfind('/');
+  sync_path(slash == std::string::npos ? "." : slash == 0 ? "/" : filename.substr(0, slash));
+}
+
+} // namespace sto
+
+#endif //STO_FSYNC_H
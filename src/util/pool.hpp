@@ -0,0 +1,138 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#ifndef STO_POOL_H
+#define STO_POOL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace sto {
+
+/**
+ * Slab allocator for many small objects of type T, owned by a single data structure (e.g. the nodes of an RBTree).
+ *
+ * Objects are placed into slabs sized to half the number of live objects (kFirstSlab up to kMaxSlab objects), so that
+ * small pools stay small, at most a third of a growing pool's slots are unused, and large pools need few slab allocations.
+ * Reserve() sizes the first slab exactly, for owners which know their size up front (see RBTree::BuildSorted()).
+ * Deleted slots go onto an intrusive free list and are reused by New().
+ * All slabs are freed in bulk by ~NodePool(), without visiting the objects if T is trivially destructible.
+ *
+ * Not thread safe: only the writer may call New() and Delete(). Objects which readers may still access must be
+ * retired first and deleted after the grace period (see RetireList with NodePool::Deleter), exactly as with delete.
+ */
+template<typename T, size_t kFirstSlab = 1, size_t kMaxSlab = 1024>
+class NodePool {
+public:
+  /** deleter for RetireList and std::unique_ptr, returning objects to their pool */
+  struct Deleter {
+    NodePool *pool;
+    Deleter(NodePool *p = nullptr) : pool(p) {}
+    void operator()(T *obj) const { pool->Delete(obj); }
+  };
+
+  NodePool() : free_(nullptr), next_(0), live_(0) {}
+  NodePool(const NodePool &) = delete;
+  NodePool &operator=(const NodePool &) = delete;
+
+  /** releases all slabs. Objects still live are destructed only if T is not trivially destructible. */
+  ~NodePool() {
+    if(!std::is_trivially_destructible<T>::value && live_ > 0)
+      DestroyLive();
+  }
+
+  /** construct a T in a free slot */
+  template<typename... Args>
+  T *New(Args&&... args) {
+    void *slot = Allocate();
+    T *obj = new(slot) T(std::forward<Args>(args)...);
+    live_++;
+    return obj;
+  }
+
+  /** empty pool only: allocate a first slab of exactly 'n' slots, instead of growing from kFirstSlab */
+  void Reserve(size_t n) {
+    if(slabs_.empty() && n > 0)
+      AddSlab(n);
+  }
+
+  /** destruct 'obj' and put its slot onto the free list */
+  void Delete(T *obj) {
+    obj->~T();
+    Slot *slot = reinterpret_cast<Slot *>(obj);
+    slot->next = free_;
+    free_ = slot;
+    live_--;
+  }
+
+  /** number of live objects */
+  size_t size() const { return live_; }
+
+  /** number of allocated slots */
+  size_t capacity() const {
+    size_t n = 0;
+    for(auto &s : slabs_)
+      n += s.size;
+    return n;
+  }
+
+private:
+  union Slot {
+    Slot *next; /** while on the free list */
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+  struct Slab {
+    std::unique_ptr<Slot[]> slots;
+    size_t size;
+  };
+
+  std::vector<Slab> slabs_;
+  Slot *free_; /** free list of deleted slots */
+  size_t next_; /** next unused slot in slabs_.back() */
+  size_t live_;
+
+  void *Allocate() {
+    if(free_ != nullptr) {
+      Slot *slot = free_;
+      free_ = slot->next;
+      return slot;
+    }
+    if(slabs_.empty() || next_ == slabs_.back().size)
+      AddSlab(std::max(kFirstSlab, std::min(live_ / 2, kMaxSlab)));
+    return &slabs_.back().slots[next_++];
+  }
+
+  void AddSlab(size_t size) {
+    slabs_.push_back(Slab{std::unique_ptr<Slot[]>(new Slot[size]), size});
+    next_ = 0;
+  }
+
+  /** destruct all objects not on the free list (slow path, only for non-trivial T) */
+  void DestroyLive() {
+    std::vector<const Slot *> free;
+    for(const Slot *s = free_; s != nullptr; s = s->next)
+      free.push_back(s);
+    std::sort(free.begin(), free.end(), std::less<const Slot *>());
+    for(size_t i = 0; i < slabs_.size(); i++) {
+      size_t used = (i + 1 == slabs_.size()) ? next_ : slabs_[i].size;
+      for(size_t j = 0; j < used; j++) {
+        Slot *s = &slabs_[i].slots[j];
+        if(!std::binary_search(free.begin(), free.end(), s, std::less<const Slot *>()))
+          reinterpret_cast<T *>(s)->~T();
+      }
+    }
+  }
+};
+
+} // namespace sto
+
+#endif //STO_POOL_H
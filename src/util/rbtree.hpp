@@ -15,12 +15,18 @@
 #include <iostream>
 #include <sstream>
 
+#include <atomic>
 #include <memory>
 #include <vector>
 #include <cstddef>
 #include <cassert>
+#include <type_traits>
 #include <utility>
 
+#include "epoch.hpp"
+#include "pool.hpp"
+#include "stats.hpp"
+
 namespace sto {
 
 
@@ -37,6 +43,14 @@ namespace sto {
  * Writing may occur concurrently with multiple threads reading. In this case, every call to the RBTree
  * presents a consistent (valid) state, but with a best-effort presentation of write results to readers.
  *
+ * Readers traverse raw pointers within an Epoch::Guard, without any reference counting. Rotations replace
+ * nodes by modified copies, and the writer retires the old nodes, which are deleted once no reader can
+ * access them anymore (see RetireList).
+ *
+ * Nodes are allocated from the tree's own NodePool, which improves locality and frees them in bulk on destruction.
+ * The pool grows from a single node, and bulk-loaded trees get exactly one slab (see BuildSorted()),
+ * so the many small trees of deep TreeNodes do not pay for unused slots.
+ *
  * Template types:
  *
  * KeyType must support these operators: !=, ==, <, >
@@ -47,20 +61,24 @@ class RBTree {
  public:
   typedef std::size_t size_type;
 
-  inline RBTree() : nil_(new Node), count_(0) {
-    root_ = nil_;
+  inline RBTree() : nil_(new Node), count_(0), retired_(typename NodePool<Node>::Deleter(&pool_)) {
+    root_.store(nil_);
     nil_->parent = nil_;
-    nil_->left = nil_;
-    nil_->right = nil_;
+    nil_->left.store(nil_);
+    nil_->right.store(nil_);
     nil_->color = kBlack;
   }
+  /** the owner must ensure that there are no readers left. */
   inline ~RBTree() {
-    root_.reset();
-    nil_.reset();
+    // with trivially destructible nodes, ~NodePool() frees them all in bulk
+    if(!std::is_trivially_destructible<Node>::value)
+      DeleteSubtree(Root());
+    delete nil_;
   }
   bool Remove(const KeyType& key);
   inline bool Contains(const KeyType& key) const {
-    std::shared_ptr<Node> node = FindNodeOrParent(key);
+    Epoch::Guard guard;
+    Node *node = FindNodeOrParent(key);
     return !IsNil(node) && node->key == key;
   }
   inline size_type Count() const {
@@ -71,7 +89,7 @@ class RBTree {
   }
 
   ValueType& FindOrInsert(const KeyType& key, size_t add_size = 0) {
-    std::pair<std::shared_ptr<Node> , bool> result = Put(key);
+    std::pair<Node *, bool> result = Put(key);
     if(add_size != 0)
       AddSize(result.first, add_size); // update node's and ancestors' partial_sums
     return result.first->value;
@@ -83,7 +101,8 @@ class RBTree {
   }
 
   bool Find(const KeyType& key, ValueType *val = nullptr) const {
-    std::shared_ptr<Node> node = FindNodeOrParent(key);
+    Epoch::Guard guard;
+    Node *node = FindNodeOrParent(key);
     if(!IsNil(node) && node->key == key) {
       if(val != nullptr)
         *val = node->value;
@@ -94,42 +113,69 @@ class RBTree {
   }
 
   void Print() {
-    PrintTree(root_);
+    PrintTree();
   }
 
-  // debug only
+  /** size of the entry with 'key' itself (without the partial sums of its subtree) */
   size_t ChildSize(const KeyType& key) const {
-    std::shared_ptr<Node> node = FindNodeOrParent(key);
+    Epoch::Guard guard;
+    Node *node = FindNodeOrParent(key);
     assert(!IsNil(node) && node->key == key);
-    return node->partial_sum;
+    return OwnSize(node);
   }
 
   size_t Size() const {
-    return root_->partial_sum;
+    Epoch::Guard guard;
+    return PartialSum(Root());
   }
 
   /**
    * Random access into this tree at a specific size offset.
    * Changes 'offset' to be relative into the node returned.
    * */
-  ValueType& At(size_t *offset) {
-    std::shared_ptr<Node> node = At(root_, *offset);
+  ValueType At(size_t *offset) const {
+    Epoch::Guard guard;
+    Node *node = At(Root(), *offset);
     return node->value;
   }
 
   void AddSize(const KeyType& key, size_t add_size) {
-    std::shared_ptr<Node> node = FindNodeOrParent(key);
+    Node *node = FindNodeOrParent(key);
     assert(!IsNil(node) && node->key == key);
     AddSize(node, add_size);
   }
 
+  /**
+   * Bulk-load this empty tree from entries sorted by ascending key, each with its own size.
+   * Builds a balanced tree in O(n), filling partial sums bottom-up, and publishes it at once.
+   */
+  void BuildSorted(const std::vector<KeyType> &keys, const std::vector<ValueType> &values, const std::vector<size_t> &sizes) {
+    assert(Empty());
+    assert(keys.size() == values.size() && keys.size() == sizes.size());
+
+    // nodes below the last complete level are red, all others black: equal black height on all paths
+    size_t red_depth = 0;
+    while((static_cast<size_t>(2) << red_depth) <= keys.size() + 1)
+      red_depth++;
+
+    // thread safety: the tree is built separately, and becomes visible to readers with the root_ assignment
+    pool_.Reserve(keys.size());
+    Node *root = BuildSorted(keys, values, sizes, 0, keys.size(), 0, red_depth, nil_);
+    count_ = keys.size();
+    root_.store(root, std::memory_order_release);
+  }
+
   /** Walk tree in-order and apply func(key, value) to each node. */
   template<typename Func>
   void Walk(Func func) {
-    Walk(root_, func);
+    Epoch::Guard guard;
+    Walk(Root(), func);
   }
 
-  /** Walking keys in ascending order, supporting standard operations (range-based for loop over RBTree). */
+  /**
+   * Walking keys in ascending order, supporting standard operations (range-based for loop over RBTree).
+   * Not protected against concurrent writes, since it keeps pointers across calls.
+   */
   class Iterator {
   public:
     Iterator &operator++() {
@@ -154,8 +200,8 @@ class RBTree {
         switch(top->second) {
           case kLeft:
             top->second = kYield;
-            if(top->first->left != nil_) {
-              path_.push_back(std::make_pair(top->first->left, kLeft));
+            if(Left(top->first) != nil_) {
+              path_.push_back(std::make_pair(Left(top->first), kLeft));
             }
             break;
 
@@ -167,13 +213,13 @@ class RBTree {
 
           case kRight:
             top->second = kDone;
-            if(top->first->right != nil_) {
-              path_.push_back(std::make_pair(top->first->right, kLeft));
+            if(Right(top->first) != nil_) {
+              path_.push_back(std::make_pair(Right(top->first), kLeft));
             } else {
               path_.pop_back();
               if(path_.size() == 0) {
                 // reached end() at depth = 0 -- with single-entry tree
-                cur_.reset();
+                cur_ = nullptr;
                 return *this;
               }
             }
@@ -181,7 +227,7 @@ class RBTree {
 
           case kDone:
             // reached end() in some depth > 0
-            cur_.reset();
+            cur_ = nullptr;
             return *this;
             break;
 
@@ -206,13 +252,13 @@ class RBTree {
 
     enum IterState { kLeft, kYield, kRight, kDone };
 
-    std::vector<std::pair<std::shared_ptr<Node>, IterState>> path_; /** tree path from the root (a stack substitute) */
-    std::shared_ptr<Node> cur_; /** current node, nullptr for end() */
-    std::shared_ptr<Node> nil_;
+    std::vector<std::pair<Node *, IterState>> path_; /** tree path from the root (a stack substitute) */
+    Node *cur_ = nullptr; /** current node, nullptr for end() */
+    Node *nil_ = nullptr;
 
 
     /** constructs begin() iterator */
-    Iterator(std::shared_ptr<Node> root, std::shared_ptr<Node> nil) : nil_(nil) {
+    Iterator(Node *root, Node *nil) : nil_(nil) {
       if(root != nil) {
         path_.push_back(std::make_pair(root, kLeft));
         operator++();
@@ -223,7 +269,7 @@ class RBTree {
     Iterator() {}
   };
 
-  Iterator begin() { return Iterator(root_, nil_); }
+  Iterator begin() { return Iterator(Root(), nil_); }
   Iterator end() { return Iterator(); }
 
 
@@ -233,54 +279,66 @@ class RBTree {
   struct Node {
     KeyType key;
 
-    size_t partial_sum; /** size sum of this node + its children */
-    size_t own_size; /** size of this node only */
+    std::atomic<size_t> partial_sum; /** size sum of this node + its children */
+    std::atomic<size_t> own_size; /** size of this node only */
     ValueType value;
 
-    Node(std::shared_ptr<Node> p, std::shared_ptr<Node> l, std::shared_ptr<Node> r, Color c, KeyType k): key(k), partial_sum(0), own_size(0), value(), parent(p), left(l), right(r), color(c) {}
+    Node(Node *p, Node *l, Node *r, Color c, KeyType k): key(k), partial_sum(0), own_size(0), value(), parent(p), left(l), right(r), color(c) {}
 
-    Node(): partial_sum(0), own_size(0), value(), parent(), left(nullptr), right(nullptr) {}
+    Node(): partial_sum(0), own_size(0), value(), parent(nullptr), left(nullptr), right(nullptr) {}
 
   private:
-    std::weak_ptr<Node> parent; /** only used for modifying access, hence we don't need reference counting (and also break reference cycles here) */
-    std::shared_ptr<Node> left;
-    std::shared_ptr<Node> right;
+    Node *parent; /** only used for modifying access by the writer */
+    std::atomic<Node *> left; /** published with release stores, so readers always see fully constructed nodes */
+    std::atomic<Node *> right;
     Color color;
 
     friend class RBTree<KeyType, ValueType>;
   };
 
+  static inline Node *Left(const Node *node) { return node->left.load(std::memory_order_acquire); }
+  static inline Node *Right(const Node *node) { return node->right.load(std::memory_order_acquire); }
+  static inline size_t PartialSum(const Node *node) { return node->partial_sum.load(std::memory_order_relaxed); }
+  static inline size_t OwnSize(const Node *node) { return node->own_size.load(std::memory_order_relaxed); }
+  inline Node *Root() const { return root_.load(std::memory_order_acquire); }
+
   /** find or insert */
-  std::pair<std::shared_ptr<Node> , bool> Put(const KeyType& key);
+  std::pair<Node *, bool> Put(const KeyType& key);
 
   /** update node's and ancestors' partial_sums */
-  inline void AddSize(std::shared_ptr<Node> node, size_t add_size) {
-    node->own_size += add_size;
+  inline void AddSize(Node *node, size_t add_size) {
+    // single writer: no read-modify-write necessary
+    node->own_size.store(OwnSize(node) + add_size, std::memory_order_relaxed);
 
-    std::shared_ptr<Node> n = node;
+    Node *n = node;
     while(!IsNil(n)) {
-      n->partial_sum += add_size;
-      n = n->parent.lock();
+      n->partial_sum.store(PartialSum(n) + add_size, std::memory_order_relaxed);
+      n = n->parent;
     }
   }
 
   // note: changes offset to be relative into the node returned
-  inline std::shared_ptr<Node> At(std::shared_ptr<Node> node, size_t &offset) {
-    //std::shared_ptr<Node> prev = node;
-    assert(offset < node->partial_sum);
+  inline Node *At(Node *node, size_t &offset) const {
+    //Node *prev = node;
+    assert(offset < PartialSum(node));
+    STO_STATS_ONLY(size_t steps = 0);
 
     // nodes in-order like this: (left, node, right)
     while(node != nil_) {
       //prev = node;
+      STO_STATS_ONLY(steps++);
       // to do: to work with 0-sized nodes, this should be upper_bound style!
-      if(offset < node->left->partial_sum) {
-        node = node->left;
-      } else if(offset < node->left->partial_sum + node->own_size) {
-        offset -= node->left->partial_sum;
+      Node *left = Left(node);
+      size_t left_sum = PartialSum(left), own_size = OwnSize(node);
+      if(offset < left_sum) {
+        node = left;
+      } else if(offset < left_sum + own_size) {
+        offset -= left_sum;
+        STO_STATS_RECORD(kRBTreeSteps, steps);
         return node;
       } else { // offset < node->left->partial_sum + node->own_size + node->right->partial_sum == node->partial_sum
-        offset -= node->left->partial_sum + node->own_size;
-        node = node->right;
+        offset -= left_sum + own_size;
+        node = Right(node);
       }
     }
     assert(false);
@@ -288,102 +346,123 @@ class RBTree {
     return nullptr;
   }
 
+  /** build balanced subtree from sorted entries [lo, hi), see BuildSorted() */
+  Node *BuildSorted(const std::vector<KeyType> &keys, const std::vector<ValueType> &values, const std::vector<size_t> &sizes,
+                    size_t lo, size_t hi, size_t depth, size_t red_depth, Node *parent) {
+    if(lo >= hi)
+      return nil_;
+    size_t mid = lo + (hi - lo) / 2;
+
+    // Node(parent, left, right, color, key)
+    Node *node = pool_.New(parent, nil_, nil_, depth == red_depth ? kRed : kBlack, keys[mid]);
+    node->value = values[mid];
+    node->own_size.store(sizes[mid], std::memory_order_relaxed);
+    node->left.store(BuildSorted(keys, values, sizes, lo, mid, depth + 1, red_depth, node), std::memory_order_relaxed);
+    node->right.store(BuildSorted(keys, values, sizes, mid + 1, hi, depth + 1, red_depth, node), std::memory_order_relaxed);
+    node->partial_sum.store(OwnSize(node) + PartialSum(Left(node)) + PartialSum(Right(node)), std::memory_order_relaxed);
+    return node;
+  }
+
   template<typename Func>
-  void Walk(std::shared_ptr<Node> node, Func func) {
+  void Walk(Node *node, Func func) {
     if (node != nil_) {
-      Walk(node->left, func);
+      Walk(Left(node), func);
       func(node->key, node->value);
-      Walk(node->right, func);
+      Walk(Right(node), func);
+    }
+  }
+
+  /** delete all nodes of the subtree (no readers must be left) */
+  void DeleteSubtree(Node *node) {
+    if (node != nil_) {
+      DeleteSubtree(Left(node));
+      DeleteSubtree(Right(node));
+      pool_.Delete(node);
     }
   }
 
 
   // debug only
   template<typename Func>
-  void WalkNodePre(std::weak_ptr<Node> n, Func func, size_t depth = 0) {
-    const Node *node = n.lock().get();
-    func(n, depth);
-    if (n.lock() != nil_ && (node->left != nil_ || node->right != nil_)) {
-      WalkNodePre(node->left, func, depth + 1);
-      WalkNodePre(node->right, func, depth + 1);
+  void WalkNodePre(Node *node, Func func, size_t depth = 0) {
+    func(node, depth);
+    if (node != nil_ && (Left(node) != nil_ || Right(node) != nil_)) {
+      WalkNodePre(Left(node), func, depth + 1);
+      WalkNodePre(Right(node), func, depth + 1);
     }
   }
 
   // debug only
-  void PrintTree(std::weak_ptr<Node> par) {
-    std::cerr << " PrintTree parent.use_count()=" << par.use_count() << std::endl;
+  void PrintTree() {
+    Epoch::Guard guard;
 
     //func(key, value)
-    std::shared_ptr<Node> nil = nil_;
+    Node *nil = nil_;
     std::cerr << std::endl;
-    WalkNodePre(root_, [&nil](std::weak_ptr<Node> n, size_t depth) {
+    WalkNodePre(Root(), [&nil](Node *node, size_t depth) {
       std::stringstream ss; for(size_t i = 0; i < depth; i++) ss << " ";
-      if(n.lock() == nil) {
+      if(node == nil) {
         std::cerr << ss.str() << "nil_" << std::endl;
         return;
       }
-      // there is a stacked order of locking/unlocking if you do this (multiple locks are acquired and released after the statement):
-      //std::cerr << ss.str() << "vid=" << n.lock()->key << " (s use_count=" << (n.lock().use_count() - 1) << ", w use_count=" << n.use_count() << ") " << n.lock().get() << std::endl;
-      std::shared_ptr<Node> node = n.lock();
-      //std::cerr << ss.str() << "vid=" << node->key << " (s use_count=" << (node.use_count() - 1) << ") " << node.get() << std::endl;
-      std::cerr << ss.str() << "vid=" << node->key << " (partial_sum=" << node->partial_sum << " own_size=" << node->own_size << ") " << node.get() << std::endl;
+      std::cerr << ss.str() << "vid=" << node->key << " (partial_sum=" << PartialSum(node) << " own_size=" << OwnSize(node) << ") " << node << std::endl;
     });
     std::cerr << std::endl;
   }
 
 
-  inline const std::shared_ptr<Node> GetRoot() const {
-    return root_;
+  inline Node *GetRoot() const {
+    return Root();
   }
-  inline bool IsNil(const std::shared_ptr<Node> node) const {
+  inline bool IsNil(const Node *node) const {
     return node == nil_;
   }
-  inline bool IsRed(const std::shared_ptr<Node> node) const {
+  inline bool IsRed(const Node *node) const {
     return node->color == kRed;
   }
-  inline bool IsBlack(const std::shared_ptr<Node> node) const {
+  inline bool IsBlack(const Node *node) const {
     return node->color == kBlack;
   }
 
  private:
-  inline void SetRed(std::shared_ptr<Node> node) {
+  inline void SetRed(Node *node) {
     assert(node != nil_);
     node->color = kRed;
   }
-  inline void SetBlack(std::shared_ptr<Node> node) {
+  inline void SetBlack(Node *node) {
     node->color = kBlack;
   }
-  inline bool IsLeftChild(const std::shared_ptr<Node> node) const {
-    return node->parent.lock()->left == node;
+  inline bool IsLeftChild(const Node *node) const {
+    return Left(node->parent) == node;
   }
-  inline bool IsRightChild(const std::shared_ptr<Node> node) const {
-    return node->parent.lock()->right == node;
+  inline bool IsRightChild(const Node *node) const {
+    return Right(node->parent) == node;
   }
-  inline void SetLeft(std::shared_ptr<Node> node, std::shared_ptr<Node> child) {
+  inline void SetLeft(Node *node, Node *child) {
     assert(!IsNil(node));
     if (!IsNil(child))
       child->parent = node;
-    node->left = child;
+    node->left.store(child, std::memory_order_release);
   }
-  inline void SetRight(std::shared_ptr<Node> node, std::shared_ptr<Node> child) {
+  inline void SetRight(Node *node, Node *child) {
     assert(!IsNil(node));
     if (!IsNil(child))
       child->parent = node;
-    node->right = child;
+    node->right.store(child, std::memory_order_release);
   }
-  inline std::shared_ptr<Node> GetSibling(const std::shared_ptr<Node> node) const {
+  inline Node *GetSibling(const Node *node) const {
     if (IsLeftChild(node))
-      return node->parent.lock()->right;
+      return Right(node->parent);
     else if (IsRightChild(node))
-      return node->parent.lock()->left;
+      return Left(node->parent);
     assert(false);
     return nullptr;
   }
-  inline std::shared_ptr<Node> ReplaceChild(std::shared_ptr<Node> child, std::shared_ptr<Node> new_child) {
-    std::shared_ptr<Node> parent = child->parent.lock();
+  inline Node *ReplaceChild(Node *child, Node *new_child) {
+    Node *parent = child->parent;
     if (IsNil(parent)) {
       new_child->parent = nil_;
-      root_ = new_child;
+      root_.store(new_child, std::memory_order_release);
     } else if (IsLeftChild(child)) {
       SetLeft(parent, new_child);
     } else if (IsRightChild(child)) {
@@ -393,50 +472,41 @@ class RBTree {
   }
 
   /** See comments on RightRotate() */
-  inline std::shared_ptr<Node> LeftRotate(std::shared_ptr<Node> node, std::shared_ptr<Node> keepRef) {
-    assert(node != nil_ && node->right != nil_);
-    std::shared_ptr<Node> child = node->right;
+  inline Node *LeftRotate(Node *node) {
+    assert(node != nil_ && Right(node) != nil_);
+    Node *child = Right(node);
 
     // Node(parent, left, right, color, key)
-    std::shared_ptr<Node> p = std::make_shared<Node>(nil_ /* set below */, node->left, child->left, child->color, node->key); p->value = node->value;
-    std::shared_ptr<Node> q = std::make_shared<Node>(node, p, child->right, node->color, child->key); q->value = child->value;
+    Node *p = pool_.New(nil_ /* set below */, Left(node), Left(child), child->color, node->key); p->value = node->value;
+    Node *q = pool_.New(node->parent, p, Right(child), node->color, child->key); q->value = child->value;
     p->parent = q;
-    q->own_size = child->own_size;
-    q->partial_sum = node->partial_sum;
-    p->own_size = node->own_size;
-    p->partial_sum = p->own_size + p->left->partial_sum + p->right->partial_sum;
+    q->own_size.store(OwnSize(child), std::memory_order_relaxed);
+    q->partial_sum.store(PartialSum(node), std::memory_order_relaxed);
+    p->own_size.store(OwnSize(node), std::memory_order_relaxed);
+    p->partial_sum.store(OwnSize(p) + PartialSum(Left(p)) + PartialSum(Right(p)), std::memory_order_relaxed);
     ReplaceChild(node, q);
 
-    // keep the reference to the node just inserted
-    if(node == keepRef) {
-      *node = *p;
-      ReplaceChild(p, node);
-      p = node;
-    }
-    if(child == keepRef) {
-      *child = *q;
-      ReplaceChild(q, child);
-      q = child;
-      p->parent = q;
-    }
-
     // before, (a, b, c) nodes still have their old parents.
-    if(p->left != nil_) p->left->parent = p;
-    if(p->right != nil_) p->right->parent = p;
-    if(q->right != nil_) q->right->parent = q;
+    if(Left(p) != nil_) Left(p)->parent = p;
+    if(Right(p) != nil_) Right(p)->parent = p;
+    if(Right(q) != nil_) Right(q)->parent = q;
+
+    // readers may still be traversing the old nodes, which keep valid links into the tree
+    retired_.Retire(node);
+    retired_.Retire(child);
 
     return q;
   }
   /**
    * LeftRotate() and RightRotate() need to allocate two new nodes for P and Q, make them valid,
    * then swap them.
-   * Since delete of the two old nodes depends on their usage from reading threads, we must use
-   * shared_ptr to do thread-safe atomic reference counting and release memory when appropriate.
-   * Note that the newly inserted node, keepRef, is kept in the tree structure, for Put() reference re-use.
+   * Since delete of the two old nodes depends on their usage from reading threads, they are retired
+   * and deleted only after all readers which may have seen them have finished, see RetireList.
+   * Hence, any Node pointer held by the writer may become invalid after a rotation.
    */
-  inline std::shared_ptr<Node> RightRotate(std::shared_ptr<Node> node, std::shared_ptr<Node> keepRef) {
-    assert(node != nil_ && node->left != nil_);
-    std::shared_ptr<Node> child = node->left;
+  inline Node *RightRotate(Node *node) {
+    assert(node != nil_ && Left(node) != nil_);
+    Node *child = Left(node);
 
     // p, q: see picture of nodes at https://en.wikipedia.org/wiki/Tree_rotation#Illustration
     //
@@ -444,69 +514,53 @@ class RBTree {
     // and then swap it in in a valid state.
 
     // Node(parent, left, right, color, key)
-    std::shared_ptr<Node> q = std::make_shared<Node>(nil_ /* set below */, child->right, node->right, child->color, node->key); q->value = node->value;
-    std::shared_ptr<Node> p = std::make_shared<Node>(node, child->left, q, node->color, child->key); p->value = child->value;
+    Node *q = pool_.New(nil_ /* set below */, Right(child), Right(node), child->color, node->key); q->value = node->value;
+    Node *p = pool_.New(node->parent, Left(child), q, node->color, child->key); p->value = child->value;
     q->parent = p;
-    p->own_size = child->own_size;
-    p->partial_sum = node->partial_sum;
-    q->own_size = node->own_size;
-    q->partial_sum = q->own_size + q->left->partial_sum + q->right->partial_sum;
+    p->own_size.store(OwnSize(child), std::memory_order_relaxed);
+    p->partial_sum.store(PartialSum(node), std::memory_order_relaxed);
+    q->own_size.store(OwnSize(node), std::memory_order_relaxed);
+    q->partial_sum.store(OwnSize(q) + PartialSum(Left(q)) + PartialSum(Right(q)), std::memory_order_relaxed);
     ReplaceChild(node, p);
 
-    // keep the reference to the node just inserted
-    /*
-     * As an additional complication, the Put() implementation keeps the reference to the node just inserted.
-     * We could either search for that node again, or we can re-use that node's memory as we do now.
-     */
-    if(node == keepRef) {
-      *node = *q;
-      ReplaceChild(q, node);
-      q = node;
-    }
-    if(child == keepRef) {
-      *child = *p;
-      ReplaceChild(p, child);
-      p = child;
-      q->parent = p;
-    }
-
     // before, (a, b, c) nodes still have their old parents.
     // for thread safety: node->parent is never used by reading access, only by writes, so we are safe to update them.
-    if(p->left != nil_) p->left->parent = p;
-    if(q->left != nil_) q->left->parent = q;
-    if(q->right != nil_) q->right->parent = q;
+    if(Left(p) != nil_) Left(p)->parent = p;
+    if(Left(q) != nil_) Left(q)->parent = q;
+    if(Right(q) != nil_) Right(q)->parent = q;
+
+    // readers may still be traversing the old nodes, which keep valid links into the tree
+    retired_.Retire(node);
+    retired_.Retire(child);
 
     return p;
-    /*
-     * Since delete of the two old nodes depends on their usage from reading threads, we use
-     * shared_ptr to do thread-safe atomic reference counting and release memory when readers
-     * have finished using them.
-     */
   }
-  inline std::shared_ptr<Node> ReverseRotate(std::shared_ptr<Node> node, std::shared_ptr<Node> keepRef) {
+  inline Node *ReverseRotate(Node *node) {
     if (IsLeftChild(node))
-      return RightRotate(node->parent.lock(), keepRef);
+      return RightRotate(node->parent);
     else if (IsRightChild(node))
-      return LeftRotate(node->parent.lock(), keepRef);
+      return LeftRotate(node->parent);
     assert(false);
     return nullptr;
   }
-  inline std::shared_ptr<Node> FindNodeOrParent(const KeyType& key) const {
-    std::shared_ptr<Node> node = root_;
-    std::shared_ptr<Node> parent = nil_;
+  inline Node *FindNodeOrParent(const KeyType& key) const {
+    Node *node = Root();
+    Node *parent = nil_;
     while (!IsNil(node)) {
       if (node->key == key) return node;
       parent = node;
-      node = node->key > key ? node->left : node->right;
+      node = node->key > key ? Left(node) : Right(node);
     }
     return parent;
   }
-  void FixInsert(const std::shared_ptr<Node> node);
-  void FixRemove(std::shared_ptr<Node> node);
+  void FixInsert(Node *node);
+  void FixRemove(Node *node);
 
-  std::shared_ptr<Node> root_;
-  std::shared_ptr<Node> nil_;
+  std::atomic<Node *> root_;
+  Node *nil_;
   size_type count_;
+  NodePool<Node> pool_; /** all nodes except nil_. Declared before retired_, which returns nodes to it */
+  RetireList<Node, typename NodePool<Node>::Deleter> retired_; /** nodes replaced by rotations, waiting for readers to finish */
 
   // disallow copy and assign
   RBTree(const RBTree<KeyType, ValueType>&) = delete;
@@ -516,50 +570,50 @@ class RBTree {
 /* Public */
 
 template <typename KeyType, typename ValueType>
-std::pair<std::shared_ptr<typename RBTree<KeyType, ValueType>::Node> , bool>
+std::pair<typename RBTree<KeyType, ValueType>::Node *, bool>
 RBTree<KeyType, ValueType>::Put(const KeyType& key) {
-  std::shared_ptr<Node> parent = FindNodeOrParent(key);
+  Node *parent = FindNodeOrParent(key);
   if (!IsNil(parent) && parent->key == key)
     return std::make_pair(parent, false); // no insertion; return existing node
-  std::shared_ptr<Node> node = std::make_shared<Node>(nil_, nil_, nil_, kRed, key);
+  Node *node = pool_.New(nil_, nil_, nil_, kRed, key);
   if (IsNil(parent)) {
-    root_ = node;
+    root_.store(node, std::memory_order_release);
   } else {  // !IsNil(parent)
     if (key < parent->key)
       SetLeft(parent, node);
     else
       SetRight(parent, node);
   }
-  FixInsert(node); // reallocates memory for some nodes, but keeps the 'node' reference.
-  // (we re-use that node's memory in FixInsert(). see LeftRotate())
+  FixInsert(node); // rotations may replace 'node' by a copy, so we need to look it up again
   ++count_;
-  return std::make_pair(node, true);
+  return std::make_pair(FindNodeOrParent(key), true);
 }
 
 template <typename KeyType, typename ValueType>
 bool RBTree<KeyType, ValueType>::Remove(const KeyType& key) {
-  std::shared_ptr<Node> node = FindNodeOrParent(key);
-  std::shared_ptr<Node> child;
+  Node *node = FindNodeOrParent(key);
+  Node *child;
   if (IsNil(node) || node->key != key)
     return false;
-  if (IsNil(node->right)) {
-    child = node->left;
-  } else if (IsNil(node->left)) {
-    child = node->right;
+  if (IsNil(Right(node))) {
+    child = Left(node);
+  } else if (IsNil(Left(node))) {
+    child = Right(node);
   } else {
-    std::shared_ptr<Node> sub = node->right;
-    while (!IsNil(sub->left))
-      sub = sub->left;
+    Node *sub = Right(node);
+    while (!IsNil(Left(sub)))
+      sub = Left(sub);
     node->key = std::move(sub->key);
+    node->value = std::move(sub->value);
     node = sub;
-    child = sub->right;
+    child = Right(sub);
   }
   child = IsNil(child) ? node : ReplaceChild(node, child);
   if (IsBlack(node))
     FixRemove(child);
   if (node == child)
     ReplaceChild(node, nil_);
-  delete node;
+  retired_.Retire(node);
   --count_;
   return true;
 }
@@ -568,47 +622,48 @@ bool RBTree<KeyType, ValueType>::Remove(const KeyType& key) {
 
 template <typename KeyType, typename ValueType>
 void
-RBTree<KeyType, ValueType>::FixInsert(const std::shared_ptr<Node> inserted) {
-  std::shared_ptr<Node> node = inserted;
+RBTree<KeyType, ValueType>::FixInsert(Node *inserted) {
+  Node *node = inserted;
 
-  while (!IsBlack(node) && !IsBlack(node->parent.lock())) {
-    std::shared_ptr<Node> parent = node->parent.lock();
-    std::shared_ptr<Node> uncle = GetSibling(parent);
+  while (!IsBlack(node) && !IsBlack(node->parent)) {
+    Node *parent = node->parent;
+    Node *uncle = GetSibling(parent);
     if (IsRed(uncle)) {
       SetBlack(uncle);
       SetBlack(parent);
-      SetRed(parent->parent.lock());
-      node = parent->parent.lock();
+      SetRed(parent->parent);
+      node = parent->parent;
     } else {  // IsBlack(uncle)
       if (IsLeftChild(node) != IsLeftChild(parent))
-        parent = ReverseRotate(node, /* preserve = */ inserted);
-      node = ReverseRotate(parent, /* preserve = */ inserted);
+        parent = ReverseRotate(node);
+      node = ReverseRotate(parent);
     }
   }
-  if (IsNil(node->parent.lock()))
+  if (IsNil(node->parent))
     SetBlack(node);
 }
 
 template <typename KeyType, typename ValueType>
-void RBTree<KeyType, ValueType>::FixRemove(std::shared_ptr<Node> target) {
-  std::shared_ptr<Node> node = target;
+void RBTree<KeyType, ValueType>::FixRemove(Node *target) {
+  // note: rotations below never replace 'target' itself, only its ancestors and their other descendants
+  Node *node = target;
 
-  while (!IsRed(node) && !IsNil(node->parent.lock())) {
-    std::shared_ptr<Node> sibling = GetSibling(node);
+  while (!IsRed(node) && !IsNil(node->parent)) {
+    Node *sibling = GetSibling(node);
     if (IsRed(sibling)) {
-      ReverseRotate(sibling, /* preserve = */ target);
+      ReverseRotate(sibling);
       sibling = GetSibling(node);
     }
-    if (IsBlack(sibling->left) && IsBlack(sibling->right)) {
+    if (IsBlack(Left(sibling)) && IsBlack(Right(sibling))) {
       SetRed(sibling);
-      node = node->parent.lock();
+      node = node->parent;
     } else {
-      if (IsLeftChild(sibling) && !IsRed(sibling->left))
-        sibling = LeftRotate(sibling, /* preserve = */ target);
-      else if (IsRightChild(sibling) && !IsRed(sibling->right))
-        sibling = RightRotate(sibling, /* preserve = */ target);
-      ReverseRotate(sibling, /* preserve = */ target);
-      node = GetSibling(node->parent.lock());
+      if (IsLeftChild(sibling) && !IsRed(Left(sibling)))
+        sibling = LeftRotate(sibling);
+      else if (IsRightChild(sibling) && !IsRed(Right(sibling)))
+        sibling = RightRotate(sibling);
+      ReverseRotate(sibling);
+      node = GetSibling(node->parent);
     }
   }
   SetBlack(node);
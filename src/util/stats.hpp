@@ -0,0 +1,230 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#ifndef STO_STATS_H
+#define STO_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+#include "aligned.hpp"
+
+/*
+ * Hot path instrumentation, compiled in with -DSTO_STATS (cmake -DSTO_STATS=ON). Otherwise, the macros expand to
+ * nothing and Stats::Collect() returns zeros.
+ */
+#ifdef STO_STATS
+#define STO_STATS_ADD(counter, n) ::sto::Stats::Add(::sto::Stats::counter, n)
+#define STO_STATS_RECORD(histogram, value) ::sto::Stats::Record(::sto::Stats::histogram, value)
+#define STO_STATS_TIMER(histogram) ::sto::Stats::Timer sto_stats_timer(::sto::Stats::histogram)
+#define STO_STATS_ONLY(...) __VA_ARGS__
+#else
+#define STO_STATS_ADD(counter, n) ((void) 0)
+#define STO_STATS_RECORD(histogram, value) ((void) 0)
+#define STO_STATS_TIMER(histogram) ((void) 0)
+#define STO_STATS_ONLY(...)
+#endif
+
+namespace sto {
+
+/** Histogram with power-of-two buckets: bucket 0 counts value 0, bucket b counts values in [2^(b-1), 2^b). */
+struct StatsHistogram {
+  static constexpr size_t kBuckets = 65;
+
+  uint64_t count; /** number of recorded values */
+  uint64_t sum; /** sum of recorded values */
+  uint64_t buckets[kBuckets];
+
+  double mean() const { return count ? static_cast<double>(sum) / static_cast<double>(count) : 0.0; }
+
+  static size_t bucket(uint64_t value) {
+    return value ? static_cast<size_t>(64 - __builtin_clzll(static_cast<unsigned long long>(value))) : 0;
+  }
+};
+
+/**
+ * Process-wide counters and histograms of the TokenIndex hot paths.
+ *
+ * Each thread records into its own (cache line aligned) ThreadRecord with plain relaxed stores, so recording does not
+ * contend between threads and costs no atomic read-modify-write. Collect() sums up all ThreadRecords, including those
+ * of exited threads, which are reused by new threads.
+ */
+class Stats {
+public:
+  enum Counter {
+    kNarrowTree, /** narrow() steps in the tree */
+    kNarrowArray, /** narrow() steps in suffix array leaves */
+    kAt, /** random accesses via Span::operator[] */
+    kAtTreeNodes, /** TreeNodes traversed by these accesses */
+    kArrayCopies, /** read-only leaves copied into memory (merging their insert buffer) */
+    kArrayCopiedPositions, /** Positions copied by kArrayCopies */
+    kSplits, /** leaves split into TreeNodes */
+    kMergedPositions, /** Positions copied by batch merges into leaf arrays (AddPositions(), installing background splits) */
+    kNumCounters
+  };
+
+  enum Histogram {
+    kFindBoundsProbes, /** binary search probes per narrow() in a suffix array leaf */
+    kRBTreeSteps, /** RBTree nodes visited per child lookup by rank */
+    kAddPositionCopies, /** Positions copied per AddPosition() into a leaf */
+    kSplitNanos, /** duration of leaf splits by AddPosition() in nanoseconds */
+    kNumHistograms
+  };
+
+#ifdef STO_STATS
+  static constexpr bool kEnabled = true;
+#else
+  static constexpr bool kEnabled = false;
+#endif
+
+  /** sums over all threads */
+  struct Snapshot {
+    uint64_t counters[kNumCounters];
+    StatsHistogram histograms[kNumHistograms];
+
+    uint64_t operator[](Counter c) const { return counters[c]; }
+    const StatsHistogram &operator[](Histogram h) const { return histograms[h]; }
+
+    /** print all counters and histograms, one per line: "name value", or "name count=... mean=... >=lower:count ..." */
+    void Print(std::ostream &os) const {
+      for(size_t c = 0; c < kNumCounters; c++)
+        os << Name(static_cast<Counter>(c)) << " " << counters[c] << std::endl;
+      for(size_t h = 0; h < kNumHistograms; h++) {
+        const StatsHistogram &hist = histograms[h];
+        os << Name(static_cast<Histogram>(h)) << " count=" << hist.count << " mean=" << hist.mean();
+        for(size_t b = 0; b < StatsHistogram::kBuckets; b++)
+          if(hist.buckets[b])
+            os << " >=" << (b ? 1ULL << (b - 1) : 0) << ":" << hist.buckets[b];
+        os << std::endl;
+      }
+    }
+  };
+
+  static const char *Name(Counter c) {
+    static const char *names[kNumCounters] = {
+        "narrow_tree", "narrow_array", "at", "at_tree_nodes", "array_copies", "array_copied_positions", "splits", "merged_positions"
+    };
+    return names[c];
+  }
+  static const char *Name(Histogram h) {
+    static const char *names[kNumHistograms] = {
+        "find_bounds_probes", "rbtree_steps", "add_position_copies", "split_nanos"
+    };
+    return names[h];
+  }
+
+  static void Add(Counter c, uint64_t n) {
+    Bump(local()->counters[c], n);
+  }
+
+  static void Record(Histogram h, uint64_t value) {
+    ThreadRecord::Hist &hist = local()->histograms[h];
+    Bump(hist.count, 1);
+    Bump(hist.sum, value);
+    Bump(hist.buckets[StatsHistogram::bucket(value)], 1);
+  }
+
+  /** @return the sums of all threads' counters. Concurrent updates may or may not be included. */
+  static Snapshot Collect() {
+    Snapshot s = Snapshot();
+    for(ThreadRecord *r = head().load(std::memory_order_acquire); r != nullptr; r = r->next) {
+      for(size_t c = 0; c < kNumCounters; c++)
+        s.counters[c] += r->counters[c].load(std::memory_order_relaxed);
+      for(size_t h = 0; h < kNumHistograms; h++) {
+        s.histograms[h].count += r->histograms[h].count.load(std::memory_order_relaxed);
+        s.histograms[h].sum += r->histograms[h].sum.load(std::memory_order_relaxed);
+        for(size_t b = 0; b < StatsHistogram::kBuckets; b++)
+          s.histograms[h].buckets[b] += r->histograms[h].buckets[b].load(std::memory_order_relaxed);
+      }
+    }
+    return s;
+  }
+
+  /** RAII: records the duration of its scope in nanoseconds. */
+  class Timer {
+  public:
+    explicit Timer(Histogram h) : histogram_(h), start_(std::chrono::steady_clock::now()) {}
+    ~Timer() {
+      auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count();
+      Record(histogram_, static_cast<uint64_t>(nanos));
+    }
+    Timer(const Timer &) = delete;
+    Timer &operator=(const Timer &) = delete;
+
+  private:
+    Histogram histogram_;
+    std::chrono::steady_clock::time_point start_;
+  };
+
+private:
+  /** per-thread counters. ThreadRecords are never freed, but reused after their thread exits (keeping their counts). */
+  struct alignas(64) ThreadRecord {
+    struct Hist {
+      std::atomic<uint64_t> count;
+      std::atomic<uint64_t> sum;
+      std::atomic<uint64_t> buckets[StatsHistogram::kBuckets];
+    };
+    std::atomic<uint64_t> counters[kNumCounters];
+    Hist histograms[kNumHistograms];
+    std::atomic<bool> in_use;
+    ThreadRecord *next;
+
+    ThreadRecord() : in_use(true), next(nullptr) {
+      for(auto &c : counters)
+        c.store(0, std::memory_order_relaxed);
+      for(auto &h : histograms) {
+        h.count.store(0, std::memory_order_relaxed);
+        h.sum.store(0, std::memory_order_relaxed);
+        for(auto &b : h.buckets)
+          b.store(0, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  /** only the owning thread writes, so a relaxed load and store suffices (no locked instruction) */
+  static void Bump(std::atomic<uint64_t> &value, uint64_t n) {
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  static std::atomic<ThreadRecord *> &head() {
+    static std::atomic<ThreadRecord *> list(nullptr);
+    return list;
+  }
+
+  /** releases the thread's ThreadRecord for reuse when the thread exits. */
+  struct LocalRecord {
+    ThreadRecord *record;
+    LocalRecord() : record(Acquire()) {}
+    ~LocalRecord() { record->in_use.store(false, std::memory_order_release); }
+  };
+
+  static ThreadRecord *local() {
+    static thread_local LocalRecord local;
+    return local.record;
+  }
+
+  /** reuse a free ThreadRecord, or prepend a new one to the list (lock-free), see Epoch::Acquire() */
+  static ThreadRecord *Acquire() {
+    for(ThreadRecord *r = head().load(std::memory_order_acquire); r != nullptr; r = r->next) {
+      bool expected = false;
+      if(!r->in_use.load(std::memory_order_relaxed) && r->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire))
+        return r;
+    }
+    ThreadRecord *r = new_aligned<ThreadRecord>(); // plain new ignores alignas(64) before C++17
+    ThreadRecord *old_head = head().load(std::memory_order_relaxed);
+    do {
+      r->next = old_head;
+    } while(!head().compare_exchange_weak(old_head, r, std::memory_order_release, std::memory_order_relaxed));
+    return r;
+  }
+};
+
+} // namespace sto
+
+#endif //STO_STATS_H
@@ -0,0 +1,95 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#ifndef STO_VIDSCAN_H
+#define STO_VIDSCAN_H
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace sto {
+
+#ifndef STO_SCAN_RANGE
+#define STO_SCAN_RANGE 0
+#endif
+
+/**
+ * Suffix array ranges of up to this many Positions are not binary searched any further: their vids are gathered
+ * and scanned with scan_bounds(), see find_bounds(). Interleaved searches (TokenIndex::NarrowBatch()) stop there too.
+ * Set with cmake -DSTO_SCAN_RANGE=n, e.g. to compare builds with query_benchmark.
+ *
+ * Off (0: binary search only) by default: gathering costs a corpus access per Position, so in query_benchmark,
+ * scanning up to 8 or 16 Positions was no faster than binary search, and up to 64 was about twice as slow.
+ */
+constexpr size_t kScanRange = STO_SCAN_RANGE;
+
+/** instruction set of the vid_t scan_bounds() kernel compiled in: "avx2", "sse2" or "scalar" */
+inline const char *scan_bounds_kernel() {
+#if defined(__AVX2__)
+  return "avx2";
+#elif defined(__SSE2__)
+  return "sse2";
+#else
+  return "scalar";
+#endif
+}
+
+/**
+ * Branch-free linear scan for the bounds of 't' in the sorted vids[0..n): sets 'nless' to the number of vids < t,
+ * and 'nequal' to the number of vids == t, so the run of t is [nless, nless + nequal).
+ *
+ * Generic scalar version, see the vid_t overload for the vectorized one.
+ */
+template<typename Vid>
+inline void scan_bounds(const Vid *vids, size_t n, Vid t, size_t &nless, size_t &nequal) {
+  size_t less = 0, equal = 0;
+  for(size_t i = 0; i < n; i++) {
+    less += (vids[i] < t);
+    equal += (vids[i] == t);
+  }
+  nless = less;
+  nequal = equal;
+}
+
+/**
+ * 32-bit vids: compares 8 (AVX2) or 4 (SSE2) vids per instruction, with a scalar tail.
+ * SSE2 and AVX2 only have signed compares, so both sides are flipped by the sign bit first.
+ */
+inline void scan_bounds(const uint32_t *vids, size_t n, uint32_t t, size_t &nless, size_t &nequal) {
+  size_t i = 0, less = 0, equal = 0;
+#if defined(__AVX2__)
+  const __m256i sign = _mm256_set1_epi32(static_cast<int>(0x80000000u));
+  const __m256i tv = _mm256_xor_si256(_mm256_set1_epi32(static_cast<int>(t)), sign);
+  for(; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(vids + i)), sign);
+    // one mask bit per byte: 4 bits per matching lane
+    less += static_cast<size_t>(__builtin_popcount(static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpgt_epi32(tv, v))))) / 4;
+    equal += static_cast<size_t>(__builtin_popcount(static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi32(tv, v))))) / 4;
+  }
+#elif defined(__SSE2__)
+  const __m128i sign = _mm_set1_epi32(static_cast<int>(0x80000000u));
+  const __m128i tv = _mm_xor_si128(_mm_set1_epi32(static_cast<int>(t)), sign);
+  for(; i + 4 <= n; i += 4) {
+    __m128i v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(vids + i)), sign);
+    less += static_cast<size_t>(__builtin_popcount(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpgt_epi32(tv, v))))) / 4;
+    equal += static_cast<size_t>(__builtin_popcount(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi32(tv, v))))) / 4;
+  }
+#endif
+  for(; i < n; i++) {
+    less += (vids[i] < t);
+    equal += (vids[i] == t);
+  }
+  nless = less;
+  nequal = equal;
+}
+
+} // namespace sto
+
+#endif //STO_VIDSCAN_H
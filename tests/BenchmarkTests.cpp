@@ -12,6 +12,8 @@
 #include <sstream>
 #include <random>
 #include <map>
+#include <thread>
+#include <atomic>
 #include <gtest/gtest.h>
 
 #include "Vocab.h"
@@ -339,3 +341,101 @@ TEST_F(BenchmarkTests, index_b11) {
     std::cerr << "nsamples_total = " << nsamples_total << " dummy = " << dummy << std::endl;
   }, "query_index");
 }
+
+
+/**
+ * Generate a synthetic corpus of 'nsents' sentences, with Zipf distributed words from a vocabulary of 'nwords'.
+ */
+void GenerateZipfCorpus(Corpus<SrcToken> &corpus, Vocab<SrcToken> &vocab, size_t nsents, size_t nwords, unsigned int seed = 42) {
+  std::mt19937 gen(seed);
+  std::vector<double> weights;
+  std::vector<SrcToken> words;
+  vocab["</s>"];
+  for(size_t i = 0; i < nwords; i++) {
+    weights.push_back(1.0 / static_cast<double>(i + 1));
+    words.push_back(vocab[std::string("w") + std::to_string(i)]);
+  }
+  std::discrete_distribution<size_t> word_dist(weights.begin(), weights.end());
+  std::uniform_int_distribution<size_t> len_dist(5, 30);
+
+  for(size_t i = 0; i < nsents; i++) {
+    std::vector<SrcToken> sent;
+    size_t len = len_dist(gen);
+    for(size_t j = 0; j < len; j++)
+      sent.push_back(words[word_dist(gen)]);
+    corpus.AddSentence(sent);
+  }
+}
+
+TEST_F(BenchmarkTests, query_threads) {
+  // reader scaling: concurrent lookups and sampling, optionally with a single writer adding held-out sentences.
+  Vocab<SrcToken> vocab;
+  Corpus<SrcToken> corpus(&vocab);
+  const size_t nsents = 50000, nheld_out = 5000;
+
+  GenerateZipfCorpus(corpus, vocab, nsents + nheld_out, /* nwords = */ 5000);
+
+  TokenIndex<SrcToken> tokenIndex(corpus, /* maxLeafSize = */ 1000);
+  std::vector<Sentence<SrcToken>> sents;
+  for(size_t i = 0; i < nsents; i++)
+    sents.push_back(corpus.sentence(i));
+  benchmark_time([&tokenIndex, &sents](){ tokenIndex.AddSentences(sents); }, "build_index");
+
+  std::vector<std::vector<SrcToken>> queries;
+  create_random_queries(tokenIndex, queries, /* num = */ 20000);
+  const size_t sample = 100;
+
+  size_t max_threads = std::max<size_t>(4, std::thread::hardware_concurrency());
+  size_t next_held_out = 0; // each run with a writer adds more held-out sentences, until readers are done (or none are left)
+  for(bool with_writer : {false, true}) {
+    double single_thread_qps = 0.0;
+    for(size_t nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+      std::atomic<size_t> failed(0);
+      std::atomic<bool> readers_done(false);
+      size_t nadded = 0;
+
+      auto reader = [&tokenIndex, &queries, &failed, sample](size_t ithread) {
+        std::mt19937 gen(ithread);
+        size_t dummy = 0;
+        for(auto &query : queries) {
+          TokenIndex<SrcToken>::Span span = tokenIndex.span();
+          for(auto token : query)
+            failed += (span.narrow(token) == 0);
+
+          std::uniform_int_distribution<size_t> sample_dist(0, span.size()-1);
+          for(size_t i = 0; i < std::min(sample, span.size()); i++)
+            dummy += span[sample_dist(gen)].offset;
+        }
+        volatile size_t sink = dummy; (void) sink;
+      };
+      auto writer = [&tokenIndex, &corpus, &readers_done, &nadded, &next_held_out, nsents, nheld_out]() {
+        while(!readers_done.load() && next_held_out < nheld_out) {
+          tokenIndex.AddSentence(corpus.sentence(nsents + next_held_out++));
+          nadded++;
+        }
+      };
+
+      double elapsed = benchmark_time([&]() {
+        std::vector<std::thread> threads;
+        std::thread writer_thread;
+        if(with_writer)
+          writer_thread = std::thread(writer);
+        for(size_t i = 0; i < nthreads; i++)
+          threads.push_back(std::thread(reader, i));
+        for(auto &t : threads)
+          t.join();
+        readers_done = true;
+        if(with_writer)
+          writer_thread.join();
+      });
+
+      EXPECT_EQ(0, failed.load()) << "queries for existing locations must succeed";
+      double qps = static_cast<double>(nthreads * queries.size()) / elapsed;
+      if(nthreads == 1)
+        single_thread_qps = qps;
+      std::cerr << "query_threads nthreads=" << nthreads << " writer=" << (with_writer ? "true" : "false")
+                << " queries/s=" << static_cast<size_t>(qps) << " speedup=" << std::setprecision(3) << (qps / single_thread_qps)
+                << " added=" << nadded << std::endl;
+    }
+  }
+}
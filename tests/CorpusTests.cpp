@@ -6,9 +6,15 @@
 
 #include <gtest/gtest.h>
 
+#include <atomic>
+#include <thread>
+
+#include <boost/filesystem.hpp>
+
 #include "Vocab.h"
 #include "Corpus.h"
 #include "Types.h"
+#include "util/epoch.hpp"
 
 using namespace sto;
 
@@ -19,6 +25,22 @@ TEST(CorpusTests, load_v2) {
   Corpus<SrcToken> sc("res/corpus.mct", &sv);
 }
 
+TEST(CorpusTests, load_map_options) {
+  Vocab<SrcToken> sv("res/vocab.tdx");
+  Corpus<SrcToken> plain("res/corpus.mct", &sv);
+  for(MapOptions options : {MapOptions(MapOptions::kRandom), MapOptions(MapOptions::kWillNeed, /* populate = */ true),
+                            MapOptions(MapOptions::kSequential, false, /* hugepages = */ true, /* warmup = */ true)}) {
+    Corpus<SrcToken> sc("res/corpus.mct", &sv, options);
+    ASSERT_EQ(plain.size(), sc.size());
+    for(Corpus<SrcToken>::Sid sid = 0; sid < sc.size(); sid++)
+      EXPECT_EQ(plain.sentence(sid).surface(), sc.sentence(sid).surface()) << "access hints must not change the contents";
+  }
+
+  MappedFile file("res/corpus.mct", /* offset = */ 0, MapOptions(MapOptions::kNormal, false, false, /* warmup = */ true));
+  file.WaitWarmup();
+  EXPECT_GT(file.size(), 0);
+}
+
 TEST(CorpusTests, empty_add) {
   Vocab<SrcToken> sv("res/vocab.tdx");
   Corpus<SrcToken> sc(&sv);
@@ -53,6 +75,209 @@ TEST(CorpusTests, sentence_index_operator) {
   EXPECT_EQ("is", sv[sent[1]]) << "proper working of Sentence::operator[]()";
 }
 
+TEST(CorpusTests, concurrent_append) {
+  Corpus<SrcToken> sc;
+
+  // enough tokens to span several segments of the dynamic track, with sentences crossing segment boundaries
+  const size_t kNumSents = 5000, kSentLen = 99;
+  auto vid = [](size_t sid, size_t i) { return static_cast<SrcToken::Vid>(sid * 7 + i + 2); };
+
+  std::atomic<bool> done(false);
+  std::thread reader([&]() {
+    while(!done.load()) {
+      size_t size = sc.size();
+      if(size == 0)
+        continue;
+      Sentence<SrcToken> sent = sc.sentence(static_cast<Corpus<SrcToken>::Sid>(size - 1));
+      ASSERT_EQ(kSentLen, sent.size()) << "published sentences must be complete";
+      for(size_t i = 0; i < kSentLen; i++)
+        ASSERT_EQ(vid(size - 1, i), sent[i].vid) << "published sentences must be visible to readers";
+    }
+  });
+
+  for(size_t sid = 0; sid < kNumSents; sid++) {
+    std::vector<SrcToken> sentence;
+    for(size_t i = 0; i < kSentLen; i++)
+      sentence.push_back(SrcToken{vid(sid, i)});
+    sc.AddSentence(sentence);
+  }
+  done.store(true);
+  reader.join();
+
+  EXPECT_EQ(kNumSents, sc.size());
+  EXPECT_EQ(kNumSents * kSentLen, sc.numTokens()) << "numTokens() must not count segment padding";
+  for(size_t sid = 0; sid < kNumSents; sid++) {
+    Sentence<SrcToken> sent = sc.sentence(static_cast<Corpus<SrcToken>::Sid>(sid));
+    ASSERT_EQ(kSentLen, sent.size());
+    EXPECT_EQ(vid(sid, kSentLen - 1), sent[kSentLen - 1].vid) << "sentences are stored contiguously, sid " << sid;
+  }
+}
+
+TEST(CorpusTests, flush_reload) {
+  Vocab<SrcToken> sv;
+  Corpus<SrcToken> sc(&sv);
+  std::string prefix = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("sto-test-%%%%-%%%%")).string();
+
+  std::vector<std::vector<std::string>> surfaces = {{"this", "is", "an", "example"}, {}, {"another", "example"}};
+  auto add = [&](const std::vector<std::string> &surface) {
+    std::vector<SrcToken> sentence;
+    for(auto s : surface)
+      sentence.push_back(sv[s]);
+    sc.AddSentence(sentence);
+  };
+  add(surfaces[0]);
+  add(surfaces[1]);
+
+  sc.Flush(prefix); // remaps the dynamic part as static
+  add(surfaces[2]);
+  EXPECT_EQ(3, sc.size());
+  EXPECT_EQ(6, sc.numTokens());
+  EXPECT_EQ("this is an example", sc.sentence(0).surface()) << "flushed sentences must keep their IDs";
+  EXPECT_EQ("another example", sc.sentence(2).surface()) << "appending after Flush() must continue the sentence IDs";
+  for(Corpus<SrcToken>::Sid sid = 0; sid < sc.size(); sid++) {
+    Corpus<SrcToken>::Tokens tokens = sc.tokens(sid);
+    EXPECT_EQ(sc.begin(sid), tokens.data()) << "static and dynamic sentences, sid " << sid;
+    EXPECT_EQ(surfaces[sid].size(), tokens.size()) << "sid " << sid;
+  }
+
+  sc.Write(prefix);
+  Corpus<SrcToken> reloaded(prefix + ".trk", &sv);
+  ASSERT_EQ(3, reloaded.size());
+  EXPECT_EQ(6, reloaded.numTokens());
+  for(size_t sid = 0; sid < reloaded.size(); sid++)
+    EXPECT_EQ(sc.sentence(sid).surface(), reloaded.sentence(sid).surface()) << "v3 round trip, sid " << sid;
+
+  boost::filesystem::remove(prefix + ".trk");
+  boost::filesystem::remove(prefix + ".six");
+}
+
+TEST(CorpusTests, flush_append_concurrent) {
+  Corpus<SrcToken> sc;
+  std::string prefix = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("sto-test-%%%%-%%%%")).string();
+
+  const size_t kNumSents = 3000, kSentLen = 17, kFlushEvery = 500;
+  auto vid = [](size_t sid, size_t i) { return static_cast<SrcToken::Vid>(sid * 5 + i + 2); };
+
+  // readers hold a guard while using token pointers, which Flush() moves to the new mapping
+  std::atomic<bool> done(false);
+  std::thread reader([&]() {
+    while(!done.load()) {
+      Epoch::Guard guard;
+      size_t size = sc.size();
+      if(size == 0)
+        continue;
+      Corpus<SrcToken>::Sid sid = static_cast<Corpus<SrcToken>::Sid>(size / 2);
+      Sentence<SrcToken> sent = sc.sentence(sid);
+      ASSERT_EQ(kSentLen, sent.size());
+      for(size_t i = 0; i < kSentLen; i++)
+        ASSERT_EQ(vid(sid, i), sent[i].vid) << "sentences must stay readable across Flush(), sid " << sid;
+    }
+  });
+
+  for(size_t sid = 0; sid < kNumSents; sid++) {
+    std::vector<SrcToken> sentence;
+    for(size_t i = 0; i < kSentLen; i++)
+      sentence.push_back(SrcToken{vid(sid, i)});
+    sc.AddSentence(sentence);
+    if((sid + 1) % kFlushEvery == 0)
+      sc.Flush(prefix); // the first one writes the corpus, later ones append to its track
+  }
+  done.store(true);
+  reader.join();
+
+  EXPECT_EQ(kNumSents, sc.size());
+  EXPECT_EQ(sizeof(CorpusTrackHeader) + kNumSents * kSentLen * sizeof(SrcToken::Vid), boost::filesystem::file_size(prefix + ".trk")) << "appending must not leave a gap in the track";
+  Corpus<SrcToken> reloaded(prefix + ".trk");
+  ASSERT_EQ(kNumSents, reloaded.size());
+  EXPECT_EQ(kNumSents * kSentLen, reloaded.numTokens());
+  for(size_t sid = 0; sid < kNumSents; sid++)
+    for(size_t i = 0; i < kSentLen; i++)
+      ASSERT_EQ(vid(sid, i), reloaded.sentence(static_cast<Corpus<SrcToken>::Sid>(sid))[i].vid) << "sid " << sid;
+
+  boost::filesystem::remove(prefix + ".trk");
+  boost::filesystem::remove(prefix + ".six");
+}
+
+TEST(CorpusTests, compress) {
+  Corpus<SrcToken> sc;
+  std::string prefix = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("sto-test-%%%%-%%%%")).string();
+
+  // a few frequent words in every sentence, and in later ones a word of their own: enough distinct words for 1, 2 and 4 bytes per token
+  const size_t kNumSents = 70000, kNumFrequent = 50, kFirstRare = 1000;
+  auto sentence = [&](size_t sid) {
+    std::vector<SrcToken> sent;
+    if(sid % 1001 == 0)
+      return sent; // empty
+    for(size_t i = 0; i < 4; i++)
+      sent.push_back(SrcToken{static_cast<SrcToken::Vid>((sid * 7 + i) % kNumFrequent + 2)});
+    if(sid >= kFirstRare)
+      sent.push_back(SrcToken{static_cast<SrcToken::Vid>(kFirstRare + sid)});
+    return sent;
+  };
+  size_t ntokens = 0;
+  auto add = [&](size_t sid) {
+    sc.AddSentence(sentence(sid));
+    ntokens += sentence(sid).size();
+  };
+  auto check = [&](const Corpus<SrcToken> &corpus, size_t nsents, const std::string &name) {
+    ASSERT_EQ(nsents, corpus.size()) << name;
+    EXPECT_EQ(ntokens, corpus.numTokens()) << name;
+    for(size_t sid = 0; sid < nsents; sid++) {
+      std::vector<SrcToken> expected = sentence(sid);
+      Sentence<SrcToken> sent = corpus.sentence(static_cast<Corpus<SrcToken>::Sid>(sid));
+      Corpus<SrcToken>::Tokens tokens = corpus.tokens(static_cast<Corpus<SrcToken>::Sid>(sid));
+      ASSERT_EQ(expected.size(), sent.size()) << name << ", sid " << sid;
+      ASSERT_EQ(expected.size(), tokens.size()) << name << ", sid " << sid;
+      for(size_t i = 0; i < expected.size(); i++) {
+        ASSERT_EQ(expected[i].vid, sent[i].vid) << name << ", sid " << sid << " token " << i;
+        ASSERT_EQ(expected[i].vid, tokens[i]) << name << ", sid " << sid << " token " << i;
+      }
+      ASSERT_EQ(Vocab<SrcToken>::kEOS, sent[sent.size()].vid) << name << ": implicit </s>, sid " << sid;
+    }
+  };
+
+  // static and dynamic sentences are compressed alike
+  size_t sid = 0;
+  for(; sid < kNumSents / 2; sid++)
+    add(sid);
+  sc.Flush(prefix);
+  for(; sid < kNumSents; sid++)
+    add(sid);
+  EXPECT_FALSE(sc.compressed());
+  sc.Compress();
+  EXPECT_TRUE(sc.compressed());
+  EXPECT_EQ(nullptr, sc.begin(1)) << "a compressed sentence has no contiguous vids";
+  check(sc, kNumSents, "compressed");
+
+  // sentences added later are uncompressed, until Flush() compresses them too
+  add(sid++);
+  EXPECT_NE(nullptr, sc.begin(static_cast<Corpus<SrcToken>::Sid>(sid - 1)));
+  check(sc, sid, "added after Compress()");
+  sc.Flush(prefix);
+  EXPECT_TRUE(sc.compressed()) << "Flush() must keep the corpus compressed";
+  check(sc, sid, "flushed");
+  {
+    Corpus<SrcToken> written(prefix + ".trk");
+    EXPECT_FALSE(written.compressed()) << "the files are written uncompressed";
+    check(written, sid, "files written from a compressed corpus");
+  }
+
+  // appending to the track which the compressed static part describes
+  add(sid++);
+  sc.Flush(prefix);
+  EXPECT_EQ(sizeof(CorpusTrackHeader) + ntokens * sizeof(SrcToken::Vid), boost::filesystem::file_size(prefix + ".trk")) << "appending must not leave a gap in the track";
+  Corpus<SrcToken> reloaded(prefix + ".trk");
+  check(reloaded, sid, "appended to from a compressed corpus");
+
+  boost::filesystem::remove(prefix + ".trk");
+  boost::filesystem::remove(prefix + ".six");
+
+  Corpus<AlignmentLink> ac;
+  ac.AddSentence(std::vector<AlignmentLink>{{0,0}, {1,2}});
+  EXPECT_THROW(ac.Compress(), std::runtime_error) << "alignment links have no frequency ranks";
+  EXPECT_EQ(AlignmentLink(1,2), ac.sentence(0)[1]);
+}
+
 TEST(CorpusTests, word_alignment_corpus) {
   Corpus<AlignmentLink> ac;
 
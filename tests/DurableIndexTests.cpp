@@ -0,0 +1,166 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#include <cstdio>
+#include <random>
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+
+#include "Vocab.h"
+#include "Corpus.h"
+#include "TokenIndex.h"
+#include "DurableIndex.h"
+#include "Types.h"
+#include "RandomCorpus.h"
+
+using namespace sto;
+
+/**
+ * Test Fixture for random sentences, added both to a DurableIndex and to an in-memory reference TokenIndex.
+ */
+struct DurableIndexTests : testing::Test {
+  Vocab<SrcToken> vocab;
+  Corpus<SrcToken> corpus;
+  TokenIndex<SrcToken> index;
+  std::string path;
+  std::mt19937 gen;
+
+  DurableIndexTests() : corpus(&vocab), index(corpus, /* maxLeafSize = */ 16), gen(29) {
+    path = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("sto-test-%%%%-%%%%")).string();
+    for(size_t i = 0; i < 8; i++)
+      vocab[std::string("w") + std::to_string(i)];
+  }
+  ~DurableIndexTests() {
+    boost::filesystem::remove_all(path);
+  }
+
+  void AddSentences(DurableIndex<SrcToken> &durable, size_t n) {
+    for(auto &words : RandomSentences(gen, n, /* maxLen = */ 8, /* nwords = */ 8)) {
+      std::vector<SrcToken> sent;
+      for(auto &w : words)
+        sent.push_back(vocab[w]);
+      durable.AddSentence(sent);
+      corpus.AddSentence(sent);
+      index.AddSentence(corpus.sentence(corpus.size() - 1));
+    }
+  }
+
+  /** the recovered index must hold the same Positions as the reference */
+  void ExpectSameIndex(DurableIndex<SrcToken> &durable) {
+    ASSERT_EQ(corpus.size(), durable.corpus().size());
+    for(std::vector<std::string> lookup : std::vector<std::vector<std::string>>{{}, {"w1"}, {"w2", "w3"}, {"w0", "</s>"}}) {
+      TokenIndex<SrcToken>::Span expected = index.span(), actual = durable.index().span();
+      for(auto &w : lookup)
+        EXPECT_EQ(expected.narrow(vocab[w]), actual.narrow(vocab[w]));
+      ASSERT_EQ(expected.size(), actual.size());
+      for(size_t i = 0; i < expected.size(); i++)
+        EXPECT_EQ(expected[i], actual[i]) << "Position entry " << i;
+    }
+  }
+};
+
+TEST_F(DurableIndexTests, replay_log) {
+  {
+    DurableIndex<SrcToken> durable(path, &vocab, /* maxLeafSize = */ 16);
+    AddSentences(durable, 100);
+  }
+  DurableIndex<SrcToken> recovered(path, &vocab, /* maxLeafSize = */ 16);
+  EXPECT_EQ(0, recovered.checkpoint());
+  EXPECT_EQ(100, recovered.replayed());
+  ExpectSameIndex(recovered);
+}
+
+TEST_F(DurableIndexTests, checkpoint) {
+  {
+    DurableIndex<SrcToken> durable(path, &vocab, /* maxLeafSize = */ 16);
+    AddSentences(durable, 100);
+    durable.Checkpoint();
+    EXPECT_EQ(0, durable.log_size());
+    AddSentences(durable, 30);
+    durable.Checkpoint();
+    AddSentences(durable, 20);
+    ExpectSameIndex(durable);
+  }
+  DurableIndex<SrcToken> recovered(path, &vocab, /* maxLeafSize = */ 16);
+  EXPECT_EQ(2, recovered.checkpoint());
+  EXPECT_EQ(20, recovered.replayed()) << "only the log after the last checkpoint is replayed";
+  ExpectSameIndex(recovered);
+  EXPECT_FALSE(boost::filesystem::exists(boost::filesystem::path(path) / "ckpt-1.sfa")) << "older checkpoints are removed";
+  EXPECT_TRUE(boost::filesystem::exists(boost::filesystem::path(path) / "corpus.trk")) << "checkpoints append to a single track";
+
+  // keep going after recovery
+  AddSentences(recovered, 10);
+  ExpectSameIndex(recovered);
+}
+
+TEST_F(DurableIndexTests, torn_record) {
+  {
+    DurableIndex<SrcToken> durable(path, &vocab, /* maxLeafSize = */ 16);
+    AddSentences(durable, 50);
+  }
+  // a crash during an append: a partial record at the end of the log
+  std::string log = (boost::filesystem::path(path) / "log-0").string();
+  FILE *file = fopen(log.c_str(), "ab");
+  ASSERT_NE(nullptr, file);
+  uint32_t partial[3] = {0, 1234, 7}; // header of a sentence record, whose length exceeds the rest of the file
+  fwrite(partial, sizeof(uint32_t), 3, file);
+  fclose(file);
+
+  {
+    DurableIndex<SrcToken> recovered(path, &vocab, /* maxLeafSize = */ 16);
+    EXPECT_EQ(50, recovered.replayed()) << "the torn record must be dropped";
+    AddSentences(recovered, 5);
+  }
+  DurableIndex<SrcToken> recovered(path, &vocab, /* maxLeafSize = */ 16);
+  EXPECT_EQ(55, recovered.replayed()) << "appends continue after the last complete record";
+  ExpectSameIndex(recovered);
+}
+
+TEST_F(DurableIndexTests, restore_vocab) {
+  std::vector<std::string> surfaces;
+  {
+    DurableIndex<SrcToken> durable(path, &vocab, /* maxLeafSize = */ 16);
+    auto add = [&](const std::string &word) {
+      surfaces.push_back(word + " w1 " + word);
+      durable.AddSentence({vocab[word], vocab["w1"], vocab[word]});
+    };
+    add("checkpointed");
+    durable.Checkpoint();
+    add("logged"); // new word after the checkpoint, only in the log
+  }
+
+  // the caller's vocabulary is lost
+  Vocab<SrcToken> fresh;
+  DurableIndex<SrcToken> recovered(path, &fresh, /* maxLeafSize = */ 16);
+  ASSERT_EQ(surfaces.size(), recovered.corpus().size());
+  for(size_t sid = 0; sid < surfaces.size(); sid++)
+    EXPECT_EQ(surfaces[sid], recovered.corpus().sentence(static_cast<Corpus<SrcToken>::Sid>(sid)).surface()) << "sid " << sid;
+  EXPECT_EQ(vocab["logged"].vid, fresh.at("logged").vid) << "restored words must keep their vids";
+
+  Vocab<SrcToken> other;
+  other["logged"];
+  EXPECT_THROW(DurableIndex<SrcToken>(path, &other, /* maxLeafSize = */ 16), std::runtime_error) << "a conflicting vocabulary must be rejected";
+}
+
+TEST_F(DurableIndexTests, crash_after_corpus_flush) {
+  {
+    DurableIndex<SrcToken> durable(path, &vocab, /* maxLeafSize = */ 16);
+    AddSentences(durable, 100);
+    durable.Checkpoint();
+    AddSentences(durable, 30);
+    // a crash during Checkpoint(), after the corpus is flushed but before CURRENT is switched
+    durable.corpus().Flush((boost::filesystem::path(path) / "corpus").string());
+  }
+  DurableIndex<SrcToken> recovered(path, &vocab, /* maxLeafSize = */ 16);
+  EXPECT_EQ(1, recovered.checkpoint());
+  EXPECT_EQ(30, recovered.replayed());
+  ExpectSameIndex(recovered);
+
+  AddSentences(recovered, 10);
+  recovered.Checkpoint();
+  ExpectSameIndex(recovered);
+}
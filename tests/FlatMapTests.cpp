@@ -0,0 +1,91 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#include <gtest/gtest.h>
+
+#include <random>
+
+#include "util/flatmap.hpp"
+#include "util/rbtree.hpp"
+
+using namespace sto;
+
+TEST(FlatMapTests, insert_find) {
+  FlatMap<int, int> map;
+
+  map[2]=2;
+  map[1]=1;
+  map[4]=4;
+  map.FindOrInsert(3, /* add_size = */ 5) = 3;
+  map[7]=7;
+
+  EXPECT_EQ(5, map.Count());
+  int val = 0;
+  EXPECT_TRUE(map.Find(3, &val));
+  EXPECT_EQ(3, val);
+  EXPECT_FALSE(map.Find(5));
+  EXPECT_EQ(5, map.ChildSize(3));
+  EXPECT_EQ(5, map.Size());
+
+  std::vector<int> seq;
+  map.Walk([&seq](int key, int value) {
+    EXPECT_EQ(key, value);
+    seq.push_back(key);
+  });
+  std::vector<int> expected_seq = {1, 2, 3, 4, 7};
+  EXPECT_EQ(expected_seq, seq);
+}
+
+TEST(FlatMapTests, partial_sums_like_rbtree) {
+  // random sizes and random access must behave exactly like RBTree
+  FlatMap<int, int> map;
+  RBTree<int, int> tree;
+  std::mt19937 gen(1);
+  std::uniform_int_distribution<int> key_dist(0, 200);
+  std::uniform_int_distribution<size_t> size_dist(1, 10);
+
+  for(size_t i = 0; i < 1000; i++) {
+    int key = key_dist(gen);
+    size_t add_size = size_dist(gen);
+    if(i % 3 == 0) {
+      map.FindOrInsert(key, add_size) = key;
+      tree.FindOrInsert(key, add_size) = key;
+    } else if(map.Contains(key)) {
+      map.AddSize(key, add_size);
+      tree.AddSize(key, add_size);
+    }
+  }
+  ASSERT_EQ(tree.Size(), map.Size());
+
+  for(size_t offset = 0; offset < map.Size(); offset++) {
+    size_t map_offset = offset, tree_offset = offset;
+    EXPECT_EQ(tree.At(&tree_offset), map.At(&map_offset)) << "At(" << offset << ")";
+    EXPECT_EQ(tree_offset, map_offset) << "relative offset of At(" << offset << ")";
+  }
+}
+
+TEST(FlatMapTests, build_sorted) {
+  FlatMap<int, int> map;
+  map.BuildSorted({1, 3, 5}, {10, 30, 50}, {2, 1, 3});
+
+  EXPECT_EQ(3, map.Count());
+  EXPECT_EQ(6, map.Size());
+  EXPECT_EQ(1, map.ChildSize(3));
+
+  std::vector<int> expected_values = {10, 10, 30, 50, 50, 50};
+  std::vector<size_t> expected_offsets = {0, 1, 0, 0, 1, 2};
+  for(size_t offset = 0; offset < map.Size(); offset++) {
+    size_t rel = offset;
+    EXPECT_EQ(expected_values[offset], map.At(&rel));
+    EXPECT_EQ(expected_offsets[offset], rel);
+  }
+
+  // insert after bulk-loading keeps the partial sums
+  map.FindOrInsert(4, /* add_size = */ 2) = 40;
+  size_t rel = 3;
+  EXPECT_EQ(40, map.At(&rel));
+  EXPECT_EQ(8, map.Size());
+}
@@ -0,0 +1,98 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#include <random>
+
+#include <gtest/gtest.h>
+
+#include "Vocab.h"
+#include "Corpus.h"
+#include "TokenIndex.h"
+#include "PhraseExtractor.h"
+#include "Types.h"
+
+using namespace sto;
+
+/**
+ * Test Fixture for a small word-aligned bitext.
+ */
+struct PhraseExtractorTests : testing::Test {
+  Vocab<SrcToken> srcVocab;
+  Vocab<TrgToken> trgVocab;
+  Corpus<SrcToken> srcCorpus;
+  Corpus<TrgToken> trgCorpus;
+  Corpus<AlignmentLink> alignCorpus;
+  TokenIndex<SrcToken> srcIndex;
+
+  PhraseExtractorTests() : srcCorpus(&srcVocab), trgCorpus(&trgVocab), srcIndex(srcCorpus) {}
+
+  void AddSentencePair(const std::vector<std::string> &src, const std::vector<std::string> &trg, const std::vector<AlignmentLink> &links) {
+    std::vector<SrcToken> srcSent;
+    for(auto &s : src)
+      srcSent.push_back(srcVocab[s]);
+    std::vector<TrgToken> trgSent;
+    for(auto &t : trg)
+      trgSent.push_back(trgVocab[t]);
+    srcCorpus.AddSentence(srcSent);
+    trgCorpus.AddSentence(trgSent);
+    alignCorpus.AddSentence(links);
+    srcIndex.AddSentence(srcCorpus.sentence(srcCorpus.size() - 1));
+  }
+
+  TokenIndex<SrcToken>::Span Lookup(const std::vector<std::string> &src) {
+    TokenIndex<SrcToken>::Span span = srcIndex.span();
+    for(auto &s : src)
+      span.narrow(srcVocab[s]);
+    return span;
+  }
+
+  PhraseExtractor::TargetPhrase Phrase(const std::vector<std::string> &trg) {
+    PhraseExtractor::TargetPhrase phrase;
+    for(auto &t : trg)
+      phrase.push_back(trgVocab[t].vid);
+    return phrase;
+  }
+};
+
+TEST_F(PhraseExtractorTests, consistent_phrases) {
+  AddSentencePair({"das", "ist", "ein", "haus"}, {"this", "is", "a", "house"}, {{0,0}, {1,1}, {2,2}, {3,3}});
+  AddSentencePair({"ein", "haus", "ist", "gross"}, {"a", "house", "is", "big"}, {{0,0}, {1,1}, {2,2}, {3,3}});
+  // "haus" is aligned to "is" as well, so "ist ein" is not consistent here
+  AddSentencePair({"das", "ist", "ein", "haus"}, {"that", "is", "one", "home"}, {{0,0}, {1,1}, {2,2}, {3,3}, {3,1}});
+
+  PhraseExtractor extractor(trgCorpus, alignCorpus);
+  std::mt19937 rng(1);
+
+  PhraseExtractor::PhraseCounts counts;
+  EXPECT_EQ(2, extractor.Extract(Lookup({"ein", "haus"}), 100, rng, counts)) << "two of three occurrences are consistent";
+  EXPECT_EQ(1, counts.size());
+  EXPECT_EQ(2, counts[Phrase({"a", "house"})]);
+  EXPECT_EQ(0, counts.count(Phrase({"one", "home"}))) << "'home' is aligned to 'ist' outside of the source phrase";
+
+  counts.clear();
+  EXPECT_EQ(1, extractor.Extract(Lookup({"ist", "ein"}), 100, rng, counts));
+  EXPECT_EQ(1, counts[Phrase({"is", "a"})]);
+}
+
+TEST_F(PhraseExtractorTests, unaligned_extension) {
+  AddSentencePair({"ein", "haus"}, {"a", "small", "house", "indeed"}, {{0,0}, {1,2}});
+  Corpus<SrcToken>::Sid sid = 0;
+  std::vector<Position<SrcToken>> positions = {Position<SrcToken>(sid, 1)}; // "haus"
+
+  PhraseExtractor::PhraseCounts counts;
+  PhraseExtractor minimal(trgCorpus, alignCorpus, /* maxPhraseLength = */ 7, /* extendUnaligned = */ false);
+  EXPECT_EQ(1, minimal.Extract(positions, /* length = */ 1, counts));
+  EXPECT_EQ(1, counts.size());
+  EXPECT_EQ(1, counts[Phrase({"house"})]);
+
+  counts.clear();
+  PhraseExtractor extended(trgCorpus, alignCorpus, /* maxPhraseLength = */ 2, /* extendUnaligned = */ true);
+  EXPECT_EQ(1, extended.Extract(positions, /* length = */ 1, counts));
+  EXPECT_EQ(3, counts.size()) << "extensions by unaligned tokens on either side, up to maxPhraseLength";
+  EXPECT_EQ(1, counts[Phrase({"house"})]);
+  EXPECT_EQ(1, counts[Phrase({"small", "house"})]);
+  EXPECT_EQ(1, counts[Phrase({"house", "indeed"})]);
+}
@@ -7,6 +7,7 @@
 #include <gtest/gtest.h>
 
 #include "util/rbtree.hpp"
+#include "util/pool.hpp"
 
 using namespace sto;
 
@@ -31,6 +32,18 @@ TEST(RBTreeIteratorTests, tree) {
   EXPECT_EQ(expected_seq, seq);
 }
 
+TEST(RBTreeIteratorTests, child_size) {
+  RBTree<int, int> tree;
+  for(int k : {2, 1, 4, 3, 7})
+    tree.FindOrInsert(k, /* add_size = */ k * 10) = k;
+
+  // the inner nodes' own sizes, not the partial sums of their subtrees
+  for(int k : {1, 2, 3, 4, 7})
+    EXPECT_EQ(k * 10, tree.ChildSize(k));
+  EXPECT_EQ(170, tree.Size());
+}
+
+
 
 TEST(RBTreeIteratorTests, single) {
   RBTree<int, int> tree;
@@ -64,3 +77,54 @@ TEST(RBTreeIteratorTests, empty) {
   std::vector<int> expected_seq = {};
   EXPECT_EQ(expected_seq, seq);
 }
+
+
+TEST(NodePoolTests, reuse) {
+  NodePool<int, 2, 4> pool;
+  std::vector<int *> objs;
+  for(int i = 0; i < 10; i++)
+    objs.push_back(pool.New(i));
+  EXPECT_EQ(10, pool.size());
+  EXPECT_EQ(2 + 2 + 2 + 3 + 4, pool.capacity()) << "slabs of half the live objects, from kFirstSlab up to kMaxSlab";
+
+  int *freed = objs[3];
+  pool.Delete(freed);
+  EXPECT_EQ(freed, pool.New(42)) << "deleted slots are reused first";
+  EXPECT_EQ(13, pool.capacity());
+  for(int i = 0; i < 10; i++)
+    EXPECT_EQ(i == 3 ? 42 : i, *objs[i]);
+}
+
+TEST(NodePoolTests, destruct_live) {
+  std::shared_ptr<int> value = std::make_shared<int>(1);
+  {
+    RBTree<int, std::shared_ptr<int>> tree;
+    for(int i = 0; i < 100; i++)
+      tree[i] = value;
+    for(int i = 0; i < 100; i += 2)
+      tree.Remove(i);
+    EXPECT_GT(value.use_count(), 1);
+  }
+  EXPECT_EQ(1, value.use_count()) << "nodes with non-trivial values are destructed on teardown";
+}
+
+TEST(NodePoolTests, small_pools_stay_small) {
+  NodePool<long> pool;
+  pool.New(1);
+  EXPECT_EQ(1, pool.capacity()) << "a pool with a single object must not allocate unused slots";
+
+  for(long i = 1; i < 10000; i++) {
+    pool.New(i);
+    ASSERT_LE(pool.capacity(), pool.size() * 3 / 2 + 1) << "at most a third of the slots are unused";
+  }
+}
+
+TEST(NodePoolTests, reserve_exact) {
+  NodePool<long> pool;
+  pool.Reserve(37);
+  for(long i = 0; i < 37; i++)
+    pool.New(i);
+  EXPECT_EQ(37, pool.capacity()) << "reserved objects fit into the first slab";
+  pool.Reserve(100);
+  EXPECT_EQ(37, pool.capacity()) << "Reserve() only sizes the first slab";
+}
@@ -0,0 +1,40 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#ifndef STO_RANDOMCORPUS_H
+#define STO_RANDOMCORPUS_H
+
+#include <random>
+#include <string>
+#include <vector>
+
+/** Test helpers for random corpora over a small vocabulary, which makes for deep trees and many equal suffixes. */
+
+/**
+ * Random sentences of the words "w0" ... "w<nwords-1>", with lengths uniform in [minLen, maxLen].
+ * Words are uniformly distributed.
+ */
+inline std::vector<std::vector<std::string>> RandomSentences(std::mt19937 &gen, size_t n, size_t maxLen, size_t nwords, size_t minLen = 1) {
+  std::uniform_int_distribution<size_t> len_dist(minLen, maxLen);
+  std::uniform_int_distribution<size_t> word_dist(0, nwords - 1);
+  std::vector<std::vector<std::string>> sents;
+  for(size_t i = 0; i < n; i++) {
+    std::vector<std::string> words;
+    size_t len = len_dist(gen);
+    for(size_t j = 0; j < len; j++)
+      words.push_back(std::string("w") + std::to_string(word_dist(gen)));
+    sents.push_back(words);
+  }
+  return sents;
+}
+
+/** See above, with a fresh generator seeded with 'seed'. */
+inline std::vector<std::vector<std::string>> RandomSentences(unsigned int seed, size_t n, size_t maxLen, size_t nwords, size_t minLen = 1) {
+  std::mt19937 gen(seed);
+  return RandomSentences(gen, n, maxLen, nwords, minLen);
+}
+
+#endif //STO_RANDOMCORPUS_H
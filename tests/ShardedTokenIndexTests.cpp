@@ -0,0 +1,148 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#include <algorithm>
+#include <memory>
+
+#include <gtest/gtest.h>
+
+#include "Vocab.h"
+#include "Corpus.h"
+#include "TokenIndex.h"
+#include "ShardedTokenIndex.h"
+#include "Types.h"
+#include "RandomCorpus.h"
+
+using namespace sto;
+
+/**
+ * Test Fixture for a random corpus, indexed both in a single TokenIndex and in a ShardedTokenIndex.
+ */
+struct ShardedTokenIndexTests : testing::Test {
+  Vocab<SrcToken> vocab;
+  Corpus<SrcToken> corpus;
+  TokenIndex<SrcToken> index;
+  ShardedTokenIndex<SrcToken> sharded;
+
+  ShardedTokenIndexTests() : corpus(&vocab), index(corpus, /* maxLeafSize = */ 16), sharded(&vocab, /* nshards = */ 3, /* maxLeafSize = */ 16) {
+    for(auto &words : RandomSentences(/* seed = */ 5, /* n = */ 200, /* maxLen = */ 10, /* nwords = */ 6)) {
+      std::vector<SrcToken> sent;
+      for(auto &w : words)
+        sent.push_back(vocab[w]);
+      corpus.AddSentence(sent);
+      index.AddSentence(corpus.sentence(corpus.size() - 1));
+      sharded.AddSentence(sent);
+    }
+    sharded.Flush();
+  }
+
+  static bool less(const Position<SrcToken> &a, const Position<SrcToken> &b) {
+    return a.sid < b.sid || (a.sid == b.sid && a.offset < b.offset);
+  }
+};
+
+TEST_F(ShardedTokenIndexTests, same_positions) {
+  for(std::vector<std::string> lookup : std::vector<std::vector<std::string>>{{}, {"w0"}, {"w3", "w1"}, {"w2", "w2", "w5"}, {"w4", "</s>"}}) {
+    TokenIndex<SrcToken>::Span span = index.span();
+    ShardedTokenIndex<SrcToken>::Span shardedSpan = sharded.span();
+    for(auto &w : lookup)
+      EXPECT_EQ(span.narrow(vocab[w]), shardedSpan.narrow(vocab[w])) << "narrow(" << w << ")";
+    ASSERT_EQ(span.size(), shardedSpan.size());
+
+    // the merged span is ordered by shard, so compare the sets of Positions
+    std::vector<Position<SrcToken>> expected, actual, sorted_actual;
+    for(size_t i = 0; i < span.size(); i++) {
+      expected.push_back(span[i]);
+      actual.push_back(shardedSpan[i]);
+    }
+    std::vector<size_t> ranks(span.size());
+    for(size_t i = 0; i < ranks.size(); i++)
+      ranks[i] = i;
+    shardedSpan.at_sorted(ranks, sorted_actual);
+    EXPECT_EQ(actual, sorted_actual) << "at_sorted() must match operator[]";
+
+    std::sort(expected.begin(), expected.end(), less);
+    std::sort(actual.begin(), actual.end(), less);
+    EXPECT_EQ(expected, actual) << "global Positions of all shards must match the single TokenIndex";
+  }
+}
+
+TEST_F(ShardedTokenIndexTests, narrow_not_found) {
+  ShardedTokenIndex<SrcToken>::Span span = sharded.span();
+  size_t size = span.narrow(vocab["w1"]);
+  EXPECT_EQ(0, span.narrow(vocab["unknown"]));
+  EXPECT_EQ(size, span.size()) << "narrow() to a missing token must leave the Span unchanged";
+  EXPECT_EQ(1, span.depth());
+}
+
+/** shard behind a plain-value interface, as if remote: uses the default SpanView, and counts the lookups */
+struct CountingShard : public TokenIndexShard<SrcToken> {
+  LocalShard<SrcToken> shard;
+  mutable size_t ncounts;
+
+  CountingShard(const Vocab<SrcToken> *vocab) : shard(vocab, /* maxLeafSize = */ 16), ncounts(0) {}
+
+  virtual void AddSentence(const std::vector<SrcToken> &sent) { shard.AddSentence(sent); }
+  virtual void Flush() { shard.Flush(); }
+  virtual size_t Count(const std::vector<SrcToken> &sequence) const { ncounts++; return shard.Count(sequence); }
+  virtual void Positions(const std::vector<SrcToken> &sequence, const std::vector<size_t> &ranks, std::vector<Position<SrcToken>> &out) const {
+    shard.Positions(sequence, ranks, out);
+  }
+};
+
+TEST_F(ShardedTokenIndexTests, remote_shard_view) {
+  std::vector<std::unique_ptr<TokenIndexShard<SrcToken>>> shards;
+  std::vector<CountingShard *> counting;
+  for(size_t i = 0; i < 3; i++) {
+    counting.push_back(new CountingShard(&vocab));
+    shards.push_back(std::unique_ptr<TokenIndexShard<SrcToken>>(counting.back()));
+  }
+  ShardedTokenIndex<SrcToken> remote(std::move(shards));
+  for(Corpus<SrcToken>::Sid sid = 0; sid < corpus.size(); sid++) {
+    std::vector<SrcToken> sent;
+    for(size_t i = 0; i < corpus.sentence(sid).size(); i++)
+      sent.push_back(corpus.sentence(sid)[i]);
+    remote.AddSentence(sent);
+  }
+  remote.Flush();
+
+  ShardedTokenIndex<SrcToken>::Span expected = sharded.span(), actual = remote.span();
+  EXPECT_EQ(expected.narrow(vocab["w3"]), actual.narrow(vocab["w3"]));
+  for(CountingShard *shard : counting)
+    EXPECT_EQ(2, shard->ncounts) << "one Count() for the empty span, and one per narrow()";
+  ASSERT_EQ(expected.size(), actual.size());
+  for(size_t i = 0; i < expected.size(); i++)
+    EXPECT_EQ(expected[i], actual[i]) << "Position entry " << i;
+  for(CountingShard *shard : counting)
+    EXPECT_EQ(2, shard->ncounts) << "random access must not repeat the lookup";
+}
+
+TEST_F(ShardedTokenIndexTests, span_snapshot) {
+  // large leaves, so that the narrowed spans of all shards are in leaf arrays, which their views retain
+  ShardedTokenIndex<SrcToken> leaves(&vocab, /* nshards = */ 3, /* maxLeafSize = */ 100000);
+  auto add_all = [&]() {
+    for(Corpus<SrcToken>::Sid sid = 0; sid < corpus.size(); sid++) {
+      std::vector<SrcToken> sent;
+      for(size_t i = 0; i < corpus.sentence(sid).size(); i++)
+        sent.push_back(corpus.sentence(sid)[i]);
+      leaves.AddSentence(sent);
+    }
+    leaves.Flush();
+  };
+  add_all();
+
+  ShardedTokenIndex<SrcToken>::Span span = leaves.span();
+  size_t size = span.narrow(vocab["w2"]);
+  std::vector<Position<SrcToken>> before;
+  for(size_t i = 0; i < size; i++)
+    before.push_back(span[i]);
+
+  add_all(); // the same sentences again, with new sentence IDs
+  EXPECT_EQ(size, span.size()) << "the Span must keep its snapshot";
+  for(size_t i = 0; i < size; i++)
+    EXPECT_EQ(before[i], span[i]) << "Position entry " << i << " of the snapshot";
+  EXPECT_EQ(2 * size, leaves.span().narrow(vocab["w2"])) << "a new Span sees the new sentences";
+}
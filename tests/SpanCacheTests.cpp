@@ -0,0 +1,150 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#include <gtest/gtest.h>
+
+#include "Vocab.h"
+#include "Corpus.h"
+#include "TokenIndex.h"
+#include "SpanCache.h"
+#include "Types.h"
+#include "RandomCorpus.h"
+
+using namespace sto;
+
+/**
+ * Test Fixture for a random corpus in a TokenIndex, with a SpanCache over it.
+ */
+struct SpanCacheTests : testing::Test {
+  Vocab<SrcToken> vocab;
+  Corpus<SrcToken> corpus;
+  TokenIndex<SrcToken> index;
+
+  SpanCacheTests() : corpus(&vocab), index(corpus, /* maxLeafSize = */ 16) {
+    for(auto &words : RandomSentences(/* seed = */ 3, /* n = */ 200, /* maxLen = */ 10, /* nwords = */ 6))
+      AddSentence(words);
+  }
+
+  void AddSentence(const std::vector<std::string> &words) {
+    std::vector<SrcToken> sent;
+    for(auto &w : words)
+      sent.push_back(vocab[w]);
+    corpus.AddSentence(sent);
+    index.AddSentence(corpus.sentence(corpus.size() - 1));
+  }
+
+  std::vector<SrcToken> Sequence(const std::vector<std::string> &words) {
+    std::vector<SrcToken> seq;
+    for(auto &w : words)
+      seq.push_back(vocab[w]);
+    return seq;
+  }
+
+  TokenIndex<SrcToken>::Span Lookup(const std::vector<std::string> &words) {
+    TokenIndex<SrcToken>::Span span = index.span();
+    for(auto &w : words)
+      if(span.narrow(vocab[w]) == 0)
+        break;
+    return span;
+  }
+};
+
+TEST_F(SpanCacheTests, hit_and_refresh) {
+  SpanCache<SrcToken> cache(index);
+  std::vector<std::string> words = {"w1", "w2"};
+
+  TokenIndex<SrcToken>::Span span = cache.span(Sequence(words));
+  EXPECT_EQ(Lookup(words).size(), span.size());
+  EXPECT_EQ(2, span.depth());
+  EXPECT_EQ(0, cache.hits());
+  EXPECT_EQ(1, cache.misses());
+
+  EXPECT_EQ(span.size(), cache.span(Sequence(words)).size());
+  EXPECT_EQ(1, cache.hits());
+
+  // the index changes: the entry is stale, and resolved again
+  size_t size = span.size();
+  AddSentence({"w1", "w2", "w1", "w2"});
+  TokenIndex<SrcToken>::Span refreshed = cache.span(Sequence(words));
+  EXPECT_EQ(2, cache.misses());
+  EXPECT_EQ(Lookup(words).size(), refreshed.size()) << "stale entries must reflect later AddSentence() calls";
+  EXPECT_EQ(size + 2, refreshed.size());
+  EXPECT_EQ(1, cache.size());
+
+  // not found: the Span stops before the missing token
+  EXPECT_EQ(1, cache.span(Sequence({"w1", "w9", "w2"})).depth());
+}
+
+TEST_F(SpanCacheTests, sample) {
+  SpanCache<SrcToken> cache(index, /* capacity = */ 64, /* sampleSize = */ 10);
+  std::vector<std::string> words = {"w3"};
+
+  std::shared_ptr<const std::vector<Position<SrcToken>>> sample = cache.sample(Sequence(words));
+  ASSERT_EQ(10, sample->size());
+  EXPECT_EQ(sample, cache.sample(Sequence(words))) << "the sample is drawn once per entry version";
+
+  for(const Position<SrcToken> &pos : *sample)
+    EXPECT_EQ(vocab["w3"], corpus.sentence(pos.sid)[pos.offset]);
+
+  // small spans: the entire span
+  std::shared_ptr<const std::vector<Position<SrcToken>>> all = cache.sample(Sequence({"w0", "w0", "w0"}));
+  EXPECT_EQ(std::min<size_t>(10, Lookup({"w0", "w0", "w0"}).size()), all->size());
+}
+
+TEST_F(SpanCacheTests, eviction) {
+  // 16 shards, one entry each
+  SpanCache<SrcToken> cache(index, /* capacity = */ 16);
+  std::vector<std::string> words = {"w0", "w1", "w2", "w3", "w4", "w5"};
+  for(auto &a : words)
+    for(auto &b : words)
+      EXPECT_EQ(Lookup({a, b}).size(), cache.span(Sequence({a, b})).size());
+  EXPECT_LE(cache.size(), 16);
+  EXPECT_GT(cache.size(), 0);
+
+  cache.clear();
+  EXPECT_EQ(0, cache.size());
+}
+
+TEST_F(SpanCacheTests, unrelated_writes_stay_cached) {
+  SpanCache<SrcToken> cache(index);
+  std::vector<std::string> words = {"w1", "w2"};
+  TokenIndex<SrcToken>::Span span = cache.span(Sequence(words));
+  ASSERT_GT(span.size(), 0);
+  ASSERT_GT(span.tree_depth(), 0) << "test needs the entry below the root";
+  size_t size = span.size();
+
+  // neither adds Positions below w1, nor touches its leaves
+  AddSentence({"w5", "w4"});
+  EXPECT_EQ(size, cache.span(Sequence(words)).size());
+  EXPECT_EQ(1, cache.hits()) << "writes to other subtrees must not invalidate the entry";
+  EXPECT_EQ(1, cache.misses());
+
+  AddSentence({"w1", "w2"});
+  EXPECT_EQ(size + 1, cache.span(Sequence(words)).size());
+  EXPECT_EQ(Lookup(words).size(), cache.span(Sequence(words)).size());
+  EXPECT_EQ(2, cache.misses()) << "a write within the Span must";
+}
+
+TEST_F(SpanCacheTests, prune_stale) {
+  SpanCache<SrcToken> cache(index);
+  std::vector<std::string> words = {"w0", "w1", "w2", "w3", "w4", "w5"};
+  for(auto &a : words)
+    for(auto &b : words)
+      cache.span(Sequence({a, b}));
+  size_t cached = cache.size();
+  ASSERT_EQ(words.size() * words.size(), cached);
+
+  cache.prune();
+  EXPECT_EQ(cached, cache.size()) << "fresh entries stay";
+
+  AddSentence({"w2", "w3", "w2"});
+  cache.prune();
+  EXPECT_LT(cache.size(), cached) << "entries within the new sentence's Spans are stale";
+  EXPECT_GT(cache.size(), 0) << "entries in other leaves stay";
+  for(auto &a : words)
+    for(auto &b : words)
+      EXPECT_EQ(Lookup({a, b}).size(), cache.span(Sequence({a, b})).size());
+}
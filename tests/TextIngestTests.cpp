@@ -0,0 +1,136 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#include <fstream>
+#include <sstream>
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+
+#include "Vocab.h"
+#include "Corpus.h"
+#include "TokenIndex.h"
+#include "TextIngest.h"
+#include "Types.h"
+#include "RandomCorpus.h"
+
+using namespace sto;
+
+/** random text, one sentence per line, including empty lines */
+std::string RandomText(size_t nlines) {
+  std::ostringstream text;
+  for(auto &words : RandomSentences(/* seed = */ 31, nlines, /* maxLen = */ 12, /* nwords = */ 201, /* minLen = */ 0)) {
+    for(size_t j = 0; j < words.size(); j++)
+      text << (j ? " " : "") << words[j];
+    text << "\n";
+  }
+  return text.str();
+}
+
+TEST(TextIngestTests, same_as_serial) {
+  std::string text = RandomText(2000);
+
+  // serial reference
+  Vocab<SrcToken> vocab;
+  Corpus<SrcToken> corpus(&vocab);
+  TokenIndex<SrcToken> index(corpus, /* maxLeafSize = */ 64);
+  std::istringstream is(text);
+  std::string line;
+  while(std::getline(is, line)) {
+    std::istringstream words(line);
+    std::vector<SrcToken> sent;
+    std::string w;
+    while(words >> w)
+      sent.push_back(vocab[w]);
+    corpus.AddSentence(sent);
+    index.AddSentence(corpus.sentence(corpus.size() - 1));
+  }
+
+  // small chunks and queue, to exercise ordering and backpressure
+  Vocab<SrcToken> ingestVocab;
+  Corpus<SrcToken> ingestCorpus(&ingestVocab);
+  TokenIndex<SrcToken> ingestIndex(ingestCorpus, /* maxLeafSize = */ 64);
+  TextIngest<SrcToken> ingest(ingestVocab, ingestCorpus, &ingestIndex, TextIngest<SrcToken>::Options(/* nthreads = */ 4, /* chunk_size = */ 256, /* queue_size = */ 2, /* index_batch = */ 500));
+  TextIngest<SrcToken>::Stats stats = ingest.Read(text.data(), text.size());
+
+  EXPECT_EQ(text.size(), stats.bytes);
+  EXPECT_EQ(2000, stats.lines);
+  EXPECT_EQ(corpus.numTokens(), stats.tokens);
+  EXPECT_EQ(vocab.end().vid - 2, stats.new_words) << "all words but </s> and the reserved vid are new";
+
+  ASSERT_EQ(corpus.size(), ingestCorpus.size());
+  for(Corpus<SrcToken>::Sid sid = 0; sid < corpus.size(); sid++)
+    ASSERT_EQ(corpus.sentence(sid).surface(), ingestCorpus.sentence(sid).surface()) << "sentence " << sid;
+  EXPECT_EQ(vocab["w7"].vid, ingestVocab["w7"].vid) << "vids are assigned in file order";
+
+  TokenIndex<SrcToken>::Span span = index.span(), ingestSpan = ingestIndex.span();
+  ASSERT_EQ(span.size(), ingestSpan.size());
+  for(size_t i = 0; i < span.size(); i++)
+    EXPECT_EQ(span[i], ingestSpan[i]) << "Position entry " << i;
+}
+
+TEST(TextIngestTests, read_file) {
+  std::string filename = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("sto-test-%%%%-%%%%")).string();
+  {
+    std::ofstream ofs(filename);
+    ofs << "das ist  ein haus\r\n" << "\n" << "\tein haus ist gross";
+  }
+
+  Vocab<SrcToken> vocab;
+  Corpus<SrcToken> corpus(&vocab);
+  TextIngest<SrcToken> ingest(vocab, corpus);
+  TextIngest<SrcToken>::Stats stats = ingest.Read(filename);
+  boost::filesystem::remove(filename);
+
+  ASSERT_EQ(3, corpus.size()) << "empty lines are kept as empty sentences, a missing last line end is fine";
+  EXPECT_EQ(3, stats.lines);
+  EXPECT_EQ(8, stats.tokens);
+  EXPECT_EQ("das ist ein haus", corpus.sentence(0).surface());
+  EXPECT_EQ(0, corpus.sentence(1).size());
+  EXPECT_EQ("ein haus ist gross", corpus.sentence(2).surface());
+  EXPECT_EQ(5, stats.new_words);
+
+  std::ostringstream os;
+  stats.Print(os);
+  EXPECT_NE(std::string::npos, os.str().find("tokens 8"));
+}
+
+TEST(TextIngestTests, seeded_vocab) {
+  Vocab<SrcToken> vocab;
+  Corpus<SrcToken> corpus(&vocab);
+  SrcToken haus = vocab["haus"], ein = vocab["ein"];
+  TextIngest<SrcToken> ingest(vocab, corpus, nullptr, TextIngest<SrcToken>::Options(/* nthreads = */ 2, /* chunk_size = */ 8));
+
+  std::string text = "ein haus\nein neues haus\n";
+  TextIngest<SrcToken>::Stats stats = ingest.Read(text.data(), text.size());
+  EXPECT_EQ(1, stats.new_words) << "words already in the Vocab are not inserted again";
+  EXPECT_EQ(ein, corpus.sentence(0)[0]);
+  EXPECT_EQ(haus, corpus.sentence(1)[2]);
+
+  // words inserted into the Vocab between reads
+  SrcToken gross = vocab["gross"];
+  text = "gross neues haus\n";
+  stats = ingest.Read(text.data(), text.size());
+  EXPECT_EQ(0, stats.new_words);
+  EXPECT_EQ(gross, corpus.sentence(2)[0]);
+  EXPECT_EQ(vocab["neues"], corpus.sentence(2)[1]);
+}
+
+TEST(TextIngestTests, writer_error) {
+  // Corpus::AddSentence() throws for sentences longer than kMaxDynSentence
+  std::ostringstream text;
+  text << RandomText(500);
+  for(size_t i = 0; i < 70000; i++)
+    text << "w" << (i % 10) << " ";
+  text << "\n" << RandomText(500);
+  std::string data = text.str();
+
+  Vocab<SrcToken> vocab;
+  Corpus<SrcToken> corpus(&vocab);
+  TextIngest<SrcToken> ingest(vocab, corpus, nullptr, TextIngest<SrcToken>::Options(/* nthreads = */ 4, /* chunk_size = */ 256, /* queue_size = */ 2));
+  EXPECT_THROW(ingest.Read(data.data(), data.size()), std::runtime_error) << "the error reaches the caller, after the tokenizers are joined";
+  EXPECT_EQ(500, corpus.size()) << "sentences before the failing one are kept";
+}
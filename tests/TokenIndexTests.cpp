@@ -4,8 +4,12 @@
  * Licensed under GNU LGPL Version 2.1, see COPYING *
  ****************************************************/
 
+#include <algorithm>
+#include <atomic>
 #include <random>
+#include <cmath>
 #include <sstream>
+#include <thread>
 #include <utility>
 #include <unordered_set>
 
@@ -15,8 +19,10 @@
 #include "Corpus.h"
 #include "TokenIndex.h"
 #include "Types.h"
+#include "RandomCorpus.h"
 
 #include "util/Time.h"
+#include "util/epoch.hpp"
 #include "util/usage.h"
 
 using namespace sto;
@@ -41,6 +47,14 @@ struct TokenIndexTests : testing::Test {
     return corpus.sentence(corpus.size() - 1);
   }
 
+  /** add random sentences of the words "w0" ... "w<nwords-1>", see RandomSentences() */
+  std::vector<std::vector<std::string>> AddRandomSentences(unsigned int seed, size_t n, size_t maxLen, size_t nwords) {
+    std::vector<std::vector<std::string>> sents = RandomSentences(seed, n, maxLen, nwords);
+    for(auto &words : sents)
+      AddSentence(words);
+    return sents;
+  }
+
   void fill_tree_2level_common_prefix_the(TokenIndex<SrcToken> &tokenIndex);
   void tree_2level_common_prefix_the_m(size_t maxLeafSize);
 
@@ -124,6 +138,93 @@ TEST_F(TokenIndexTests, load_v2) {
   }
 }
 
+TEST_F(TokenIndexTests, load_v2_add) {
+  Vocab<SrcToken> sv("res/vocab.tdx");
+  Corpus<SrcToken> sc("res/corpus.mct", &sv);
+  TokenIndex<SrcToken> staticIndex("res/index.sfa", sc); // memory mapped
+
+  std::vector<std::string> surface = {"pear", "and", "orange"};
+  std::vector<SrcToken> sent;
+  for(auto s : surface)
+    sent.push_back(sv.at(s));
+  sc.AddSentence(sent);
+
+  // inserts go into a buffer on top of the mapped suffix array
+  staticIndex.AddSentence(sc.sentence(1));
+
+  TokenIndex<SrcToken> dynamicIndex(sc);
+  dynamicIndex.AddSentence(sc.sentence(0));
+  dynamicIndex.AddSentence(sc.sentence(1));
+
+  TokenIndex<SrcToken>::Span staticSpan = staticIndex.span();
+  TokenIndex<SrcToken>::Span dynamicSpan = dynamicIndex.span();
+
+  ASSERT_EQ(dynamicSpan.size(), staticSpan.size()) << "adding to a loaded index must add all positions";
+  for(size_t i = 0; i < staticSpan.size(); i++) {
+    EXPECT_EQ(dynamicSpan[i], staticSpan[i]) << "Position entry " << i << " must match between loaded+added and dynamic TokenIndex";
+  }
+}
+
+TEST_F(TokenIndexTests, load_v2_bulk_split) {
+  Vocab<SrcToken> sv("res/vocab.tdx");
+  Corpus<SrcToken> sc("res/corpus.mct", &sv);
+  TokenIndex<SrcToken> staticIndex("res/index.sfa", sc, /* maxLeafSize = */ 2);
+
+  std::stringstream actual_tree;
+  staticIndex.DebugPrint(actual_tree);
+
+  // "apple and orange and pear and apple and orange"
+  std::string expected_tree = R"(TreeNode size=9 is_leaf=false
+* 'and' vid=2
+  TreeNode size=4 is_leaf=false
+  * 'apple' vid=3
+    TreeNode size=1 is_leaf=true
+    * [sid=0 offset=5]
+  * 'orange' vid=4
+    TreeNode size=2 is_leaf=true
+    * [sid=0 offset=7]
+    * [sid=0 offset=1]
+  * 'pear' vid=5
+    TreeNode size=1 is_leaf=true
+    * [sid=0 offset=3]
+* 'apple' vid=3
+  TreeNode size=2 is_leaf=true
+  * [sid=0 offset=6]
+  * [sid=0 offset=0]
+* 'orange' vid=4
+  TreeNode size=2 is_leaf=true
+  * [sid=0 offset=8]
+  * [sid=0 offset=2]
+* 'pear' vid=5
+  TreeNode size=1 is_leaf=true
+  * [sid=0 offset=4]
+)";
+  EXPECT_EQ(expected_tree, actual_tree.str()) << "tree structure after bulk split";
+
+  std::vector<std::string> surface = {"pear", "and", "orange"};
+  std::vector<SrcToken> sent;
+  for(auto s : surface)
+    sent.push_back(sv.at(s));
+  sc.AddSentence(sent);
+  staticIndex.AddSentence(sc.sentence(1));
+
+  TokenIndex<SrcToken> dynamicIndex(sc, /* maxLeafSize = */ 2);
+  dynamicIndex.AddSentence(sc.sentence(0));
+  dynamicIndex.AddSentence(sc.sentence(1));
+
+  TokenIndex<SrcToken>::Span staticSpan = staticIndex.span();
+  TokenIndex<SrcToken>::Span dynamicSpan = dynamicIndex.span();
+
+  ASSERT_EQ(dynamicSpan.size(), staticSpan.size()) << "adding to a bulk split index must add all positions";
+  for(size_t i = 0; i < staticSpan.size(); i++) {
+    EXPECT_EQ(dynamicSpan[i], staticSpan[i]) << "Position entry " << i << " must match between loaded+added and dynamic TokenIndex";
+  }
+
+  EXPECT_EQ(2, staticSpan.narrow(sv.at("pear"))) << "'pear' range size check";
+  EXPECT_EQ(2, staticSpan.narrow(sv.at("and"))) << "'pear and' range size check";
+  EXPECT_EQ(1, staticSpan.narrow(sv.at("orange"))) << "'pear and orange' range size check";
+}
+
 TEST_F(TokenIndexTests, suffix_array_split) {
   //                                      1       2      3      4      5      6     7
   std::vector<std::string> vocab_id_order{"</s>", "bit", "cat", "dog", "mat", "on", "the"};
@@ -351,6 +452,427 @@ TEST_F(TokenIndexTests, tree_2level_common_prefix_the_15) {
   tree_2level_common_prefix_the_m(/* maxLeafSize = */ 15);
 }
 
+TEST_F(TokenIndexTests, build_parallel) {
+  // random corpus, deep enough to cause splits below the first level
+  AddRandomSentences(/* seed = */ 42, /* n = */ 300, /* maxLen = */ 12, /* nwords = */ 8);
+
+  TokenIndex<SrcToken> dynamicIndex(corpus, /* maxLeafSize = */ 16);
+  for(size_t i = 0; i < corpus.size(); i++)
+    dynamicIndex.AddSentence(corpus.sentence(i));
+
+  TokenIndex<SrcToken> parallelIndex(corpus, /* maxLeafSize = */ 16);
+  parallelIndex.Build(/* nthreads = */ 4);
+
+  TokenIndex<SrcToken>::Span dynamicSpan = dynamicIndex.span();
+  TokenIndex<SrcToken>::Span parallelSpan = parallelIndex.span();
+  ASSERT_EQ(dynamicSpan.size(), parallelSpan.size()) << "Build() must index every corpus position";
+  for(size_t i = 0; i < dynamicSpan.size(); i++)
+    EXPECT_EQ(dynamicSpan[i], parallelSpan[i]) << "Position entry " << i << " must match between AddSentence() and Build()";
+
+  EXPECT_EQ(dynamicSpan.narrow(vocab["w3"]), parallelSpan.narrow(vocab["w3"])) << "narrow() on the built tree";
+  EXPECT_EQ(dynamicSpan.narrow(vocab["w1"]), parallelSpan.narrow(vocab["w1"])) << "narrow() on the built tree";
+
+  // small corpus: Build() results in a single leaf
+  TokenIndex<SrcToken> leafIndex(corpus, /* maxLeafSize = */ 100000);
+  leafIndex.Build(/* nthreads = */ 2);
+  TokenIndex<SrcToken>::Span leafSpan = leafIndex.span();
+  EXPECT_TRUE(leafSpan.in_array()) << "small index must be a single leaf";
+  for(size_t i = 0; i < dynamicSpan.size(); i++)
+    EXPECT_EQ(dynamicIndex.span()[i], leafSpan[i]) << "Position entry " << i << " must match in single leaf Build()";
+}
+
+TEST_F(TokenIndexTests, add_sentences_batch) {
+  AddRandomSentences(/* seed = */ 7, /* n = */ 300, /* maxLen = */ 12, /* nwords = */ 8);
+
+  TokenIndex<SrcToken> dynamicIndex(corpus, /* maxLeafSize = */ 16);
+  for(size_t i = 0; i < corpus.size(); i++)
+    dynamicIndex.AddSentence(corpus.sentence(i));
+
+  // a few individual sentences first, then batches of growing size, which split leaves
+  TokenIndex<SrcToken> batchIndex(corpus, /* maxLeafSize = */ 16);
+  size_t sid = 0;
+  for(; sid < 10; sid++)
+    batchIndex.AddSentence(corpus.sentence(sid));
+  for(size_t batch_size = 1; sid < corpus.size(); batch_size *= 2) {
+    std::vector<Sentence<SrcToken>> batch;
+    for(; sid < corpus.size() && batch.size() < batch_size; sid++)
+      batch.push_back(corpus.sentence(sid));
+    batchIndex.AddSentences(batch);
+  }
+
+  TokenIndex<SrcToken>::Span dynamicSpan = dynamicIndex.span();
+  TokenIndex<SrcToken>::Span batchSpan = batchIndex.span();
+  ASSERT_EQ(dynamicSpan.size(), batchSpan.size()) << "AddSentences() must index every sentence position";
+  for(size_t i = 0; i < dynamicSpan.size(); i++)
+    EXPECT_EQ(dynamicSpan[i], batchSpan[i]) << "Position entry " << i << " must match between AddSentence() and AddSentences()";
+
+  for(std::string w : {"w0", "w5", "</s>"}) {
+    TokenIndex<SrcToken>::Span d = dynamicIndex.span();
+    TokenIndex<SrcToken>::Span b = batchIndex.span();
+    EXPECT_EQ(d.narrow(vocab[w]), b.narrow(vocab[w])) << "narrow(" << w << ") after AddSentences()";
+    EXPECT_EQ(d.narrow(vocab["w2"]), b.narrow(vocab["w2"])) << "narrow(" << w << " w2) after AddSentences()";
+  }
+}
+
+TEST_F(TokenIndexTests, leaf_insert_buffer) {
+  AddRandomSentences(/* seed = */ 13, /* n = */ 200, /* maxLen = */ 12, /* nwords = */ 8);
+
+  // a single large leaf: inserts go through its buffer, which is merged every sqrt(n) inserts
+  TokenIndex<SrcToken> dynamicIndex(corpus, /* maxLeafSize = */ 100000);
+  TokenIndex<SrcToken> builtIndex(corpus, /* maxLeafSize = */ 100000);
+  builtIndex.Build(/* nthreads = */ 1);
+
+  TokenIndex<SrcToken>::Span held = dynamicIndex.span();
+  for(size_t i = 0; i < corpus.size(); i++) {
+    dynamicIndex.AddSentence(corpus.sentence(i));
+    if(i == corpus.size() / 2) {
+      held = dynamicIndex.span();
+      held.narrow(vocab["w1"]);
+    }
+  }
+
+  // a Span keeps its view of the leaf (including the buffer at that time), regardless of later inserts and merges
+  size_t held_size = held.size();
+  for(size_t i = 0; i < held_size; i++)
+    EXPECT_EQ(vocab["w1"].vid, held[i].vid(corpus)) << "held Span entry " << i;
+
+  TokenIndex<SrcToken>::Span dynamicSpan = dynamicIndex.span();
+  TokenIndex<SrcToken>::Span builtSpan = builtIndex.span();
+  ASSERT_EQ(builtSpan.size(), dynamicSpan.size());
+  for(size_t i = 0; i < builtSpan.size(); i++)
+    EXPECT_EQ(builtSpan[i], dynamicSpan[i]) << "Position entry " << i << " must match between buffered inserts and Build()";
+
+  for(std::string w : {"w0", "w5", "</s>"}) {
+    TokenIndex<SrcToken>::Span d = dynamicIndex.span();
+    TokenIndex<SrcToken>::Span b = builtIndex.span();
+    EXPECT_EQ(b.narrow(vocab[w]), d.narrow(vocab[w])) << "narrow(" << w << ") through the insert buffer";
+    EXPECT_EQ(b.narrow(vocab["w2"]), d.narrow(vocab["w2"])) << "narrow(" << w << " w2) through the insert buffer";
+  }
+}
+
+TEST_F(TokenIndexTests, async_splits) {
+  AddRandomSentences(/* seed = */ 11, /* n = */ 300, /* maxLen = */ 12, /* nwords = */ 8);
+
+  TokenIndex<SrcToken> syncIndex(corpus, /* maxLeafSize = */ 16);
+  for(size_t i = 0; i < corpus.size(); i++)
+    syncIndex.AddSentence(corpus.sentence(i));
+
+  TokenIndex<SrcToken> asyncIndex(corpus, /* maxLeafSize = */ 16);
+  asyncIndex.SetAsyncSplits(true);
+
+  // a concurrent reader must always see a consistent tree: every indexed Position is readable
+  std::atomic<bool> done(false);
+  std::atomic<size_t> inconsistent(0);
+  std::thread reader([&]() {
+    while(!done.load()) {
+      TokenIndex<SrcToken>::Span span = asyncIndex.span();
+      span.narrow(vocab["w3"]);
+      for(size_t i = 0; i < span.size(); i++)
+        if(span[i].vid(corpus) != vocab["w3"].vid)
+          inconsistent++;
+    }
+  });
+  for(size_t i = 0; i < corpus.size(); i++)
+    asyncIndex.AddSentence(corpus.sentence(i));
+  done = true;
+  reader.join();
+  EXPECT_EQ(0, inconsistent.load());
+
+  asyncIndex.FinishSplits();
+  std::stringstream syncTree, asyncTree;
+  syncIndex.DebugPrint(syncTree);
+  asyncIndex.DebugPrint(asyncTree);
+  EXPECT_EQ(syncTree.str(), asyncTree.str()) << "async splits must build the same tree as synchronous splits";
+
+  TokenIndex<SrcToken>::Span syncSpan = syncIndex.span();
+  TokenIndex<SrcToken>::Span asyncSpan = asyncIndex.span();
+  ASSERT_EQ(syncSpan.size(), asyncSpan.size());
+  for(size_t i = 0; i < syncSpan.size(); i++)
+    EXPECT_EQ(syncSpan[i], asyncSpan[i]) << "Position entry " << i << " must match with and without async splits";
+
+  // after disabling, splits happen inline again
+  asyncIndex.SetAsyncSplits(false);
+  asyncIndex.AddSentence(corpus.sentence(0));
+  syncIndex.AddSentence(corpus.sentence(0));
+  EXPECT_EQ(syncIndex.span().size(), asyncIndex.span().size());
+}
+
+TEST_F(TokenIndexTests, narrow_array_counts) {
+  std::vector<std::vector<std::string>> sents = AddRandomSentences(/* seed = */ 3, /* n = */ 100, /* maxLen = */ 6, /* nwords = */ 5);
+  for(auto &words : sents)
+    words.push_back("</s>");
+  vocab["w9"]; // in vocabulary, but never in the corpus
+
+  // single suffix array leaf, so all narrow() calls search the array
+  TokenIndex<SrcToken> tokenIndex(corpus);
+  for(size_t i = 0; i < corpus.size(); i++)
+    tokenIndex.AddSentence(corpus.sentence(i));
+
+  std::vector<std::string> words = {"w0", "w1", "w2", "w3", "w4", "w9", "</s>"};
+  for(auto &first : words) {
+    for(auto &second : words) {
+      size_t expected = 0;
+      for(auto &sent : sents)
+        for(size_t i = 0; i + 1 < sent.size(); i++)
+          expected += (sent[i] == first && sent[i + 1] == second);
+
+      TokenIndex<SrcToken>::Span span = tokenIndex.span();
+      if(span.narrow(vocab[first]) == 0)
+        continue; // not found: span stays unmodified
+      EXPECT_EQ(expected, span.narrow(vocab[second])) << "count of '" << first << " " << second << "'";
+    }
+  }
+}
+
+TEST_F(TokenIndexTests, children_counts) {
+  AddRandomSentences(/* seed = */ 5, /* n = */ 200, /* maxLen = */ 8, /* nwords = */ 5);
+  std::vector<std::string> words = {"</s>", "w0", "w1", "w2", "w3", "w4"};
+
+  // counts must match narrow() for each token, both within the tree and in suffix array leaves
+  for(size_t maxLeafSize : {16, 100000}) {
+    TokenIndex<SrcToken> tokenIndex(corpus, maxLeafSize);
+    for(size_t i = 0; i < corpus.size(); i++)
+      tokenIndex.AddSentence(corpus.sentence(i));
+
+    // a span ending in </s> has no extensions
+    std::vector<std::vector<std::string>> prefixes = {{}, {"w1"}, {"w2", "w3"}, {"w0", "w0", "w4"}, {"w2", "</s>"}};
+    for(auto &prefix : prefixes) {
+      TokenIndex<SrcToken>::Span span = tokenIndex.span();
+      for(auto &w : prefix)
+        span.narrow(vocab[w]);
+      ASSERT_EQ(prefix.size(), span.depth());
+
+      std::vector<std::pair<SrcToken, size_t>> expected;
+      for(auto &w : words) {
+        TokenIndex<SrcToken>::Span extended = span;
+        size_t count = extended.narrow(vocab[w]);
+        if(count > 0)
+          expected.push_back(std::make_pair(vocab[w], count));
+      }
+      std::sort(expected.begin(), expected.end()); // ascending vid order
+      EXPECT_EQ(expected, span.children_counts()) << "children_counts() with maxLeafSize " << maxLeafSize << " at depth " << prefix.size();
+    }
+  }
+}
+
+TEST_F(TokenIndexTests, lookup_sentence) {
+  AddRandomSentences(/* seed = */ 7, /* n = */ 200, /* maxLen = */ 8, /* nwords = */ 5);
+  TokenIndex<SrcToken> tokenIndex(corpus, /* maxLeafSize = */ 16);
+  for(size_t i = 0; i < corpus.size(); i++)
+    tokenIndex.AddSentence(corpus.sentence(i));
+
+  std::vector<SrcToken> query;
+  for(std::string w : {"w1", "w2", "w0", "w3", "w3", "w4", "w9", "w2", "w1"})
+    query.push_back(vocab[w]); // "w9" is never in the corpus
+
+  for(size_t nthreads : {1, 4}) {
+    std::vector<std::vector<TokenIndex<SrcToken>::Span>> spans = tokenIndex.LookupSentence(query, /* maxLen = */ 5, nthreads);
+    ASSERT_EQ(query.size(), spans.size());
+    for(size_t i = 0; i < query.size(); i++) {
+      // expected: a fresh span for each sub-phrase, up to the first one not found
+      size_t k = 0;
+      for(; k < 5 && i + k < query.size(); k++) {
+        TokenIndex<SrcToken>::Span expected = tokenIndex.span();
+        size_t size = 0;
+        for(size_t j = i; j <= i + k; j++)
+          size = expected.narrow(query[j]);
+        if(size == 0 || expected.depth() != k + 1)
+          break;
+        ASSERT_LT(k, spans[i].size()) << "sub-phrase at " << i << " of length " << k + 1 << " must be found";
+        EXPECT_EQ(expected.size(), spans[i][k].size()) << "sub-phrase at " << i << " of length " << k + 1;
+        EXPECT_EQ(k + 1, spans[i][k].depth());
+      }
+      EXPECT_EQ(k, spans[i].size()) << "spans must stop at the first sub-phrase not found, at " << i;
+    }
+  }
+}
+
+TEST_F(TokenIndexTests, narrow_batch) {
+  std::mt19937 gen(13);
+  AddRandomSentences(/* seed = */ 13, /* n = */ 300, /* maxLen = */ 8, /* nwords = */ 5);
+  std::vector<std::string> words = {"</s>", "w0", "w1", "w2", "w3", "w4", "w9"}; // "w9" is never in the corpus
+
+  // large leaves for interleaved binary searches, small ones for tree steps
+  for(size_t maxLeafSize : {16, 100000}) {
+    TokenIndex<SrcToken> tokenIndex(corpus, maxLeafSize);
+    for(size_t i = 0; i < corpus.size(); i++)
+      tokenIndex.AddSentence(corpus.sentence(i));
+
+    std::uniform_int_distribution<size_t> depth_dist(0, 3);
+    std::uniform_int_distribution<size_t> token_dist(0, words.size() - 1);
+    std::vector<TokenIndex<SrcToken>::Span> spans, expected;
+    std::vector<SrcToken> tokens;
+    for(size_t i = 0; i < 200; i++) {
+      TokenIndex<SrcToken>::Span span = tokenIndex.span();
+      for(size_t d = depth_dist(gen); d > 0; d--)
+        span.narrow(vocab[words[token_dist(gen)]]);
+      spans.push_back(span);
+      expected.push_back(span);
+      tokens.push_back(vocab[words[token_dist(gen)]]);
+    }
+
+    for(size_t width : {1, 16}) {
+      std::vector<TokenIndex<SrcToken>::Span> batch = spans;
+      std::vector<size_t> sizes = tokenIndex.NarrowBatch(batch, tokens, width);
+      ASSERT_EQ(spans.size(), sizes.size());
+      for(size_t i = 0; i < spans.size(); i++) {
+        TokenIndex<SrcToken>::Span span = expected[i];
+        EXPECT_EQ(span.narrow(tokens[i]), sizes[i]) << "span " << i << " with maxLeafSize " << maxLeafSize;
+        EXPECT_EQ(span.depth(), batch[i].depth()) << "a span must stay unmodified if the token is not found";
+        ASSERT_EQ(span.size(), batch[i].size());
+        for(size_t j = 0; j < span.size(); j++)
+          EXPECT_EQ(span[j], batch[i][j]);
+      }
+    }
+  }
+}
+
+TEST_F(TokenIndexTests, span_sample) {
+  AddRandomSentences(/* seed = */ 11, /* n = */ 200, /* maxLen = */ 8, /* nwords = */ 5);
+  TokenIndex<SrcToken> tokenIndex(corpus, /* maxLeafSize = */ 16);
+  for(size_t i = 0; i < corpus.size(); i++)
+    tokenIndex.AddSentence(corpus.sentence(i));
+
+  // spans in the tree (full index) and in a suffix array leaf
+  std::vector<std::vector<std::string>> prefixes = {{}, {"w2"}, {"w1", "w3"}};
+  for(auto &prefix : prefixes) {
+    TokenIndex<SrcToken>::Span span = tokenIndex.span();
+    for(auto &w : prefix)
+      span.narrow(vocab[w]);
+    std::vector<Position<SrcToken>> all;
+    for(size_t i = 0; i < span.size(); i++)
+      all.push_back(span[i]);
+
+    for(bool stratified : {false, true}) {
+      for(size_t k : {size_t(1), size_t(7), span.size(), span.size() + 3}) {
+        std::vector<Position<SrcToken>> sample;
+        std::mt19937 rng(42);
+        span.sample(k, rng, sample, stratified);
+        ASSERT_EQ(std::min(k, span.size()), sample.size()) << "sample size with prefix length " << prefix.size();
+
+        // distinct positions of the span, in suffix order
+        size_t rank = 0;
+        for(auto &pos : sample) {
+          while(rank < all.size() && !(all[rank] == pos))
+            rank++;
+          ASSERT_LT(rank, all.size()) << "sampled positions must be distinct and in suffix order";
+          rank++;
+        }
+
+        std::vector<Position<SrcToken>> again;
+        std::mt19937 rng2(42);
+        span.sample(k, rng2, again, stratified);
+        EXPECT_EQ(sample, again) << "samples must be reproducible with the same seed";
+      }
+    }
+  }
+}
+
+TEST_F(TokenIndexTests, stats) {
+  Stats::Snapshot before = tokenIndex.Stats();
+  for(size_t i = 0; i < 20; i++)
+    tokenIndex.AddSentence(AddSentence({"one", "two", "three", "two", "one"}));
+  Stats::Snapshot added = tokenIndex.Stats();
+
+  TokenIndex<SrcToken>::Span span = tokenIndex.span();
+  span.narrow(vocab["two"]);
+  span.narrow(vocab["one"]);
+  EXPECT_EQ(20, span.size());
+  EXPECT_LT(span[0].sid, 20);
+  Stats::Snapshot after = tokenIndex.Stats();
+
+  if(!Stats::kEnabled) {
+    EXPECT_EQ(0, after[Stats::kNarrowArray]) << "counters must stay zero without STO_STATS";
+    return;
+  }
+  EXPECT_EQ(100, added[Stats::kAddPositionCopies].count - before[Stats::kAddPositionCopies].count) << "one per inserted position";
+  EXPECT_EQ(2, after[Stats::kNarrowArray] - added[Stats::kNarrowArray]) << "both narrow() steps in the single leaf";
+  EXPECT_EQ(1, after[Stats::kAt] - added[Stats::kAt]);
+  EXPECT_LT(added[Stats::kFindBoundsProbes].count, after[Stats::kFindBoundsProbes].count);
+}
+
+TEST_F(TokenIndexTests, insert_copies_amortized) {
+  if(!Stats::kEnabled)
+    return; // needs the kAddPositionCopies counter, see STO_STATS
+  AddRandomSentences(/* seed = */ 29, /* n = */ 500, /* maxLen = */ 10, /* nwords = */ 8);
+
+  // a single large leaf: without the insert buffer, each insert would copy the whole leaf
+  TokenIndex<SrcToken> index(corpus, /* maxLeafSize = */ 100000);
+  Stats::Snapshot before = index.Stats();
+  for(size_t i = 0; i < corpus.size(); i++)
+    index.AddSentence(corpus.sentence(i));
+  Stats::Snapshot after = index.Stats();
+
+  size_t n = index.span().size();
+  uint64_t copies = after[Stats::kAddPositionCopies].sum - before[Stats::kAddPositionCopies].sum;
+  EXPECT_LT(copies, 4 * n * static_cast<size_t>(std::sqrt(static_cast<double>(n)))) << "O(sqrt(n)) amortized copies per insert";
+  EXPECT_LT(copies, n * n / 8) << "far below the O(n) copies per insert of copying the leaf";
+}
+
+TEST_F(TokenIndexTests, batch_insert_buffer) {
+  AddRandomSentences(/* seed = */ 41, /* n = */ 500, /* maxLen = */ 10, /* nwords = */ 8);
+
+  // a single large leaf, then small batches: each one fits into the leaf's insert buffer
+  TokenIndex<SrcToken> expected(corpus, /* maxLeafSize = */ 100000);
+  TokenIndex<SrcToken> batched(corpus, /* maxLeafSize = */ 100000);
+  std::vector<Sentence<SrcToken>> first;
+  for(size_t i = 0; i < 400; i++) {
+    expected.AddSentence(corpus.sentence(i));
+    first.push_back(corpus.sentence(i));
+  }
+  batched.AddSentences(first);
+
+  Stats::Snapshot before = batched.Stats();
+  size_t nbatches = 0;
+  for(size_t i = 400; i < corpus.size(); i += 2, nbatches++) {
+    expected.AddSentence(corpus.sentence(i));
+    expected.AddSentence(corpus.sentence(i + 1));
+    batched.AddSentences({corpus.sentence(i), corpus.sentence(i + 1)});
+  }
+  if(Stats::kEnabled) {
+    uint64_t merged = batched.Stats()[Stats::kMergedPositions] - before[Stats::kMergedPositions];
+    EXPECT_LT(merged, nbatches * batched.span().size() / 4) << "small batches must not copy the whole leaf each time";
+  }
+
+  TokenIndex<SrcToken>::Span span = expected.span(), actual = batched.span();
+  ASSERT_EQ(span.size(), actual.size());
+  for(size_t i = 0; i < span.size(); i++)
+    ASSERT_EQ(span[i], actual[i]) << "Position entry " << i;
+  EXPECT_EQ(expected.span().narrow(vocab["w2"]), batched.span().narrow(vocab["w2"]));
+}
+
+TEST_F(TokenIndexTests, flatmap_children) {
+  AddRandomSentences(/* seed = */ 11, /* n = */ 300, /* maxLen = */ 12, /* nwords = */ 8);
+
+  typedef TokenIndex<SrcToken, TreeNodeMemory<SrcToken, FlatMap>> FlatTokenIndex;
+  TokenIndex<SrcToken> rbtreeIndex(corpus, /* maxLeafSize = */ 16);
+  FlatTokenIndex flatIndex(corpus, /* maxLeafSize = */ 16);
+  FlatTokenIndex flatBuiltIndex(corpus, /* maxLeafSize = */ 16);
+  for(size_t i = 0; i < corpus.size(); i++) {
+    rbtreeIndex.AddSentence(corpus.sentence(i));
+    flatIndex.AddSentence(corpus.sentence(i));
+  }
+  flatBuiltIndex.Build(/* nthreads = */ 2);
+
+  std::stringstream rbtreeTree, flatTree;
+  rbtreeIndex.DebugPrint(rbtreeTree);
+  flatIndex.DebugPrint(flatTree);
+  EXPECT_EQ(rbtreeTree.str(), flatTree.str()) << "FlatMap children must result in the same tree as RBTree";
+
+  TokenIndex<SrcToken>::Span rbtreeSpan = rbtreeIndex.span();
+  FlatTokenIndex::Span flatSpan = flatIndex.span();
+  FlatTokenIndex::Span flatBuiltSpan = flatBuiltIndex.span();
+  ASSERT_EQ(rbtreeSpan.size(), flatSpan.size());
+  ASSERT_EQ(rbtreeSpan.size(), flatBuiltSpan.size());
+  for(size_t i = 0; i < rbtreeSpan.size(); i++) {
+    EXPECT_EQ(rbtreeSpan[i], flatSpan[i]) << "Position entry " << i;
+    EXPECT_EQ(rbtreeSpan[i], flatBuiltSpan[i]) << "Position entry " << i << " after Build()";
+  }
+
+  EXPECT_EQ(rbtreeSpan.narrow(vocab["w4"]), flatSpan.narrow(vocab["w4"]));
+  EXPECT_EQ(rbtreeSpan.narrow(vocab["w6"]), flatSpan.narrow(vocab["w6"]));
+}
+
 namespace std {
 template <> struct hash<Position<SrcToken>> {
   std::size_t operator()(const Position<SrcToken>& pos) const {
@@ -550,3 +1072,584 @@ TEST_F(TokenIndexTests, TreeNodeDisk) {
   EXPECT_EQ("0007a/0007a120", csp1);
   EXPECT_EQ("00000/00000001", csp2);
 }
+
+#include <boost/filesystem.hpp>
+
+TEST_F(TokenIndexTests, disk_add_reopen) {
+  AddRandomSentences(/* seed = */ 13, /* n = */ 300, /* maxLen = */ 12, /* nwords = */ 8);
+  typedef TokenIndex<SrcToken, TreeNodeDisk<SrcToken>> DiskTokenIndex;
+  std::string path = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("sto-test-%%%%-%%%%")).string();
+
+  TokenIndex<SrcToken> memoryIndex(corpus, /* maxLeafSize = */ 16);
+  for(size_t i = 0; i < corpus.size(); i++)
+    memoryIndex.AddSentence(corpus.sentence(i));
+  std::stringstream memoryTree;
+  memoryIndex.DebugPrint(memoryTree);
+
+  {
+    // a few individual sentences first, then batches, which split leaves on disk
+    DiskTokenIndex diskIndex(path, corpus, /* maxLeafSize = */ 16);
+    size_t sid = 0;
+    for(; sid < 10; sid++)
+      diskIndex.AddSentence(corpus.sentence(sid));
+    while(sid < corpus.size()) {
+      std::vector<Sentence<SrcToken>> batch;
+      for(; sid < corpus.size() && batch.size() < 50; sid++)
+        batch.push_back(corpus.sentence(sid));
+      diskIndex.AddSentences(batch);
+    }
+    std::stringstream diskTree;
+    diskIndex.DebugPrint(diskTree);
+    EXPECT_EQ(memoryTree.str(), diskTree.str()) << "TreeNodeDisk must result in the same tree as TreeNodeMemory";
+  }
+
+  DiskTokenIndex reopened(path, corpus, /* maxLeafSize = */ 16);
+  std::stringstream reopenedTree;
+  reopened.DebugPrint(reopenedTree);
+  EXPECT_EQ(memoryTree.str(), reopenedTree.str()) << "reopening the directory must load the same tree";
+
+  TokenIndex<SrcToken>::Span memorySpan = memoryIndex.span();
+  DiskTokenIndex::Span diskSpan = reopened.span();
+  ASSERT_EQ(memorySpan.size(), diskSpan.size());
+  for(size_t i = 0; i < memorySpan.size(); i++)
+    EXPECT_EQ(memorySpan[i], diskSpan[i]) << "Position entry " << i;
+  EXPECT_EQ(memorySpan.narrow(vocab["w3"]), diskSpan.narrow(vocab["w3"]));
+  EXPECT_EQ(memorySpan.narrow(vocab["w1"]), diskSpan.narrow(vocab["w1"]));
+
+  boost::filesystem::remove_all(path);
+}
+
+TEST_F(TokenIndexTests, disk_merge) {
+  AddRandomSentences(/* seed = */ 17, /* n = */ 300, /* maxLen = */ 12, /* nwords = */ 8);
+  std::string path = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("sto-test-%%%%-%%%%")).string();
+
+  TokenIndex<SrcToken> memoryIndex(corpus, /* maxLeafSize = */ 16);
+  for(size_t i = 0; i < corpus.size(); i++)
+    memoryIndex.AddSentence(corpus.sentence(i));
+
+  {
+    // persist two batches indexed in memory
+    TreeNodeDisk<SrcToken> root(path, /* maxArraySize = */ 16);
+    for(size_t first : {0, 150}) {
+      TokenIndex<SrcToken> batchIndex(corpus, /* maxLeafSize = */ 16);
+      for(size_t i = first; i < first + 150; i++)
+        batchIndex.AddSentence(corpus.sentence(i));
+      TokenIndex<SrcToken>::Span batchSpan = batchIndex.span();
+      root.Merge(batchSpan);
+    }
+  }
+
+  TokenIndex<SrcToken, TreeNodeDisk<SrcToken>> diskIndex(path, corpus, /* maxLeafSize = */ 16);
+  TokenIndex<SrcToken>::Span memorySpan = memoryIndex.span();
+  TokenIndex<SrcToken, TreeNodeDisk<SrcToken>>::Span diskSpan = diskIndex.span();
+  ASSERT_EQ(memorySpan.size(), diskSpan.size()) << "Merge() must persist every position";
+  for(size_t i = 0; i < memorySpan.size(); i++)
+    EXPECT_EQ(memorySpan[i], diskSpan[i]) << "Position entry " << i << " after Merge()";
+
+  boost::filesystem::remove_all(path);
+}
+
+TEST_F(TokenIndexTests, disk_insert_buffer) {
+  AddRandomSentences(/* seed = */ 23, /* n = */ 203, /* maxLen = */ 12, /* nwords = */ 8);
+  typedef TokenIndex<SrcToken, TreeNodeDisk<SrcToken>> DiskTokenIndex;
+  std::string path = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("sto-test-%%%%-%%%%")).string();
+  std::string array = path + "/array";
+
+  TokenIndex<SrcToken> memoryIndex(corpus, /* maxLeafSize = */ 100000);
+  for(size_t i = 0; i < corpus.size(); i++)
+    memoryIndex.AddSentence(corpus.sentence(i));
+
+  {
+    DiskTokenIndex diskIndex(path, corpus, /* maxLeafSize = */ 100000);
+    std::vector<Sentence<SrcToken>> batch;
+    for(size_t i = 0; i < 200; i++)
+      batch.push_back(corpus.sentence(i));
+    diskIndex.AddSentences(batch);
+    size_t written = diskIndex.span().size();
+    ASSERT_EQ(written * sizeof(SuffixArrayPosition<SrcToken>), boost::filesystem::file_size(array));
+
+    // a few Positions go into the insert buffer of the (single) leaf, without rewriting its file
+    diskIndex.AddSentence(corpus.sentence(200));
+    diskIndex.AddSentence(corpus.sentence(201));
+    EXPECT_EQ(written * sizeof(SuffixArrayPosition<SrcToken>), boost::filesystem::file_size(array)) << "AddSentence() must not rewrite the leaf";
+    EXPECT_LT(written, diskIndex.span().size());
+
+    diskIndex.FinishSplits();
+    EXPECT_EQ(diskIndex.span().size() * sizeof(SuffixArrayPosition<SrcToken>), boost::filesystem::file_size(array)) << "FinishSplits() must write the insert buffer";
+
+    diskIndex.AddSentence(corpus.sentence(202)); // written by the destructor
+  }
+
+  DiskTokenIndex reopened(path, corpus, /* maxLeafSize = */ 100000);
+  TokenIndex<SrcToken>::Span memorySpan = memoryIndex.span();
+  DiskTokenIndex::Span diskSpan = reopened.span();
+  ASSERT_EQ(memorySpan.size(), diskSpan.size()) << "buffered Positions must be persistent after closing the index";
+  for(size_t i = 0; i < memorySpan.size(); i++)
+    EXPECT_EQ(memorySpan[i], diskSpan[i]) << "Position entry " << i;
+
+  boost::filesystem::remove_all(path);
+}
+
+TEST_F(TokenIndexTests, disk_build_threads) {
+  AddRandomSentences(/* seed = */ 29, /* n = */ 300, /* maxLen = */ 12, /* nwords = */ 8);
+  typedef TokenIndex<SrcToken, TreeNodeDisk<SrcToken>> DiskTokenIndex;
+
+  TokenIndex<SrcToken> memoryIndex(corpus, /* maxLeafSize = */ 16);
+  for(size_t i = 0; i < corpus.size(); i++)
+    memoryIndex.AddSentence(corpus.sentence(i));
+  std::stringstream memoryTree;
+  memoryIndex.DebugPrint(memoryTree);
+
+  for(size_t nthreads : {1, 4}) {
+    std::string path = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("sto-test-%%%%-%%%%")).string();
+    {
+      DiskTokenIndex diskIndex(path, corpus, /* maxLeafSize = */ 16);
+      diskIndex.Build(nthreads);
+      std::stringstream diskTree;
+      diskIndex.DebugPrint(diskTree);
+      EXPECT_EQ(memoryTree.str(), diskTree.str()) << "Build(" << nthreads << ") must result in the same tree as AddSentence()";
+    }
+
+    DiskTokenIndex reopened(path, corpus, /* maxLeafSize = */ 16);
+    std::stringstream reopenedTree;
+    reopened.DebugPrint(reopenedTree);
+    EXPECT_EQ(memoryTree.str(), reopenedTree.str()) << "reopening after Build(" << nthreads << ") must load the same tree";
+
+    boost::filesystem::remove_all(path);
+  }
+}
+
+TEST_F(TokenIndexTests, disk_lazy_open) {
+  AddRandomSentences(/* seed = */ 31, /* n = */ 300, /* maxLen = */ 12, /* nwords = */ 8);
+  typedef TokenIndex<SrcToken, TreeNodeDisk<SrcToken>> DiskTokenIndex;
+  typedef TreeNode<SrcToken, SuffixArrayDisk<SrcToken>> BaseNode;
+  std::string path = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("sto-test-%%%%-%%%%")).string();
+  std::string manifest = path + "/children";
+
+  TokenIndex<SrcToken> memoryIndex(corpus, /* maxLeafSize = */ 16);
+  for(size_t i = 0; i < corpus.size(); i++)
+    memoryIndex.AddSentence(corpus.sentence(i));
+  std::stringstream memoryTree;
+  memoryIndex.DebugPrint(memoryTree);
+
+  {
+    DiskTokenIndex diskIndex(path, corpus, /* maxLeafSize = */ 16);
+    for(size_t i = 0; i < 200; i++)
+      diskIndex.AddSentence(corpus.sentence(i));
+    diskIndex.FinishSplits();
+    EXPECT_TRUE(boost::filesystem::exists(manifest)) << "FinishSplits() must write the manifests";
+    std::vector<Sentence<SrcToken>> batch;
+    for(size_t i = 200; i < corpus.size(); i++)
+      batch.push_back(corpus.sentence(i));
+    diskIndex.AddSentences(batch);
+    EXPECT_FALSE(boost::filesystem::exists(manifest)) << "changing a leaf must invalidate the manifests";
+  }
+  ASSERT_TRUE(boost::filesystem::exists(manifest)) << "closing the index must write the manifests";
+
+  {
+    // only the root's manifest is read on open, and each subtree on its first access
+    TreeNodeDisk<SrcToken> root(path, /* maxArraySize = */ 16);
+    EXPECT_FALSE(root.children_loaded_);
+    EXPECT_EQ(memoryIndex.span().size(), root.size());
+    ASSERT_TRUE(root.children_loaded_);
+    size_t internal = 0;
+    root.children_.Walk([&internal](SrcToken::Vid vid, BaseNode *child) {
+      (void) vid;
+      if(!child->is_leaf()) {
+        EXPECT_FALSE(static_cast<TreeNodeDisk<SrcToken> *>(child)->children_loaded_) << "subtree loaded before its first access";
+        internal++;
+      }
+    });
+    EXPECT_LT(0, internal);
+  }
+
+  {
+    DiskTokenIndex reopened(path, corpus, /* maxLeafSize = */ 16);
+    std::stringstream reopenedTree;
+    reopened.DebugPrint(reopenedTree);
+    EXPECT_EQ(memoryTree.str(), reopenedTree.str()) << "a lazily loaded tree must be the same tree";
+  }
+
+  // without the root's manifest (e.g. after a crash), the index is loaded eagerly from the directory structure
+  boost::filesystem::remove(manifest);
+  {
+    TreeNodeDisk<SrcToken> root(path, /* maxArraySize = */ 16);
+    EXPECT_TRUE(root.children_loaded_);
+    root.children_.Walk([](SrcToken::Vid vid, BaseNode *child) {
+      (void) vid;
+      EXPECT_TRUE(static_cast<TreeNodeDisk<SrcToken> *>(child)->children_loaded_);
+    });
+  }
+  EXPECT_TRUE(boost::filesystem::exists(manifest)) << "closing an eagerly loaded index must rewrite the manifests";
+  DiskTokenIndex reopened(path, corpus, /* maxLeafSize = */ 16);
+  std::stringstream reopenedTree;
+  reopened.DebugPrint(reopenedTree);
+  EXPECT_EQ(memoryTree.str(), reopenedTree.str()) << "an eagerly loaded tree must be the same tree";
+
+  boost::filesystem::remove_all(path);
+}
+
+TEST_F(TokenIndexTests, write_reload) {
+  AddRandomSentences(/* seed = */ 19, /* n = */ 300, /* maxLen = */ 12, /* nwords = */ 8);
+  std::string prefix = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("sto-test-%%%%-%%%%")).string();
+
+  TokenIndex<SrcToken> index(corpus, /* maxLeafSize = */ 16);
+  for(size_t i = 0; i < corpus.size(); i++)
+    index.AddSentence(corpus.sentence(i));
+
+  // persist corpus and index, e.g. to restart without re-indexing
+  corpus.Flush(prefix);
+  index.Write(prefix + ".sfa");
+
+  Corpus<SrcToken> reloadedCorpus(prefix + ".trk", &vocab);
+  TokenIndex<SrcToken> reloaded(prefix + ".sfa", reloadedCorpus, /* maxLeafSize = */ 16);
+  TokenIndex<SrcToken>::Span span = index.span();
+  TokenIndex<SrcToken>::Span reloadedSpan = reloaded.span();
+  ASSERT_EQ(span.size(), reloadedSpan.size());
+  for(size_t i = 0; i < span.size(); i++)
+    EXPECT_EQ(span[i], reloadedSpan[i]) << "Position entry " << i;
+  EXPECT_EQ(span.narrow(vocab["w3"]), reloadedSpan.narrow(vocab["w3"]));
+  EXPECT_EQ(span.narrow(vocab["w5"]), reloadedSpan.narrow(vocab["w5"])) << "index over the flushed Corpus must stay valid";
+
+  for(std::string ext : {".trk", ".six", ".sfa"})
+    boost::filesystem::remove(prefix + ext);
+}
+
+TEST_F(TokenIndexTests, leaf_run_index) {
+  AddRandomSentences(/* seed = */ 23, /* n = */ 300, /* maxLen = */ 10, /* nwords = */ 7);
+  std::vector<std::string> words = {"</s>", "w0", "w1", "w3", "w6", "w9"}; // "w9" is never in the corpus
+  std::string prefix = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("sto-test-%%%%-%%%%")).string();
+
+  // reference: inserted sentence by sentence, so the leaf has no RunIndex
+  TokenIndex<SrcToken> expected(corpus, /* maxLeafSize = */ 100000);
+  for(size_t i = 0; i < corpus.size(); i++)
+    expected.AddSentence(corpus.sentence(i));
+  corpus.Flush(prefix);
+  expected.Write(prefix + ".sfa");
+
+  // single large leaves with a RunIndex: built in memory, and loaded from the mapped .sfa
+  Corpus<SrcToken> loadedCorpus(prefix + ".trk", &vocab);
+  TokenIndex<SrcToken> built(corpus, /* maxLeafSize = */ 100000);
+  built.Build(/* nthreads = */ 1);
+  TokenIndex<SrcToken> loaded(prefix + ".sfa", loadedCorpus, /* maxLeafSize = */ 100000);
+
+  auto check = [&](TokenIndex<SrcToken> &index, const std::string &name) {
+    for(auto &first : words) {
+      for(auto &second : words) {
+        TokenIndex<SrcToken>::Span span = expected.span(), actual = index.span();
+        EXPECT_EQ(span.narrow(vocab[first]), actual.narrow(vocab[first])) << name << ": first narrow() to '" << first << "'";
+        EXPECT_EQ(span.narrow(vocab[second]), actual.narrow(vocab[second])) << name << ": '" << first << " " << second << "'";
+      }
+    }
+  };
+  check(built, "built");
+  check(loaded, "loaded");
+
+  // an insert replaces the leaf's array, after which its RunIndex must not be used anymore
+  std::vector<std::string> extra = {"w3", "w3", "w1"};
+  AddSentence(extra);
+  expected.AddSentence(corpus.sentence(corpus.size() - 1));
+  built.AddSentence(corpus.sentence(corpus.size() - 1));
+  check(built, "built after insert");
+
+  for(std::string ext : {".trk", ".six", ".sfa"})
+    boost::filesystem::remove(prefix + ext);
+}
+
+TEST_F(TokenIndexTests, open_reads_no_corpus) {
+  AddRandomSentences(/* seed = */ 37, /* n = */ 300, /* maxLen = */ 10, /* nwords = */ 7);
+  typedef TokenIndex<SrcToken, TreeNodeDisk<SrcToken>> DiskTokenIndex;
+  std::vector<std::string> words = {"</s>", "w0", "w1", "w3", "w6", "w9"}; // "w9" is never in the corpus
+  std::string prefix = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("sto-test-%%%%-%%%%")).string();
+  std::string path = prefix + ".d";
+
+  // leaves large enough for a RunIndex: a single one in the .sfa, and a few (one for each first word) on disk
+  TokenIndex<SrcToken> expected(corpus, /* maxLeafSize = */ 100000);
+  expected.Build(/* nthreads = */ 1);
+  expected.Write(prefix + ".sfa");
+  {
+    DiskTokenIndex diskIndex(path, corpus, /* maxLeafSize = */ 1000);
+    diskIndex.Build(/* nthreads = */ 1);
+  }
+
+  // any corpus access would fail an assertion: there are no sentences
+  {
+    Corpus<SrcToken> empty(&vocab);
+    TokenIndex<SrcToken> loaded(prefix + ".sfa", empty, /* maxLeafSize = */ 100000);
+    EXPECT_EQ(expected.span().size(), loaded.span().size());
+    DiskTokenIndex reopened(path, empty, /* maxLeafSize = */ 1000);
+    EXPECT_EQ(expected.span().size(), reopened.span().size());
+  }
+
+  // the deferred RunIndexes are built by the first narrow() into each leaf
+  TokenIndex<SrcToken> loaded(prefix + ".sfa", corpus, /* maxLeafSize = */ 100000);
+  DiskTokenIndex reopened(path, corpus, /* maxLeafSize = */ 1000);
+  for(auto &first : words) {
+    for(auto &second : words) {
+      TokenIndex<SrcToken>::Span span = expected.span(), loadedSpan = loaded.span();
+      DiskTokenIndex::Span diskSpan = reopened.span();
+      size_t size = span.narrow(vocab[first]);
+      EXPECT_EQ(size, loadedSpan.narrow(vocab[first])) << "loaded: first narrow() to '" << first << "'";
+      EXPECT_EQ(size, diskSpan.narrow(vocab[first])) << "disk: first narrow() to '" << first << "'";
+      size = span.narrow(vocab[second]);
+      EXPECT_EQ(size, loadedSpan.narrow(vocab[second])) << "loaded: '" << first << " " << second << "'";
+      EXPECT_EQ(size, diskSpan.narrow(vocab[second])) << "disk: '" << first << " " << second << "'";
+    }
+  }
+  // likewise by a batch narrow()
+  TokenIndex<SrcToken> batchLoaded(prefix + ".sfa", corpus, /* maxLeafSize = */ 100000);
+  std::vector<TokenIndex<SrcToken>::Span> spans(words.size(), batchLoaded.span());
+  std::vector<SrcToken> tokens;
+  for(auto &word : words)
+    tokens.push_back(vocab[word]);
+  std::vector<size_t> sizes = batchLoaded.NarrowBatch(spans, tokens);
+  for(size_t i = 0; i < words.size(); i++)
+    EXPECT_EQ(expected.span().narrow(vocab[words[i]]), sizes[i]) << "batch narrow() to '" << words[i] << "'";
+
+  boost::filesystem::remove(prefix + ".sfa");
+  boost::filesystem::remove_all(path);
+}
+
+TEST_F(TokenIndexTests, loaded_leaf_insert_buffer) {
+  AddRandomSentences(/* seed = */ 31, /* n = */ 300, /* maxLen = */ 10, /* nwords = */ 7);
+  std::string prefix = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("sto-test-%%%%-%%%%")).string();
+
+  // a single large leaf of the first 200 sentences on disk
+  TokenIndex<SrcToken> written(corpus, /* maxLeafSize = */ 100000);
+  for(size_t i = 0; i < 200; i++)
+    written.AddSentence(corpus.sentence(i));
+  corpus.Flush(prefix);
+  written.Write(prefix + ".sfa");
+
+  TokenIndex<SrcToken> expected(corpus, /* maxLeafSize = */ 100000);
+  for(size_t i = 0; i < corpus.size(); i++)
+    expected.AddSentence(corpus.sentence(i));
+
+  Corpus<SrcToken> loadedCorpus(prefix + ".trk", &vocab);
+  TokenIndex<SrcToken> loaded(prefix + ".sfa", loadedCorpus, /* maxLeafSize = */ 100000);
+  Stats::Snapshot before = loaded.Stats();
+  loaded.AddSentence(loadedCorpus.sentence(200));
+  EXPECT_EQ(before[Stats::kArrayCopies], loaded.Stats()[Stats::kArrayCopies]) << "the first insert must not copy the mapped leaf";
+  for(size_t i = 201; i < loadedCorpus.size(); i++)
+    loaded.AddSentence(loadedCorpus.sentence(i));
+
+  TokenIndex<SrcToken>::Span span = expected.span(), loadedSpan = loaded.span();
+  ASSERT_EQ(span.size(), loadedSpan.size());
+  for(size_t i = 0; i < span.size(); i++)
+    EXPECT_EQ(span[i], loadedSpan[i]) << "Position entry " << i;
+  for(std::string w : {"w0", "w3", "w6", "</s>"}) {
+    TokenIndex<SrcToken>::Span a = expected.span(), b = loaded.span();
+    EXPECT_EQ(a.narrow(vocab[w]), b.narrow(vocab[w])) << w;
+  }
+
+  for(std::string ext : {".trk", ".six", ".sfa"})
+    boost::filesystem::remove(prefix + ext);
+}
+
+TEST_F(TokenIndexTests, flush_remap_leaves) {
+  std::vector<std::vector<std::string>> sentences = AddRandomSentences(/* seed = */ 37, /* n = */ 600, /* maxLen = */ 10, /* nwords = */ 9);
+  std::string prefix = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("sto-test-%%%%-%%%%")).string();
+
+  // reference over a separate Corpus which is never flushed
+  Corpus<SrcToken> expectedCorpus(&vocab);
+  TokenIndex<SrcToken> expected(expectedCorpus, /* maxLeafSize = */ 32);
+  TokenIndex<SrcToken> index(corpus, /* maxLeafSize = */ 32);
+
+  // a reader narrowing across both flushes, which replace the corpus track and the leaf arrays
+  std::atomic<bool> done(false);
+  std::thread reader([&]() {
+    while(!done.load()) {
+      Epoch::Guard guard; // for vid(), which reads the corpus track
+      TokenIndex<SrcToken>::Span span = index.span();
+      size_t size = span.size();
+      size_t narrowed = span.narrow(vocab["w1"]);
+      ASSERT_LE(narrowed, size);
+      if(narrowed > 0) {
+        ASSERT_EQ(vocab["w1"].vid, span[narrowed - 1].vid(corpus)) << "leaves must stay readable across Flush()";
+      }
+    }
+  });
+
+  auto add = [&](size_t begin, size_t end) {
+    for(size_t i = begin; i < end; i++) {
+      std::vector<SrcToken> sent;
+      for(auto &w : sentences[i])
+        sent.push_back(vocab[w]);
+      expectedCorpus.AddSentence(sent);
+      expected.AddSentence(expectedCorpus.sentence(static_cast<Corpus<SrcToken>::Sid>(i)));
+      index.AddSentence(corpus.sentence(static_cast<Corpus<SrcToken>::Sid>(i)));
+    }
+  };
+  auto check = [&](const std::string &name) {
+    TokenIndex<SrcToken>::Span span = expected.span(), actual = index.span();
+    ASSERT_EQ(span.size(), actual.size()) << name;
+    for(size_t i = 0; i < span.size(); i++)
+      ASSERT_EQ(span[i], actual[i]) << name << ": Position entry " << i;
+  };
+
+  add(0, 300);
+  corpus.Flush(prefix);
+  index.Flush(prefix + ".sfa");
+  check("after the first Flush()");
+
+  // inserts go into buffers over the remapped leaves, and splits copy out of them
+  add(300, 600);
+  check("inserts after Flush()");
+  corpus.Flush(prefix);
+  index.Flush(prefix + ".sfa");
+  done.store(true);
+  reader.join();
+  check("after the second Flush()");
+
+  Corpus<SrcToken> reloadedCorpus(prefix + ".trk", &vocab);
+  TokenIndex<SrcToken> reloaded(prefix + ".sfa", reloadedCorpus, /* maxLeafSize = */ 32);
+  EXPECT_EQ(expected.span().size(), reloaded.span().size()) << "Flush() must persist all Positions";
+
+  for(std::string ext : {".trk", ".six", ".sfa"})
+    boost::filesystem::remove(prefix + ext);
+}
+
+TEST_F(TokenIndexTests, flush_async_splits) {
+  AddRandomSentences(/* seed = */ 41, /* n = */ 400, /* maxLen = */ 12, /* nwords = */ 8);
+  std::string filename = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("sto-test-%%%%-%%%%.sfa")).string();
+
+  TokenIndex<SrcToken> syncIndex(corpus, /* maxLeafSize = */ 16);
+  TokenIndex<SrcToken> asyncIndex(corpus, /* maxLeafSize = */ 16);
+  asyncIndex.SetAsyncSplits(true);
+
+  // Flush() after every sentence, while background splits are still queued: they must be installed before the leaves are remapped
+  for(size_t i = 0; i < corpus.size(); i++) {
+    syncIndex.AddSentence(corpus.sentence(i));
+    asyncIndex.AddSentence(corpus.sentence(i));
+    asyncIndex.Flush(filename);
+  }
+  asyncIndex.FinishSplits();
+
+  std::stringstream syncTree, asyncTree;
+  syncIndex.DebugPrint(syncTree);
+  asyncIndex.DebugPrint(asyncTree);
+  EXPECT_EQ(syncTree.str(), asyncTree.str()) << "Flush() must not lose or duplicate splits";
+
+  TokenIndex<SrcToken>::Span syncSpan = syncIndex.span();
+  TokenIndex<SrcToken>::Span asyncSpan = asyncIndex.span();
+  ASSERT_EQ(syncSpan.size(), asyncSpan.size());
+  for(size_t i = 0; i < syncSpan.size(); i++)
+    EXPECT_EQ(syncSpan[i], asyncSpan[i]) << "Position entry " << i;
+
+  asyncIndex.SetAsyncSplits(false);
+  boost::filesystem::remove(filename);
+}
+
+TEST_F(TokenIndexTests, compressed_corpus) {
+  // sentences of a few words (one byte per token), and of many (two bytes per token)
+  AddRandomSentences(/* seed = */ 41, /* n = */ 200, /* maxLen = */ 12, /* nwords = */ 8);
+  AddRandomSentences(/* seed = */ 43, /* n = */ 200, /* maxLen = */ 12, /* nwords = */ 400);
+
+  TokenIndex<SrcToken> expected(corpus, /* maxLeafSize = */ 16);
+  for(size_t i = 0; i < corpus.size(); i++)
+    expected.AddSentence(corpus.sentence(i));
+  std::stringstream expectedTree;
+  expected.DebugPrint(expectedTree);
+
+  corpus.Compress();
+  ASSERT_TRUE(corpus.compressed());
+
+  // the same trees, whether indexed before or after compressing the corpus
+  TokenIndex<SrcToken> added(corpus, /* maxLeafSize = */ 16);
+  for(size_t i = 0; i < corpus.size(); i++)
+    added.AddSentence(corpus.sentence(i));
+  TokenIndex<SrcToken> built(corpus, /* maxLeafSize = */ 16);
+  built.Build(/* nthreads = */ 1);
+  for(TokenIndex<SrcToken> *index : {&expected, &added, &built}) {
+    std::stringstream tree;
+    index->DebugPrint(tree);
+    EXPECT_EQ(expectedTree.str(), tree.str()) << "indexing a compressed corpus must result in the same tree";
+  }
+
+  // lookups decode the probed tokens, in the tree and in leaves
+  for(Corpus<SrcToken>::Sid sid = 0; sid < corpus.size(); sid += 7) {
+    Sentence<SrcToken> sent = corpus.sentence(sid);
+    TokenIndex<SrcToken>::Span span = expected.span(), addedSpan = added.span();
+    for(size_t i = 0; i < sent.size(); i++) {
+      size_t size = span.narrow(sent[i]);
+      ASSERT_EQ(size, addedSpan.narrow(sent[i])) << "sid " << sid << " token " << i;
+      for(size_t j = 0; j < size; j++)
+        ASSERT_EQ(span[j], addedSpan[j]) << "sid " << sid << " token " << i << " Position " << j;
+    }
+  }
+}
+
+TEST_F(TokenIndexTests, narrow_past_eos) {
+  // a large leaf of 'c </s>', in which all Positions end before the leaf's depth
+  for(size_t i = 0; i < 600; i++)
+    AddSentence({i % 2 ? "a" : "b", "c"});
+  AddSentence({"d", "c", "d"});
+
+  TokenIndex<SrcToken> expected(corpus, /* maxLeafSize = */ 16);
+  for(size_t i = 0; i < corpus.size(); i++)
+    expected.AddSentence(corpus.sentence(i));
+  TokenIndex<SrcToken> built(corpus, /* maxLeafSize = */ 16);
+  built.Build(/* nthreads = */ 1);
+
+  std::vector<std::vector<std::string>> queries = {{"c", "</s>"}, {"c", "</s>", "c"}, {"c", "</s>", "</s>"}, {"c", "d"}, {"c", "d", "</s>"}};
+  for(auto &query : queries) {
+    TokenIndex<SrcToken>::Span span = expected.span(), actual = built.span();
+    std::string sequence;
+    for(auto &w : query) {
+      sequence += " " + w;
+      EXPECT_EQ(span.narrow(vocab[w]), actual.narrow(vocab[w])) << "narrow() to '" << sequence << "' after Build()";
+    }
+    EXPECT_EQ(span.children_counts(), actual.children_counts()) << "children_counts() of '" << sequence << "' after Build()";
+  }
+  TokenIndex<SrcToken>::Span span = built.span();
+  span.narrow(vocab["c"]);
+  EXPECT_EQ(600, span.narrow(vocab["</s>"]));
+  EXPECT_EQ(0, span.narrow(vocab["c"])) << "nothing follows the implicit </s>";
+}
+
+TEST_F(TokenIndexTests, small_token_widths) {
+  static_assert(sizeof(SuffixArrayPosition<SmallSrcToken>) == 3, "a 2-byte Sid must pack a Position into 3 bytes");
+  std::vector<std::vector<std::string>> sents = AddRandomSentences(/* seed = */ 43, /* n = */ 300, /* maxLen = */ 12, /* nwords = */ 8);
+
+  // the same sentences over a corpus with narrower Position widths
+  Vocab<SmallSrcToken> smallVocab;
+  Corpus<SmallSrcToken> smallCorpus(&smallVocab);
+  for(auto &words : sents) {
+    std::vector<SmallSrcToken> sent;
+    for(auto &w : words)
+      sent.push_back(smallVocab[w]);
+    smallCorpus.AddSentence(sent);
+  }
+
+  TokenIndex<SrcToken> index(corpus, /* maxLeafSize = */ 16);
+  for(size_t i = 0; i < corpus.size(); i++)
+    index.AddSentence(corpus.sentence(i));
+  TokenIndex<SmallSrcToken> dynamicIndex(smallCorpus, /* maxLeafSize = */ 16);
+  for(size_t i = 0; i < smallCorpus.size(); i++)
+    dynamicIndex.AddSentence(smallCorpus.sentence(static_cast<Corpus<SmallSrcToken>::Sid>(i)));
+  TokenIndex<SmallSrcToken> builtIndex(smallCorpus, /* maxLeafSize = */ 16);
+  builtIndex.Build(/* nthreads = */ 2);
+
+  for(const std::vector<std::string> &query : std::vector<std::vector<std::string>>{{}, {"w1"}, {"w3", "w2"}, {"w0", "w0", "w5"}}) {
+    TokenIndex<SrcToken>::Span span = index.span();
+    TokenIndex<SmallSrcToken>::Span dynamicSpan = dynamicIndex.span(), builtSpan = builtIndex.span();
+    for(auto &w : query) {
+      span.narrow(vocab[w]);
+      dynamicSpan.narrow(smallVocab[w]);
+      builtSpan.narrow(smallVocab[w]);
+    }
+    ASSERT_EQ(span.size(), dynamicSpan.size()) << "query of length " << query.size();
+    ASSERT_EQ(span.size(), builtSpan.size()) << "query of length " << query.size();
+    for(size_t i = 0; i < span.size(); i++) {
+      Position<SrcToken> pos = span[i];
+      Position<SmallSrcToken> dynamicPos = dynamicSpan[i], builtPos = builtSpan[i];
+      EXPECT_EQ(pos.sid, dynamicPos.sid) << "Position entry " << i;
+      EXPECT_EQ(pos.offset, dynamicPos.offset) << "Position entry " << i;
+      EXPECT_EQ(pos.sid, builtPos.sid) << "Position entry " << i;
+      EXPECT_EQ(pos.offset, builtPos.offset) << "Position entry " << i;
+    }
+  }
+
+  // not layout compatible with mtt-build *.sfa files
+  EXPECT_THROW(builtIndex.Write("small_token_widths.sfa"), std::runtime_error);
+}
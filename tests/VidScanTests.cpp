@@ -0,0 +1,54 @@
+/****************************************************
+ * Moses - factored phrase-based language decoder   *
+ * Copyright (C) 2015 University of Edinburgh       *
+ * Licensed under GNU LGPL Version 2.1, see COPYING *
+ ****************************************************/
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Types.h"
+#include "util/vidscan.hpp"
+
+using namespace sto;
+
+/** compare scan_bounds() of random sorted vids with lower_bound() and upper_bound() */
+template<typename Vid>
+void ExpectScanBounds(const std::vector<Vid> &targets, Vid high) {
+  std::mt19937 gen(3);
+  for(size_t n = 0; n < 70; n++) {
+    std::vector<Vid> vids(n);
+    for(auto &v : vids)
+      v = static_cast<Vid>((gen() % 4 == 0) ? high + gen() % 4 : gen() % 6); // also above the sign bit
+    std::sort(vids.begin(), vids.end());
+    for(Vid t : targets) {
+      size_t nless, nequal;
+      scan_bounds(vids.data(), vids.size(), t, nless, nequal);
+      size_t lower = std::lower_bound(vids.begin(), vids.end(), t) - vids.begin();
+      size_t upper = std::upper_bound(vids.begin(), vids.end(), t) - vids.begin();
+      EXPECT_EQ(lower, nless) << "n = " << n << " t = " << t;
+      EXPECT_EQ(upper - lower, nequal) << "n = " << n << " t = " << t;
+    }
+  }
+}
+
+TEST(VidScanTests, scan_bounds) {
+  // the vid_t overload runs the vectorized kernel, see scan_bounds_kernel()
+  if(std::string(scan_bounds_kernel()) == "avx2" && !__builtin_cpu_supports("avx2"))
+    GTEST_SKIP() << "built with AVX2, but the CPU does not support it";
+  ExpectScanBounds<vid_t>({vid_t(0), vid_t(2), vid_t(7), vid_t(0xfffffff1u)}, vid_t(0xfffffff0u));
+}
+
+TEST(VidScanTests, scan_bounds_generic) {
+  ExpectScanBounds<uint16_t>({uint16_t(0), uint16_t(2), uint16_t(7), uint16_t(0xfff1u)}, uint16_t(0xfff0u));
+}
+
+#ifdef STO_TEST_AVX2
+TEST(VidScanTests, avx2_kernel) {
+  EXPECT_STREQ("avx2", scan_bounds_kernel()) << "this test build must compile in the AVX2 kernel";
+}
+#endif
@@ -6,6 +6,11 @@
 
 #include <gtest/gtest.h>
 
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+
 #include "Vocab.h"
 #include "Types.h"
 
@@ -39,3 +44,32 @@ TEST(VocabTests, load) {
 
   ASSERT_THROW(sv.at("banana"), std::out_of_range) << "out-of-range access must throw an exception";
 }
+
+TEST(VocabTests, load_overlay) {
+  // mapped vocabulary with new words inserted on top
+  Vocab<SrcToken> sv("res/vocab.tdx");
+  SrcToken apple = sv.at("apple");
+
+  EXPECT_STREQ("apple", sv.c_str(apple)) << "surface form served from the mapped file";
+  EXPECT_EQ("</s>", sv[SrcToken{Vocab<SrcToken>::kEOS}]) << "</s> overrides the mapped UNK";
+
+  SrcToken banana = sv["banana"]; // insert banana
+  EXPECT_EQ(sv.end().vid - 1, banana.vid) << "new words get the next free vid";
+  EXPECT_EQ(banana, sv.at("banana"));
+  EXPECT_EQ(apple, sv["apple"]) << "existing words must not be inserted again";
+  EXPECT_EQ("banana", sv[banana]);
+
+  ASSERT_THROW(sv.at(SrcToken{sv.end().vid}), std::out_of_range) << "out-of-range access must throw an exception";
+}
+
+TEST(VocabTests, load_truncated) {
+  // without the terminating NUL of the last surface form, strcmp() would read past the end of the mapping
+  std::ifstream ifs("res/vocab.tdx", std::ios::binary);
+  std::string bytes((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+  ASSERT_EQ('\0', bytes.back());
+  std::string filename = "vocab_truncated.tdx";
+  std::ofstream(filename, std::ios::binary).write(bytes.data(), static_cast<std::streamsize>(bytes.size() - 1));
+
+  EXPECT_THROW(Vocab<SrcToken> sv(filename), std::runtime_error) << "an unterminated surface form must be rejected";
+  std::remove(filename.c_str());
+}